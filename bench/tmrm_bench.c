@@ -0,0 +1,751 @@
+/*
+ * tmrm_bench.c - Microbenchmarks on synthetic subject maps
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */
+
+/**
+ * @file tmrm_bench.c
+ * @brief Runs microbenchmarks against every available storage backend.
+ *
+ * A deterministic generator fills a subject map with key proxies, a class
+ * hierarchy of the given depth and branching factor, and instance proxies
+ * that have a type and a number of properties, some of them literals. The
+ * same seed always yields the same map. The benchmarks then time the
+ * creation of the map, reads on it, the multiset operations, subclass
+ * closures and a YAML export, import and merge. Read benchmarks are
+ * repeated and the fastest run is reported. Benchmarks that a storage does
+ * not support are skipped with a note on stderr: the snapshot storage is
+ * read-only, and the PostgreSQL storage does not merge. The "memory"
+ * backend is the memory hash, not a storage; it only runs hash_put and
+ * hash_get.
+ *
+ * Results are written to stdout, one line per benchmark, as tab-separated
+ * values or (with -j) as JSON objects. With -m the memory report of
+ * libtmrm (see tmrm_memory_report()) follows on stderr; its high-water
+ * marks show the peak footprint of every allocation type.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libtmrm.h>
+#include <tmrm_storage.h>
+#include <tmrm_hash.h>
+
+#define BENCH_DATATYPE (const tmrm_char_t*)"http://www.w3.org/2001/XMLSchema#string"
+#define BENCH_SNAPSHOT_FILE "tmrm_bench.snp"
+
+typedef struct {
+    int proxies;            /* instance proxies */
+    int properties;         /* properties per instance */
+    int literal_ratio;      /* percentage of literal property values */
+    int depth;              /* depth of the class hierarchy */
+    int branching;          /* subclasses per class */
+    int keys;               /* distinct property keys */
+    int repeat;             /* runs of each read benchmark */
+    unsigned long seed;
+    const char* backends;   /* comma separated, NULL for all */
+    int json;
+    int memory;             /* print the memory report at the end */
+} bench_config;
+
+/* The proxies of a generated subject map */
+typedef struct {
+    tmrm_subject_map* map;
+    tmrm_proxy** keys;
+    tmrm_proxy** classes;
+    tmrm_proxy** instances;
+    int* first_key;         /* key of the first property of each instance */
+    int class_count;
+    int leaves;             /* index of the first class without subclasses */
+} bench_map;
+
+typedef long (*bench_function)(bench_map* bm);
+
+static unsigned long long _random_state;
+
+
+/* xorshift64*: the same seed gives the same map on every platform */
+static unsigned long
+_random(unsigned long range)
+{
+    _random_state ^= _random_state >> 12;
+    _random_state ^= _random_state << 25;
+    _random_state ^= _random_state >> 27;
+    return (unsigned long)((_random_state * 2685821657736338717ULL) >> 33)
+        % range;
+}
+
+
+static unsigned long long
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void
+_report(const bench_config* c, const char* backend, const char* name,
+        long ops, unsigned long long ns)
+{
+    double per_op = ops > 0 ? (double)ns / ops : 0.0;
+
+    if (c->json) {
+        printf("{\"backend\": \"%s\", \"benchmark\": \"%s\", \"ops\": %ld, "
+                "\"ns\": %llu, \"ns_per_op\": %.1f}\n",
+                backend, name, ops, ns, per_op);
+    } else {
+        printf("%s\t%s\t%ld\t%llu\t%.1f\n", backend, name, ops, ns, per_op);
+    }
+    fflush(stdout);
+}
+
+
+/* Runs f c->repeat times and reports the fastest run */
+static int
+_run(const bench_config* c, const char* backend, const char* name,
+        bench_function f, bench_map* bm)
+{
+    unsigned long long start, ns, best = 0;
+    long ops = 0;
+    int i;
+
+    for (i = 0; i < c->repeat; i++) {
+        start = _now();
+        ops = f(bm);
+        ns = _now() - start;
+        if (ops < 0) {
+            fprintf(stderr, "%s: benchmark %s failed\n", backend, name);
+            return 1;
+        }
+        if (i == 0 || ns < best) best = ns;
+    }
+    _report(c, backend, name, ops, best);
+    return 0;
+}
+
+
+static int
+_wanted(const bench_config* c, const char* backend)
+{
+    const char* p;
+    size_t len = strlen(backend);
+
+    if (!c->backends) return 1;
+    for (p = c->backends; (p = strstr(p, backend)) != NULL; p += len) {
+        if ((p == c->backends || p[-1] == ',') &&
+                (p[len] == '\0' || p[len] == ',')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void
+_bench_map_free(const bench_config* c, bench_map* bm)
+{
+    int i;
+
+    for (i = 0; bm->keys && i < c->keys; i++) {
+        if (bm->keys[i]) tmrm_proxy_free(bm->keys[i]);
+    }
+    for (i = 0; bm->classes && i < bm->class_count; i++) {
+        if (bm->classes[i]) tmrm_proxy_free(bm->classes[i]);
+    }
+    for (i = 0; bm->instances && i < c->proxies; i++) {
+        if (bm->instances[i]) tmrm_proxy_free(bm->instances[i]);
+    }
+    free(bm->keys);
+    free(bm->classes);
+    free(bm->instances);
+    free(bm->first_key);
+    memset(bm, 0, sizeof(bench_map));
+}
+
+
+static int
+_bench_map_alloc(const bench_config* c, bench_map* bm, tmrm_subject_map* map)
+{
+    int i, level = 1;
+
+    memset(bm, 0, sizeof(bench_map));
+    bm->map = map;
+    /* A complete tree: 1 + b + b^2 + ... + b^depth classes */
+    bm->class_count = 1;
+    for (i = 0; i < c->depth; i++) {
+        level *= c->branching;
+        bm->class_count += level;
+    }
+    bm->leaves = bm->class_count - level;
+    bm->keys = (tmrm_proxy**)calloc(c->keys, sizeof(tmrm_proxy*));
+    bm->classes = (tmrm_proxy**)calloc(bm->class_count, sizeof(tmrm_proxy*));
+    bm->instances = (tmrm_proxy**)calloc(c->proxies, sizeof(tmrm_proxy*));
+    bm->first_key = (int*)calloc(c->proxies, sizeof(int));
+    if (!bm->keys || !bm->classes || !bm->instances || !bm->first_key) {
+        _bench_map_free(c, bm);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Creates the proxies of the map (timed as proxy_new), the class
+   hierarchy and types (hierarchy_add) and the properties (property_add) */
+static int
+_generate(const bench_config* c, const char* backend, bench_map* bm,
+        tmrm_subject_map* map)
+{
+    unsigned long long start;
+    tmrm_literal* lit;
+    char value[32];
+    long ops;
+    int i, j, k, res = 0;
+
+    if (_bench_map_alloc(c, bm, map)) return 1;
+    _random_state = c->seed ? c->seed : 1;
+
+    start = _now();
+    for (i = 0; i < c->keys && !res; i++) {
+        res = (bm->keys[i] = tmrm_proxy_new(map)) == NULL;
+    }
+    for (i = 0; i < bm->class_count && !res; i++) {
+        res = (bm->classes[i] = tmrm_proxy_new(map)) == NULL;
+    }
+    for (i = 0; i < c->proxies && !res; i++) {
+        res = (bm->instances[i] = tmrm_proxy_new(map)) == NULL;
+    }
+    if (res) {
+        fprintf(stderr, "%s: could not create proxies\n", backend);
+        return 1;
+    }
+    _report(c, backend, "proxy_new", c->keys + bm->class_count + c->proxies,
+            _now() - start);
+
+    start = _now();
+    for (i = 1; i < bm->class_count && !res; i++) {
+        res = tmrm_proxy_add_superclass(bm->classes[i],
+                bm->classes[(i - 1) / c->branching]);
+    }
+    for (i = 0; i < c->proxies && !res; i++) {
+        res = tmrm_proxy_add_type(bm->instances[i],
+                bm->classes[bm->leaves +
+                _random(bm->class_count - bm->leaves)]);
+    }
+    if (res) {
+        fprintf(stderr, "%s: could not create the class hierarchy\n",
+                backend);
+        return 1;
+    }
+    _report(c, backend, "hierarchy_add", bm->class_count - 1 + c->proxies,
+            _now() - start);
+
+    ops = 0;
+    start = _now();
+    for (i = 0; i < c->proxies && !res; i++) {
+        for (j = 0; j < c->properties && !res; j++) {
+            k = (int)_random(c->keys);
+            if (j == 0) bm->first_key[i] = k;
+            if ((int)_random(100) < c->literal_ratio) {
+                /* Values repeat, so that literals are shared */
+                snprintf(value, sizeof(value), "v%lu",
+                        _random(c->proxies));
+                lit = tmrm_literal_new((tmrm_char_t*)value, BENCH_DATATYPE);
+                if (!lit) {
+                    res = 1;
+                    break;
+                }
+                res = tmrm_proxy_add_property_literal(bm->instances[i],
+                        bm->keys[k], lit);
+                tmrm_literal_free(lit);
+            } else {
+                res = tmrm_proxy_add_property(bm->instances[i], bm->keys[k],
+                        bm->instances[_random(c->proxies)]);
+            }
+            ops++;
+        }
+    }
+    if (res) {
+        fprintf(stderr, "%s: could not add properties\n", backend);
+        return 1;
+    }
+    _report(c, backend, "property_add", ops, _now() - start);
+    return 0;
+}
+
+
+/* Returns the proxy of map with the label of proxy */
+static tmrm_proxy*
+_by_label(tmrm_subject_map* map, tmrm_proxy* proxy)
+{
+    tmrm_proxy* found;
+    char* label;
+
+    if (!(label = (char*)tmrm_proxy_label(proxy))) return NULL;
+    found = tmrm_proxy_by_label(map, label);
+    tmrm_free(label);
+    return found;
+}
+
+
+/* Looks up the proxies of src in another map with the same labels (a
+   snapshot of src->map) */
+static int
+_rebind(const bench_config* c, bench_map* bm, const bench_map* src,
+        tmrm_subject_map* map)
+{
+    int i, res = 0;
+
+    if (_bench_map_alloc(c, bm, map)) return 1;
+    memcpy(bm->first_key, src->first_key, c->proxies * sizeof(int));
+    for (i = 0; i < c->keys && !res; i++) {
+        res = (bm->keys[i] = _by_label(map, src->keys[i])) == NULL;
+    }
+    for (i = 0; i < bm->class_count && !res; i++) {
+        res = (bm->classes[i] = _by_label(map, src->classes[i])) == NULL;
+    }
+    for (i = 0; i < c->proxies && !res; i++) {
+        res = (bm->instances[i] = _by_label(map, src->instances[i])) == NULL;
+    }
+    return res;
+}
+
+
+/* Read benchmarks; each returns the number of operations or -1 */
+
+static int _proxy_count;
+
+static long
+_bench_values_by_key(bench_map* bm)
+{
+    tmrm_multiset* ms;
+    int i;
+
+    for (i = 0; i < _proxy_count; i++) {
+        ms = tmrm_proxy_values_by_key(bm->instances[i],
+                bm->keys[bm->first_key[i]]);
+        if (!ms) return -1;
+        tmrm_multiset_free(ms);
+    }
+    return _proxy_count;
+}
+
+
+static long
+_bench_is_value_by_key(bench_map* bm)
+{
+    tmrm_multiset* ms;
+    int i;
+
+    for (i = 0; i < _proxy_count; i++) {
+        ms = tmrm_proxy_is_value_by_key(bm->instances[i],
+                bm->keys[bm->first_key[i]]);
+        if (!ms) return -1;
+        tmrm_multiset_free(ms);
+    }
+    return _proxy_count;
+}
+
+
+static long
+_bench_subclasses(bench_map* bm)
+{
+    tmrm_list* list;
+    int i;
+
+    for (i = 0; i < bm->leaves; i++) {
+        if (!(list = tmrm_proxy_subclasses(bm->classes[i]))) return -1;
+        tmrm_list_free(list);
+    }
+    return bm->leaves;
+}
+
+
+static long
+_bench_superclasses(bench_map* bm)
+{
+    tmrm_list* list;
+    int i;
+
+    for (i = bm->leaves; i < bm->class_count; i++) {
+        if (!(list = tmrm_proxy_superclasses(bm->classes[i]))) return -1;
+        tmrm_list_free(list);
+    }
+    return bm->class_count - bm->leaves;
+}
+
+
+static long
+_bench_subject_map_proxies(bench_map* bm)
+{
+    tmrm_multiset* ms;
+    long size;
+
+    if (!(ms = tmrm_subject_map_proxies(bm->map))) return -1;
+    size = tmrm_multiset_size(ms);
+    tmrm_multiset_free(ms);
+    return size;
+}
+
+
+/* Inserts every proxy into a multiset, copies it into a second one and
+   adds that back to the first */
+static long
+_bench_multiset(bench_map* bm)
+{
+    tmrm_multiset *ms, *copy;
+    long ops = -1;
+    int i;
+
+    if (!(ms = tmrm_multiset_new(bm->map))) return -1;
+    if (!(copy = tmrm_multiset_new(bm->map))) {
+        tmrm_multiset_free(ms);
+        return -1;
+    }
+    for (i = 0; i < _proxy_count; i++) {
+        if (tmrm_multiset_insert(ms, tmrm_proxy_to_object(bm->instances[i]))) {
+            break;
+        }
+    }
+    if (i == _proxy_count && tmrm_multiset_add(copy, ms) == 0 &&
+            tmrm_multiset_add(ms, copy) == 0) {
+        ops = _proxy_count + tmrm_multiset_size(ms);
+    }
+    tmrm_multiset_free(copy);
+    tmrm_multiset_free(ms);
+    return ops;
+}
+
+
+static int
+_read_benchmarks(const bench_config* c, const char* backend, bench_map* bm)
+{
+    _proxy_count = c->proxies;
+    return _run(c, backend, "values_by_key", _bench_values_by_key, bm) ||
+        _run(c, backend, "is_value_by_key", _bench_is_value_by_key, bm) ||
+        _run(c, backend, "subclass_closure", _bench_subclasses, bm) ||
+        _run(c, backend, "superclass_closure", _bench_superclasses, bm) ||
+        _run(c, backend, "subject_map_proxies", _bench_subject_map_proxies,
+                bm) ||
+        _run(c, backend, "multiset_ops", _bench_multiset, bm);
+}
+
+
+/* Exports the map to YAML, imports it into a second map of the same
+   storage and, with merge set, merges that */
+static int
+_yaml_benchmarks(const bench_config* c, const char* backend, bench_map* bm,
+        tmrm_subject_map_sphere* sms, tmrm_storage* storage, int merge)
+{
+    unsigned long long start;
+    tmrm_subject_map* copy;
+    tmrm_multiset* ms;
+    FILE* fh;
+    long size, proxies;
+    int res;
+
+    if (!(fh = tmpfile())) {
+        fprintf(stderr, "%s: could not create a temporary file\n", backend);
+        return 1;
+    }
+    start = _now();
+    res = tmrm_subject_map_export_to_yaml(bm->map, fh);
+    fflush(fh);
+    size = ftell(fh);
+    if (res) {
+        fprintf(stderr, "%s: YAML export failed\n", backend);
+        fclose(fh);
+        return 1;
+    }
+    _report(c, backend, "yaml_export", size, _now() - start);
+
+    if (!(copy = tmrm_subject_map_new(sms, storage, "bench_import"))) {
+        fprintf(stderr, "%s: could not create subject map\n", backend);
+        fclose(fh);
+        return 1;
+    }
+    rewind(fh);
+    start = _now();
+    res = tmrm_subject_map_import_from_yaml(copy, fh);
+    fclose(fh);
+    if (res) {
+        fprintf(stderr, "%s: YAML import failed\n", backend);
+    } else {
+        _report(c, backend, "yaml_import", size, _now() - start);
+    }
+    if (!res && !merge) {
+        fprintf(stderr, "%s: merge not supported, skipped\n", backend);
+    } else if (!res) {
+        /* The proxies that the merge compares */
+        if (!(ms = tmrm_subject_map_proxies(copy))) {
+            fprintf(stderr, "%s: could not list proxies\n", backend);
+            res = 1;
+        } else {
+            proxies = tmrm_multiset_size(ms);
+            tmrm_multiset_free(ms);
+            start = _now();
+            if ((res = tmrm_subject_map_merge(copy)) != 0) {
+                fprintf(stderr, "%s: merge failed\n", backend);
+            } else {
+                _report(c, backend, "merge", proxies, _now() - start);
+            }
+        }
+    }
+    tmrm_storage_remove(storage, copy);
+    tmrm_subject_map_free(copy);
+    return res;
+}
+
+
+static int
+_snapshot_benchmarks(const bench_config* c, bench_map* src,
+        tmrm_subject_map_sphere* sms)
+{
+    unsigned long long start;
+    tmrm_storage* snapshot;
+    tmrm_subject_map* map;
+    bench_map bm;
+    int res;
+
+    start = _now();
+    if (tmrm_subject_map_export_snapshot(src->map, BENCH_SNAPSHOT_FILE)) {
+        fprintf(stderr, "snapshot: export failed\n");
+        return 1;
+    }
+    _report(c, "snapshot", "snapshot_export", c->proxies, _now() - start);
+    snapshot = tmrm_storage_new(sms, "snapshot",
+            "file='" BENCH_SNAPSHOT_FILE "'");
+    if (!snapshot) {
+        unlink(BENCH_SNAPSHOT_FILE);
+        return 1;
+    }
+    res = 1;
+    if ((map = tmrm_subject_map_new(sms, snapshot, "snapshot")) != NULL) {
+        if (_rebind(c, &bm, src, map)) {
+            fprintf(stderr, "snapshot: proxies not found\n");
+        } else {
+            res = _read_benchmarks(c, "snapshot", &bm);
+        }
+        _bench_map_free(c, &bm);
+        tmrm_subject_map_free(map);
+    }
+    tmrm_storage_free(snapshot);
+    unlink(BENCH_SNAPSHOT_FILE);
+    return res;
+}
+
+
+/* Generates the map on a writable storage and runs all benchmarks on it,
+   with snapshot set also on a snapshot of the map. merge tells whether
+   the storage merges proxies. Returns -1 if the storage is not
+   available. */
+static int
+_bench_storage(const bench_config* c, const char* backend,
+        const char* params, int snapshot, int merge)
+{
+    tmrm_subject_map_sphere* sms;
+    tmrm_storage* storage;
+    tmrm_subject_map* map;
+    bench_map bm;
+    int res = 1;
+
+    if (!(sms = tmrm_subject_map_sphere_new())) return 1;
+    if (!(storage = tmrm_storage_new(sms, backend, params))) {
+        tmrm_subject_map_sphere_free(sms);
+        return -1;
+    }
+    if ((map = tmrm_subject_map_new(sms, storage, "bench")) != NULL) {
+        /* The snapshot is taken before the YAML import adds to the
+           storage */
+        if (_generate(c, backend, &bm, map) == 0 &&
+                _read_benchmarks(c, backend, &bm) == 0 &&
+                (!snapshot || _snapshot_benchmarks(c, &bm, sms) == 0)) {
+            res = _yaml_benchmarks(c, backend, &bm, sms, storage, merge);
+        }
+        _bench_map_free(c, &bm);
+        tmrm_storage_remove(storage, map);
+        tmrm_subject_map_free(map);
+    }
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+    return res;
+}
+
+
+/* Puts c->proxies strings into a memory hash and reads them back */
+static int
+_bench_hash(const bench_config* c)
+{
+    unsigned long long start;
+    tmrm_subject_map_sphere* sms;
+    tmrm_hash* h;
+    char key[32], value[32];
+    char* v;
+    int i, res = 0;
+
+    if (!(sms = tmrm_subject_map_sphere_new())) return 1;
+    if (!(h = tmrm_hash_new(sms, "memory"))) {
+        tmrm_subject_map_sphere_free(sms);
+        return 1;
+    }
+    start = _now();
+    for (i = 0; i < c->proxies && !res; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        snprintf(value, sizeof(value), "v%d", i);
+        res = tmrm_hash_put_strings(h, key, value);
+    }
+    if (!res) _report(c, "memory", "hash_put", c->proxies, _now() - start);
+    start = _now();
+    for (i = 0; i < c->proxies && !res; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        if (!(v = tmrm_hash_get(h, key))) res = 1;
+        else tmrm_free(v);
+    }
+    if (!res) _report(c, "memory", "hash_get", c->proxies, _now() - start);
+    else fprintf(stderr, "memory: hash benchmark failed\n");
+    tmrm_hash_free(h);
+    tmrm_subject_map_sphere_free(sms);
+    return res;
+}
+
+
+static void
+_usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [-p proxies] [-k properties] [-l literal%%] "
+            "[-d depth] [-b branching]\n"
+            "       [-K keys] [-r repeat] [-s seed] [-B backends] [-j] [-m]\n"
+            "Backends: memory (hash put/get only), log, dbd, snapshot (of "
+            "the log map,\n"
+            "          reads only), pgsql (no merge, options from "
+            "$TMRM_BENCH_PGSQL)\n", name);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    bench_config c;
+    const char* pgsql;
+    char* report;
+    int opt, res, failed = 0;
+
+    c.proxies = 1000;
+    c.properties = 5;
+    c.literal_ratio = 50;
+    c.depth = 4;
+    c.branching = 3;
+    c.keys = 16;
+    c.repeat = 3;
+    c.seed = 42;
+    c.backends = NULL;
+    c.json = 0;
+    c.memory = 0;
+
+    while ((opt = getopt(argc, argv, "p:k:l:d:b:K:r:s:B:jmh")) != -1) {
+        switch (opt) {
+        case 'p': c.proxies = atoi(optarg); break;
+        case 'k': c.properties = atoi(optarg); break;
+        case 'l': c.literal_ratio = atoi(optarg); break;
+        case 'd': c.depth = atoi(optarg); break;
+        case 'b': c.branching = atoi(optarg); break;
+        case 'K': c.keys = atoi(optarg); break;
+        case 'r': c.repeat = atoi(optarg); break;
+        case 's': c.seed = strtoul(optarg, NULL, 10); break;
+        case 'B': c.backends = optarg; break;
+        case 'j': c.json = 1; break;
+        case 'm': c.memory = 1; break;
+        default:
+            _usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (c.proxies < 1 || c.properties < 1 || c.keys < 1 || c.repeat < 1 ||
+            c.depth < 0 || c.branching < 1 || c.literal_ratio < 0 ||
+            c.literal_ratio > 100) {
+        _usage(argv[0]);
+        return 2;
+    }
+
+    /* Debug messages would dominate the timings */
+    tmrm_set_logger(TMRM_LOG_ERROR, NULL, NULL);
+
+    if (c.json) {
+        printf("{\"config\": {\"proxies\": %d, \"properties\": %d, "
+                "\"literal_ratio\": %d, \"depth\": %d, \"branching\": %d, "
+                "\"keys\": %d, \"repeat\": %d, \"seed\": %lu}}\n",
+                c.proxies, c.properties, c.literal_ratio, c.depth,
+                c.branching, c.keys, c.repeat, c.seed);
+    } else {
+        printf("# proxies=%d properties=%d literal_ratio=%d depth=%d "
+                "branching=%d keys=%d repeat=%d seed=%lu\n",
+                c.proxies, c.properties, c.literal_ratio, c.depth,
+                c.branching, c.keys, c.repeat, c.seed);
+        printf("backend\tbenchmark\tops\tns\tns_per_op\n");
+    }
+
+    if (_wanted(&c, "memory")) failed |= _bench_hash(&c);
+    if (_wanted(&c, "log") || _wanted(&c, "snapshot")) {
+        res = _bench_storage(&c, "log",
+                "dir='.',name='tmrm_bench',new='yes'",
+                _wanted(&c, "snapshot"), 1);
+        if (res < 0) fprintf(stderr, "log: storage not available\n");
+        failed |= res > 0;
+    }
+    if (_wanted(&c, "dbd")) {
+        res = _bench_storage(&c, "dbd",
+                "dir='.',file='tmrm_bench.db',new='yes'", 0, 1);
+        if (res < 0) fprintf(stderr, "dbd: storage not available\n");
+        failed |= res > 0;
+    }
+    pgsql = getenv("TMRM_BENCH_PGSQL");
+    if (_wanted(&c, "pgsql") && pgsql) {
+        res = _bench_storage(&c, "pgsql", pgsql, 0, 0);
+        if (res < 0) fprintf(stderr, "pgsql: storage not available\n");
+        failed |= res > 0;
+    }
+    if (c.memory) {
+        if (!tmrm_memory_accounting()) {
+            fprintf(stderr, "Memory accounting is disabled, configure "
+                    "with --enable-memory-accounting\n");
+        }
+        if ((report = tmrm_memory_report(c.json ? TMRM_STATS_JSON :
+                        TMRM_STATS_TEXT))) {
+            fprintf(stderr, "%s%s", report, c.json ? "\n" : "");
+            tmrm_free(report);
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -46,6 +46,66 @@
 #include <tmrm_storage.h>
 
 
+static void
+_sphere_error_free(void* data)
+{
+    tmrm_sphere_error* error = (tmrm_sphere_error*)data;
+
+    if (error->message) TMRM_FREE(cstring, error->message);
+#ifdef HAVE_PTHREAD
+    TMRM_FREE(tmrm_sphere_error, error);
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+/* Destructor of the error state of a thread that exits */
+static void
+_sphere_error_release(void* data)
+{
+    tmrm_sphere_error* error = (tmrm_sphere_error*)data;
+    tmrm_subject_map_sphere* sms = error->sms;
+
+    pthread_mutex_lock(&sms->errors_lock);
+    if (error->prev) error->prev->next = error->next;
+    else sms->errors = error->next;
+    if (error->next) error->next->prev = error->prev;
+    pthread_mutex_unlock(&sms->errors_lock);
+    _sphere_error_free(error);
+}
+#endif
+
+/* The error state of the calling thread, or NULL if it cannot be
+   allocated */
+static tmrm_sphere_error*
+_sphere_error(tmrm_subject_map_sphere* sms)
+{
+#ifdef HAVE_PTHREAD
+    tmrm_sphere_error* error;
+
+    if ((error = (tmrm_sphere_error*)pthread_getspecific(sms->error_key))) {
+        return error;
+    }
+    if (!(error = (tmrm_sphere_error*)TMRM_CALLOC(tmrm_sphere_error, 1,
+                    sizeof(tmrm_sphere_error)))) {
+        return NULL;
+    }
+    error->sms = sms;
+    if (pthread_setspecific(sms->error_key, error)) {
+        TMRM_FREE(tmrm_sphere_error, error);
+        return NULL;
+    }
+    pthread_mutex_lock(&sms->errors_lock);
+    error->next = sms->errors;
+    if (sms->errors) sms->errors->prev = error;
+    sms->errors = error;
+    pthread_mutex_unlock(&sms->errors_lock);
+    return error;
+#else
+    return &sms->error;
+#endif
+}
+
+
 /**
  * Contructor: Creates a new subject map system object. Returns NULL
  * on failure.
@@ -62,8 +122,14 @@ tmrm_subject_map_sphere_new(void)
             sizeof(tmrm_subject_map_sphere));
     if (!new_sms)
         return (tmrm_subject_map_sphere*)NULL;
-    /* Use free to free tmrm_storage_factory structures */
-    new_sms->factories = tmrm_list_new((tmrm_list_free_handler*)free);
+#ifdef HAVE_PTHREAD
+    if (pthread_key_create(&new_sms->error_key, _sphere_error_release)) {
+        TMRM_FREE(tmrm_subject_map_sphere, new_sms);
+        return (tmrm_subject_map_sphere*)NULL;
+    }
+    pthread_mutex_init(&new_sms->errors_lock, NULL);
+#endif
+    new_sms->factories = tmrm_list_new(tmrm_storage_factory_free);
     tmrm_init_storage(new_sms); 
     tmrm_init_hash(new_sms);
     return new_sms;
@@ -77,34 +143,155 @@ tmrm_subject_map_sphere_new(void)
 void
 tmrm_subject_map_sphere_free(/*@only@*/ tmrm_subject_map_sphere* sms)
 {
+#ifdef HAVE_PTHREAD
+    tmrm_sphere_error* error;
+
+#endif
     TMRM_ASSERT_OBJECT_POINTER_RETURN(sms, tmrm_subject_map_sphere);
+    if (sms->executor) tmrm_executor_free(sms->executor);
     tmrm_list_free(sms->factories);
+    tmrm_finish_hash(sms);
+#ifdef HAVE_PTHREAD
+    /* Once the key is deleted, the destructor no longer runs when a
+       thread exits, so the states of all threads are freed here */
+    (void)pthread_key_delete(sms->error_key);
+    while ((error = sms->errors)) {
+        sms->errors = error->next;
+        _sphere_error_free(error);
+    }
+    pthread_mutex_destroy(&sms->errors_lock);
+#else
+    _sphere_error_free(&sms->error);
+#endif
     /*@=compdestroy@*/
     TMRM_FREE(tmrm_subject_map_sphere, sms);
 }
 
 /**
- * Internal function that sets the error flags of the corresponding
- * subject map sphere object.
+ * Sets the number of worker threads that evaluate large reads, such as
+ * tmrm_subject_map_is_value_by_key() and the "<-" steps of path
+ * expressions over many objects, in parallel. With 0 (the default), all
+ * reads run on the calling thread. Must not be called while other threads
+ * use the sphere.
+ *
+ * @param sms A pointer to a valid subject_map_sphere object.
+ * @param threads Number of worker threads, 0 to disable parallel reads
+ * @returns 0 on success, 1 on failure or if libtmrm was built without
+ * POSIX threads
  */
-static int
-tmrm_subject_map_sphere_set_storage_error(tmrm_subject_map_sphere *sms,
-        tmrm_storage *storage, const char *problem) {
-    size_t len;
+int
+tmrm_subject_map_sphere_set_threads(tmrm_subject_map_sphere *sms,
+        int threads)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(sms, tmrm_subject_map_sphere, 1);
+    if (sms->executor) {
+        tmrm_executor_free(sms->executor);
+        sms->executor = NULL;
+    }
+    if (threads <= 0) return 0;
+    if (!(sms->executor = tmrm_executor_new(threads))) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Could not start %d worker threads", threads);
+        return 1;
+    }
+    return 0;
+}
 
+/**
+ * Installs callbacks that receive a span for every storage call and, for
+ * the PostgreSQL storage, for every SQL statement, with the labels of the
+ * proxy and key, the statement text, the number of rows and the duration.
+ * The callbacks run on the thread that makes the call, possibly on several
+ * threads at once. Must not be called while other threads use the sphere.
+ *
+ * @param sms A pointer to a valid subject_map_sphere object.
+ * @param tracer The callbacks, copied; NULL disables tracing
+ */
+void
+tmrm_subject_map_sphere_set_tracer(tmrm_subject_map_sphere *sms,
+        const tmrm_tracer* tracer)
+{
     TMRM_ASSERT_OBJECT_POINTER_RETURN(sms, tmrm_subject_map_sphere);
+    if (tracer) sms->tracer = *tracer;
+    else memset(&sms->tracer, 0, sizeof(tmrm_tracer));
+}
 
-    if (sms->errno != TMRM_NO_ERROR) return 1;
+/**
+ * Returns the first error that occurred in the calling thread since the
+ * last tmrm_subject_map_sphere_clear_error(). Every thread has its own
+ * error state, so threads that share a subject map sphere do not see each
+ * other's errors.
+ *
+ * @param sms A pointer to a valid subject_map_sphere object.
+ * @returns TMRM_NO_ERROR if there was no error
+ */
+tmrm_error_type_t
+tmrm_subject_map_sphere_last_error(tmrm_subject_map_sphere *sms)
+{
+    tmrm_sphere_error* error;
 
-    sms->errno = TMRM_STORAGE_ERROR;
-    len = strlen(problem);
-    if (!(sms->err = (char*)TMRM_MALLOC(cstring, len+1))) {
-        return 1;
-    }
-    (void)strcpy(sms->err, problem);
-    return 1;
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(sms, tmrm_subject_map_sphere,
+            TMRM_MEMORY_ERROR);
+    if (!(error = _sphere_error(sms))) return TMRM_MEMORY_ERROR;
+    return error->type;
 }
 
+/**
+ * Returns the description of the error that
+ * tmrm_subject_map_sphere_last_error() reports.
+ *
+ * @param sms A pointer to a valid subject_map_sphere object.
+ * @returns NULL if there was no error
+ */
+const char*
+tmrm_subject_map_sphere_last_error_string(tmrm_subject_map_sphere *sms)
+{
+    tmrm_sphere_error* error;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(sms, tmrm_subject_map_sphere,
+            NULL);
+    if (!(error = _sphere_error(sms))) return NULL;
+    return error->message;
+}
+
+/**
+ * Forgets the error of the calling thread, so that
+ * tmrm_subject_map_sphere_last_error() reports the next one.
+ *
+ * @param sms A pointer to a valid subject_map_sphere object.
+ */
+void
+tmrm_subject_map_sphere_clear_error(tmrm_subject_map_sphere *sms)
+{
+    tmrm_sphere_error* error;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN(sms, tmrm_subject_map_sphere);
+    if (!(error = _sphere_error(sms))) return;
+    if (error->message) TMRM_FREE(cstring, error->message);
+    error->message = NULL;
+    error->type = TMRM_NO_ERROR;
+}
+
+/**
+ * Internal function that records an error of the calling thread. Only the
+ * first error since the last tmrm_subject_map_sphere_clear_error() is
+ * kept. Use TMRM_SET_ERROR() to log the error as well.
+ *
+ * @returns 1, so that callers can return its result as their error
+ */
+int
+tmrm_subject_map_sphere_set_error(tmrm_subject_map_sphere *sms,
+        tmrm_error_type_t type, const char *problem)
+{
+    tmrm_sphere_error* error;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(sms, tmrm_subject_map_sphere, 1);
+    if (!(error = _sphere_error(sms))) return 1;
+    if (error->type != TMRM_NO_ERROR) return 1;
+
+    error->type = type;
+    error->message = tmrm_strdup(problem);
+    return 1;
+}
 
 /**
  * Constructor: Creates a new subject map with a label.
@@ -181,6 +368,160 @@ tmrm_subject_map_bottom(tmrm_subject_map* map) {
 }
 
 
+/**
+ * Caches the results of up to size reads of values by key, keys and direct
+ * types of proxies in the subject map. The least recently used results are
+ * evicted first, and writes through the subject map drop the results they
+ * change. Writes by other connections are only seen if the storage reports
+ * them: the PostgreSQL storage opened with the option notify='yes' listens
+ * for the notifications that a trigger sends on every property change,
+ * and each read drops the results that the changes reported since the
+ * last read affect. With other storages, the cache should only be used if
+ * the subject map is the only writer. A size of 0 disables the cache.
+ *
+ * @returns 0 on success
+ */
+int
+tmrm_subject_map_set_cache_size(tmrm_subject_map* map, size_t size)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, 1);
+
+    if (map->cache != NULL) {
+        tmrm_storage_cache_free(map->cache);
+        map->cache = NULL;
+    }
+    if (size == 0) return 0;
+    map->cache = tmrm_storage_cache_new(size);
+    return map->cache == NULL;
+}
+
+
+/**
+ * Returns the number of reads that were answered by the cache of the
+ * subject map (hits) and by the storage (misses). Both are 0 if the cache
+ * is disabled.
+ */
+void
+tmrm_subject_map_cache_stats(tmrm_subject_map* map, unsigned long* hits,
+        unsigned long* misses)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN(map, tmrm_subject_map);
+
+    if (hits) *hits = 0;
+    if (misses) *misses = 0;
+    if (map->cache != NULL) tmrm_storage_cache_stats(map->cache, hits, misses);
+}
+
+
+/**
+ * Returns the call statistics of the storage of the subject map: calls,
+ * errors, rows, bytes and a latency histogram for each storage callback.
+ * The statistics belong to the storage, so they include the calls of all
+ * subject maps in it. Reads answered by the read cache are not counted.
+ *
+ * @param map A subject map
+ * @param count Set to the number of entries
+ * @returns a new array that must be free'd with tmrm_free(), or NULL on
+ *          failure
+ */
+tmrm_op_stats*
+tmrm_subject_map_stats(tmrm_subject_map* map, int* count)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, NULL);
+
+    return tmrm_storage_stats(map->storage, count);
+}
+
+
+/**
+ * Clears the call statistics of the storage of the subject map.
+ */
+void
+tmrm_subject_map_stats_reset(tmrm_subject_map* map)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN(map, tmrm_subject_map);
+
+    tmrm_storage_stats_reset(map->storage);
+}
+
+
+/**
+ * Formats the call statistics of the storage of the subject map as text,
+ * one line per callback, or as a JSON object.
+ *
+ * @returns a string that must be free'd with tmrm_free(), or NULL on
+ *          failure
+ */
+char*
+tmrm_subject_map_stats_dump(tmrm_subject_map* map, tmrm_stats_format format)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, NULL);
+
+    return tmrm_storage_stats_dump(map->storage, format);
+}
+
+
+/**
+ * Constructor: Returns a read-only view of the subject map as it is now.
+ * Reads through the snapshot and its proxies all see this state, however
+ * the subject map is changed meanwhile, and long reads such as exports do
+ * not hold up writers. The storage keeps removed properties while a
+ * snapshot may see them, so snapshots should be freed with
+ * tmrm_subject_map_free() as soon as they are no longer needed.
+ *
+ * Currently only the "log" and "snapshot" storages support snapshots.
+ *
+ * @returns NULL if the storage does not support snapshots or on failure
+ */
+/*@null@*/ tmrm_subject_map*
+tmrm_subject_map_snapshot(tmrm_subject_map* map)
+{
+    tmrm_subject_map* snapshot;
+    tmrm_proxy** bootstrap[5];
+    tmrm_proxy** copy[5];
+    int i;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, NULL);
+
+    snapshot = (tmrm_subject_map*)TMRM_CALLOC(tmrm_subject_map, 1,
+            sizeof(tmrm_subject_map));
+    if (!snapshot) return NULL;
+    snapshot->sms = map->sms;
+    snapshot->storage = map->storage;
+    if (!(snapshot->label = tmrm_strdup(map->label))) {
+        TMRM_FREE(tmrm_subject_map, snapshot);
+        return NULL;
+    }
+    if (!(snapshot->snapshot = tmrm_storage_snapshot_acquire(map->storage,
+                    map))) {
+        tmrm_subject_map_free(snapshot);
+        return NULL;
+    }
+
+    /* The bootstrap proxies are bound to the snapshot, so that the proxies
+       found through them are, too */
+    bootstrap[0] = &map->bottom;
+    bootstrap[1] = &map->superclass;
+    bootstrap[2] = &map->subclass;
+    bootstrap[3] = &map->type;
+    bootstrap[4] = &map->instance;
+    copy[0] = &snapshot->bottom;
+    copy[1] = &snapshot->superclass;
+    copy[2] = &snapshot->subclass;
+    copy[3] = &snapshot->type;
+    copy[4] = &snapshot->instance;
+    for (i = 0; i < 5; i++) {
+        if (*bootstrap[i] == NULL) continue;
+        if (!(*copy[i] = tmrm_proxy_clone(*bootstrap[i]))) {
+            tmrm_subject_map_free(snapshot);
+            return NULL;
+        }
+        (*copy[i])->subject_map = snapshot;
+    }
+    return snapshot;
+}
+
+
 /* Merges all equal proxies in the subject map until the subject map is
    fully merged. */
 int tmrm_subject_map_merge(tmrm_subject_map *map) {
@@ -204,6 +545,9 @@ tmrm_subject_map_free(tmrm_subject_map* m)
     if (m->subclass != NULL) tmrm_proxy_free(m->subclass);
     if (m->type != NULL) tmrm_proxy_free(m->type);
     if (m->instance != NULL) tmrm_proxy_free(m->instance);
+
+    if (m->cache != NULL) tmrm_storage_cache_free(m->cache);
+    if (m->snapshot) tmrm_storage_snapshot_release(m->storage, m->snapshot);
     
     TMRM_FREE(tmrm_subject_map, m);
 }
@@ -211,13 +555,19 @@ tmrm_subject_map_free(tmrm_subject_map* m)
 void 
 tmrm_init_storage(tmrm_subject_map_sphere *sms)
 {
-#ifdef STORAGE_HASHES
+#ifdef STORAGE_BDB
     tmrm_init_storage_db(sms);
 #endif
 
 #ifdef STORAGE_POSTGRESQL
     tmrm_init_storage_pgsql(sms);
 #endif
+
+    tmrm_init_storage_snapshot(sms);
+
+#ifdef STORAGE_LOG
+    tmrm_init_storage_log(sms);
+#endif
 }
 
 /* temporary bootstrap-ontology:
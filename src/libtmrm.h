@@ -112,6 +112,109 @@ typedef struct tmrm_tuple_s tmrm_tuple;
 typedef struct tmrm_storage_s tmrm_storage;
 typedef struct tmrm_storage_factory_s tmrm_storage_factory;
 
+typedef struct tmrm_path_s tmrm_path;
+
+typedef struct tmrm_arena_s tmrm_arena;
+
+typedef struct tmrm_async_s tmrm_async;
+typedef struct tmrm_request_s tmrm_request;
+
+/** Called by tmrm_async_dispatch() when a request has finished. data is
+    the pointer that was passed with the request. */
+typedef void (*tmrm_request_callback)(tmrm_request* request, void* data);
+
+/** Allocator hooks, see tmrm_set_allocator(). data is passed to all
+    functions. */
+typedef struct tmrm_allocator_s {
+    void* (*malloc)(void* data, size_t size);
+    void* (*realloc)(void* data, void* ptr, size_t size);
+    void (*free)(void* data, void* ptr);
+    void* data;
+} tmrm_allocator;
+
+/** Levels of the log messages of libtmrm, see tmrm_set_logger(). */
+typedef enum tmrm_log_level_e {
+    TMRM_LOG_ERROR = 0,
+    TMRM_LOG_WARNING = 1,
+    TMRM_LOG_INFO = 2,
+    TMRM_LOG_DEBUG = 3
+} tmrm_log_level;
+
+/** Receives the log messages at or below the level of tmrm_set_logger().
+    message is formatted and has no trailing newline. */
+typedef void (*tmrm_log_handler)(void* data, tmrm_log_level level,
+        const char* file, int line, const char* function,
+        const char* message);
+
+/** Number of latency buckets in tmrm_op_stats. Each power of two
+    nanoseconds is split into four buckets, see tmrm_stats_bucket_limit(). */
+#define TMRM_STATS_BUCKETS 160
+
+/** Call statistics of one storage callback, see tmrm_subject_map_stats(). */
+typedef struct tmrm_op_stats_s {
+    const char* name;               /* name of the callback */
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long rows;             /* objects returned */
+    unsigned long bytes;            /* bytes of literal values returned */
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long histogram[TMRM_STATS_BUCKETS]; /* calls by latency */
+} tmrm_op_stats;
+
+/** A traced operation, see tmrm_subject_map_sphere_set_tracer(). Spans
+    nest: storage callbacks contain the SQL statements that they run. */
+typedef struct tmrm_span_s {
+    const char* operation;          /* storage callback, or "sql" */
+    const char* storage;            /* name of the storage factory */
+    int proxy;                      /* label of the proxy, or 0 */
+    int key;                        /* label of the key, or 0 */
+    const char* sql;                /* statement text, or NULL */
+    long rows;                      /* rows returned, -1 if unknown */
+    int failed;
+    unsigned long long start_ns;    /* monotonic clock */
+    unsigned long long duration_ns;
+    const struct tmrm_span_s* parent;   /* enclosing span, or NULL */
+    void* user;                     /* free for use by the tracer */
+} tmrm_span;
+
+/** Tracing callbacks. begin is called before an operation, end after it
+    with rows, failed and duration_ns filled in. A span is only valid
+    until end returns. Either callback may be NULL. */
+typedef struct tmrm_tracer_s {
+    void (*begin)(void* data, tmrm_span* span);
+    void (*end)(void* data, tmrm_span* span);
+    void* data;
+} tmrm_tracer;
+
+/** Output formats of tmrm_subject_map_stats_dump() and
+    tmrm_memory_report() */
+typedef enum {
+    TMRM_STATS_TEXT = 0,
+    TMRM_STATS_JSON = 1
+} tmrm_stats_format;
+
+/** Slab pools for small internal nodes, see tmrm_pool_stats(). */
+typedef enum tmrm_pool_type_e {
+    TMRM_POOL_LIST_ELEMENT = 0,
+    TMRM_POOL_HASH_NODE,
+    TMRM_POOL_HASH_NODE_VALUE,
+    TMRM_POOL_HASH_DATUM,
+    TMRM_POOL_PROXY,
+    TMRM_POOL_LITERAL,
+    TMRM_POOL_COUNT
+} tmrm_pool_type;
+
+/** Heap memory of one allocation type, see tmrm_memory_stats(). */
+typedef struct tmrm_memory_type_stats_s {
+    const char* type;           /* type tag of the allocations */
+    size_t bytes;               /* bytes in use */
+    size_t count;               /* blocks in use */
+    size_t max_bytes;           /* high-water mark of bytes */
+    size_t max_count;           /* high-water mark of blocks */
+    unsigned long allocs;       /* blocks allocated since the last reset */
+} tmrm_memory_type_stats;
+
 /** Many bad things could happen in the subject map sphere. */
 typedef enum tmrm_error_type_e {
     /** No error is produced. */
@@ -123,7 +226,9 @@ typedef enum tmrm_error_type_e {
     /** Error in the storage backend */
     TMRM_STORAGE_ERROR,
     /** Something's wrong with the ontology */
-    TMRM_MODEL_ERROR
+    TMRM_MODEL_ERROR,
+    /** Malformed path expression or binary subject map */
+    TMRM_SYNTAX_ERROR
 } tmrm_error_type_t;
 
 
@@ -214,6 +319,14 @@ tmrm_error_type_t tmrm_subject_map_sphere_last_error(tmrm_subject_map_sphere *sm
 
 const char* tmrm_subject_map_sphere_last_error_string(tmrm_subject_map_sphere *sms);
 
+void tmrm_subject_map_sphere_clear_error(tmrm_subject_map_sphere *sms);
+
+int tmrm_subject_map_sphere_set_threads(tmrm_subject_map_sphere *sms,
+        int threads);
+
+void tmrm_subject_map_sphere_set_tracer(tmrm_subject_map_sphere *sms,
+        const tmrm_tracer* tracer);
+
 
 /* Destructor: */
 void tmrm_subject_map_sphere_free(/*@only@*/ tmrm_subject_map_sphere* sms);
@@ -241,6 +354,12 @@ tmrm_iterator* tmrm_subject_map_iterator(tmrm_subject_map *map);
 tmrm_multiset* tmrm_subject_map_proxies(tmrm_subject_map *map);
 
 
+/* Returns an iterator over the proxies that have all properties. Each
+   element of properties is a tmrm_tuple <key, value>. */
+tmrm_iterator* tmrm_proxies_by_properties(tmrm_subject_map* map,
+        tmrm_list* properties);
+
+
 /* Merges all equal proxies in the subject map until the subject map is
    fully merged. */
 int tmrm_subject_map_merge(tmrm_subject_map *map);
@@ -250,6 +369,17 @@ int tmrm_subject_map_merge(tmrm_subject_map *map);
 int tmrm_subject_map_export_to_yaml(tmrm_subject_map *map, FILE *fh);
 
 
+/* Serializes the subject map into the binary interchange format. Literal
+   datatypes are preserved. */
+int tmrm_subject_map_export_to_binary(tmrm_subject_map *map, FILE *fh);
+
+
+/* Writes the subject map into an immutable snapshot file for the
+   "snapshot" storage. */
+int tmrm_subject_map_export_snapshot(tmrm_subject_map *map,
+        const char *filename);
+
+
 /* All proxies in which the proxies are the value for a particular key. */
 /* tmrm_status tmrm_subject_map_is_value_by_key(tmrm_subject_map* map, tmrm_multiset* proxies,
     tmrm_proxy* key, tmtm_iterator** it); */
@@ -257,6 +387,12 @@ int tmrm_subject_map_export_to_yaml(tmrm_subject_map *map, FILE *fh);
         tmrm_proxy* key);
 
 
+/* All proxies in which the proxies are the value for a particular key or
+   one of its subclasses. */
+/*@null@*/ tmrm_multiset* tmrm_subject_map_is_value_by_key_star(
+        tmrm_multiset* proxies, tmrm_proxy* key);
+
+
 /* Returns the symbolic name of a subject map. */
 /*@null@*/ const char* tmrm_subject_map_name(tmrm_subject_map* map);
 
@@ -269,32 +405,61 @@ int tmrm_subject_map_export_to_yaml(tmrm_subject_map *map, FILE *fh);
 int tmrm_subject_map_import_from_yaml(tmrm_subject_map *map, FILE *fh);
 
 
+/* Reads a subject map written by tmrm_subject_map_export_to_binary(). */
+int tmrm_subject_map_import_from_binary(tmrm_subject_map *map, FILE *fh);
+
+
 /* Parses a subject map from a YAML string.*/
 int tmrm_subject_map_import_from_yaml_string(tmrm_subject_map *map,
         const unsigned char* str, size_t len);
 
+/* Enables a read cache for up to size results, 0 disables it. */
+int tmrm_subject_map_set_cache_size(tmrm_subject_map* map, size_t size);
+
+
+/* Returns the hit and miss counters of the read cache. */
+void tmrm_subject_map_cache_stats(tmrm_subject_map* map, unsigned long* hits,
+        unsigned long* misses);
+
+
+/* Returns a copy of the call statistics of the storage of the map. */
+/*@null@*/ tmrm_op_stats* tmrm_subject_map_stats(tmrm_subject_map* map,
+        int* count);
+
+
+/* Clears the call statistics of the storage of the map. */
+void tmrm_subject_map_stats_reset(tmrm_subject_map* map);
+
+
+/* Formats the call statistics as text or JSON. */
+/*@null@*/ char* tmrm_subject_map_stats_dump(tmrm_subject_map* map,
+        tmrm_stats_format format);
+
+
+/* Returns the exclusive upper bound of a latency bucket in nanoseconds. */
+unsigned long long tmrm_stats_bucket_limit(int bucket);
+
+
+/* Estimates a latency percentile (0-100) in nanoseconds. */
+unsigned long long tmrm_op_stats_percentile(const tmrm_op_stats* stats,
+        double percentile);
+
+
+/* Returns a read-only view of the current state of the subject map. */
+/*@null@*/ tmrm_subject_map* tmrm_subject_map_snapshot(tmrm_subject_map* map);
+
+
 /* Destructor: */
 void tmrm_subject_map_free(tmrm_subject_map* m);
 
 
 /* 
-tmrm_iterator* tmrm_proxies_by_properties(tmrm_subject_map* map,
-    tmrm_list* properties); => TMRM_SubjectMap::getProxiesByProperties()
-
-The above function should maybe return an iterator (as there may be many
-matching proxies)
-
 tmrm_subject_map_sphere* tmrm_subject_map_sphere(tmrm_subject_map* map);
     => TMRM_SubjectMap::getWorld()
 
 Path language:
 --------------
 
- * Notation: "PROXY <- KEY *"
- * PHP-prototype: TMRM_SubjectMap::isValueByKeyWithSubtyping()
-tmrm_multiset* tmrm_subject_map_is_value_by_key_star(tmrm_multiset* proxies,
-    tmrm_proxy* key);
-
  * Finds all keys (in all proxies in the map) where the proxy is the value
  * for it.
  *
@@ -478,10 +643,33 @@ void tmrm_proxy_free(/*@only@*/ tmrm_proxy* p);
 /*@null@*/ tmrm_literal* tmrm_literal_new(const tmrm_char_t* value, const tmrm_char_t* datatype);
 
 
+/* Copy constructor. */
+/*@null@*/ tmrm_literal* tmrm_literal_clone(const tmrm_literal* lit);
+
+
 /* Returns the datatype of a literal. */
 const tmrm_char_t* tmrm_literal_datatype(const tmrm_literal* lit);
 
 
+/* Returns the ID of the datatype of a literal. */
+int tmrm_literal_datatype_id(const tmrm_literal* lit);
+
+
+/* ID of the datatype http://www.w3.org/2001/XMLSchema#string */
+#define TMRM_DATATYPE_STRING 0
+
+/* Returns the ID of a datatype URI, registering it if needed. */
+int tmrm_datatype_id(const tmrm_char_t* datatype);
+
+
+/* Returns the URI of a datatype ID. */
+/*@null@*/ const tmrm_char_t* tmrm_datatype_uri(int id);
+
+
+/* Enables or disables sharing of equal literal values. */
+void tmrm_literal_set_interning(int enable);
+
+
 /* Returns the value of a literal. */
 const tmrm_char_t* tmrm_literal_value(const tmrm_literal* lit);
 
@@ -558,10 +746,11 @@ int tmrm_multiset_is_equal(const tmrm_multiset *set1, const tmrm_multiset *set2)
 /* Returns the number of elements in the set. */
 int tmrm_multiset_size(tmrm_multiset *ms);
 
-/* Returns a list with all elements of the multi set. */
+/* Returns a list with all elements of the multi set. The elements still
+   belong to the multi set. */
 tmrm_list* tmrm_multiset_as_list(const tmrm_multiset *ms);
 
-/* Destructor. */
+/* Destructor. The results of queries are freed with their elements. */
 void tmrm_multiset_free(/*@only@*/ tmrm_multiset *ms);
 
 
@@ -604,6 +793,150 @@ void tmrm_iterator_free(tmrm_iterator* it);
 /* TODO: Implement: */
 /* tmrm_iterator* tmrm_iterator_from_list(tmrm_list* list); */
 
+
+/**
+ * @}
+ * tmrm_path is a compiled expression of the path language. Paths are
+ * composed of steps along the properties of proxies ("-> key" and
+ * "<- key"), filters, the Kleene star and set operators. See
+ * tmrm_path.c for the grammar.
+ *
+ * @defgroup tmrm_path tmrm_path
+ * @ingroup libtmrm_public
+ * @{
+ */
+
+/* Constructor: Compiles a path expression for a subject map. */
+/*@null@*/ tmrm_path* tmrm_path_new(tmrm_subject_map* map,
+        const char* expression);
+
+/* Evaluates the path for a multiset of proxies and literals. */
+/*@null@*/ tmrm_multiset* tmrm_path_evaluate(tmrm_path* path,
+        tmrm_multiset* start);
+
+/* Destructor. */
+void tmrm_path_free(/*@only@*/ tmrm_path* path);
+
+/**
+ * @}
+ * Asynchronous requests for event loops. Requests run on the worker
+ * threads of a tmrm_async queue, or as non-blocking storage queries, in
+ * no particular order; their callbacks run from tmrm_async_dispatch()
+ * once tmrm_async_fd() is readable.
+ *
+ * @defgroup tmrm_async tmrm_async
+ * @ingroup libtmrm_public
+ * @{
+ */
+
+/* Constructor: A request queue with its own worker threads. */
+/*@null@*/ tmrm_async* tmrm_async_new(tmrm_subject_map_sphere* sms,
+        int threads);
+
+/* Destructor: Waits for the running requests. */
+void tmrm_async_free(/*@only@*/ tmrm_async* a);
+
+/* Returns a descriptor that is readable when requests have finished or
+   storage queries can go on. */
+int tmrm_async_fd(tmrm_async* a);
+
+/* Runs the callbacks of the finished requests without blocking. */
+int tmrm_async_dispatch(tmrm_async* a);
+
+/* Waits for a request to finish and runs the callbacks. */
+int tmrm_async_wait(tmrm_async* a);
+
+/* Results, valid in the callback only. */
+int tmrm_request_status(const tmrm_request* r);
+/*@null@*/ tmrm_proxy* tmrm_request_take_proxy(tmrm_request* r);
+/*@null@*/ tmrm_multiset* tmrm_request_take_multiset(tmrm_request* r);
+
+/* Asynchronous variants of the reads and writes of the same names. */
+int tmrm_proxy_by_label_async(tmrm_async* a, tmrm_subject_map* map,
+        const char* label, tmrm_request_callback callback, void* data);
+int tmrm_proxy_values_by_key_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_proxy* key, tmrm_request_callback callback, void* data);
+int tmrm_proxy_is_value_by_key_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_proxy* key, tmrm_request_callback callback, void* data);
+int tmrm_proxy_keys_by_value_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_request_callback callback, void* data);
+int tmrm_subject_map_is_value_by_key_async(tmrm_async* a,
+        tmrm_multiset* proxies, tmrm_proxy* key,
+        tmrm_request_callback callback, void* data);
+int tmrm_path_evaluate_async(tmrm_async* a, tmrm_path* path,
+        tmrm_multiset* start, tmrm_request_callback callback, void* data);
+int tmrm_proxy_add_property_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_proxy* key, tmrm_proxy* value, tmrm_request_callback callback,
+        void* data);
+int tmrm_proxy_add_property_literal_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_proxy* key, tmrm_literal* value, tmrm_request_callback callback,
+        void* data);
+int tmrm_proxy_remove_properties_by_key_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_proxy* key, tmrm_request_callback callback, void* data);
+
+/**
+ * @}
+ * Memory management: allocator hooks and arenas that free the results of
+ * a query at once.
+ *
+ * @defgroup tmrm_memory tmrm_memory
+ * @ingroup libtmrm_public
+ * @{
+ */
+
+/* Replaces the allocator (NULL restores malloc/realloc/free). */
+void tmrm_set_allocator(const tmrm_allocator* allocator);
+
+void* tmrm_malloc(size_t size);
+void* tmrm_calloc(size_t count, size_t size);
+void* tmrm_realloc(void* ptr, size_t size);
+void tmrm_free(void* ptr);
+
+/* Opens an arena for the allocations of the calling thread. */
+/*@null@*/ tmrm_arena* tmrm_arena_begin(void);
+
+/* Closes the arena and frees everything that was allocated in it. */
+void tmrm_arena_end(/*@only@*/ tmrm_arena* arena);
+
+/* Returns the number of bytes allocated in the arena. */
+size_t tmrm_arena_allocated(const tmrm_arena* arena);
+
+/* Returns the number of objects in use and held by the slabs of a pool. */
+void tmrm_pool_stats(tmrm_pool_type pool, size_t* in_use, size_t* capacity);
+
+/* Returns 1 if libtmrm was configured with --enable-memory-accounting. */
+int tmrm_memory_accounting(void);
+
+/* Returns a copy of the heap memory use per allocation type. */
+/*@null@*/ tmrm_memory_type_stats* tmrm_memory_stats(int* count);
+
+/* Resets the high-water marks to the current use. */
+void tmrm_memory_stats_reset(void);
+
+/* Formats the memory use per type and pool as text or JSON. */
+/*@null@*/ char* tmrm_memory_report(tmrm_stats_format format);
+
+/** @} */
+
+/**
+ * Logging: messages of libtmrm go to a handler, by default stderr. Debug
+ * messages are dropped at runtime unless enabled with tmrm_set_logger()
+ * and are compiled out if libtmrm was configured with a lower
+ * --with-log-level.
+ *
+ * @defgroup tmrm_log tmrm_log
+ * @ingroup libtmrm_public
+ * @{
+ */
+
+/* Sets the handler (NULL writes to stderr) and the highest level passed to
+   it. Must not be called while other threads use libtmrm. */
+void tmrm_set_logger(tmrm_log_level level, tmrm_log_handler handler,
+        void* data);
+
+/* Returns the highest level that is currently logged. */
+tmrm_log_level tmrm_get_log_level(void);
+
 /** @} */
 
 tmrm_storage* tmrm_storage_new(tmrm_subject_map_sphere* sms, const char* name, const char* params);
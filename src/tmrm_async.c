@@ -0,0 +1,851 @@
+/*
+ * tmrm_async.c - Asynchronous requests with completion callbacks
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */
+
+/**
+ * @file tmrm_async.c
+ * @brief Asynchronous variants of the core reads and writes for event
+ * loops.
+ *
+ * A tmrm_async object runs requests on its own worker threads (see
+ * tmrm_executor.c). Finished requests are queued, and a byte is written
+ * to a pipe whose read end tmrm_async_fd() returns. The event loop waits
+ * for that descriptor to become readable and calls tmrm_async_dispatch(),
+ * which runs the completion callbacks on the calling thread:
+ *
+ *   a = tmrm_async_new(sms, 4);
+ *   tmrm_proxy_values_by_key_async(a, p, key, done, NULL);
+ *   ... poll(tmrm_async_fd(a)) ...
+ *   tmrm_async_dispatch(a);
+ *
+ * Without POSIX threads, requests run when they are submitted, and their
+ * callbacks still run from tmrm_async_dispatch().
+ *
+ * Storages that can read without blocking (see the query_send callback;
+ * the PostgreSQL storage sends its statements with PQsendQueryParams()
+ * on connections of their own) answer proxy_by_label, values_by_key,
+ * is_value_by_key and keys_by_value requests without a worker. Where
+ * epoll is available, tmrm_async_fd() is an epoll descriptor that also
+ * watches the sockets of these queries, and tmrm_async_dispatch() reads
+ * whatever has arrived on them. Writes, the other reads, and reads through
+ * subject maps with a read cache or a snapshot run on the workers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include <libtmrm.h>
+#include <tmrm_internal.h>
+#include <tmrm_storage.h>
+
+/* Number of ready descriptors that tmrm_async_dispatch() handles at once */
+#define TMRM_ASYNC_EVENTS 16
+
+typedef enum {
+    TMRM_ASYNC_PROXY_BY_LABEL = 0,
+    TMRM_ASYNC_VALUES_BY_KEY,
+    TMRM_ASYNC_IS_VALUE_BY_KEY,
+    TMRM_ASYNC_KEYS_BY_VALUE,
+    TMRM_ASYNC_SUBJECT_MAP_IS_VALUE_BY_KEY,
+    TMRM_ASYNC_PATH_EVALUATE,
+    TMRM_ASYNC_ADD_PROPERTY,
+    TMRM_ASYNC_ADD_PROPERTY_LITERAL,
+    TMRM_ASYNC_REMOVE_PROPERTIES_BY_KEY
+} tmrm_async_op;
+
+struct tmrm_request_s {
+    tmrm_async* async;
+    tmrm_async_op op;
+    tmrm_request_callback callback;
+    void* data;
+
+    /* Arguments, borrowed from the caller except for label */
+    tmrm_subject_map* map;
+    tmrm_proxy* proxy;
+    tmrm_proxy* key;
+    tmrm_proxy* value;
+    tmrm_literal* literal;
+    tmrm_multiset* multiset;
+    tmrm_path* path;
+    char* label;
+
+    /* Results, freed after the callback unless taken */
+    int status;
+    tmrm_proxy* result_proxy;
+    tmrm_multiset* result_multiset;
+
+    /* Non-blocking read of the storage (see _request_send), and the
+       descriptor and events it is watched for */
+    tmrm_storage_query* query;
+    int query_fd;
+    unsigned int query_events;
+
+    struct tmrm_request_s* next;
+};
+
+struct tmrm_async_s {
+    tmrm_executor* executor;    /* NULL: requests run when submitted */
+    int fds[2];                 /* completion pipe */
+#ifdef HAVE_SYS_EPOLL_H
+    int epoll_fd;               /* completion pipe and storage queries */
+#endif
+#ifdef HAVE_PTHREAD
+    /* Guards everything below */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#endif
+    int pending;                /* submitted, but not finished */
+    tmrm_request* done;         /* finished, in order of completion */
+    tmrm_request* done_tail;
+    tmrm_request* querying;     /* waiting for their storage queries */
+};
+
+#ifdef HAVE_PTHREAD
+#define _async_lock(a) pthread_mutex_lock(&(a)->lock)
+#define _async_unlock(a) pthread_mutex_unlock(&(a)->lock)
+#else
+#define _async_lock(a) do {} while (0)
+#define _async_unlock(a) do {} while (0)
+#endif
+
+
+static void
+_request_free(tmrm_request* r)
+{
+    if (r->result_proxy) tmrm_proxy_free(r->result_proxy);
+    if (r->result_multiset) tmrm_multiset_free(r->result_multiset);
+    if (r->query) tmrm_storage_query_free(r->query);
+    if (r->label) TMRM_FREE(char, r->label);
+    TMRM_FREE(tmrm_request, r);
+}
+
+
+/* Queues a finished request for tmrm_async_dispatch() */
+static void
+_request_done(tmrm_request* r)
+{
+    tmrm_async* a = r->async;
+    char c = 1;
+
+    _async_lock(a);
+    if (a->done_tail) {
+        a->done_tail->next = r;
+    } else {
+        a->done = r;
+        /* Wake up the event loop. The pipe is only written while done is
+           empty, so it cannot fill up. */
+        if (write(a->fds[1], &c, 1) != 1) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Could not signal a completed request: %s",
+                    strerror(errno));
+        }
+    }
+    a->done_tail = r;
+    a->pending--;
+#ifdef HAVE_PTHREAD
+    pthread_cond_broadcast(&a->changed);
+#endif
+    _async_unlock(a);
+}
+
+
+/* Runs the request and queues it for tmrm_async_dispatch() */
+static void
+_request_run(void* data, int index)
+{
+    tmrm_request* r = (tmrm_request*)data;
+
+    switch (r->op) {
+        case TMRM_ASYNC_PROXY_BY_LABEL:
+            r->result_proxy = tmrm_proxy_by_label(r->map, r->label);
+            r->status = r->result_proxy == NULL;
+            break;
+        case TMRM_ASYNC_VALUES_BY_KEY:
+            r->result_multiset = tmrm_proxy_values_by_key(r->proxy, r->key);
+            r->status = r->result_multiset == NULL;
+            break;
+        case TMRM_ASYNC_IS_VALUE_BY_KEY:
+            r->result_multiset = tmrm_proxy_is_value_by_key(r->proxy, r->key);
+            r->status = r->result_multiset == NULL;
+            break;
+        case TMRM_ASYNC_KEYS_BY_VALUE:
+            r->result_multiset = tmrm_proxy_keys_by_value(r->proxy);
+            r->status = r->result_multiset == NULL;
+            break;
+        case TMRM_ASYNC_SUBJECT_MAP_IS_VALUE_BY_KEY:
+            r->result_multiset = tmrm_subject_map_is_value_by_key(r->multiset,
+                    r->key);
+            r->status = r->result_multiset == NULL;
+            break;
+        case TMRM_ASYNC_PATH_EVALUATE:
+            r->result_multiset = tmrm_path_evaluate(r->path, r->multiset);
+            r->status = r->result_multiset == NULL;
+            break;
+        case TMRM_ASYNC_ADD_PROPERTY:
+            r->status = tmrm_proxy_add_property(r->proxy, r->key, r->value);
+            break;
+        case TMRM_ASYNC_ADD_PROPERTY_LITERAL:
+            r->status = tmrm_proxy_add_property_literal(r->proxy, r->key,
+                    r->literal);
+            break;
+        case TMRM_ASYNC_REMOVE_PROPERTIES_BY_KEY:
+            r->status = tmrm_proxy_remove_properties_by_key(r->proxy, r->key);
+            break;
+    }
+    _request_done(r);
+}
+
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Watches the descriptor of the storage query of r for the events that
+   the query waits for. Returns non-zero on failure. */
+static int
+_request_watch(tmrm_request* r)
+{
+    tmrm_async* a = r->async;
+    struct epoll_event event;
+    int fd = r->query->fd;
+
+    memset(&event, 0, sizeof(event));
+    event.events = r->query->want_write ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = r;
+    if (fd == r->query_fd) {
+        if (epoll_ctl(a->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0) {
+            r->query_events = event.events;
+            return 0;
+        }
+        /* A descriptor that was closed and reused is no longer watched */
+        if (errno != ENOENT) goto failed;
+    } else if (r->query_fd >= 0) {
+        /* libpq may change sockets while it connects */
+        (void)epoll_ctl(a->epoll_fd, EPOLL_CTL_DEL, r->query_fd, NULL);
+    }
+    r->query_fd = -1;
+    if (fd < 0 || epoll_ctl(a->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        goto failed;
+    }
+    r->query_fd = fd;
+    r->query_events = event.events;
+    return 0;
+
+failed:
+    TMRM_LOG(TMRM_LOG_ERROR, "Could not watch a storage query: %s",
+            strerror(errno));
+    return 1;
+}
+
+
+/* Takes r off the list of requests that wait for storage queries */
+static void
+_request_unlink(tmrm_request* r)
+{
+    tmrm_async* a = r->async;
+    tmrm_request** prev;
+
+    _async_lock(a);
+    for (prev = &a->querying; *prev && *prev != r; prev = &(*prev)->next) {
+    }
+    if (*prev) *prev = r->next;
+    r->next = NULL;
+    _async_unlock(a);
+}
+
+
+/* Starts r as a non-blocking read of its storage. Returns non-zero if the
+   storage cannot read without blocking, so that r goes to a worker. */
+static int
+_request_send(tmrm_request* r)
+{
+    tmrm_async* a = r->async;
+    tmrm_subject_map* map;
+    tmrm_storage_op op;
+
+    switch (r->op) {
+        case TMRM_ASYNC_PROXY_BY_LABEL:
+            op = TMRM_STORAGE_OP_PROXY_BY_LABEL;
+            map = r->map;
+            break;
+        case TMRM_ASYNC_VALUES_BY_KEY:
+            op = TMRM_STORAGE_OP_PROXY_VALUES_BY_KEY;
+            map = r->proxy->subject_map;
+            break;
+        case TMRM_ASYNC_IS_VALUE_BY_KEY:
+            op = TMRM_STORAGE_OP_PROXY_IS_VALUE_BY_KEY;
+            map = r->proxy->subject_map;
+            break;
+        case TMRM_ASYNC_KEYS_BY_VALUE:
+            op = TMRM_STORAGE_OP_PROXY_KEYS_BY_VALUE;
+            map = r->proxy->subject_map;
+            break;
+        default:
+            return 1;
+    }
+    if (!(r->query = tmrm_storage_query_send(map->storage, op, map,
+                    r->proxy, r->key, r->label))) {
+        return 1;
+    }
+    /* Listed before it is watched, because tmrm_async_dispatch() may run
+       on another thread and see it ready right away */
+    r->query_fd = -1;
+    _async_lock(a);
+    r->next = a->querying;
+    a->querying = r;
+    _async_unlock(a);
+    if (_request_watch(r)) {
+        _request_unlink(r);
+        tmrm_storage_query_free(r->query);
+        r->query = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Reads what has arrived for the storage query of r, and queues r once
+   the query has finished */
+static void
+_request_poll(tmrm_request* r)
+{
+    tmrm_async* a = r->async;
+    tmrm_iterator* it;
+
+    if (tmrm_storage_query_poll(r->query) && _request_watch(r) == 0) return;
+
+    if (r->query_fd >= 0) {
+        (void)epoll_ctl(a->epoll_fd, EPOLL_CTL_DEL, r->query_fd, NULL);
+    }
+    _request_unlink(r);
+    /* A query that cannot be watched any more has no result */
+    if ((it = r->query->result)) {
+        if (r->op == TMRM_ASYNC_PROXY_BY_LABEL) {
+            if (!tmrm_iterator_end(it)) {
+                r->result_proxy = (tmrm_proxy*)tmrm_iterator_get_object(it);
+            }
+            r->status = r->result_proxy == NULL;
+        } else {
+            r->result_multiset = tmrm_multiset_new_from_iterator(
+                    r->query->map, it);
+            r->status = r->result_multiset == NULL;
+        }
+    } else {
+        r->status = 1;
+    }
+    tmrm_storage_query_free(r->query);
+    r->query = NULL;
+    _request_done(r);
+}
+#endif
+
+
+/* Allocates a request. Returns NULL on failure. */
+static tmrm_request*
+_request_new(tmrm_async* a, tmrm_async_op op, tmrm_request_callback callback,
+        void* data)
+{
+    tmrm_request* r;
+
+    if (!callback) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Asynchronous requests need a callback");
+        return NULL;
+    }
+    r = (tmrm_request*)TMRM_CALLOC(tmrm_request, 1, sizeof(tmrm_request));
+    if (!r) return NULL;
+    r->async = a;
+    r->op = op;
+    r->callback = callback;
+    r->data = data;
+    return r;
+}
+
+
+/* Hands r to a worker, or runs it right away */
+static int
+_request_submit(tmrm_request* r)
+{
+    tmrm_async* a = r->async;
+
+    _async_lock(a);
+    a->pending++;
+    _async_unlock(a);
+#ifdef HAVE_SYS_EPOLL_H
+    if (_request_send(r) == 0) return 0;
+#endif
+    if (!a->executor || tmrm_executor_submit(a->executor, _request_run, r)) {
+        _request_run(r, 0);
+    }
+    return 0;
+}
+
+
+/**
+ * Creates a queue for asynchronous requests with the given number of
+ * worker threads. The arguments of all requests must stay valid until
+ * their callbacks have run.
+ *
+ * @param sms A pointer to a valid subject_map_sphere object.
+ * @param threads Number of worker threads. With 0, or without POSIX
+ * threads, requests that need a worker run when they are submitted.
+ * @returns NULL on failure
+ */
+/*@null@*/ tmrm_async*
+tmrm_async_new(tmrm_subject_map_sphere* sms, int threads)
+{
+    tmrm_async* a;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event event;
+#endif
+    int i;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(sms, tmrm_subject_map_sphere,
+            NULL);
+    a = (tmrm_async*)TMRM_CALLOC(tmrm_async, 1, sizeof(tmrm_async));
+    if (!a) return NULL;
+    if (pipe(a->fds)) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Could not create completion pipe: %s",
+                strerror(errno));
+        TMRM_FREE(tmrm_async, a);
+        return NULL;
+    }
+    for (i = 0; i < 2; i++) {
+        (void)fcntl(a->fds[i], F_SETFL, fcntl(a->fds[i], F_GETFL) | O_NONBLOCK);
+        (void)fcntl(a->fds[i], F_SETFD, FD_CLOEXEC);
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if ((a->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            epoll_ctl(a->epoll_fd, EPOLL_CTL_ADD, a->fds[0], &event)) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Could not create epoll descriptor: %s",
+                strerror(errno));
+        if (a->epoll_fd >= 0) close(a->epoll_fd);
+        close(a->fds[0]);
+        close(a->fds[1]);
+        TMRM_FREE(tmrm_async, a);
+        return NULL;
+    }
+#endif
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->changed, NULL);
+#endif
+    if (threads > 0 && !(a->executor = tmrm_executor_new(threads))) {
+        TMRM_LOG(TMRM_LOG_WARNING, "Asynchronous requests run synchronously");
+    }
+    return a;
+}
+
+
+/**
+ * Cancels the storage queries, waits for the running requests and frees
+ * the queue. The callbacks of requests that were not dispatched yet are
+ * not called.
+ */
+void
+tmrm_async_free(/*@only@*/ tmrm_async* a)
+{
+    tmrm_request *r, *querying;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN(a, tmrm_async);
+    /* Only tmrm_async_dispatch() finishes storage queries */
+    _async_lock(a);
+    querying = a->querying;
+    a->querying = NULL;
+    for (r = querying; r; r = r->next) a->pending--;
+    _async_unlock(a);
+    while ((r = querying)) {
+        querying = r->next;
+        _request_free(r);
+    }
+#ifdef HAVE_PTHREAD
+    _async_lock(a);
+    while (a->pending > 0) pthread_cond_wait(&a->changed, &a->lock);
+    _async_unlock(a);
+#endif
+    if (a->executor) tmrm_executor_free(a->executor);
+    while ((r = a->done)) {
+        a->done = r->next;
+        _request_free(r);
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->changed);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    close(a->epoll_fd);
+#endif
+    close(a->fds[0]);
+    close(a->fds[1]);
+    TMRM_FREE(tmrm_async, a);
+}
+
+
+/**
+ * Returns a file descriptor that becomes readable when requests have
+ * finished, or when storage queries can go on, for select(), poll() or
+ * epoll. Only tmrm_async_dispatch() may read from it.
+ */
+int
+tmrm_async_fd(tmrm_async* a)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(a, tmrm_async, -1);
+#ifdef HAVE_SYS_EPOLL_H
+    return a->epoll_fd;
+#else
+    return a->fds[0];
+#endif
+}
+
+
+/**
+ * Reads the results of the storage queries that are ready and runs the
+ * callbacks of all finished requests on the calling thread, in the order
+ * in which the requests finished. Does not block.
+ *
+ * @returns the number of callbacks that ran
+ */
+int
+tmrm_async_dispatch(tmrm_async* a)
+{
+    tmrm_request *r, *next;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[TMRM_ASYNC_EVENTS];
+    int i, n;
+#endif
+    char buffer[64];
+    int count = 0;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(a, tmrm_async, 0);
+#ifdef HAVE_SYS_EPOLL_H
+    n = epoll_wait(a->epoll_fd, events, TMRM_ASYNC_EVENTS, 0);
+    for (i = 0; i < n; i++) {
+        /* The completion pipe is read below */
+        if (events[i].data.ptr) {
+            _request_poll((tmrm_request*)events[i].data.ptr);
+        }
+    }
+#endif
+    _async_lock(a);
+    while (read(a->fds[0], buffer, sizeof(buffer)) > 0) {
+    }
+    r = a->done;
+    a->done = a->done_tail = NULL;
+    _async_unlock(a);
+
+    for (; r; r = next) {
+        next = r->next;
+        r->callback(r, r->data);
+        _request_free(r);
+        count++;
+    }
+    return count;
+}
+
+
+/**
+ * Blocks until a request has finished, or until none is running, and
+ * dispatches the finished requests (see tmrm_async_dispatch()).
+ *
+ * @returns the number of callbacks that ran
+ */
+int
+tmrm_async_wait(tmrm_async* a)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event event;
+#endif
+    int count, idle;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(a, tmrm_async, 0);
+    while ((count = tmrm_async_dispatch(a)) == 0) {
+        _async_lock(a);
+#if defined(HAVE_PTHREAD) && !defined(HAVE_SYS_EPOLL_H)
+        while (!a->done && a->pending > 0) {
+            pthread_cond_wait(&a->changed, &a->lock);
+        }
+#endif
+        idle = !a->done && a->pending == 0;
+        _async_unlock(a);
+        if (idle) break;
+#ifdef HAVE_SYS_EPOLL_H
+        /* Storage queries only go on in tmrm_async_dispatch(), so wait
+           for them and for the workers alike */
+        (void)epoll_wait(a->epoll_fd, &event, 1, -1);
+#endif
+    }
+    return count;
+}
+
+
+/**
+ * Returns the return value of the synchronous function for writes, or
+ * 0 if a read succeeded and 1 if it failed.
+ */
+int
+tmrm_request_status(const tmrm_request* r)
+{
+    return r->status;
+}
+
+
+/**
+ * Takes the proxy that a request returned. The caller has to free it; if
+ * it is not taken in the callback, it is freed afterwards.
+ */
+/*@null@*/ tmrm_proxy*
+tmrm_request_take_proxy(tmrm_request* r)
+{
+    tmrm_proxy* p = r->result_proxy;
+
+    r->result_proxy = NULL;
+    return p;
+}
+
+
+/**
+ * Takes the multiset that a request returned. The caller has to free it;
+ * if it is not taken in the callback, it is freed afterwards.
+ */
+/*@null@*/ tmrm_multiset*
+tmrm_request_take_multiset(tmrm_request* r)
+{
+    tmrm_multiset* ms = r->result_multiset;
+
+    r->result_multiset = NULL;
+    return ms;
+}
+
+
+/**
+ * Asynchronous tmrm_proxy_by_label(). The result is taken with
+ * tmrm_request_take_proxy().
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_proxy_by_label_async(tmrm_async* a, tmrm_subject_map* map,
+        const char* label, tmrm_request_callback callback, void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_PROXY_BY_LABEL, callback, data))) {
+        return 1;
+    }
+    r->map = map;
+    if (!(r->label = tmrm_strdup(label))) {
+        _request_free(r);
+        return 1;
+    }
+    return _request_submit(r);
+}
+
+
+/**
+ * Asynchronous tmrm_proxy_values_by_key(). The result is taken with
+ * tmrm_request_take_multiset().
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_proxy_values_by_key_async(tmrm_async* a, tmrm_proxy* p, tmrm_proxy* key,
+        tmrm_request_callback callback, void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_VALUES_BY_KEY, callback, data))) {
+        return 1;
+    }
+    r->proxy = p;
+    r->key = key;
+    return _request_submit(r);
+}
+
+
+/**
+ * Asynchronous tmrm_proxy_is_value_by_key(). The result is taken with
+ * tmrm_request_take_multiset().
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_proxy_is_value_by_key_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_proxy* key, tmrm_request_callback callback, void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_IS_VALUE_BY_KEY, callback, data))) {
+        return 1;
+    }
+    r->proxy = p;
+    r->key = key;
+    return _request_submit(r);
+}
+
+
+/**
+ * Asynchronous tmrm_proxy_keys_by_value(). The result is taken with
+ * tmrm_request_take_multiset().
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_proxy_keys_by_value_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_request_callback callback, void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_KEYS_BY_VALUE, callback, data))) {
+        return 1;
+    }
+    r->proxy = p;
+    return _request_submit(r);
+}
+
+
+/**
+ * Asynchronous tmrm_subject_map_is_value_by_key(). The result is taken
+ * with tmrm_request_take_multiset().
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_subject_map_is_value_by_key_async(tmrm_async* a,
+        tmrm_multiset* proxies, tmrm_proxy* key,
+        tmrm_request_callback callback, void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_SUBJECT_MAP_IS_VALUE_BY_KEY,
+                    callback, data))) {
+        return 1;
+    }
+    r->multiset = proxies;
+    r->key = key;
+    return _request_submit(r);
+}
+
+
+/**
+ * Asynchronous tmrm_path_evaluate(). The result is taken with
+ * tmrm_request_take_multiset().
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_path_evaluate_async(tmrm_async* a, tmrm_path* path,
+        tmrm_multiset* start, tmrm_request_callback callback, void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_PATH_EVALUATE, callback, data))) {
+        return 1;
+    }
+    r->path = path;
+    r->multiset = start;
+    return _request_submit(r);
+}
+
+
+/**
+ * Asynchronous tmrm_proxy_add_property(). tmrm_request_status() returns
+ * its return value.
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_proxy_add_property_async(tmrm_async* a, tmrm_proxy* p, tmrm_proxy* key,
+        tmrm_proxy* value, tmrm_request_callback callback, void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_ADD_PROPERTY, callback, data))) {
+        return 1;
+    }
+    r->proxy = p;
+    r->key = key;
+    r->value = value;
+    return _request_submit(r);
+}
+
+
+/**
+ * Asynchronous tmrm_proxy_add_property_literal(). tmrm_request_status()
+ * returns its return value.
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_proxy_add_property_literal_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_proxy* key, tmrm_literal* value, tmrm_request_callback callback,
+        void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_ADD_PROPERTY_LITERAL, callback,
+                    data))) {
+        return 1;
+    }
+    r->proxy = p;
+    r->key = key;
+    r->literal = value;
+    return _request_submit(r);
+}
+
+
+/**
+ * Asynchronous tmrm_proxy_remove_properties_by_key().
+ * tmrm_request_status() returns its return value.
+ *
+ * @returns 0 if the request was submitted
+ */
+int
+tmrm_proxy_remove_properties_by_key_async(tmrm_async* a, tmrm_proxy* p,
+        tmrm_proxy* key, tmrm_request_callback callback, void* data)
+{
+    tmrm_request* r;
+
+    if (!(r = _request_new(a, TMRM_ASYNC_REMOVE_PROPERTIES_BY_KEY, callback,
+                    data))) {
+        return 1;
+    }
+    r->proxy = p;
+    r->key = key;
+    return _request_submit(r);
+}
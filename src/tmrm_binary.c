@@ -0,0 +1,798 @@
+/*
+ * tmrm_binary.c - Binary interchange format for subject maps
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libtmrm.h>
+#include <tmrm_internal.h>
+#include <tmrm_storage.h>
+
+/*
+ * Layout of a binary subject map. The file starts with the magic bytes
+ * TMRM_BINARY_MAGIC, followed by records of the form
+ *
+ *   tag (1 byte)  length (varint)  payload (length bytes)
+ *
+ * Readers skip records with unknown tags. Integers in the payload are
+ * unsigned LEB128 varints; signed differences are zigzag encoded.
+ *
+ *   'M'  name of the subject map
+ *   'B'  label of the bottom proxy
+ *   'S'  a string for the dictionary. Strings are numbered from 0 in the
+ *        order of their records and are written before their first use.
+ *   'P'  a proxy and its properties: the difference to the label of the
+ *        previous proxy, the number of properties and for each property
+ *          - the difference to the previous key of this proxy
+ *          - for a proxy value: the difference to the previous proxy
+ *            value of this proxy, shifted left by one
+ *          - for a literal value: the string number of the value, shifted
+ *            left by one with the lowest bit set, followed by the string
+ *            number of the datatype
+ *   'E'  end of the subject map
+ */
+#define TMRM_BINARY_MAGIC "TMRMBIN1"
+
+#define TMRM_BINARY_RECORD_NAME 'M'
+#define TMRM_BINARY_RECORD_BOTTOM 'B'
+#define TMRM_BINARY_RECORD_STRING 'S'
+#define TMRM_BINARY_RECORD_PROXY 'P'
+#define TMRM_BINARY_RECORD_END 'E'
+
+/* Maximum size of an encoded varint */
+#define TMRM_BINARY_VARINT_SIZE 10
+
+/* The writer collects its output and writes it in chunks of this size */
+#define TMRM_BINARY_WRITE_BUFFER_SIZE (256 * 1024)
+/* Records are read in chunks of this size, so that memory is only
+   reserved for data that has arrived */
+#define TMRM_BINARY_READ_CHUNK (64 * 1024)
+
+struct tmrm_binary_buffer_s {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+};
+typedef struct tmrm_binary_buffer_s tmrm_binary_buffer;
+
+struct tmrm_binary_string_s {
+    char *value;
+    unsigned long hash;
+    unsigned long id;
+};
+typedef struct tmrm_binary_string_s tmrm_binary_string;
+
+struct tmrm_binary_writer_s {
+    FILE *fh;
+    /* Output that has not been written to fh yet */
+    tmrm_binary_buffer out;
+    /* The properties of the current proxy */
+    tmrm_binary_buffer block;
+    size_t properties;
+    long proxy;
+    long prev_proxy;
+    long prev_key;
+    long prev_value;
+    /* String dictionary, open addressing */
+    tmrm_binary_string *strings;
+    size_t strings_size;
+    size_t strings_count;
+    int error;
+};
+
+/* Maps the labels of an imported map to the proxies created for them */
+struct tmrm_binary_label_s {
+    long label;
+    tmrm_proxy *proxy;
+};
+typedef struct tmrm_binary_label_s tmrm_binary_label;
+
+struct tmrm_binary_reader_s {
+    tmrm_subject_map *map;
+    int has_bottom;
+    long bottom;
+    char **strings;
+    size_t strings_count;
+    size_t strings_size;
+    tmrm_binary_label *labels;
+    size_t labels_size;
+    size_t labels_count;
+};
+typedef struct tmrm_binary_reader_s tmrm_binary_reader;
+
+static int tmrm_binary_subject_map_start(void *context,
+    const tmrm_char_t *name);
+static int tmrm_binary_subject_map_end(void *context);
+static int tmrm_binary_proxy_start(void *context, tmrm_label label);
+static int tmrm_binary_property(void *context, tmrm_label key,
+    tmrm_label value);
+static int tmrm_binary_property_literal(void *context, tmrm_label key,
+    const tmrm_char_t *value, const tmrm_char_t *datatype);
+static int tmrm_binary_proxy_end(void *context);
+
+const tmrm_streaming_handler tmrm_binary_streaming_handler = {
+    tmrm_binary_subject_map_start,
+    tmrm_binary_subject_map_end,
+    tmrm_binary_proxy_start,
+    tmrm_binary_property,
+    tmrm_binary_property_literal,
+    tmrm_binary_proxy_end
+};
+
+
+static unsigned long
+tmrm_binary_zigzag(long v)
+{
+    return v < 0 ? ((unsigned long)(-(v + 1)) << 1) | 1 :
+        (unsigned long)v << 1;
+}
+
+
+static long
+tmrm_binary_unzigzag(unsigned long u)
+{
+    return u & 1 ? -(long)(u >> 1) - 1 : (long)(u >> 1);
+}
+
+
+static size_t
+tmrm_binary_encode_varint(unsigned char *p, unsigned long v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+
+/* Reads a varint from *p and advances *p. Returns non-zero if the varint
+   is truncated or too long. */
+static int
+tmrm_binary_decode_varint(const unsigned char **p, const unsigned char *end,
+    unsigned long *v)
+{
+    unsigned long result = 0;
+    unsigned int shift = 0;
+
+    while (*p < end && shift < 8 * sizeof(unsigned long)) {
+        result |= (unsigned long)(**p & 0x7f) << shift;
+        if (!(*(*p)++ & 0x80)) {
+            *v = result;
+            return 0;
+        }
+        shift += 7;
+    }
+    return 1;
+}
+
+
+static int
+tmrm_binary_buffer_reserve(tmrm_binary_buffer *b, size_t len)
+{
+    unsigned char *data;
+    size_t size;
+
+    if (b->len + len <= b->size) return 0;
+    size = b->size ? 2 * b->size : 4096;
+    while (size < b->len + len) size *= 2;
+    if (!(data = (unsigned char*)TMRM_REALLOC(cstring, b->data, size))) {
+        return 1;
+    }
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+
+static int
+tmrm_binary_buffer_put_varint(tmrm_binary_buffer *b, unsigned long v)
+{
+    if (tmrm_binary_buffer_reserve(b, TMRM_BINARY_VARINT_SIZE)) return 1;
+    b->len += tmrm_binary_encode_varint(b->data + b->len, v);
+    return 0;
+}
+
+
+static int
+tmrm_binary_writer_flush(tmrm_binary_writer *w)
+{
+    if (w->out.len && fwrite(w->out.data, 1, w->out.len, w->fh) != w->out.len) {
+        w->error = 1;
+    }
+    w->out.len = 0;
+    return w->error;
+}
+
+
+/* Appends a record to the output whose payload is head followed by
+   data. */
+static int
+tmrm_binary_write_record_parts(tmrm_binary_writer *w, int tag,
+    const unsigned char *head, size_t head_len,
+    const unsigned char *data, size_t len)
+{
+    tmrm_binary_buffer *b = &w->out;
+
+    if (tmrm_binary_buffer_reserve(b,
+                1 + TMRM_BINARY_VARINT_SIZE + head_len + len)) {
+        w->error = 1;
+        return 1;
+    }
+    b->data[b->len++] = (unsigned char)tag;
+    b->len += tmrm_binary_encode_varint(b->data + b->len,
+            (unsigned long)(head_len + len));
+    if (head_len) memcpy(b->data + b->len, head, head_len);
+    b->len += head_len;
+    if (len) memcpy(b->data + b->len, data, len);
+    b->len += len;
+    if (b->len >= TMRM_BINARY_WRITE_BUFFER_SIZE) {
+        return tmrm_binary_writer_flush(w);
+    }
+    return 0;
+}
+
+
+static int
+tmrm_binary_write_record(tmrm_binary_writer *w, int tag,
+    const unsigned char *data, size_t len)
+{
+    return tmrm_binary_write_record_parts(w, tag, NULL, 0, data, len);
+}
+
+
+static unsigned long
+tmrm_binary_string_hash(const char *s)
+{
+    unsigned long h = 5381;
+
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+
+/* Returns the dictionary number of s. Strings that are new to the
+   dictionary are written as a string record first. */
+static int
+tmrm_binary_string_id(tmrm_binary_writer *w, const char *s,
+    unsigned long *id)
+{
+    tmrm_binary_string *strings, *slot;
+    unsigned long h;
+    size_t i, j, size, len;
+
+    h = tmrm_binary_string_hash(s);
+    if (w->strings_size > 0) {
+        for (i = h & (w->strings_size - 1); w->strings[i].value;
+                i = (i + 1) & (w->strings_size - 1)) {
+            if (w->strings[i].hash == h && !strcmp(w->strings[i].value, s)) {
+                *id = w->strings[i].id;
+                return 0;
+            }
+        }
+    }
+
+    if (2 * (w->strings_count + 1) > w->strings_size) {
+        size = w->strings_size ? 2 * w->strings_size : 256;
+        strings = (tmrm_binary_string*)TMRM_CALLOC(tmrm_binary_string, size,
+                sizeof(tmrm_binary_string));
+        if (!strings) return 1;
+        for (j = 0; j < w->strings_size; j++) {
+            if (!w->strings[j].value) continue;
+            for (i = w->strings[j].hash & (size - 1); strings[i].value;
+                    i = (i + 1) & (size - 1)) ;
+            strings[i] = w->strings[j];
+        }
+        if (w->strings) TMRM_FREE(tmrm_binary_string, w->strings);
+        w->strings = strings;
+        w->strings_size = size;
+    }
+    for (i = h & (w->strings_size - 1); w->strings[i].value;
+            i = (i + 1) & (w->strings_size - 1)) ;
+    slot = &w->strings[i];
+
+    len = strlen(s);
+    if (!(slot->value = (char*)TMRM_MALLOC(cstring, len + 1))) return 1;
+    memcpy(slot->value, s, len + 1);
+    slot->hash = h;
+    slot->id = (unsigned long)w->strings_count++;
+    *id = slot->id;
+    return tmrm_binary_write_record(w, TMRM_BINARY_RECORD_STRING,
+            (const unsigned char*)s, len);
+}
+
+
+/**
+ * Creates a writer for the binary format on fh and writes the file
+ * header. The writer is the context of tmrm_binary_streaming_handler.
+ *
+ * @returns NULL on failure.
+ */
+tmrm_binary_writer*
+tmrm_binary_writer_new(FILE *fh)
+{
+    tmrm_binary_writer *w;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(fh, FILE, NULL);
+
+    if (!(w = (tmrm_binary_writer*)TMRM_CALLOC(tmrm_binary_writer, 1,
+                    sizeof(tmrm_binary_writer)))) {
+        return NULL;
+    }
+    w->fh = fh;
+    if (tmrm_binary_buffer_reserve(&w->out, TMRM_BINARY_WRITE_BUFFER_SIZE)) {
+        TMRM_FREE(tmrm_binary_writer, w);
+        return NULL;
+    }
+    memcpy(w->out.data, TMRM_BINARY_MAGIC, 8);
+    w->out.len = 8;
+    return w;
+}
+
+
+/**
+ * Records the label of the bottom proxy, so that the import can map it to
+ * the bottom proxy of the target subject map.
+ */
+int
+tmrm_binary_writer_bottom(tmrm_binary_writer *w, tmrm_label bottom)
+{
+    unsigned char data[TMRM_BINARY_VARINT_SIZE];
+    size_t n;
+
+    n = tmrm_binary_encode_varint(data, tmrm_binary_zigzag((long)bottom));
+    return tmrm_binary_write_record(w, TMRM_BINARY_RECORD_BOTTOM, data, n);
+}
+
+
+/**
+ * Returns non-zero if any write of w has failed. Output is only complete
+ * after the subject_map_end callback.
+ */
+int
+tmrm_binary_writer_error(tmrm_binary_writer *w)
+{
+    return w->error;
+}
+
+
+void
+tmrm_binary_writer_free(tmrm_binary_writer *w)
+{
+    size_t i;
+
+    if (!w) return;
+    for (i = 0; i < w->strings_size; i++) {
+        if (w->strings[i].value) TMRM_FREE(cstring, w->strings[i].value);
+    }
+    if (w->strings) TMRM_FREE(tmrm_binary_string, w->strings);
+    if (w->block.data) TMRM_FREE(cstring, w->block.data);
+    if (w->out.data) TMRM_FREE(cstring, w->out.data);
+    TMRM_FREE(tmrm_binary_writer, w);
+}
+
+
+static int
+tmrm_binary_subject_map_start(void *context, const tmrm_char_t *name)
+{
+    tmrm_binary_writer *w = (tmrm_binary_writer*)context;
+
+    return tmrm_binary_write_record(w, TMRM_BINARY_RECORD_NAME,
+            name, name ? strlen((char*)name) : 0);
+}
+
+
+static int
+tmrm_binary_subject_map_end(void *context)
+{
+    tmrm_binary_writer *w = (tmrm_binary_writer*)context;
+
+    if (tmrm_binary_write_record(w, TMRM_BINARY_RECORD_END, NULL, 0) ||
+            tmrm_binary_writer_flush(w)) {
+        return -1;
+    }
+    if (fflush(w->fh)) {
+        w->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+
+static int
+tmrm_binary_proxy_start(void *context, tmrm_label label)
+{
+    tmrm_binary_writer *w = (tmrm_binary_writer*)context;
+
+    w->proxy = (long)label;
+    w->block.len = 0;
+    w->properties = 0;
+    w->prev_key = w->prev_value = 0;
+    return 0;
+}
+
+
+static int
+tmrm_binary_property(void *context, tmrm_label key, tmrm_label value)
+{
+    tmrm_binary_writer *w = (tmrm_binary_writer*)context;
+    long k = (long)key, v = (long)value;
+
+    if (tmrm_binary_buffer_put_varint(&w->block,
+                tmrm_binary_zigzag(k - w->prev_key)) ||
+            tmrm_binary_buffer_put_varint(&w->block,
+                tmrm_binary_zigzag(v - w->prev_value) << 1)) {
+        w->error = 1;
+        return -1;
+    }
+    w->prev_key = k;
+    w->prev_value = v;
+    w->properties++;
+    return 0;
+}
+
+
+static int
+tmrm_binary_property_literal(void *context, tmrm_label key,
+    const tmrm_char_t *value, const tmrm_char_t *datatype)
+{
+    tmrm_binary_writer *w = (tmrm_binary_writer*)context;
+    unsigned long value_id, datatype_id;
+    long k = (long)key;
+
+    if (!datatype) datatype = (const tmrm_char_t*)TMRM_XMLSCHEMA_STRING;
+    if (tmrm_binary_string_id(w, (char*)value, &value_id) ||
+            tmrm_binary_string_id(w, (char*)datatype, &datatype_id) ||
+            tmrm_binary_buffer_put_varint(&w->block,
+                tmrm_binary_zigzag(k - w->prev_key)) ||
+            tmrm_binary_buffer_put_varint(&w->block, (value_id << 1) | 1) ||
+            tmrm_binary_buffer_put_varint(&w->block, datatype_id)) {
+        w->error = 1;
+        return -1;
+    }
+    w->prev_key = k;
+    w->properties++;
+    return 0;
+}
+
+
+static int
+tmrm_binary_proxy_end(void *context)
+{
+    tmrm_binary_writer *w = (tmrm_binary_writer*)context;
+    unsigned char head[2 * TMRM_BINARY_VARINT_SIZE];
+    size_t n;
+
+    n = tmrm_binary_encode_varint(head,
+            tmrm_binary_zigzag(w->proxy - w->prev_proxy));
+    n += tmrm_binary_encode_varint(head + n, (unsigned long)w->properties);
+    if (tmrm_binary_write_record_parts(w, TMRM_BINARY_RECORD_PROXY, head, n,
+                w->block.data, w->block.len)) {
+        return -1;
+    }
+    w->prev_proxy = w->proxy;
+    return 0;
+}
+
+
+/**
+ * Serializes the subject map into the binary interchange format. Unlike
+ * the YAML export, the datatypes of literals are preserved.
+ *
+ * @returns -1 on failure
+ */
+int
+tmrm_subject_map_export_to_binary(tmrm_subject_map *map, FILE *fh)
+{
+    tmrm_binary_writer *w;
+    tmrm_proxy *bottom;
+    int res;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, -1);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(fh, FILE, -1);
+
+    if (!(w = tmrm_binary_writer_new(fh))) return -1;
+    if ((bottom = tmrm_subject_map_bottom(map))) {
+        res = tmrm_binary_writer_bottom(w, bottom->label);
+        tmrm_proxy_free(bottom);
+        if (res) {
+            tmrm_binary_writer_free(w);
+            return -1;
+        }
+    }
+    res = tmrm_subject_map_export_streamer(map,
+            &tmrm_binary_streaming_handler, w);
+    if (tmrm_binary_writer_error(w)) res = -1;
+    tmrm_binary_writer_free(w);
+    return res;
+}
+
+
+/* Returns the proxy for the label of the imported map. The returned proxy
+   belongs to the reader. */
+static tmrm_proxy*
+tmrm_binary_reader_proxy(tmrm_binary_reader *r, long label)
+{
+    tmrm_binary_label *labels;
+    size_t i, j, size;
+    unsigned long h;
+
+    if (r->labels_size > 0) {
+        h = (unsigned long)label * 2654435761UL;
+        for (i = h & (r->labels_size - 1); r->labels[i].proxy;
+                i = (i + 1) & (r->labels_size - 1)) {
+            if (r->labels[i].label == label) return r->labels[i].proxy;
+        }
+    }
+
+    if (2 * (r->labels_count + 1) > r->labels_size) {
+        size = r->labels_size ? 2 * r->labels_size : 1024;
+        labels = (tmrm_binary_label*)TMRM_CALLOC(tmrm_binary_label, size,
+                sizeof(tmrm_binary_label));
+        if (!labels) return NULL;
+        for (j = 0; j < r->labels_size; j++) {
+            if (!r->labels[j].proxy) continue;
+            h = (unsigned long)r->labels[j].label * 2654435761UL;
+            for (i = h & (size - 1); labels[i].proxy; i = (i + 1) & (size - 1)) ;
+            labels[i] = r->labels[j];
+        }
+        if (r->labels) TMRM_FREE(tmrm_binary_label, r->labels);
+        r->labels = labels;
+        r->labels_size = size;
+    }
+    h = (unsigned long)label * 2654435761UL;
+    for (i = h & (r->labels_size - 1); r->labels[i].proxy;
+            i = (i + 1) & (r->labels_size - 1)) ;
+
+    if (r->has_bottom && label == r->bottom) {
+        r->labels[i].proxy = tmrm_subject_map_bottom(r->map);
+    } else {
+        r->labels[i].proxy = tmrm_proxy_new(r->map);
+    }
+    if (!r->labels[i].proxy) return NULL;
+    r->labels[i].label = label;
+    r->labels_count++;
+    return r->labels[i].proxy;
+}
+
+
+static int
+tmrm_binary_reader_string(tmrm_binary_reader *r, const unsigned char *data,
+    size_t len)
+{
+    char **strings;
+    size_t size;
+
+    if (r->strings_count == r->strings_size) {
+        size = r->strings_size ? 2 * r->strings_size : 256;
+        strings = (char**)TMRM_REALLOC(cstring, r->strings,
+                size * sizeof(char*));
+        if (!strings) return 1;
+        r->strings = strings;
+        r->strings_size = size;
+    }
+    if (!(r->strings[r->strings_count] = (char*)TMRM_MALLOC(cstring, len + 1))) {
+        return 1;
+    }
+    memcpy(r->strings[r->strings_count], data, len);
+    r->strings[r->strings_count][len] = '\0';
+    r->strings_count++;
+    return 0;
+}
+
+
+static int
+tmrm_binary_reader_proxy_record(tmrm_binary_reader *r, long *prev_proxy,
+    const unsigned char *p, const unsigned char *end)
+{
+    unsigned long u, count, n, datatype_id;
+    long label, key = 0, value = 0;
+    tmrm_proxy *proxy, *key_proxy, *value_proxy;
+    tmrm_literal *lit;
+    int res;
+
+    if (tmrm_binary_decode_varint(&p, end, &u)) return 1;
+    label = *prev_proxy + tmrm_binary_unzigzag(u);
+    *prev_proxy = label;
+    if (tmrm_binary_decode_varint(&p, end, &count)) return 1;
+    if (!(proxy = tmrm_binary_reader_proxy(r, label))) return 1;
+
+    for (n = 0; n < count; n++) {
+        if (tmrm_binary_decode_varint(&p, end, &u)) return 1;
+        key += tmrm_binary_unzigzag(u);
+        if (!(key_proxy = tmrm_binary_reader_proxy(r, key))) return 1;
+        if (tmrm_binary_decode_varint(&p, end, &u)) return 1;
+        if (u & 1) {
+            if (tmrm_binary_decode_varint(&p, end, &datatype_id) ||
+                    (u >> 1) >= r->strings_count ||
+                    datatype_id >= r->strings_count) {
+                return 1;
+            }
+            lit = tmrm_literal_new((tmrm_char_t*)r->strings[u >> 1],
+                    (tmrm_char_t*)r->strings[datatype_id]);
+            if (!lit) return 1;
+            res = tmrm_proxy_add_property_literal(proxy, key_proxy, lit);
+            tmrm_literal_free(lit);
+        } else {
+            value += tmrm_binary_unzigzag(u >> 1);
+            if (!(value_proxy = tmrm_binary_reader_proxy(r, value))) return 1;
+            res = tmrm_proxy_add_property(proxy, key_proxy, value_proxy);
+        }
+        if (res) return 1;
+    }
+    return p != end;
+}
+
+
+/* Reads a varint from fh and counts the bytes read off *left */
+static int
+tmrm_binary_read_varint(FILE *fh, unsigned long *v, unsigned long *left)
+{
+    unsigned long result = 0;
+    unsigned int shift = 0;
+    int c;
+
+    while (shift < 8 * sizeof(unsigned long) && (c = fgetc(fh)) != EOF) {
+        if (*left) (*left)--;
+        result |= (unsigned long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = result;
+            return 0;
+        }
+        shift += 7;
+    }
+    return 1;
+}
+
+
+/* Reads the len bytes of a record into b. Returns 1 if the input ends
+   first and -1 if memory runs out. */
+static int
+tmrm_binary_read_record(FILE *fh, tmrm_binary_buffer *b, unsigned long len)
+{
+    size_t n;
+
+    b->len = 0;
+    while (b->len < len) {
+        n = len - b->len < TMRM_BINARY_READ_CHUNK ?
+            len - b->len : TMRM_BINARY_READ_CHUNK;
+        if (tmrm_binary_buffer_reserve(b, n)) return -1;
+        if (fread(b->data + b->len, 1, n, fh) != n) return 1;
+        b->len += n;
+    }
+    return 0;
+}
+
+
+/**
+ * Imports a subject map that was written by
+ * tmrm_subject_map_export_to_binary(). The bottom proxy of the exported
+ * map is mapped to the bottom proxy of map, all other proxies are created.
+ *
+ * @returns -1 on failure
+ */
+int
+tmrm_subject_map_import_from_binary(tmrm_subject_map *map, FILE *fh)
+{
+    tmrm_binary_reader r;
+    tmrm_binary_buffer buf = {NULL, 0, 0};
+    const unsigned char *p;
+    char magic[8];
+    unsigned long len, u, left = ULONG_MAX;
+    long prev_proxy = 0, pos;
+    struct stat st;
+    size_t i;
+    int tag, ret, res = -1;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, -1);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(fh, FILE, -1);
+
+    if (fread(magic, 1, 8, fh) != 8 ||
+            memcmp(magic, TMRM_BINARY_MAGIC, 8)) {
+        TMRM_SET_ERROR(map->sms, TMRM_SYNTAX_ERROR,
+                "Not a binary subject map");
+        return -1;
+    }
+    memset(&r, 0, sizeof(r));
+    r.map = map;
+    /* The rest of a file bounds the length of each record */
+    if (fstat(fileno(fh), &st) == 0 && S_ISREG(st.st_mode) &&
+            (pos = ftell(fh)) >= 0 && st.st_size >= pos) {
+        left = (unsigned long)(st.st_size - pos);
+    }
+
+    while ((tag = fgetc(fh)) != EOF) {
+        if (left) left--;
+        if (tmrm_binary_read_varint(fh, &len, &left)) goto truncated;
+        if (len > left) goto truncated;
+        if ((ret = tmrm_binary_read_record(fh, &buf, len))) {
+            if (ret > 0) goto truncated;
+            goto cleanup;
+        }
+        left -= len;
+        p = buf.data;
+
+        switch (tag) {
+            case TMRM_BINARY_RECORD_NAME:
+                TMRM_DEBUG3(" - found subject map: '%.*s'\n", (int)len,
+                        (char*)buf.data);
+                break;
+            case TMRM_BINARY_RECORD_BOTTOM:
+                if (tmrm_binary_decode_varint(&p, buf.data + len, &u)) {
+                    goto corrupt;
+                }
+                r.bottom = tmrm_binary_unzigzag(u);
+                r.has_bottom = 1;
+                break;
+            case TMRM_BINARY_RECORD_STRING:
+                if (tmrm_binary_reader_string(&r, buf.data, len)) {
+                    goto cleanup;
+                }
+                break;
+            case TMRM_BINARY_RECORD_PROXY:
+                if (tmrm_binary_reader_proxy_record(&r, &prev_proxy, p,
+                            buf.data + len)) {
+                    goto corrupt;
+                }
+                break;
+            case TMRM_BINARY_RECORD_END:
+                res = 0;
+                goto cleanup;
+            default:
+                /* Unknown records are skipped */
+                break;
+        }
+    }
+
+truncated:
+    TMRM_SET_ERROR(map->sms, TMRM_SYNTAX_ERROR,
+            "Binary subject map is truncated");
+    goto cleanup;
+corrupt:
+    TMRM_SET_ERROR(map->sms, TMRM_SYNTAX_ERROR,
+            "Invalid record '%c' in binary subject map", tag);
+cleanup:
+    for (i = 0; i < r.labels_size; i++) {
+        if (r.labels[i].proxy) tmrm_proxy_free(r.labels[i].proxy);
+    }
+    if (r.labels) TMRM_FREE(tmrm_binary_label, r.labels);
+    for (i = 0; i < r.strings_count; i++) {
+        TMRM_FREE(cstring, r.strings[i]);
+    }
+    if (r.strings) TMRM_FREE(cstring, r.strings);
+    if (buf.data) TMRM_FREE(cstring, buf.data);
+    return res;
+}
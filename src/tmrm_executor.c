@@ -0,0 +1,403 @@
+/*
+ * tmrm_executor.c - Thread pool for parallel reads
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */
+
+/**
+ * @file tmrm_executor.c
+ * @brief A fixed pool of worker threads that runs the chunks of large
+ * reads in parallel (see tmrm_subject_map_sphere_set_threads()).
+ *
+ * tmrm_executor_run() splits a job into count tasks and deals them out to
+ * the deques of the workers. A worker takes tasks from the bottom of its
+ * own deque and, once that is empty, steals from the top of the others,
+ * so that workers that are done early help with the rest. The calling
+ * thread steals as well until its job is finished.
+ *
+ * tmrm_executor_submit() queues a single task without waiting for it; the
+ * asynchronous requests of tmrm_async.c run this way.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include <libtmrm.h>
+#include <tmrm_internal.h>
+
+#ifdef HAVE_PTHREAD
+
+/* A call of tmrm_executor_run() */
+typedef struct {
+    int remaining;
+} tmrm_executor_job;
+
+typedef struct {
+    void (*task)(void* data, int index);
+    void* data;
+    int index;
+    tmrm_executor_job* job;     /* NULL for submitted tasks */
+} tmrm_executor_task;
+
+/* Deque of a worker. The owner pops from the bottom, thieves take from the
+   top. */
+typedef struct {
+    pthread_mutex_t lock;
+    tmrm_executor_task* tasks;
+    int top;
+    int size;
+    int max;
+} tmrm_executor_deque;
+
+typedef struct {
+    tmrm_executor* executor;
+    int index;
+} tmrm_executor_worker;
+
+struct tmrm_executor_s {
+    int threads;
+    int started;
+    pthread_t* workers;
+    tmrm_executor_worker* args;
+    tmrm_executor_deque* deques;
+    /* Guards queued, next, the remaining counters of the jobs and
+       shutdown */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    long queued;
+    int next;                   /* deque for the next submitted task */
+    int shutdown;
+};
+
+
+/* Appends a task at the bottom of d */
+static int
+_deque_push(tmrm_executor_deque* d, const tmrm_executor_task* task)
+{
+    tmrm_executor_task* tasks;
+    int max, i;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->size == d->max) {
+        max = d->max ? 2 * d->max : 16;
+        tasks = (tmrm_executor_task*)TMRM_MALLOC(tmrm_executor_task,
+                max * sizeof(tmrm_executor_task));
+        if (!tasks) {
+            pthread_mutex_unlock(&d->lock);
+            return 1;
+        }
+        for (i = 0; i < d->size; i++) {
+            tasks[i] = d->tasks[(d->top + i) % d->max];
+        }
+        if (d->tasks) TMRM_FREE(tmrm_executor_task, d->tasks);
+        d->tasks = tasks;
+        d->top = 0;
+        d->max = max;
+    }
+    d->tasks[(d->top + d->size) % d->max] = *task;
+    d->size++;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+
+/* Takes a task from the bottom (own deque) or the top (stealing) of d */
+static int
+_deque_take(tmrm_executor_deque* d, int bottom, tmrm_executor_task* task)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->size == 0) {
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+    }
+    if (bottom) {
+        *task = d->tasks[(d->top + d->size - 1) % d->max];
+    } else {
+        *task = d->tasks[d->top];
+        d->top = (d->top + 1) % d->max;
+    }
+    d->size--;
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+
+/* Finds a task for worker self, or for the calling thread if self is -1 */
+static int
+_take(tmrm_executor* e, int self, tmrm_executor_task* task)
+{
+    int i, found = 0;
+
+    if (self >= 0) found = _deque_take(&e->deques[self], 1, task);
+    for (i = 1; !found && i <= e->threads; i++) {
+        found = _deque_take(&e->deques[(self + i + e->threads) % e->threads],
+                0, task);
+    }
+    if (found) {
+        pthread_mutex_lock(&e->lock);
+        e->queued--;
+        pthread_mutex_unlock(&e->lock);
+    }
+    return found;
+}
+
+
+static void
+_execute(tmrm_executor* e, tmrm_executor_task* task)
+{
+    task->task(task->data, task->index);
+    if (!task->job) return;
+    pthread_mutex_lock(&e->lock);
+    if (--task->job->remaining == 0) pthread_cond_broadcast(&e->changed);
+    pthread_mutex_unlock(&e->lock);
+}
+
+
+static void*
+_worker(void* data)
+{
+    tmrm_executor_worker* w = (tmrm_executor_worker*)data;
+    tmrm_executor* e = w->executor;
+    tmrm_executor_task task;
+
+    for (;;) {
+        if (_take(e, w->index, &task)) {
+            _execute(e, &task);
+            continue;
+        }
+        pthread_mutex_lock(&e->lock);
+        while (e->queued == 0 && !e->shutdown) {
+            pthread_cond_wait(&e->changed, &e->lock);
+        }
+        if (e->shutdown) {
+            pthread_mutex_unlock(&e->lock);
+            break;
+        }
+        pthread_mutex_unlock(&e->lock);
+    }
+    return NULL;
+}
+
+#else
+
+struct tmrm_executor_s {
+    int threads;
+};
+
+#endif
+
+
+/**
+ * Starts an executor with the given number of worker threads.
+ *
+ * @returns NULL on failure or if libtmrm was built without POSIX threads
+ */
+tmrm_executor*
+tmrm_executor_new(int threads)
+{
+#ifdef HAVE_PTHREAD
+    tmrm_executor* e;
+    int i;
+
+    if (threads < 1) return NULL;
+    e = (tmrm_executor*)TMRM_CALLOC(tmrm_executor, 1, sizeof(tmrm_executor));
+    if (!e) return NULL;
+    e->workers = (pthread_t*)TMRM_CALLOC(pthread_t, threads,
+            sizeof(pthread_t));
+    e->args = (tmrm_executor_worker*)TMRM_CALLOC(tmrm_executor_worker,
+            threads, sizeof(tmrm_executor_worker));
+    e->deques = (tmrm_executor_deque*)TMRM_CALLOC(tmrm_executor_deque,
+            threads, sizeof(tmrm_executor_deque));
+    if (!e->workers || !e->args || !e->deques) {
+        tmrm_executor_free(e);
+        return NULL;
+    }
+    e->threads = threads;
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->changed, NULL);
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&e->deques[i].lock, NULL);
+    }
+    for (i = 0; i < threads; i++) {
+        e->args[i].executor = e;
+        e->args[i].index = i;
+        if (pthread_create(&e->workers[i], NULL, _worker, &e->args[i])) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Starting worker thread %d failed", i);
+            tmrm_executor_free(e);
+            return NULL;
+        }
+        e->started++;
+    }
+    return e;
+#else
+    return NULL;
+#endif
+}
+
+
+/**
+ * Stops the workers and frees the executor. No job may be running.
+ */
+void
+tmrm_executor_free(tmrm_executor* e)
+{
+#ifdef HAVE_PTHREAD
+    int i;
+
+    if (e->started > 0) {
+        pthread_mutex_lock(&e->lock);
+        e->shutdown = 1;
+        pthread_cond_broadcast(&e->changed);
+        pthread_mutex_unlock(&e->lock);
+        for (i = 0; i < e->started; i++) {
+            pthread_join(e->workers[i], NULL);
+        }
+    }
+    /* threads is only set once the locks are initialized */
+    if (e->threads > 0) {
+        pthread_mutex_destroy(&e->lock);
+        pthread_cond_destroy(&e->changed);
+    }
+    if (e->deques) {
+        for (i = 0; i < e->threads; i++) {
+            pthread_mutex_destroy(&e->deques[i].lock);
+            if (e->deques[i].tasks) {
+                TMRM_FREE(tmrm_executor_task, e->deques[i].tasks);
+            }
+        }
+        TMRM_FREE(tmrm_executor_deque, e->deques);
+    }
+    if (e->args) TMRM_FREE(tmrm_executor_worker, e->args);
+    if (e->workers) TMRM_FREE(pthread_t, e->workers);
+#endif
+    TMRM_FREE(tmrm_executor, e);
+}
+
+
+/**
+ * Returns the number of worker threads of e.
+ */
+int
+tmrm_executor_threads(const tmrm_executor* e)
+{
+    return e->threads;
+}
+
+
+/**
+ * Calls task(data, index) for every index from 0 to count - 1 and returns
+ * once all calls are done. The calls run on the workers and the calling
+ * thread in any order. Several threads may run jobs at the same time.
+ */
+void
+tmrm_executor_run(tmrm_executor* e, int count,
+        void (*task)(void* data, int index), void* data)
+{
+#ifdef HAVE_PTHREAD
+    tmrm_executor_job job;
+    tmrm_executor_task t;
+    int i, queued = 0, finished;
+
+    job.remaining = count;
+    t.task = task;
+    t.data = data;
+    t.job = &job;
+
+    /* Deal the tasks out; the ones that do not fit run here */
+    for (i = 0; i < count; i++) {
+        t.index = i;
+        if (_deque_push(&e->deques[i % e->threads], &t)) break;
+        queued++;
+    }
+    pthread_mutex_lock(&e->lock);
+    e->queued += queued;
+    pthread_cond_broadcast(&e->changed);
+    pthread_mutex_unlock(&e->lock);
+    for (i = queued; i < count; i++) {
+        t.index = i;
+        _execute(e, &t);
+    }
+
+    for (;;) {
+        if (_take(e, -1, &t)) {
+            _execute(e, &t);
+            continue;
+        }
+        pthread_mutex_lock(&e->lock);
+        while (job.remaining > 0 && e->queued == 0) {
+            pthread_cond_wait(&e->changed, &e->lock);
+        }
+        finished = job.remaining == 0;
+        pthread_mutex_unlock(&e->lock);
+        if (finished) break;
+    }
+#else
+    int i;
+
+    for (i = 0; i < count; i++) task(data, i);
+#endif
+}
+
+
+/**
+ * Queues a call of task(data, 0) and returns without waiting for it. The
+ * task must not call tmrm_executor_free() on e.
+ *
+ * @returns 0 on success, 1 on failure or if libtmrm was built without
+ * POSIX threads
+ */
+int
+tmrm_executor_submit(tmrm_executor* e, void (*task)(void* data, int index),
+        void* data)
+{
+#ifdef HAVE_PTHREAD
+    tmrm_executor_task t;
+    int d;
+
+    t.task = task;
+    t.data = data;
+    t.index = 0;
+    t.job = NULL;
+    pthread_mutex_lock(&e->lock);
+    d = e->next;
+    e->next = (e->next + 1) % e->threads;
+    pthread_mutex_unlock(&e->lock);
+    if (_deque_push(&e->deques[d], &t)) return 1;
+    pthread_mutex_lock(&e->lock);
+    e->queued++;
+    pthread_cond_broadcast(&e->changed);
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+#else
+    return 1;
+#endif
+}
@@ -56,8 +56,6 @@
 /* prototypes for helper functions */
 static void tmrm_delete_hash_factories(tmrm_subject_map_sphere *sms);
 
-static void tmrm_init_hash_datums(tmrm_subject_map_sphere *sms);
-static void tmrm_hash_datums_free(tmrm_subject_map_sphere *sms);
 
 
 /* prototypes for iterator for getting all keys and values */
@@ -87,8 +85,6 @@ static void tmrm_hash_keys_iterator_finished(void* iterator);
 void
 tmrm_init_hash(tmrm_subject_map_sphere *sms) 
 {
-    /* Init hash datum cache */
-    tmrm_init_hash_datums(sms);
 /*
 #ifdef HAVE_BDB_HASH
      FIXME not implemented
@@ -109,7 +105,6 @@ void
 tmrm_finish_hash(tmrm_subject_map_sphere *sms) 
 {
     tmrm_delete_hash_factories(sms);
-    tmrm_hash_datums_free(sms);
 }
 
 
@@ -130,27 +125,6 @@ tmrm_delete_hash_factories(tmrm_subject_map_sphere *sms)
 
 
 
-/* hash datums structures */
-static void
-tmrm_init_hash_datums(tmrm_subject_map_sphere *sms)
-{
-    sms->hash_datums_list = NULL;
-}
-
-
-static void
-tmrm_hash_datums_free(tmrm_subject_map_sphere *sms)
-{
-    tmrm_hash_datum *datum, *next;
-
-    for(datum = sms->hash_datums_list; datum; datum = next) {
-        next = datum->next;
-        TMRM_FREE(tmrm_hash_datum, datum);
-    }
-    sms->hash_datums_list=NULL;
-}
-
-
 /**
  * tmrm_hash_datum_new:
  * @param sms Subject map sphere object
@@ -168,16 +142,9 @@ tmrm_hash_datum_new(tmrm_subject_map_sphere *sms, void *data, size_t size)
 
     /*tmrm_subject_map_sphere_open(sms);*/
 
-    /* get one from free list, or allocate new one */ 
-    if ((datum = sms->hash_datums_list)) {
-        sms->hash_datums_list = datum->next;
-    } else {
-        datum = (tmrm_hash_datum*)TMRM_CALLOC(tmrm_hash_datum, 1, sizeof(tmrm_hash_datum));
-        if (datum)
-            datum->sms = sms;
-    }
-
+    datum = TMRM_POOL_CALLOC(tmrm_hash_datum, TMRM_POOL_HASH_DATUM);
     if (datum) {
+        datum->sms = sms;
         datum->data = data;
         datum->size = size;
     }
@@ -198,8 +165,7 @@ tmrm_hash_datum_free(tmrm_hash_datum *datum)
 {
     if(datum->data)
         TMRM_FREE(cstring, datum->data);
-    datum->next = datum->sms->hash_datums_list;
-    datum->sms->hash_datums_list = datum;
+    TMRM_POOL_FREE(tmrm_hash_datum, TMRM_POOL_HASH_DATUM, datum);
 }
 
 
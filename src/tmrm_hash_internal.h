@@ -42,8 +42,6 @@ struct tmrm_hash_datum_s
     tmrm_subject_map_sphere *sms;
     void *data;
     size_t size;
-    /* used internally to build lists of these  */
-    struct tmrm_hash_datum_s *next;
 };
 typedef struct tmrm_hash_datum_s tmrm_hash_datum;
 
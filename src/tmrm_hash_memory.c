@@ -236,10 +236,11 @@ tmrm_hash_memory_node_free(tmrm_hash_memory_node* node)
             next = vnode->next;
             if(vnode->value)
                 TMRM_FREE(cstring, vnode->value);
-            TMRM_FREE(tmrm_hash_memory_node_value, vnode);
+            TMRM_POOL_FREE(tmrm_hash_memory_node_value,
+                    TMRM_POOL_HASH_NODE_VALUE, vnode);
         }
     }
-    TMRM_FREE(tmrm_hash_memory_node, node);
+    TMRM_POOL_FREE(tmrm_hash_memory_node, TMRM_POOL_HASH_NODE, node);
 }
 
 
@@ -693,8 +694,7 @@ tmrm_hash_memory_put(void* context, tmrm_hash_datum *key,
         bucket = hash_key & (hash->capacity - 1);
 
         /* allocate new node */
-        node = (tmrm_hash_memory_node*)TMRM_CALLOC(tmrm_hash_memory_node, 1,
-                sizeof(tmrm_hash_memory_node));
+        node = TMRM_POOL_CALLOC(tmrm_hash_memory_node, TMRM_POOL_HASH_NODE);
         if (!node)
             return 1;
 
@@ -703,7 +703,8 @@ tmrm_hash_memory_put(void* context, tmrm_hash_datum *key,
         /* allocate key for new node */
         new_key = TMRM_MALLOC(cstring, key->size);
         if (!new_key) {
-            TMRM_FREE(tmrm_hash_memory_node, node);
+            TMRM_POOL_FREE(tmrm_hash_memory_node, TMRM_POOL_HASH_NODE,
+                    node);
             return 1;
         }
 
@@ -719,19 +720,21 @@ tmrm_hash_memory_put(void* context, tmrm_hash_datum *key,
     if (!new_value) {
         if (is_new_node) {
             TMRM_FREE(cstring, new_key);
-            TMRM_FREE(tmrm_hash_memory_node, node);
+            TMRM_POOL_FREE(tmrm_hash_memory_node, TMRM_POOL_HASH_NODE,
+                    node);
         }
         return 1;
     }
 
     /* always allocate new tmrm_hash_memory_node_value */
-    vnode = (tmrm_hash_memory_node_value*)TMRM_CALLOC(
-        tmrm_hash_memory_node_value, 1, sizeof(tmrm_hash_memory_node_value));
+    vnode = TMRM_POOL_CALLOC(tmrm_hash_memory_node_value,
+            TMRM_POOL_HASH_NODE_VALUE);
     if (!vnode) {
         TMRM_FREE(cstring, new_value);
         if (is_new_node) {
             TMRM_FREE(cstring, new_key);
-            TMRM_FREE(tmrm_hash_memory_node, node);
+            TMRM_POOL_FREE(tmrm_hash_memory_node, TMRM_POOL_HASH_NODE,
+                    node);
         }
         return 1;
     }
@@ -859,7 +862,8 @@ tmrm_hash_memory_delete_key_value(void* context, tmrm_hash_datum *key,
     /* free value and value node */
     if (vnode->value)
         TMRM_FREE(tmrm_hash_memory_node_value, vnode->value);
-    TMRM_FREE(tmrm_hash_memory_node_value, vnode);
+    TMRM_POOL_FREE(tmrm_hash_memory_node_value, TMRM_POOL_HASH_NODE_VALUE,
+            vnode);
 
     /* update hash counts */
     hash->values--;
@@ -52,6 +52,10 @@ extern "C" {
 
 #include <assert.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 /**
  * Internal macros
  * @defgroup tmrm_macros Macros
@@ -68,18 +72,48 @@ extern "C" {
 
 #define TMRM_API
 
+/* Logging, see tmrm_log.c. Messages above TMRM_LOG_MAX_LEVEL (set with
+   configure --with-log-level, 0 = errors ... 3 = debug) are compiled out;
+   the others cost a compare with tmrm_log_threshold unless they are
+   logged. */
+#ifndef TMRM_LOG_MAX_LEVEL
+#define TMRM_LOG_MAX_LEVEL 3
+#endif
+
+extern int tmrm_log_threshold;
+
+void tmrm_log(int level, const char* file, int line, const char* function,
+        const char* format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 5, 6)))
+#endif
+    ;
+
+#define TMRM_LOG(level, ...) do { \
+  if ((level) <= TMRM_LOG_MAX_LEVEL && (level) <= tmrm_log_threshold) \
+    tmrm_log((level), __FILE__, __LINE__, __func__, __VA_ARGS__); \
+} while(0)
+
 /* Debugging messages */
-#define TMRM_DEBUG1(msg) do {fprintf(stderr, "%s:%d:%s: " msg, __FILE__, __LINE__, __func__); } while(0)
-#define TMRM_DEBUG2(msg, arg1) do {fprintf(stderr, "%s:%d:%s: " msg, __FILE__, __LINE__, __func__, arg1);} while(0)
-#define TMRM_DEBUG3(msg, arg1, arg2) do {fprintf(stderr, "%s:%d:%s: " msg, __FILE__, __LINE__, __func__, arg1, arg2);} while(0)
-#define TMRM_DEBUG4(msg, arg1, arg2, arg3) do {fprintf(stderr, "%s:%d:%s: " msg, __FILE__, __LINE__, __func__, arg1, arg2, arg3);} while(0)
-#define TMRM_DEBUG5(msg, arg1, arg2, arg3, arg4) do {fprintf(stderr, "%s:%d:%s: " msg, __FILE__, __LINE__, __func__, arg1, arg2, arg3, arg4);} while(0)
+#if TMRM_LOG_MAX_LEVEL >= 3
+#define TMRM_DEBUG1(msg) TMRM_LOG(TMRM_LOG_DEBUG, msg)
+#define TMRM_DEBUG2(msg, arg1) TMRM_LOG(TMRM_LOG_DEBUG, msg, arg1)
+#define TMRM_DEBUG3(msg, arg1, arg2) TMRM_LOG(TMRM_LOG_DEBUG, msg, arg1, arg2)
+#define TMRM_DEBUG4(msg, arg1, arg2, arg3) TMRM_LOG(TMRM_LOG_DEBUG, msg, arg1, arg2, arg3)
+#define TMRM_DEBUG5(msg, arg1, arg2, arg3, arg4) TMRM_LOG(TMRM_LOG_DEBUG, msg, arg1, arg2, arg3, arg4)
+#else
+#define TMRM_DEBUG1(msg) do { } while(0)
+#define TMRM_DEBUG2(msg, arg1) do { } while(0)
+#define TMRM_DEBUG3(msg, arg1, arg2) do { } while(0)
+#define TMRM_DEBUG4(msg, arg1, arg2, arg3) do { } while(0)
+#define TMRM_DEBUG5(msg, arg1, arg2, arg3, arg4) do { } while(0)
+#endif
 
 #define TMRM_ASSERT assert
 
 /* #define TMRM_ASSERT_DIE abort(); */
 #define TMRM_ASSERT_DIE
-#define TMRM_ASSERT_REPORT(msg) fprintf(stderr, "%s:%d: (%s) assertion failed: " msg "\n", __FILE__, __LINE__, __func__);
+#define TMRM_ASSERT_REPORT(msg) TMRM_LOG(TMRM_LOG_ERROR, "assertion failed: " msg);
 #define TMRM_ASSERT_OBJECT_POINTER_RETURN(pointer, type) do { \
   if(!pointer) { \
     TMRM_ASSERT_REPORT("object pointer of type " #type " is NULL.") \
@@ -97,9 +131,41 @@ extern "C" {
 } while(0)
 
 
-#define TMRM_MALLOC(type, size) malloc(size)
-#define TMRM_CALLOC(type, size, count) calloc(size, count)
-#define TMRM_FREE(type, ptr) free(ptr)
+/* Allocations go through the hooks and arenas of tmrm_memory.c. With
+   configure --enable-memory-accounting, heap blocks are counted under
+   their type tag (see tmrm_memory_stats()). */
+#ifdef TMRM_MEMORY_ACCOUNTING
+#define TMRM_MALLOC(type, size) tmrm_malloc_typed(#type, size)
+#define TMRM_CALLOC(type, size, count) tmrm_calloc_typed(#type, size, count)
+#define TMRM_REALLOC(type, ptr, size) tmrm_realloc_typed(#type, ptr, size)
+#else
+#define TMRM_MALLOC(type, size) tmrm_malloc(size)
+#define TMRM_CALLOC(type, size, count) tmrm_calloc(size, count)
+#define TMRM_REALLOC(type, ptr, size) tmrm_realloc(ptr, size)
+#endif
+#define TMRM_FREE(type, ptr) tmrm_free(ptr)
+
+void* tmrm_malloc_typed(const char* type, size_t size);
+void* tmrm_calloc_typed(const char* type, size_t count, size_t size);
+void* tmrm_realloc_typed(const char* type, void* ptr, size_t size);
+
+/* Fixed-size nodes come from the slab pools of tmrm_memory.c */
+#define TMRM_POOL_CALLOC(type, pool) (type*)tmrm_pool_calloc(pool, sizeof(type))
+#define TMRM_POOL_FREE(type, pool, ptr) tmrm_pool_free(pool, ptr)
+
+void* tmrm_pool_calloc(tmrm_pool_type pool, size_t size);
+void tmrm_pool_free(tmrm_pool_type pool, void* ptr);
+
+char* tmrm_strdup(const char* s);
+int tmrm_printf_append(char** buffer, size_t* length, size_t* capacity,
+        const char* format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 4, 5)))
+#endif
+    ;
+int tmrm_arena_active(void);
+void tmrm_arena_suspend(void);
+void tmrm_arena_resume(void);
 
 /* Constants and sizes */
 #define TMRM_MAXLENGTH_MAP_NAME 255   // Max size of name of map
@@ -114,6 +180,8 @@ extern "C" {
 /* Internal representation of proxies: we storage proxy_id as a number. */
 typedef int tmrm_label;
 
+typedef struct tmrm_storage_cache_s tmrm_storage_cache;
+
 /**
  * @}
  * Internal data structures.
@@ -122,21 +190,60 @@ typedef int tmrm_label;
  * @{
  */
 
+/* Thread pool for parallel reads (see tmrm_executor.c) */
+typedef struct tmrm_executor_s tmrm_executor;
+
+tmrm_executor* tmrm_executor_new(int threads);
+void tmrm_executor_free(tmrm_executor* e);
+int tmrm_executor_threads(const tmrm_executor* e);
+void tmrm_executor_run(tmrm_executor* e, int count,
+        void (*task)(void* data, int index), void* data);
+int tmrm_executor_submit(tmrm_executor* e,
+        void (*task)(void* data, int index), void* data);
+
+/* The first error of a thread since the last
+   tmrm_subject_map_sphere_clear_error() */
+typedef struct tmrm_sphere_error_s {
+    tmrm_error_type_t type;
+    char *message;
+#ifdef HAVE_PTHREAD
+    /* The error states of all threads, owned by the sphere */
+    tmrm_subject_map_sphere *sms;
+    struct tmrm_sphere_error_s *prev;
+    struct tmrm_sphere_error_s *next;
+#endif
+} tmrm_sphere_error;
+
 struct tmrm_subject_map_sphere_s {
-    /** List of storage factories */
+    /** List of storage factories. Filled by tmrm_subject_map_sphere_new()
+        and not changed afterwards, so it is read without locking. */
     tmrm_list* factories;
 
     /** The hash factory (currently one a memory implementation).
      TODO: Should be a list of hash factories. */
     tmrm_hash_factory* hashes;
 
-    /* list of free librdf_hash_datums is kept */
-    tmrm_hash_datum* hash_datums_list;
     /* hash load_factor out of 1000 */
     int hash_load_factor;
 
-    tmrm_error_type_t errno;
-    char *err;
+    /* Runs large reads in parallel. NULL unless
+       tmrm_subject_map_sphere_set_threads() was called. */
+    tmrm_executor* executor;
+
+    /* Receives a span for every storage call. Set by
+       tmrm_subject_map_sphere_set_tracer(), all NULL by default. */
+    tmrm_tracer tracer;
+
+#ifdef HAVE_PTHREAD
+    /* Each thread sees its own errors (a tmrm_sphere_error). The states
+       are also linked into errors, so that the sphere can free the states
+       of threads that are still running when it is freed. */
+    pthread_key_t error_key;
+    pthread_mutex_t errors_lock;
+    tmrm_sphere_error* errors;
+#else
+    tmrm_sphere_error error;
+#endif
 };
 
 
@@ -152,6 +259,11 @@ struct tmrm_subject_map_s {
     tmrm_proxy *subclass;
     tmrm_proxy *type;
     tmrm_proxy *instance;
+    /* Optional read cache (see tmrm_subject_map_set_cache_size()) */
+    tmrm_storage_cache *cache;
+    /* Version that the storage pinned for a read-only snapshot (see
+       tmrm_subject_map_snapshot()), 0 for the current state */
+    unsigned long snapshot;
 };
 
 
@@ -171,14 +283,44 @@ struct tmrm_proxy_s {
     */
 };
 
+/* Values shorter than this are stored in the literal itself */
+#define TMRM_LITERAL_INLINE_SIZE 24
+
+/* Where the value of a literal lives */
+typedef enum {
+    TMRM_LITERAL_INLINE = 0,    /* in inline_value */
+    TMRM_LITERAL_OWNED,         /* in a copy of its own */
+    TMRM_LITERAL_INTERNED,      /* in the table of interned values */
+    TMRM_LITERAL_BORROWED       /* in memory of owner */
+} tmrm_literal_storage;
+
+/* Keeps borrowed literal values alive. refs counts the literals that
+   borrow from the owner; release is called once the owner is closed and
+   no literal is left. */
+typedef struct tmrm_literal_owner_s {
+    int refs;
+    int closed;
+    void (*release)(struct tmrm_literal_owner_s* owner);
+} tmrm_literal_owner;
+
 /* => move to tmrm_literal_internal.h */
 struct tmrm_literal_s {
     tmrm_object type;
+    tmrm_literal_storage storage;
+    int datatype;               /* ID in the datatype registry */
     tmrm_char_t* value;
-    tmrm_char_t* datatype; /* URI: TODO should we use a separate class?
-                       => TMDM uses URIs a lot */
+    tmrm_literal_owner* owner;  /* for TMRM_LITERAL_BORROWED */
+    tmrm_char_t inline_value[TMRM_LITERAL_INLINE_SIZE];
 };
 
+/* Creates a literal whose value points into memory of owner instead of
+   being copied. Short values are copied anyway. */
+tmrm_literal* tmrm_literal_new_borrowed(const tmrm_char_t* value,
+        const tmrm_char_t* datatype, tmrm_literal_owner* owner);
+
+/* Marks owner as closed; it is released when the last literal is freed */
+void tmrm_literal_owner_close(tmrm_literal_owner* owner);
+
 /** 
  * A set that allows duplicate members.
  * @todo The implementation uses a single-linked list, but a different
@@ -210,6 +352,21 @@ struct tmrm_tuple_s {
     void (*free_method)(tmrm_object*);
 };
 
+/**
+ * Callbacks for serializing a subject map. Proxies are passed by their
+ * labels; literal strings are borrowed and only valid during the call.
+ */
+struct tmrm_streaming_handler_s {
+    int (*subject_map_start)(void *context, const tmrm_char_t *name);
+    int (*subject_map_end)(void *context);
+    int (*proxy_start)(void *context, tmrm_label label);
+    int (*property)(void *context, tmrm_label key, tmrm_label value);
+    int (*property_literal)(void *context, tmrm_label key, const tmrm_char_t *value, const tmrm_char_t *datatype);
+    int (*proxy_end)(void *context);
+};
+
+typedef struct tmrm_streaming_handler_s tmrm_streaming_handler;
+
 
 
 /**
@@ -220,18 +377,56 @@ struct tmrm_tuple_s {
  * @{
  */
 
-static int
-tmrm_subject_map_sphere_set_storage_error(tmrm_subject_map_sphere *sms,
-tmrm_storage *storage, const char *problem);
+int tmrm_subject_map_sphere_set_error(tmrm_subject_map_sphere *sms,
+        tmrm_error_type_t type, const char *problem);
+
+/* Logs an error and records it as the error of the calling thread (see
+   tmrm_subject_map_sphere_last_error()) */
+#define TMRM_SET_ERROR(sms, error_type, ...) do { \
+    char _tmrm_problem[256]; \
+    snprintf(_tmrm_problem, sizeof(_tmrm_problem), __VA_ARGS__); \
+    TMRM_LOG(TMRM_LOG_ERROR, "%s", _tmrm_problem); \
+    (void)tmrm_subject_map_sphere_set_error((sms), (error_type), \
+            _tmrm_problem); \
+} while (0)
 
 
 void tmrm_init_storage(tmrm_subject_map_sphere *sms);
 
+/* Free handler of the storage factory list of a sphere */
+void tmrm_storage_factory_free(tmrm_object *factory);
+
+/**
+ * Constructs an empty multiset that owns its elements: they are freed with
+ * the multiset. Query results are built this way.
+ */
+/*@null@*/ tmrm_multiset* tmrm_multiset_new_result(tmrm_subject_map *map);
+
 /**
  * Generates an anonymous (and unique) label for a proxy.
  */
 char* tmrm_proxy_generate_label();
 
+/**
+ * Passes all proxies and properties of a subject map to a streaming
+ * handler.
+ */
+int tmrm_subject_map_export_streamer(tmrm_subject_map *map,
+    const tmrm_streaming_handler *h, void *handler_context);
+
+/**
+ * Streaming handler that writes the binary interchange format (see
+ * tmrm_binary.c). The context is created by tmrm_binary_writer_new().
+ */
+extern const tmrm_streaming_handler tmrm_binary_streaming_handler;
+
+typedef struct tmrm_binary_writer_s tmrm_binary_writer;
+
+tmrm_binary_writer* tmrm_binary_writer_new(FILE *fh);
+int tmrm_binary_writer_bottom(tmrm_binary_writer *w, tmrm_label bottom);
+int tmrm_binary_writer_error(tmrm_binary_writer *w);
+void tmrm_binary_writer_free(tmrm_binary_writer *w);
+
 /** @} */
 
 #ifdef __cplusplus
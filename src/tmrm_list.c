@@ -57,17 +57,29 @@ tmrm_list_new(/*@NULL@*/ tmrm_list_free_handler* free_handler) {
 }
 
 /**
- * Copy constructor. Clones a list.
+ * Copy constructor. Clones a list. The elements are shared with l_src, so
+ * the clone has no free handler.
  */
 tmrm_list*
 /*@null@*/tmrm_list_clone(tmrm_list *l_src) {
-    /* FIXME */
-    return NULL;
+    tmrm_list* list;
+    tmrm_list_elmt* elem;
+
+    if ((list = tmrm_list_new(NULL)) == NULL) return NULL;
+    for (elem = tmrm_list_head(l_src); elem != NULL;
+            elem = tmrm_list_next(elem)) {
+        if (tmrm_list_ins_next(list, tmrm_list_tail(list),
+                    tmrm_list_data(elem)) != 0) {
+            tmrm_list_free(list);
+            return NULL;
+        }
+    }
+    return list;
 }
 
 
-/* Removes each element and calls a user-defined function to free
- * dynamically allocated data.
+/* Removes each element, calls a user-defined function to free
+ * dynamically allocated data and frees the list.
  */
 void
 tmrm_list_free(/*@only@*/ tmrm_list *list) {
@@ -78,16 +90,14 @@ tmrm_list_free(/*@only@*/ tmrm_list *list) {
             list->free_handler(data);
         }
     }
-    /* No operations are allowed now, but clear the structure as a precaution. */
-    memset(list, 0, sizeof(tmrm_list));
-    return;
+    TMRM_FREE(tmrm_list, list);
 }
 
 int 
 tmrm_list_ins_next(tmrm_list *list, tmrm_list_elmt *element, const tmrm_object *data) {
     tmrm_list_elmt *new_element;
 
-    new_element = (tmrm_list_elmt *)TMRM_CALLOC(tmrm_list_elmt, 1, sizeof(tmrm_list_elmt));
+    new_element = TMRM_POOL_CALLOC(tmrm_list_elmt, TMRM_POOL_LIST_ELEMENT);
     if (new_element == NULL)
         return -1;
 
@@ -139,7 +149,7 @@ tmrm_list_rem_next(tmrm_list *list, tmrm_list_elmt *element, tmrm_object **data)
         if (element->next == NULL)
             list->tail = element;
     }
-    TMRM_FREE(tmrm_list_elmt, old_element);
+    TMRM_POOL_FREE(tmrm_list_elmt, TMRM_POOL_LIST_ELEMENT, old_element);
     list->size--;
 
     return 0;
@@ -156,8 +166,12 @@ tmrm_list_from_iterator(tmrm_iterator* it, void (*free_handler)(tmrm_object *dat
 
     while (!tmrm_iterator_end(it)) {
         data = tmrm_iterator_get_object(it);
-        tmrm_list_ins_next(list, NULL, data);
-        if (!tmrm_iterator_next(it)) break;
+        if (data != NULL && tmrm_list_ins_next(list, NULL, data) != 0) {
+            if (free_handler) free_handler(data);
+            tmrm_list_free(list);
+            return NULL;
+        }
+        if (tmrm_iterator_next(it)) break;
     }
     return list;
 }
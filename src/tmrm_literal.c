@@ -34,51 +34,422 @@
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
 
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include <libtmrm.h>
 #include <tmrm_internal.h>
 
 
+/*
+ * Datatypes are interned in a registry and literals keep a small integer
+ * ID. The URIs are kept in pages that never move, so tmrm_datatype_uri()
+ * needs no lock. The registry and the table of interned values live as
+ * long as the process and are allocated outside of any arena.
+ */
+
+#define TMRM_DATATYPE_PAGE_SIZE 64
+#define TMRM_DATATYPE_PAGES 256
+
+static tmrm_char_t* _datatype_first_page[TMRM_DATATYPE_PAGE_SIZE] = {
+    (tmrm_char_t*)TMRM_XMLSCHEMA_STRING
+};
+static tmrm_char_t** _datatype_pages[TMRM_DATATYPE_PAGES] = {
+    _datatype_first_page
+};
+static int _datatype_count = 1;
+
+/* Open addressing table of datatype IDs + 1, 0 marks a free slot */
+static int* _datatype_slots = NULL;
+static size_t _datatype_slot_count = 0;
+
+/* An interned value with the number of literals that share it */
+typedef struct tmrm_literal_interned_s {
+    struct tmrm_literal_interned_s* next;
+    unsigned long hash;
+    int refs;
+    tmrm_char_t value[1];
+} tmrm_literal_interned;
+
+static int _intern_values = 0;
+static tmrm_literal_interned** _interned = NULL;
+static size_t _interned_bucket_count = 0;
+static size_t _interned_count = 0;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t _literals_lock = PTHREAD_MUTEX_INITIALIZER;
+#define TMRM_LITERALS_LOCK() pthread_mutex_lock(&_literals_lock)
+#define TMRM_LITERALS_UNLOCK() pthread_mutex_unlock(&_literals_lock)
+#else
+#define TMRM_LITERALS_LOCK() do {} while (0)
+#define TMRM_LITERALS_UNLOCK() do {} while (0)
+#endif
+
+
+static unsigned long
+_string_hash(const tmrm_char_t* s)
+{
+    unsigned long h = 5381;
+
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+
+/* Adds the ID to the slot table, growing it at a load of 1/2. Must be
+   called with the lock held and the arena suspended. */
+static int
+_datatype_slots_add(int id)
+{
+    int* slots;
+    size_t count, i;
+    int old;
+
+    if (2 * (size_t)(_datatype_count + 1) > _datatype_slot_count) {
+        count = _datatype_slot_count ? 2 * _datatype_slot_count : 64;
+        if (!(slots = (int*)TMRM_CALLOC(int, count, sizeof(int)))) return 1;
+        for (old = 0; old < _datatype_count; old++) {
+            if (old == id) continue;
+            i = _string_hash(tmrm_datatype_uri(old)) & (count - 1);
+            while (slots[i]) i = (i + 1) & (count - 1);
+            slots[i] = old + 1;
+        }
+        if (_datatype_slots) TMRM_FREE(int, _datatype_slots);
+        _datatype_slots = slots;
+        _datatype_slot_count = count;
+    }
+    i = _string_hash(tmrm_datatype_uri(id)) & (_datatype_slot_count - 1);
+    while (_datatype_slots[i]) i = (i + 1) & (_datatype_slot_count - 1);
+    _datatype_slots[i] = id + 1;
+    return 0;
+}
+
+
 /**
- * Creates and returns a new literal.
- * @returns NULL on failure.
+ * Returns the ID of the datatype URI, registering it on first use. IDs are
+ * small integers that stay valid for the lifetime of the process.
+ * TMRM_DATATYPE_STRING is the ID of XML Schema strings.
+ *
+ * @returns -1 on failure
  */
-/*@null@*/ tmrm_literal*
-tmrm_literal_new(const tmrm_char_t* value, const tmrm_char_t* datatype)
+int
+tmrm_datatype_id(const tmrm_char_t* datatype)
 {
-    tmrm_char_t *str;
-    tmrm_literal* lit;
+    tmrm_char_t** page;
+    tmrm_char_t* uri;
+    size_t i;
+    int id = -1;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(datatype, tmrm_char_t, -1);
+    if (strcmp((const char*)datatype, TMRM_XMLSCHEMA_STRING) == 0) {
+        return TMRM_DATATYPE_STRING;
+    }
+
+    TMRM_LITERALS_LOCK();
+    tmrm_arena_suspend();
+    if (_datatype_slots) {
+        i = _string_hash(datatype) & (_datatype_slot_count - 1);
+        for (; _datatype_slots[i]; i = (i + 1) & (_datatype_slot_count - 1)) {
+            if (strcmp((const char*)tmrm_datatype_uri(_datatype_slots[i] - 1),
+                        (const char*)datatype) == 0) {
+                id = _datatype_slots[i] - 1;
+                goto done;
+            }
+        }
+    }
+    if (_datatype_count >= TMRM_DATATYPE_PAGE_SIZE * TMRM_DATATYPE_PAGES) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Too many datatypes");
+        goto done;
+    }
+    if (!(page = _datatype_pages[_datatype_count / TMRM_DATATYPE_PAGE_SIZE])) {
+        page = (tmrm_char_t**)TMRM_CALLOC(tmrm_char_t*,
+                TMRM_DATATYPE_PAGE_SIZE, sizeof(tmrm_char_t*));
+        if (!page) goto done;
+        _datatype_pages[_datatype_count / TMRM_DATATYPE_PAGE_SIZE] = page;
+    }
+    if (!(uri = (tmrm_char_t*)tmrm_strdup((const char*)datatype))) goto done;
+    page[_datatype_count % TMRM_DATATYPE_PAGE_SIZE] = uri;
+    if (_datatype_slots_add(_datatype_count)) {
+        page[_datatype_count % TMRM_DATATYPE_PAGE_SIZE] = NULL;
+        TMRM_FREE(cstring, uri);
+        goto done;
+    }
+    id = _datatype_count++;
+done:
+    tmrm_arena_resume();
+    TMRM_LITERALS_UNLOCK();
+    return id;
+}
+
+
+/**
+ * Returns the URI of a datatype ID.
+ * @returns NULL if the ID is unknown.
+ */
+const tmrm_char_t*
+tmrm_datatype_uri(int id)
+{
+    tmrm_char_t** page;
+
+    if (id < 0 || id >= TMRM_DATATYPE_PAGE_SIZE * TMRM_DATATYPE_PAGES) {
+        return NULL;
+    }
+    page = _datatype_pages[id / TMRM_DATATYPE_PAGE_SIZE];
+    return page ? page[id % TMRM_DATATYPE_PAGE_SIZE] : NULL;
+}
+
+
+/**
+ * Enables or disables interning of literal values. With interning, literals
+ * with equal values that are too long to be stored inline share one
+ * reference-counted copy, which saves memory when many literals repeat the
+ * same values. It is disabled by default.
+ */
+void
+tmrm_literal_set_interning(int enable)
+{
+    _intern_values = enable;
+}
+
+
+/* Returns the shared copy of value, or NULL on failure */
+static tmrm_char_t*
+_intern(const tmrm_char_t* value)
+{
+    tmrm_literal_interned **buckets, *e, *next;
+    unsigned long h = _string_hash(value);
+    size_t count, i, len;
+
+    TMRM_LITERALS_LOCK();
+    if (_interned) {
+        for (e = _interned[h & (_interned_bucket_count - 1)]; e; e = e->next) {
+            if (e->hash == h &&
+                    strcmp((const char*)e->value, (const char*)value) == 0) {
+                e->refs++;
+                TMRM_LITERALS_UNLOCK();
+                return e->value;
+            }
+        }
+    }
+
+    tmrm_arena_suspend();
+    if (_interned_count >= _interned_bucket_count) {
+        count = _interned_bucket_count ? 2 * _interned_bucket_count : 256;
+        buckets = (tmrm_literal_interned**)TMRM_CALLOC(tmrm_literal_interned*,
+                count, sizeof(tmrm_literal_interned*));
+        if (buckets) {
+            for (i = 0; i < _interned_bucket_count; i++) {
+                for (e = _interned[i]; e; e = next) {
+                    next = e->next;
+                    e->next = buckets[e->hash & (count - 1)];
+                    buckets[e->hash & (count - 1)] = e;
+                }
+            }
+            if (_interned) TMRM_FREE(tmrm_literal_interned*, _interned);
+            _interned = buckets;
+            _interned_bucket_count = count;
+        }
+    }
+    len = strlen((const char*)value);
+    e = NULL;
+    if (_interned) {
+        e = (tmrm_literal_interned*)TMRM_MALLOC(tmrm_literal_interned,
+                sizeof(tmrm_literal_interned) + len);
+    }
+    tmrm_arena_resume();
+    if (!e) {
+        TMRM_LITERALS_UNLOCK();
+        return NULL;
+    }
+    memcpy(e->value, value, len + 1);
+    e->hash = h;
+    e->refs = 1;
+    e->next = _interned[h & (_interned_bucket_count - 1)];
+    _interned[h & (_interned_bucket_count - 1)] = e;
+    _interned_count++;
+    TMRM_LITERALS_UNLOCK();
+    return e->value;
+}
+
+
+/* Drops a reference to an interned value */
+static void
+_unintern(tmrm_char_t* value)
+{
+    tmrm_literal_interned **e, *entry;
+
+    entry = (tmrm_literal_interned*)(value -
+            offsetof(tmrm_literal_interned, value));
+    TMRM_LITERALS_LOCK();
+    if (--entry->refs == 0) {
+        for (e = &_interned[entry->hash & (_interned_bucket_count - 1)];
+                *e != entry; e = &(*e)->next);
+        *e = entry->next;
+        _interned_count--;
+        TMRM_FREE(tmrm_literal_interned, entry);
+    }
+    TMRM_LITERALS_UNLOCK();
+}
 
-    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(value, tmrm_char_t, (tmrm_literal*)NULL);
-    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(datatype, tmrm_char_t, (tmrm_literal*)NULL);
 
-    if (!(lit = (tmrm_literal*)TMRM_CALLOC(tmrm_literal, 1,
-                    sizeof(tmrm_literal)))) {
+/* Allocates a literal and stores the value inline if it is short enough.
+   Returns the length of the value in len. */
+static tmrm_literal*
+_literal_alloc(const tmrm_char_t* value, int datatype, size_t* len)
+{
+    tmrm_literal* lit;
+
+    if (!(lit = TMRM_POOL_CALLOC(tmrm_literal, TMRM_POOL_LITERAL))) {
         return (tmrm_literal*)NULL;
     }
-    if (!(str = (tmrm_char_t*)TMRM_MALLOC(str, strlen((char*)value) + 1))) {
-        TMRM_FREE(tmrm_literal, lit);
+    lit->type = TMRM_TYPE_LITERAL;
+    lit->datatype = datatype;
+    lit->storage = TMRM_LITERAL_OWNED;
+    *len = strlen((const char*)value);
+    if (*len < TMRM_LITERAL_INLINE_SIZE) {
+        memcpy(lit->inline_value, value, *len + 1);
+        lit->value = lit->inline_value;
+        lit->storage = TMRM_LITERAL_INLINE;
+    }
+    return lit;
+}
+
+
+/* Creates a literal of a registered datatype */
+static tmrm_literal*
+_literal_new(const tmrm_char_t* value, int datatype)
+{
+    tmrm_literal* lit;
+    size_t len;
+
+    if (!(lit = _literal_alloc(value, datatype, &len))) {
         return (tmrm_literal*)NULL;
     }
-    (void)strcpy((char*)str, (char*)value);
-    lit->value = str;
+    if (lit->storage == TMRM_LITERAL_INLINE) return lit;
 
-    if (!(str = (tmrm_char_t*)TMRM_MALLOC(str, strlen((char*)datatype) + 1))) {
-        TMRM_FREE(cstring, str);
-        TMRM_FREE(tmrm_literal, lit);
+    /* Literals in an arena are never freed, so they must not hold a
+       reference to an interned value */
+    if (_intern_values && !tmrm_arena_active() &&
+            (lit->value = _intern(value))) {
+        lit->storage = TMRM_LITERAL_INTERNED;
+        return lit;
+    }
+    if (!(lit->value = (tmrm_char_t*)TMRM_MALLOC(str, len + 1))) {
+        TMRM_POOL_FREE(tmrm_literal, TMRM_POOL_LITERAL, lit);
         return (tmrm_literal*)NULL;
     }
-    (void)strcpy((char*)str, (char*)datatype);
-    lit->datatype = str;
-    lit->type = TMRM_TYPE_LITERAL;
+    memcpy(lit->value, value, len + 1);
     return lit;
 }
 
 
+/**
+ * Creates and returns a new literal.
+ * @returns NULL on failure.
+ */
+/*@null@*/ tmrm_literal*
+tmrm_literal_new(const tmrm_char_t* value, const tmrm_char_t* datatype)
+{
+    int id;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(value, tmrm_char_t, (tmrm_literal*)NULL);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(datatype, tmrm_char_t, (tmrm_literal*)NULL);
+
+    if ((id = tmrm_datatype_id(datatype)) < 0) return (tmrm_literal*)NULL;
+    return _literal_new(value, id);
+}
+
+
+/* Creates a literal whose value stays in memory of owner, which is kept
+   alive until the literal is freed. Short values are stored inline. Inside
+   an arena, where literals are not freed one by one, the value is
+   copied instead, so that the owner can be released. */
+tmrm_literal*
+tmrm_literal_new_borrowed(const tmrm_char_t* value,
+        const tmrm_char_t* datatype, tmrm_literal_owner* owner)
+{
+    tmrm_literal* lit;
+    size_t len;
+    int id;
+
+    if ((id = tmrm_datatype_id(datatype)) < 0) return (tmrm_literal*)NULL;
+    if (tmrm_arena_active()) return _literal_new(value, id);
+    if (!(lit = _literal_alloc(value, id, &len))) return (tmrm_literal*)NULL;
+    if (lit->storage == TMRM_LITERAL_INLINE) return lit;
+
+    lit->value = (tmrm_char_t*)value;
+    lit->owner = owner;
+    lit->storage = TMRM_LITERAL_BORROWED;
+    TMRM_LITERALS_LOCK();
+    owner->refs++;
+    TMRM_LITERALS_UNLOCK();
+    return lit;
+}
+
+
+/* Closes owner; it is released now or by the last borrowing literal */
+void
+tmrm_literal_owner_close(tmrm_literal_owner* owner)
+{
+    int release;
+
+    TMRM_LITERALS_LOCK();
+    owner->closed = 1;
+    release = owner->refs == 0;
+    TMRM_LITERALS_UNLOCK();
+    if (release) owner->release(owner);
+}
+
+
+/**
+ * Returns a copy of the literal lit. Interned and borrowed values are
+ * shared with the copy, except inside an arena.
+ * @returns NULL on failure.
+ */
+/*@null@*/ tmrm_literal*
+tmrm_literal_clone(const tmrm_literal* lit)
+{
+    tmrm_literal* copy;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(lit, tmrm_literal, (tmrm_literal*)NULL);
+
+    if (lit->storage != TMRM_LITERAL_INLINE && tmrm_arena_active()) {
+        return _literal_new(lit->value, lit->datatype);
+    }
+    switch (lit->storage) {
+        case TMRM_LITERAL_INLINE:
+            if (!(copy = TMRM_POOL_CALLOC(tmrm_literal, TMRM_POOL_LITERAL))) {
+                return (tmrm_literal*)NULL;
+            }
+            *copy = *lit;
+            copy->value = copy->inline_value;
+            return copy;
+        case TMRM_LITERAL_BORROWED:
+            return tmrm_literal_new_borrowed(lit->value,
+                    tmrm_datatype_uri(lit->datatype), lit->owner);
+        case TMRM_LITERAL_INTERNED:
+            if (!(copy = TMRM_POOL_CALLOC(tmrm_literal, TMRM_POOL_LITERAL))) {
+                return (tmrm_literal*)NULL;
+            }
+            *copy = *lit;
+            TMRM_LITERALS_LOCK();
+            ((tmrm_literal_interned*)(lit->value -
+                offsetof(tmrm_literal_interned, value)))->refs++;
+            TMRM_LITERALS_UNLOCK();
+            return copy;
+        default:
+            return _literal_new(lit->value, lit->datatype);
+    }
+}
+
+
 /**
  * Returns the datatype of a literal.
  * @returns NULL on failure.
@@ -86,6 +457,17 @@ tmrm_literal_new(const tmrm_char_t* value, const tmrm_char_t* datatype)
 const tmrm_char_t*
 tmrm_literal_datatype(const tmrm_literal* lit) {
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(lit, tmrm_literal, (const tmrm_char_t*)NULL);
+    return tmrm_datatype_uri(lit->datatype);
+}
+
+
+/**
+ * Returns the ID of the datatype of a literal, see tmrm_datatype_id().
+ * @returns -1 on failure.
+ */
+int
+tmrm_literal_datatype_id(const tmrm_literal* lit) {
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(lit, tmrm_literal, -1);
     return lit->datatype;
 }
 
@@ -117,13 +499,26 @@ tmrm_literal_to_object(tmrm_literal *p) {
 void
 tmrm_literal_free(tmrm_literal* l)
 {
+    tmrm_literal_owner* owner;
+    int release;
+
     TMRM_ASSERT_OBJECT_POINTER_RETURN(l, tmrm_literal);
-    if (l->value != NULL) {
-        TMRM_FREE(cstring, l->value);
+    switch (l->storage) {
+        case TMRM_LITERAL_OWNED:
+            TMRM_FREE(cstring, l->value);
+            break;
+        case TMRM_LITERAL_INTERNED:
+            _unintern(l->value);
+            break;
+        case TMRM_LITERAL_BORROWED:
+            owner = l->owner;
+            TMRM_LITERALS_LOCK();
+            release = --owner->refs == 0 && owner->closed;
+            TMRM_LITERALS_UNLOCK();
+            if (release) owner->release(owner);
+            break;
+        default:
+            break;
     }
-    if (l->datatype != NULL) {
-        TMRM_FREE(cstring, l->datatype);
-    }
-    TMRM_FREE(tmrm_literal, l);
+    TMRM_POOL_FREE(tmrm_literal, TMRM_POOL_LITERAL, l);
 }
-
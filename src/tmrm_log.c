@@ -0,0 +1,119 @@
+/*
+ * tmrm_log.c - Leveled logging
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */
+
+/**
+ * @file tmrm_log.c
+ * @brief Log messages of libtmrm (TMRM_LOG, TMRM_DEBUG1 ... TMRM_DEBUG5).
+ *
+ * Messages above TMRM_LOG_MAX_LEVEL are removed by the preprocessor. The
+ * remaining ones compare their level with tmrm_log_threshold before any
+ * arguments are formatted, so disabled messages cost one branch. Messages
+ * that pass are formatted here and handed to the handler set with
+ * tmrm_set_logger(), which defaults to stderr.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <libtmrm.h>
+#include <tmrm_internal.h>
+
+/* Messages longer than this are truncated */
+#define TMRM_LOG_MESSAGE_SIZE 1024
+
+/* Highest level that is logged; read by TMRM_LOG */
+int tmrm_log_threshold = TMRM_LOG_WARNING;
+
+static tmrm_log_handler _handler = NULL;
+static void* _handler_data = NULL;
+
+
+static void
+_log_stderr(void* data, tmrm_log_level level, const char* file, int line,
+        const char* function, const char* message)
+{
+    fprintf(stderr, "%s:%d:%s: %s\n", file, line, function, message);
+}
+
+
+/**
+ * Sets the handler that receives the log messages and the highest level
+ * that is logged. A NULL handler writes the messages to stderr. Debug
+ * messages are only available if libtmrm was configured with
+ * --with-log-level=3 (the default).
+ *
+ * Must not be called while other threads use libtmrm.
+ */
+void
+tmrm_set_logger(tmrm_log_level level, tmrm_log_handler handler, void* data)
+{
+    tmrm_log_threshold = level;
+    _handler = handler;
+    _handler_data = data;
+}
+
+
+/**
+ * Returns the highest level that is currently logged.
+ */
+tmrm_log_level
+tmrm_get_log_level(void)
+{
+    return (tmrm_log_level)tmrm_log_threshold;
+}
+
+
+/**
+ * Formats a message and passes it to the handler. Called through TMRM_LOG
+ * once the level has been checked; a trailing newline is removed.
+ */
+void
+tmrm_log(int level, const char* file, int line, const char* function,
+        const char* format, ...)
+{
+    char message[TMRM_LOG_MESSAGE_SIZE];
+    va_list args;
+    size_t len;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    len = strlen(message);
+    if (len > 0 && message[len - 1] == '\n') message[len - 1] = '\0';
+
+    if (_handler) {
+        _handler(_handler_data, (tmrm_log_level)level, file, line, function,
+                message);
+    } else {
+        _log_stderr(NULL, (tmrm_log_level)level, file, line, function,
+                message);
+    }
+}
@@ -0,0 +1,995 @@
+/*
+ * tmrm_memory.c - Allocator hooks and query arenas
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */
+
+/**
+ * @file tmrm_memory.c
+ * @brief All allocations of libtmrm go through TMRM_MALLOC, TMRM_CALLOC,
+ * TMRM_REALLOC and TMRM_FREE, which end up here.
+ *
+ * By default the functions of the C library are used; tmrm_set_allocator()
+ * replaces them. In addition, a thread can open an arena with
+ * tmrm_arena_begin(). Until the matching tmrm_arena_end(), everything that
+ * libtmrm allocates on this thread is carved out of large chunks, freeing
+ * it is a no-op, and tmrm_arena_end() releases all of it at once. This
+ * suits read queries that build many small, short-lived objects.
+ *
+ * Arenas nest. Memory that was allocated outside of an arena stays on the
+ * heap and can be freed and reallocated as usual inside of it. Structures
+ * that outlive a query (storage indexes, the read cache) are allocated with
+ * the arena suspended, see tmrm_arena_suspend().
+ *
+ * Small nodes of a fixed size (list elements, hash nodes and datums,
+ * proxies) come from slab pools instead, see TMRM_POOL_CALLOC. Each thread
+ * keeps its own free list per pool; slabs are carved into objects and never
+ * returned to the allocator. Objects may be freed by another thread than
+ * the one that allocated them.
+ *
+ * If libtmrm is configured with --enable-memory-accounting, every heap
+ * block carries a header with its size and the type tag that was passed
+ * to TMRM_MALLOC. Live bytes and blocks and their high-water marks are
+ * counted per tag, see tmrm_memory_stats() and tmrm_memory_report().
+ * Arena blocks are not counted; tmrm_arena_allocated() covers them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include <libtmrm.h>
+#include <tmrm_internal.h>
+
+/* Size of the first chunk of an arena; later chunks double up to
+   TMRM_ARENA_MAX_CHUNK */
+#define TMRM_ARENA_MIN_CHUNK 4096
+#define TMRM_ARENA_MAX_CHUNK (1024 * 1024)
+
+/* Alignment of arena blocks; each block is preceded by a header of this
+   size that holds the block size for tmrm_realloc() */
+#define TMRM_ARENA_ALIGN 16
+
+typedef struct tmrm_arena_chunk_s {
+    struct tmrm_arena_chunk_s* next;
+    char* end;
+} tmrm_arena_chunk;
+
+struct tmrm_arena_s {
+    tmrm_arena_chunk* chunks;   /* newest first */
+    char* position;
+    char* limit;
+    size_t next_chunk;
+    size_t allocated;
+    struct tmrm_arena_s* outer;
+};
+
+/* Number of objects carved out of a slab; also the number of objects
+   moved between a thread and the depot of a pool at once */
+#define TMRM_POOL_SLAB_OBJECTS 64
+
+typedef struct tmrm_pool_block_s {
+    struct tmrm_pool_block_s* next;
+} tmrm_pool_block;
+
+/* Slabs are kept in a list so that they stay reachable */
+typedef struct tmrm_pool_slab_s {
+    struct tmrm_pool_slab_s* next;
+} tmrm_pool_slab;
+
+/* Shared part of a pool, protected by _pools_lock */
+typedef struct {
+    size_t size;                /* object size, 0 until first use */
+    size_t slabs;
+    tmrm_pool_block* depot;     /* objects left by threads */
+    size_t depot_count;
+    unsigned long allocs;       /* counters of exited threads */
+    unsigned long frees;
+} tmrm_pool;
+
+/* Free list of a pool in a thread */
+typedef struct {
+    tmrm_pool_block* free;
+    size_t free_count;
+    unsigned long allocs;
+    unsigned long frees;
+} tmrm_pool_cache;
+
+/* Memory state of a thread */
+typedef struct tmrm_arena_state_s {
+    tmrm_arena* current;
+    int suspended;
+    tmrm_pool_cache pools[TMRM_POOL_COUNT];
+    struct tmrm_arena_state_s* prev;    /* all thread states */
+    struct tmrm_arena_state_s* next;
+} tmrm_arena_state;
+
+static void*
+_libc_malloc(void* data, size_t size)
+{
+    return malloc(size);
+}
+
+static void*
+_libc_realloc(void* data, void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void
+_libc_free(void* data, void* ptr)
+{
+    free(ptr);
+}
+
+static const tmrm_allocator _libc_allocator = {
+    _libc_malloc, _libc_realloc, _libc_free, NULL
+};
+
+static tmrm_allocator _allocator = {
+    _libc_malloc, _libc_realloc, _libc_free, NULL
+};
+
+#ifdef TMRM_MEMORY_ACCOUNTING
+
+/* Number of distinct type tags that are counted; the last slot counts the
+   tags that do not fit */
+#define TMRM_MEMORY_TYPES 256
+
+/* Precedes every heap block; TMRM_ARENA_ALIGN bytes are reserved for it */
+typedef struct {
+    tmrm_memory_type_stats* type;
+    size_t size;
+} tmrm_memory_header;
+
+static tmrm_memory_type_stats _types[TMRM_MEMORY_TYPES];
+
+#ifdef HAVE_PTHREAD
+#define _memory_add(counter, n) __sync_add_and_fetch(&(counter), (n))
+#define _memory_sub(counter, n) (void)__sync_fetch_and_sub(&(counter), (n))
+#define _memory_get(counter) __sync_fetch_and_add(&(counter), 0)
+#define _memory_cas(counter, old, new) \
+    __sync_bool_compare_and_swap(&(counter), (old), (new))
+#define _memory_claim(slot, name) \
+    __sync_val_compare_and_swap(&(slot), NULL, (name))
+#else
+#define _memory_add(counter, n) ((counter) += (n))
+#define _memory_sub(counter, n) ((counter) -= (n))
+#define _memory_get(counter) (counter)
+#define _memory_cas(counter, old, new) ((counter) = (new), 1)
+#define _memory_claim(slot, name) ((slot) ? (slot) : ((slot) = (name), NULL))
+#endif
+
+
+/* Returns the counters of a type tag, claiming a free slot for new tags.
+   Slots are never released, so the lookup needs no lock. */
+static tmrm_memory_type_stats*
+_memory_type(const char* name)
+{
+    const char* old;
+    unsigned long h = 5381;
+    const char* c;
+    int i, n;
+
+    for (c = name; *c; c++) h = h * 33 + (unsigned char)*c;
+    i = (int)(h % (TMRM_MEMORY_TYPES - 1));
+    for (n = 0; n < TMRM_MEMORY_TYPES - 1; n++) {
+        old = _memory_claim(_types[i].type, name);
+        if (!old || old == name || !strcmp(old, name)) return &_types[i];
+        i = (i + 1) % (TMRM_MEMORY_TYPES - 1);
+    }
+    (void)_memory_claim(_types[TMRM_MEMORY_TYPES - 1].type, "other");
+    return &_types[TMRM_MEMORY_TYPES - 1];
+}
+
+
+/* Counts added bytes and blocks of a type and raises its high-water
+   marks */
+static void
+_memory_count(tmrm_memory_type_stats* t, size_t bytes, size_t count)
+{
+    size_t max, live_bytes, live_count;
+
+    live_bytes = _memory_add(t->bytes, bytes);
+    live_count = _memory_add(t->count, count);
+    if (count) (void)_memory_add(t->allocs, 1);
+    while ((max = _memory_get(t->max_bytes)) < live_bytes &&
+            !_memory_cas(t->max_bytes, max, live_bytes)) {
+    }
+    while ((max = _memory_get(t->max_count)) < live_count &&
+            !_memory_cas(t->max_count, max, live_count)) {
+    }
+}
+
+#endif
+
+/* Number of open arenas in all threads. As long as it is 0, no thread
+   state has to be looked up. */
+static volatile int _arenas_open = 0;
+
+static tmrm_pool _pools[TMRM_POOL_COUNT];
+static tmrm_pool_slab* _pool_slabs = NULL;
+static tmrm_arena_state* _states = NULL;
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t _arena_key;
+static pthread_once_t _arena_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t _pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define TMRM_POOLS_LOCK() pthread_mutex_lock(&_pools_lock)
+#define TMRM_POOLS_UNLOCK() pthread_mutex_unlock(&_pools_lock)
+
+/* Hands the free lists and counters of an exiting thread to the pools */
+static void
+_arena_state_free(void* data)
+{
+    tmrm_arena_state* state = (tmrm_arena_state*)data;
+    tmrm_pool_cache* cache;
+    tmrm_pool_block* block;
+    int i;
+
+    TMRM_POOLS_LOCK();
+    for (i = 0; i < TMRM_POOL_COUNT; i++) {
+        cache = &state->pools[i];
+        while ((block = cache->free)) {
+            cache->free = block->next;
+            block->next = _pools[i].depot;
+            _pools[i].depot = block;
+            _pools[i].depot_count++;
+        }
+        _pools[i].allocs += cache->allocs;
+        _pools[i].frees += cache->frees;
+    }
+    if (state->prev) state->prev->next = state->next;
+    else _states = state->next;
+    if (state->next) state->next->prev = state->prev;
+    TMRM_POOLS_UNLOCK();
+    _allocator.free(_allocator.data, state);
+}
+
+static void
+_arena_key_create(void)
+{
+    (void)pthread_key_create(&_arena_key, _arena_state_free);
+}
+#else
+#define TMRM_POOLS_LOCK() do {} while (0)
+#define TMRM_POOLS_UNLOCK() do {} while (0)
+
+static tmrm_arena_state _arena_state;
+#endif
+
+
+/* Returns the arena state of the calling thread, creating it if asked */
+static tmrm_arena_state*
+_arena_state_get(int create)
+{
+#ifdef HAVE_PTHREAD
+    tmrm_arena_state* state;
+
+    (void)pthread_once(&_arena_key_once, _arena_key_create);
+    state = (tmrm_arena_state*)pthread_getspecific(_arena_key);
+    if (!state && create) {
+        state = (tmrm_arena_state*)_allocator.malloc(_allocator.data,
+                sizeof(tmrm_arena_state));
+        if (!state) return NULL;
+        memset(state, 0, sizeof(tmrm_arena_state));
+        if (pthread_setspecific(_arena_key, state)) {
+            _allocator.free(_allocator.data, state);
+            return NULL;
+        }
+        TMRM_POOLS_LOCK();
+        state->next = _states;
+        if (_states) _states->prev = state;
+        _states = state;
+        TMRM_POOLS_UNLOCK();
+    }
+    return state;
+#else
+    if (!_states) _states = &_arena_state;
+    return &_arena_state;
+#endif
+}
+
+
+static void
+_arenas_open_add(int n)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&_arenas_lock);
+    _arenas_open += n;
+    pthread_mutex_unlock(&_arenas_lock);
+#else
+    _arenas_open += n;
+#endif
+}
+
+
+/* Returns the arena that new blocks come from, or NULL */
+static tmrm_arena_state*
+_arena_state_active(void)
+{
+    if (!_arenas_open) return NULL;
+    return _arena_state_get(0);
+}
+
+
+/* Returns 1 if ptr lies in one of the open arenas of the thread */
+static int
+_arena_owns(tmrm_arena_state* state, const void* ptr)
+{
+    tmrm_arena* a;
+    tmrm_arena_chunk* chunk;
+
+    for (a = state->current; a; a = a->outer) {
+        for (chunk = a->chunks; chunk; chunk = chunk->next) {
+            if ((const char*)ptr > (const char*)chunk &&
+                    (const char*)ptr < chunk->end) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+static void*
+_arena_alloc(tmrm_arena* a, size_t size)
+{
+    tmrm_arena_chunk* chunk;
+    size_t need, chunk_size;
+    char* block;
+
+    need = TMRM_ARENA_ALIGN +
+        (size + TMRM_ARENA_ALIGN - 1) / TMRM_ARENA_ALIGN * TMRM_ARENA_ALIGN;
+    if ((size_t)(a->limit - a->position) < need) {
+        chunk_size = a->next_chunk;
+        if (chunk_size < need + TMRM_ARENA_ALIGN) {
+            chunk_size = need + TMRM_ARENA_ALIGN;
+        }
+        chunk = (tmrm_arena_chunk*)_allocator.malloc(_allocator.data,
+                chunk_size);
+        if (!chunk) return NULL;
+        chunk->end = (char*)chunk + chunk_size;
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        /* The chunk header takes the first aligned slot */
+        a->position = (char*)chunk + TMRM_ARENA_ALIGN;
+        a->limit = chunk->end;
+        if (a->next_chunk < TMRM_ARENA_MAX_CHUNK) a->next_chunk *= 2;
+    }
+    block = a->position;
+    a->position += need;
+    a->allocated += size;
+    *(size_t*)block = size;
+    return block + TMRM_ARENA_ALIGN;
+}
+
+
+/* Allocates a heap block of size bytes, counted under type if memory
+   accounting is enabled */
+static void*
+_heap_malloc(const char* type, size_t size)
+{
+#ifdef TMRM_MEMORY_ACCOUNTING
+    tmrm_memory_header* h;
+
+    if (size > (size_t)-1 - TMRM_ARENA_ALIGN) return NULL;
+    h = (tmrm_memory_header*)_allocator.malloc(_allocator.data,
+            size + TMRM_ARENA_ALIGN);
+    if (!h) return NULL;
+    h->type = _memory_type(type ? type : "untyped");
+    h->size = size;
+    _memory_count(h->type, size, 1);
+    return (char*)h + TMRM_ARENA_ALIGN;
+#else
+    return _allocator.malloc(_allocator.data, size);
+#endif
+}
+
+
+static void*
+_heap_realloc(void* ptr, size_t size)
+{
+#ifdef TMRM_MEMORY_ACCOUNTING
+    tmrm_memory_header *h = (tmrm_memory_header*)((char*)ptr -
+            TMRM_ARENA_ALIGN);
+    tmrm_memory_type_stats* type = h->type;
+    size_t old = h->size;
+
+    if (size > (size_t)-1 - TMRM_ARENA_ALIGN) return NULL;
+    h = (tmrm_memory_header*)_allocator.realloc(_allocator.data, h,
+            size + TMRM_ARENA_ALIGN);
+    if (!h) return NULL;
+    h->size = size;
+    _memory_sub(type->bytes, old);
+    _memory_count(type, size, 0);
+    return (char*)h + TMRM_ARENA_ALIGN;
+#else
+    return _allocator.realloc(_allocator.data, ptr, size);
+#endif
+}
+
+
+static void
+_heap_free(void* ptr)
+{
+#ifdef TMRM_MEMORY_ACCOUNTING
+    tmrm_memory_header *h = (tmrm_memory_header*)((char*)ptr -
+            TMRM_ARENA_ALIGN);
+
+    _memory_sub(h->type->bytes, h->size);
+    _memory_sub(h->type->count, 1);
+    _allocator.free(_allocator.data, h);
+#else
+    _allocator.free(_allocator.data, ptr);
+#endif
+}
+
+
+/**
+ * Replaces the allocator of libtmrm, or restores the allocator of the C
+ * library if allocator is NULL. The allocator is global and must be set
+ * before the first call to libtmrm, as memory must be freed by the
+ * allocator that allocated it. Strings returned by libtmrm must then be
+ * freed with tmrm_free() instead of free().
+ */
+void
+tmrm_set_allocator(const tmrm_allocator* allocator)
+{
+    _allocator = allocator ? *allocator : _libc_allocator;
+}
+
+
+/* Allocates size bytes from the current arena or the allocator; heap
+   blocks are counted under type */
+void*
+tmrm_malloc_typed(const char* type, size_t size)
+{
+    tmrm_arena_state* state = _arena_state_active();
+
+    if (state && state->current && !state->suspended) {
+        return _arena_alloc(state->current, size);
+    }
+    return _heap_malloc(type, size);
+}
+
+
+/* Allocates size bytes from the current arena or the allocator */
+void*
+tmrm_malloc(size_t size)
+{
+    return tmrm_malloc_typed(NULL, size);
+}
+
+
+void*
+tmrm_calloc_typed(const char* type, size_t count, size_t size)
+{
+    void* ptr;
+
+    if (size && count > (size_t)-1 / size) return NULL;
+    if ((ptr = tmrm_malloc_typed(type, count * size))) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+
+/* Allocates count zeroed elements of size bytes */
+void*
+tmrm_calloc(size_t count, size_t size)
+{
+    return tmrm_calloc_typed(NULL, count, size);
+}
+
+
+/* Resizes a block. Blocks from an arena are moved to the current arena,
+   heap blocks stay on the heap and keep their type. */
+void*
+tmrm_realloc_typed(const char* type, void* ptr, size_t size)
+{
+    tmrm_arena_state* state = _arena_state_active();
+    size_t old;
+    void* block;
+
+    if (ptr && state && _arena_owns(state, ptr)) {
+        old = *(size_t*)((char*)ptr - TMRM_ARENA_ALIGN);
+        if (size <= old) return ptr;
+        if (!(block = tmrm_malloc_typed(type, size))) return NULL;
+        memcpy(block, ptr, old);
+        return block;
+    }
+    if (!ptr) return tmrm_malloc_typed(type, size);
+    return _heap_realloc(ptr, size);
+}
+
+
+void*
+tmrm_realloc(void* ptr, size_t size)
+{
+    return tmrm_realloc_typed(NULL, ptr, size);
+}
+
+
+/* Frees a block; blocks from an open arena are released by
+   tmrm_arena_end() */
+void
+tmrm_free(void* ptr)
+{
+    tmrm_arena_state* state;
+
+    if (!ptr) return;
+    if ((state = _arena_state_active()) && _arena_owns(state, ptr)) return;
+    _heap_free(ptr);
+}
+
+
+/* Copies a string with tmrm_malloc() */
+char*
+tmrm_strdup(const char* s)
+{
+    size_t len = strlen(s) + 1;
+    char* copy;
+
+    if ((copy = (char*)TMRM_MALLOC(cstring, len))) memcpy(copy, s, len);
+    return copy;
+}
+
+
+/* Appends to a string that grows as needed. Returns 0 on success. */
+int
+tmrm_printf_append(char** buffer, size_t* length, size_t* capacity,
+        const char* format, ...)
+{
+    va_list args;
+    char* grown;
+    int n;
+
+    for (;;) {
+        va_start(args, format);
+        n = vsnprintf(*buffer + *length, *capacity - *length, format, args);
+        va_end(args);
+        if (n < 0) return 1;
+        if ((size_t)n < *capacity - *length) break;
+        if (!(grown = (char*)TMRM_REALLOC(char, *buffer,
+                        *capacity * 2 + (size_t)n))) {
+            return 1;
+        }
+        *buffer = grown;
+        *capacity = *capacity * 2 + (size_t)n;
+    }
+    *length += (size_t)n;
+    return 0;
+}
+
+
+/**
+ * Opens an arena on the calling thread. Until tmrm_arena_end(), the
+ * memory that libtmrm allocates on this thread is taken from the arena.
+ * Objects created in the arena must not be used after its end, so they
+ * must not be handed to other threads or kept in long-lived structures.
+ *
+ * @returns NULL on failure
+ */
+tmrm_arena*
+tmrm_arena_begin(void)
+{
+    tmrm_arena_state* state;
+    tmrm_arena* a;
+
+    if (!(state = _arena_state_get(1))) return NULL;
+    a = (tmrm_arena*)_allocator.malloc(_allocator.data, sizeof(tmrm_arena));
+    if (!a) return NULL;
+    memset(a, 0, sizeof(tmrm_arena));
+    a->next_chunk = TMRM_ARENA_MIN_CHUNK;
+    a->outer = state->current;
+    state->current = a;
+    _arenas_open_add(1);
+    return a;
+}
+
+
+/**
+ * Closes the arena a and frees everything that was allocated in it. a must
+ * be the innermost open arena of the calling thread.
+ */
+void
+tmrm_arena_end(tmrm_arena* a)
+{
+    tmrm_arena_state* state;
+    tmrm_arena_chunk *chunk, *next;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN(a, tmrm_arena);
+    state = _arena_state_get(0);
+    if (!state || state->current != a) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Not the innermost arena");
+        return;
+    }
+    state->current = a->outer;
+    _arenas_open_add(-1);
+    for (chunk = a->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        _allocator.free(_allocator.data, chunk);
+    }
+    _allocator.free(_allocator.data, a);
+}
+
+
+/* Returns the number of bytes that have been allocated in the arena */
+size_t
+tmrm_arena_allocated(const tmrm_arena* a)
+{
+    return a->allocated;
+}
+
+
+/* Returns 1 if allocations on the calling thread currently go to an arena */
+int
+tmrm_arena_active(void)
+{
+    tmrm_arena_state* state = _arena_state_active();
+    return state && state->current && !state->suspended;
+}
+
+
+/* Makes allocations on the calling thread bypass the arena until the
+   matching tmrm_arena_resume(). Calls nest. */
+void
+tmrm_arena_suspend(void)
+{
+    tmrm_arena_state* state = _arena_state_active();
+    if (state) state->suspended++;
+}
+
+
+void
+tmrm_arena_resume(void)
+{
+    tmrm_arena_state* state = _arena_state_active();
+    if (state && state->suspended > 0) state->suspended--;
+}
+
+
+/* Moves objects from the depot of a pool to the free list of a thread, or
+   carves a new slab. Must be called with _pools_lock held. */
+static int
+_pool_refill(tmrm_pool* pool, tmrm_pool_cache* cache, size_t size)
+{
+    tmrm_pool_slab* slab;
+    tmrm_pool_block* block;
+    char* object;
+    int i;
+
+    if (!pool->size) {
+        pool->size = (size + TMRM_ARENA_ALIGN - 1) / TMRM_ARENA_ALIGN *
+            TMRM_ARENA_ALIGN;
+    }
+    if (pool->depot) {
+        for (i = 0; i < TMRM_POOL_SLAB_OBJECTS && pool->depot; i++) {
+            block = pool->depot;
+            pool->depot = block->next;
+            pool->depot_count--;
+            block->next = cache->free;
+            cache->free = block;
+            cache->free_count++;
+        }
+        return 0;
+    }
+
+    slab = (tmrm_pool_slab*)_allocator.malloc(_allocator.data,
+            TMRM_ARENA_ALIGN + TMRM_POOL_SLAB_OBJECTS * pool->size);
+    if (!slab) return 1;
+    slab->next = _pool_slabs;
+    _pool_slabs = slab;
+    pool->slabs++;
+    object = (char*)slab + TMRM_ARENA_ALIGN;
+    for (i = 0; i < TMRM_POOL_SLAB_OBJECTS; i++, object += pool->size) {
+        block = (tmrm_pool_block*)object;
+        block->next = cache->free;
+        cache->free = block;
+        cache->free_count++;
+    }
+    return 0;
+}
+
+
+/* Returns a zeroed object of size bytes from a pool, or NULL on failure.
+   All objects of a pool must have the same size. Inside of an arena, the
+   object is taken from the arena. */
+void*
+tmrm_pool_calloc(tmrm_pool_type type, size_t size)
+{
+    tmrm_arena_state* state;
+    tmrm_pool_cache* cache;
+    tmrm_pool_block* block;
+    int failed = 0;
+
+    if (_arenas_open && tmrm_arena_active()) return tmrm_calloc(1, size);
+    /* A heap block would end up on a free list of the pool once it is
+       freed, so fail instead */
+    if (!(state = _arena_state_get(1))) return NULL;
+
+    cache = &state->pools[type];
+    if (!cache->free) {
+        TMRM_POOLS_LOCK();
+        failed = _pool_refill(&_pools[type], cache, size);
+        TMRM_POOLS_UNLOCK();
+        if (failed) return NULL;
+    }
+    block = cache->free;
+    cache->free = block->next;
+    cache->free_count--;
+    cache->allocs++;
+    memset(block, 0, size);
+    return block;
+}
+
+
+/* Returns an object to its pool */
+void
+tmrm_pool_free(tmrm_pool_type type, void* ptr)
+{
+    tmrm_arena_state* state;
+    tmrm_pool_cache* cache;
+    tmrm_pool_block *block = (tmrm_pool_block*)ptr;
+    int i;
+
+    if (!ptr) return;
+    if ((state = _arena_state_active()) && _arena_owns(state, ptr)) return;
+
+    if (!(state = _arena_state_get(1))) {
+        TMRM_POOLS_LOCK();
+        block->next = _pools[type].depot;
+        _pools[type].depot = block;
+        _pools[type].depot_count++;
+        TMRM_POOLS_UNLOCK();
+        return;
+    }
+    cache = &state->pools[type];
+    block->next = cache->free;
+    cache->free = block;
+    cache->free_count++;
+    cache->frees++;
+
+    /* A thread that frees what others allocate passes objects on */
+    if (cache->free_count > 4 * TMRM_POOL_SLAB_OBJECTS) {
+        TMRM_POOLS_LOCK();
+        for (i = 0; i < TMRM_POOL_SLAB_OBJECTS; i++) {
+            block = cache->free;
+            cache->free = block->next;
+            cache->free_count--;
+            block->next = _pools[type].depot;
+            _pools[type].depot = block;
+            _pools[type].depot_count++;
+        }
+        TMRM_POOLS_UNLOCK();
+    }
+}
+
+
+/**
+ * Returns the number of objects of the pool that are in use and the
+ * number of objects that its slabs hold. The counters of running threads
+ * are read without synchronisation, so the numbers are approximate while
+ * other threads use libtmrm.
+ */
+void
+tmrm_pool_stats(tmrm_pool_type type, size_t* in_use, size_t* capacity)
+{
+    tmrm_arena_state* state;
+    unsigned long allocs, frees;
+
+    if (in_use) *in_use = 0;
+    if (capacity) *capacity = 0;
+    if (type < 0 || type >= TMRM_POOL_COUNT) return;
+
+    TMRM_POOLS_LOCK();
+    allocs = _pools[type].allocs;
+    frees = _pools[type].frees;
+    for (state = _states; state; state = state->next) {
+        allocs += state->pools[type].allocs;
+        frees += state->pools[type].frees;
+    }
+    if (in_use) *in_use = allocs > frees ? allocs - frees : 0;
+    if (capacity) *capacity = _pools[type].slabs * TMRM_POOL_SLAB_OBJECTS;
+    TMRM_POOLS_UNLOCK();
+}
+
+
+/**
+ * Returns 1 if libtmrm counts its heap memory per type (configure option
+ * --enable-memory-accounting), 0 otherwise.
+ */
+int
+tmrm_memory_accounting(void)
+{
+#ifdef TMRM_MEMORY_ACCOUNTING
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+#ifdef TMRM_MEMORY_ACCOUNTING
+static int
+_memory_type_compare(const void* a, const void* b)
+{
+    const tmrm_memory_type_stats* x = (const tmrm_memory_type_stats*)a;
+    const tmrm_memory_type_stats* y = (const tmrm_memory_type_stats*)b;
+
+    if (x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+    return strcmp(x->type, y->type);
+}
+#endif
+
+
+/**
+ * Returns the counters of every type that was allocated, largest live
+ * size first. The array must be free'd with tmrm_free(). The counters of
+ * other threads are copied while they change, so the numbers are
+ * approximate.
+ *
+ * @returns NULL with count set to 0 if memory accounting is disabled or on
+ * failure
+ */
+tmrm_memory_type_stats*
+tmrm_memory_stats(int* count)
+{
+#ifdef TMRM_MEMORY_ACCOUNTING
+    tmrm_memory_type_stats* stats;
+    int i, n = 0;
+
+    *count = 0;
+    stats = (tmrm_memory_type_stats*)TMRM_MALLOC(tmrm_memory_type_stats,
+            TMRM_MEMORY_TYPES * sizeof(tmrm_memory_type_stats));
+    if (!stats) return NULL;
+    for (i = 0; i < TMRM_MEMORY_TYPES; i++) {
+        if (_types[i].type) stats[n++] = _types[i];
+    }
+    qsort(stats, n, sizeof(tmrm_memory_type_stats), _memory_type_compare);
+    *count = n;
+    return stats;
+#else
+    *count = 0;
+    return NULL;
+#endif
+}
+
+
+/**
+ * Sets the high-water marks to the current values and clears the
+ * allocation counters, so that the next report covers a single phase of
+ * the program.
+ */
+void
+tmrm_memory_stats_reset(void)
+{
+#ifdef TMRM_MEMORY_ACCOUNTING
+    int i;
+
+    for (i = 0; i < TMRM_MEMORY_TYPES; i++) {
+        _types[i].max_bytes = _types[i].bytes;
+        _types[i].max_count = _types[i].count;
+        _types[i].allocs = 0;
+    }
+#endif
+}
+
+
+/**
+ * Formats the live bytes and blocks of every allocation type with their
+ * high-water marks, followed by the use of the object pools, as text (one
+ * line per type or pool) or as a JSON object. The type lines are only
+ * present if memory accounting is enabled. The string must be free'd with
+ * tmrm_free().
+ *
+ * @returns NULL on failure
+ */
+char*
+tmrm_memory_report(tmrm_stats_format format)
+{
+    static const char* pool_names[TMRM_POOL_COUNT] = {
+        "list_element", "hash_node", "hash_node_value", "hash_datum",
+        "proxy", "literal"
+    };
+    tmrm_memory_type_stats* stats;
+    char* buffer;
+    size_t length = 0, capacity = 1024, in_use, slots, size;
+    int count, i, failed = 0;
+
+    stats = tmrm_memory_stats(&count);
+    if (!(buffer = (char*)TMRM_MALLOC(char, capacity))) {
+        if (stats) TMRM_FREE(tmrm_memory_type_stats, stats);
+        return NULL;
+    }
+    buffer[0] = '\0';
+    if (format == TMRM_STATS_JSON) {
+        failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                "{\"types\": {");
+    }
+    for (i = 0; i < count; i++) {
+        if (format == TMRM_STATS_JSON) {
+            failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                    "%s\"%s\": {\"bytes\": %lu, \"count\": %lu, "
+                    "\"max_bytes\": %lu, \"max_count\": %lu, "
+                    "\"allocs\": %lu}", i ? ", " : "", stats[i].type,
+                    (unsigned long)stats[i].bytes,
+                    (unsigned long)stats[i].count,
+                    (unsigned long)stats[i].max_bytes,
+                    (unsigned long)stats[i].max_count,
+                    (unsigned long)stats[i].allocs);
+        } else {
+            failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                    "%-32s bytes %lu count %lu max_bytes %lu max_count %lu "
+                    "allocs %lu\n", stats[i].type,
+                    (unsigned long)stats[i].bytes,
+                    (unsigned long)stats[i].count,
+                    (unsigned long)stats[i].max_bytes,
+                    (unsigned long)stats[i].max_count,
+                    (unsigned long)stats[i].allocs);
+        }
+    }
+    if (stats) TMRM_FREE(tmrm_memory_type_stats, stats);
+    if (format == TMRM_STATS_JSON) {
+        failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                "}, \"pools\": {");
+    }
+    for (i = 0; i < TMRM_POOL_COUNT; i++) {
+        tmrm_pool_stats((tmrm_pool_type)i, &in_use, &slots);
+        TMRM_POOLS_LOCK();
+        size = _pools[i].size;
+        TMRM_POOLS_UNLOCK();
+        if (format == TMRM_STATS_JSON) {
+            failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                    "%s\"%s\": {\"in_use\": %lu, \"capacity\": %lu, "
+                    "\"bytes\": %lu}", i ? ", " : "", pool_names[i],
+                    (unsigned long)in_use, (unsigned long)slots,
+                    (unsigned long)(slots * size));
+        } else {
+            failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                    "pool %-27s in_use %lu capacity %lu bytes %lu\n",
+                    pool_names[i], (unsigned long)in_use,
+                    (unsigned long)slots, (unsigned long)(slots * size));
+        }
+    }
+    if (format == TMRM_STATS_JSON) {
+        failed |= tmrm_printf_append(&buffer, &length, &capacity, "}}");
+    }
+    if (failed) {
+        TMRM_FREE(char, buffer);
+        return NULL;
+    }
+    return buffer;
+}
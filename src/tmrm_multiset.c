@@ -61,23 +61,40 @@ tmrm_multiset_new(tmrm_subject_map *map) {
     return ms;
 }
 
+/**
+ * Constructs an empty multi set that owns its elements: tmrm_multiset_free()
+ * frees them. The results of queries are such sets.
+ */
+/*@null@*/ tmrm_multiset*
+tmrm_multiset_new_result(tmrm_subject_map *map) {
+    tmrm_multiset *ms;
+
+    if ((ms = tmrm_multiset_new(map)) == NULL) return NULL;
+    ms->list->free_handler = tmrm_object_free;
+    return ms;
+}
+
+
+/**
+ * Constructor: Reads all objects of the iterator into a new multi set,
+ * which owns them.
+ */
 /*@null@*/ tmrm_multiset*
 tmrm_multiset_new_from_iterator(tmrm_subject_map *map, tmrm_iterator *it) {
     tmrm_multiset *ms;
-    void *element;
-    int status;
+    tmrm_object *element;
 
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map,
         (tmrm_multiset*)NULL);
-    if ((ms = tmrm_multiset_new(map)) == NULL) return NULL;
+    if ((ms = tmrm_multiset_new_result(map)) == NULL) return NULL;
     while (!tmrm_iterator_end(it)) {
         element = tmrm_iterator_get_object(it);
-        if (element == NULL) continue;
-        if ((status = tmrm_iterator_next(it)) != 0) {
+        if (element != NULL && tmrm_multiset_insert(ms, element) != 0) {
+            tmrm_object_free(element);
             tmrm_multiset_free(ms);
             return NULL;
         }
-        if ((status = tmrm_multiset_insert(ms, element)) != 0) {
+        if (tmrm_iterator_next(it) != 0) {
             tmrm_multiset_free(ms);
             return NULL;
         }
@@ -89,21 +106,66 @@ tmrm_multiset_new_from_iterator(tmrm_subject_map *map, tmrm_iterator *it) {
 }
 
 
-/* Copy constructor. */
+/* Returns a copy of a proxy or literal for a set that owns its elements */
+static tmrm_object*
+_object_copy(const tmrm_object *object) {
+    tmrm_proxy *p;
+    tmrm_literal *lit;
+
+    switch (tmrm_object_get_type(object)) {
+        case TMRM_TYPE_PROXY:
+            if (!(p = tmrm_proxy_clone((tmrm_proxy*)object))) return NULL;
+            return tmrm_proxy_to_object(p);
+        case TMRM_TYPE_LITERAL:
+            if (!(lit = tmrm_literal_clone((const tmrm_literal*)object))) {
+                return NULL;
+            }
+            return tmrm_literal_to_object(lit);
+        default:
+            return NULL;
+    }
+}
+
+
+/* Inserts data into ms, or a copy of it if ms owns its elements */
+static int
+_insert_shared(tmrm_multiset *ms, const tmrm_object *data) {
+    tmrm_object *copy;
+
+    if (ms->list->free_handler == NULL) return tmrm_multiset_insert(ms, data);
+    if (!(copy = _object_copy(data))) return -1;
+    if (tmrm_multiset_insert(ms, copy) != 0) {
+        tmrm_object_free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Copy constructor. A set that owns its elements is copied with its
+   elements. */
 tmrm_multiset* tmrm_multiset_clone(tmrm_multiset *ms_src) {
     tmrm_multiset *ms;
+    tmrm_list_elmt *elem;
 
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(ms_src, tmrm_multiset,
         (tmrm_multiset*)NULL);
     if ((ms = tmrm_multiset_new(ms_src->subject_map)) == NULL) return NULL;
-    ms->list = tmrm_list_clone(ms_src->list);
-    
+    ms->list->free_handler = ms_src->list->free_handler;
+    for (elem = tmrm_list_head(ms_src->list); elem != NULL;
+            elem = tmrm_list_next(elem)) {
+        if (_insert_shared(ms, tmrm_list_data(elem)) != 0) {
+            tmrm_multiset_free(ms);
+            return NULL;
+        }
+    }
     return ms;
 }
 
 
 /**
- * Inserts a new element into the set.
+ * Inserts a new element into the set. A set that owns its elements (the
+ * result of a query) takes over data.
  */
 int
 tmrm_multiset_insert(tmrm_multiset *ms, const tmrm_object *data) {
@@ -130,48 +192,32 @@ tmrm_multiset_size(tmrm_multiset *ms) {
 
 /**
  * Returns a list with all elements of the multi set. The calling function is
- * responsible for deleting the list with tmrm_list_free().
- * @todo Maybe we should provide a generic free function that frees all instances
- *      of proxies and literals. 
- * @return TMRM_STATUS_OK on success
+ * responsible for deleting the list with tmrm_list_free(). The elements
+ * still belong to the multi set and must not be used after it is freed.
+ * @return NULL on failure
  */
 tmrm_list*
 tmrm_multiset_as_list(const tmrm_multiset *ms) {
-    tmrm_list *tmp_list;
-    tmrm_list_elmt *elem;
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(ms, tmrm_multiset, NULL);
-    
-    /* FIXME who is responsible for the objects? Should we copy proxy objects? */
-    tmp_list = tmrm_list_new(NULL);
-    // Copy all elements of our internal list to 
-    elem = tmrm_list_head(ms->list);
-    while (elem != NULL) {
-        tmrm_list_ins_next(tmp_list, NULL, tmrm_list_data(elem));
-        elem = tmrm_list_next(elem);
-    }
-    return tmp_list;
+    return tmrm_list_clone(ms->list);
 }
 
 
-/* Adds all elements of ms2 to the multi set ms. */
+/* Adds all elements of ms2 to the multi set ms. A set that owns its
+   elements gets copies of them. */
 int tmrm_multiset_add(tmrm_multiset *ms, const tmrm_multiset *ms2) {
-    tmrm_list *ms2_list;
     tmrm_list_elmt *elem;
-    void *data;
+    int size, i;
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(ms, tmrm_multiset, -1);
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(ms2, tmrm_multiset, -1);
 
-    ms2_list = tmrm_multiset_as_list(ms2);
-    if (ms2_list == NULL) return -1;
-    elem = tmrm_list_head(ms2_list);
-    while (elem != NULL) {
-        data = tmrm_list_data(elem);
-        if (data != NULL) {
-            tmrm_multiset_insert(ms, data);
-        }
+    /* ms may be ms2 */
+    size = tmrm_list_size(ms2->list);
+    elem = tmrm_list_head(ms2->list);
+    for (i = 0; i < size; i++) {
+        if (_insert_shared(ms, tmrm_list_data(elem)) != 0) return -1;
         elem = tmrm_list_next(elem);
     }
-    tmrm_list_free(ms2_list);
     return 0;
 }
 
@@ -0,0 +1,1128 @@
+/*
+ * tmrm_path.c - Path language for subject maps
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <libtmrm.h>
+#include <tmrm_internal.h>
+#include <tmrm_storage_internal.h>
+#include <tmrm_storage.h>
+
+/*
+ * Grammar of path expressions. Proxies are referenced by their labels.
+ *
+ *   expression := sequence { ("++" | "==" | "--") sequence }
+ *   sequence   := item { item }
+ *   item       := "->" key | "<-" key | "/" | "[" filter "]"
+ *               | "(" expression ")" [ "*" ]
+ *   key        := label [ "*" ]
+ *   filter     := label [ "=" ( label | string [ "^^" datatype ] ) ]
+ *
+ * A sequence applies its items one after the other, each to the multiset
+ * that the previous one returned. The set operators apply both operands
+ * to the same input and return the sum, the intersection or the
+ * difference of the results; duplicates are counted. "key *" matches the
+ * key and all its subclasses. "( ... ) *" is the Kleene star: the
+ * expression is applied to its own results until nothing new turns up,
+ * and the distinct objects of all rounds, the input included, are
+ * returned. A filter keeps the proxies that have a property with the key
+ * (and the value). Strings are double-quoted with backslash escapes; the
+ * datatype defaults to xsd:string.
+ *
+ * Example: if 4, 5, 6 and 7 are the labels of the superclass, subclass,
+ * type and instance proxies, then
+ *
+ *   (<- 4 -> 5)* <- 6 -> 7
+ *
+ * returns the instances of a class and of all its subclasses.
+ */
+
+/*
+ * Cost model of the planner, in requests to the storage. Steps that the
+ * storage answers per object cost one request for each object, and the
+ * Kleene star is assumed to take this many rounds. A sequence of steps
+ * that the storage evaluates itself (the path callback) costs a single
+ * request, and is used if it is cheaper.
+ */
+#define TMRM_PATH_CLOSURE_ROUNDS 4
+
+typedef enum {
+    TMRM_PATH_NODE_STEP,
+    TMRM_PATH_NODE_FILTER,
+    TMRM_PATH_NODE_SEQUENCE,
+    TMRM_PATH_NODE_CLOSURE,
+    TMRM_PATH_NODE_UNION,
+    TMRM_PATH_NODE_INTERSECTION,
+    TMRM_PATH_NODE_DIFFERENCE
+} tmrm_path_node_type;
+
+typedef struct tmrm_path_node_s tmrm_path_node;
+
+struct tmrm_path_node_s {
+    tmrm_path_node_type type;
+    /* Steps and filters: the proxies for step.keys */
+    tmrm_path_step step;
+    tmrm_proxy **keys;
+    /* Filters: the value, or NULL for any value */
+    tmrm_object *value;
+    /* Sequences, closures and set operators */
+    tmrm_path_node **children;
+    int child_count;
+};
+
+struct tmrm_path_s {
+    tmrm_subject_map *map;
+    tmrm_path_node *root;
+};
+
+/* A multiset under evaluation. Unlike tmrm_multiset it owns its objects. */
+struct tmrm_path_set_s {
+    tmrm_object **items;
+    int size;
+    int capacity;
+};
+typedef struct tmrm_path_set_s tmrm_path_set;
+
+struct tmrm_path_parser_s {
+    tmrm_subject_map *map;
+    const char *expression;
+    const char *pos;
+};
+typedef struct tmrm_path_parser_s tmrm_path_parser;
+
+
+static tmrm_path_node*
+_parse_expression(tmrm_path_parser* p);
+
+static int
+_eval(tmrm_path* path, tmrm_path_node* node, tmrm_path_set* in,
+        tmrm_path_set* out);
+
+
+/* ======================================================================= */
+/* Multisets under evaluation */
+
+static void
+_set_clear(tmrm_path_set* set)
+{
+    int i;
+    for (i = 0; i < set->size; i++) {
+        tmrm_object_free(set->items[i]);
+    }
+    if (set->items) TMRM_FREE(tmrm_object**, set->items);
+    set->items = NULL;
+    set->size = 0;
+    set->capacity = 0;
+}
+
+
+/* Adds object to the set, which takes it over (or frees it on failure) */
+static int
+_set_add(tmrm_path_set* set, tmrm_object* object)
+{
+    tmrm_object **items;
+    int capacity;
+
+    if (set->size == set->capacity) {
+        capacity = set->capacity ? 2 * set->capacity : 16;
+        items = (tmrm_object**)TMRM_REALLOC(tmrm_object*, set->items,
+                capacity * sizeof(tmrm_object*));
+        if (!items) {
+            tmrm_object_free(object);
+            return 1;
+        }
+        set->items = items;
+        set->capacity = capacity;
+    }
+    set->items[set->size++] = object;
+    return 0;
+}
+
+
+/* Adds the objects of the iterator to the set and frees the iterator */
+static int
+_set_add_iterator(tmrm_path_set* set, tmrm_iterator* it)
+{
+    tmrm_object* object;
+    int ret = 0;
+
+    if (!it) return 1;
+    while (ret == 0 && !tmrm_iterator_end(it)) {
+        object = tmrm_iterator_get_object(it);
+        if (object) ret = _set_add(set, object);
+        if (tmrm_iterator_next(it)) ret = 1;
+    }
+    tmrm_iterator_free(it);
+    return ret;
+}
+
+
+/* Moves all objects of src to dst */
+static int
+_set_move(tmrm_path_set* dst, tmrm_path_set* src)
+{
+    int i, ret = 0;
+
+    if (dst->size == 0) {
+        _set_clear(dst);
+        *dst = *src;
+        src->items = NULL;
+        src->size = src->capacity = 0;
+        return 0;
+    }
+    for (i = 0; i < src->size; i++) {
+        if (ret == 0) {
+            ret = _set_add(dst, src->items[i]);
+        } else {
+            tmrm_object_free(src->items[i]);
+        }
+    }
+    src->size = 0;
+    _set_clear(src);
+    return ret;
+}
+
+
+static tmrm_object*
+_object_clone(tmrm_object* object)
+{
+    tmrm_proxy* p;
+    tmrm_literal* lit;
+
+    switch (tmrm_object_get_type(object)) {
+        case TMRM_TYPE_PROXY:
+            if (!(p = tmrm_proxy_clone((tmrm_proxy*)object))) return NULL;
+            return tmrm_proxy_to_object(p);
+        case TMRM_TYPE_LITERAL:
+            lit = (tmrm_literal*)object;
+            if (!(lit = tmrm_literal_clone(lit))) return NULL;
+            return tmrm_literal_to_object(lit);
+        default:
+            return NULL;
+    }
+}
+
+
+/* Adds copies of the objects in src to dst */
+static int
+_set_add_copies(tmrm_path_set* dst, const tmrm_path_set* src)
+{
+    tmrm_object* copy;
+    int i;
+
+    for (i = 0; i < src->size; i++) {
+        if (!(copy = _object_clone(src->items[i])) || _set_add(dst, copy)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static int
+_strcmp_null(const tmrm_char_t* a, const tmrm_char_t* b)
+{
+    if (!a || !b) return (a != NULL) - (b != NULL);
+    return strcmp((const char*)a, (const char*)b);
+}
+
+
+/* Orders proxies by label and literals by value and datatype */
+static int
+_object_compare(const void* a, const void* b)
+{
+    const tmrm_object *x = *(tmrm_object* const*)a;
+    const tmrm_object *y = *(tmrm_object* const*)b;
+    const tmrm_literal *lx, *ly;
+    tmrm_object_type tx, ty;
+    int ret;
+
+    tx = tmrm_object_get_type(x);
+    ty = tmrm_object_get_type(y);
+    if (tx != ty) return tx < ty ? -1 : 1;
+    if (tx == TMRM_TYPE_PROXY) {
+        if (((const tmrm_proxy*)x)->label == ((const tmrm_proxy*)y)->label) {
+            return 0;
+        }
+        return ((const tmrm_proxy*)x)->label < ((const tmrm_proxy*)y)->label ?
+            -1 : 1;
+    }
+    lx = (const tmrm_literal*)x;
+    ly = (const tmrm_literal*)y;
+    ret = _strcmp_null(tmrm_literal_value(lx), tmrm_literal_value(ly));
+    if (ret) return ret;
+    return _strcmp_null(tmrm_literal_datatype(lx), tmrm_literal_datatype(ly));
+}
+
+
+static void
+_set_sort(tmrm_path_set* set)
+{
+    if (set->size > 1) {
+        qsort(set->items, set->size, sizeof(tmrm_object*), _object_compare);
+    }
+}
+
+
+/* Removes duplicates */
+static void
+_set_distinct(tmrm_path_set* set)
+{
+    int i, n = 0;
+
+    _set_sort(set);
+    for (i = 0; i < set->size; i++) {
+        if (n > 0 && _object_compare(&set->items[n - 1], &set->items[i]) == 0) {
+            tmrm_object_free(set->items[i]);
+        } else {
+            set->items[n++] = set->items[i];
+        }
+    }
+    set->size = n;
+}
+
+
+/*
+ * Moves the objects of a to out that are (intersect set) or are not
+ * (intersect not set) in b, counting duplicates, and frees the others.
+ * b is sorted but otherwise left as it is.
+ */
+static int
+_set_merge(tmrm_path_set* a, tmrm_path_set* b, int intersect,
+        tmrm_path_set* out)
+{
+    int i = 0, j = 0, cmp, keep, ret = 0;
+
+    _set_sort(a);
+    _set_sort(b);
+    while (i < a->size) {
+        cmp = j < b->size ? _object_compare(&a->items[i], &b->items[j]) : -1;
+        if (cmp > 0) {
+            j++;
+            continue;
+        }
+        keep = (cmp == 0) == (intersect != 0);
+        if (cmp == 0) j++;
+        if (keep && ret == 0) {
+            ret = _set_add(out, a->items[i]);
+        } else {
+            tmrm_object_free(a->items[i]);
+        }
+        i++;
+    }
+    a->size = 0;
+    _set_clear(a);
+    return ret;
+}
+
+
+/* ======================================================================= */
+/* Parser */
+
+static void
+_node_free(tmrm_path_node* node)
+{
+    int i;
+
+    if (!node) return;
+    for (i = 0; i < node->step.key_count; i++) {
+        tmrm_proxy_free(node->keys[i]);
+    }
+    if (node->keys) TMRM_FREE(tmrm_proxy*, node->keys);
+    if (node->step.keys) TMRM_FREE(tmrm_label, node->step.keys);
+    if (node->value) tmrm_object_free(node->value);
+    for (i = 0; i < node->child_count; i++) {
+        _node_free(node->children[i]);
+    }
+    if (node->children) TMRM_FREE(tmrm_path_node*, node->children);
+    TMRM_FREE(tmrm_path_node, node);
+}
+
+
+static tmrm_path_node*
+_node_new(tmrm_path_node_type type)
+{
+    tmrm_path_node* node;
+
+    node = (tmrm_path_node*)TMRM_CALLOC(tmrm_path_node, 1,
+            sizeof(tmrm_path_node));
+    if (node) node->type = type;
+    return node;
+}
+
+
+static int
+_node_add_child(tmrm_path_node* node, tmrm_path_node* child)
+{
+    tmrm_path_node** children;
+
+    children = (tmrm_path_node**)TMRM_REALLOC(tmrm_path_node*,
+            node->children, (node->child_count + 1) * sizeof(tmrm_path_node*));
+    if (!children) {
+        _node_free(child);
+        return 1;
+    }
+    node->children = children;
+    node->children[node->child_count++] = child;
+    return 0;
+}
+
+
+/*
+ * Sets the key of a step or filter, which takes over the proxy. With
+ * subclasses set, the subclasses of the key are added as well.
+ */
+static int
+_node_set_key(tmrm_path_node* node, tmrm_proxy* key, int subclasses)
+{
+    tmrm_list* list = NULL;
+    tmrm_object* object;
+    int size = 1;
+
+    if (subclasses) {
+        if (!(list = tmrm_proxy_subclasses(key))) {
+            tmrm_proxy_free(key);
+            return 1;
+        }
+        size = tmrm_list_size(list);
+    }
+    node->keys = (tmrm_proxy**)TMRM_CALLOC(tmrm_proxy*, size,
+            sizeof(tmrm_proxy*));
+    node->step.keys = (tmrm_label*)TMRM_CALLOC(tmrm_label, size,
+            sizeof(tmrm_label));
+    if (!node->keys || !node->step.keys) {
+        if (list) tmrm_list_free(list);
+        tmrm_proxy_free(key);
+        return 1;
+    }
+    if (!list) {
+        node->keys[0] = key;
+        node->step.keys[0] = key->label;
+        node->step.key_count = 1;
+        return 0;
+    }
+    /* The list of subclasses includes the key itself */
+    tmrm_proxy_free(key);
+    while (tmrm_list_size(list) > 0 && node->step.key_count < size) {
+        if (tmrm_list_rem_next(list, NULL, &object)) break;
+        node->keys[node->step.key_count] = tmrm_object_to_proxy(object);
+        node->step.keys[node->step.key_count] =
+            node->keys[node->step.key_count]->label;
+        node->step.key_count++;
+    }
+    tmrm_list_free(list);
+    return 0;
+}
+
+
+static void
+_parse_error(tmrm_path_parser* p, const char* message)
+{
+    TMRM_SET_ERROR(p->map->sms, TMRM_SYNTAX_ERROR,
+            "Invalid path expression at position %d: %s",
+            (int)(p->pos - p->expression), message);
+}
+
+
+static void
+_skip_space(tmrm_path_parser* p)
+{
+    while (isspace((unsigned char)*p->pos)) p->pos++;
+}
+
+
+/* Consumes token if it comes next */
+static int
+_accept(tmrm_path_parser* p, const char* token)
+{
+    size_t len = strlen(token);
+
+    _skip_space(p);
+    if (strncmp(p->pos, token, len) != 0) return 0;
+    p->pos += len;
+    return 1;
+}
+
+
+/* Reads a label and returns the proxy with this label */
+static tmrm_proxy*
+_parse_label(tmrm_path_parser* p)
+{
+    char label[INT_DIGITS + 1];
+    tmrm_proxy* proxy;
+    size_t len = 0;
+
+    _skip_space(p);
+    while (isdigit((unsigned char)p->pos[len]) && len < INT_DIGITS) len++;
+    if (len == 0) {
+        _parse_error(p, "label expected");
+        return NULL;
+    }
+    memcpy(label, p->pos, len);
+    label[len] = '\0';
+    if (!(proxy = tmrm_proxy_by_label(p->map, label))) {
+        _parse_error(p, "unknown proxy");
+        return NULL;
+    }
+    p->pos += len;
+    return proxy;
+}
+
+
+/* Reads a double-quoted string with an optional datatype */
+static tmrm_literal*
+_parse_literal(tmrm_path_parser* p)
+{
+    tmrm_literal* lit;
+    char *value, *datatype = NULL;
+    size_t len = 0;
+
+    if (!_accept(p, "\"")) {
+        _parse_error(p, "label or string expected");
+        return NULL;
+    }
+    if (!(value = (char*)TMRM_MALLOC(cstring, strlen(p->pos) + 1))) {
+        return NULL;
+    }
+    while (*p->pos && *p->pos != '"') {
+        if (*p->pos == '\\' && p->pos[1]) p->pos++;
+        value[len++] = *p->pos++;
+    }
+    value[len] = '\0';
+    if (!_accept(p, "\"")) {
+        _parse_error(p, "unterminated string");
+        TMRM_FREE(cstring, value);
+        return NULL;
+    }
+    if (_accept(p, "^^")) {
+        _skip_space(p);
+        len = 0;
+        while (p->pos[len] && !isspace((unsigned char)p->pos[len]) &&
+                p->pos[len] != ']') {
+            len++;
+        }
+        if (len == 0 || !(datatype = (char*)TMRM_MALLOC(cstring, len + 1))) {
+            if (len == 0) _parse_error(p, "datatype expected");
+            TMRM_FREE(cstring, value);
+            return NULL;
+        }
+        memcpy(datatype, p->pos, len);
+        datatype[len] = '\0';
+        p->pos += len;
+    }
+    lit = tmrm_literal_new((tmrm_char_t*)value,
+            (tmrm_char_t*)(datatype ? datatype : TMRM_XMLSCHEMA_STRING));
+    TMRM_FREE(cstring, value);
+    if (datatype) TMRM_FREE(cstring, datatype);
+    return lit;
+}
+
+
+static tmrm_path_node*
+_parse_step(tmrm_path_parser* p, tmrm_path_axis axis)
+{
+    tmrm_path_node* node;
+    tmrm_proxy* key;
+
+    if (!(node = _node_new(TMRM_PATH_NODE_STEP))) return NULL;
+    node->step.axis = axis;
+    if (axis == TMRM_PATH_AXIS_KEYS_BY_VALUE) return node;
+    if (!(key = _parse_label(p)) ||
+            _node_set_key(node, key, _accept(p, "*"))) {
+        _node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+
+static tmrm_path_node*
+_parse_filter(tmrm_path_parser* p)
+{
+    tmrm_path_node* node;
+    tmrm_proxy *key, *proxy;
+    tmrm_literal* lit;
+
+    if (!(node = _node_new(TMRM_PATH_NODE_FILTER))) return NULL;
+    if (!(key = _parse_label(p)) || _node_set_key(node, key, 0)) {
+        _node_free(node);
+        return NULL;
+    }
+    if (_accept(p, "=")) {
+        _skip_space(p);
+        if (isdigit((unsigned char)*p->pos)) {
+            if ((proxy = _parse_label(p))) {
+                node->value = tmrm_proxy_to_object(proxy);
+            }
+        } else if ((lit = _parse_literal(p))) {
+            node->value = tmrm_literal_to_object(lit);
+        }
+        if (!node->value) {
+            _node_free(node);
+            return NULL;
+        }
+    }
+    if (!_accept(p, "]")) {
+        _parse_error(p, "']' expected");
+        _node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+
+static tmrm_path_node*
+_parse_item(tmrm_path_parser* p)
+{
+    tmrm_path_node *node, *closure;
+
+    if (_accept(p, "->")) {
+        return _parse_step(p, TMRM_PATH_AXIS_VALUES_BY_KEY);
+    } else if (_accept(p, "<-")) {
+        return _parse_step(p, TMRM_PATH_AXIS_IS_VALUE_BY_KEY);
+    } else if (_accept(p, "/")) {
+        return _parse_step(p, TMRM_PATH_AXIS_KEYS_BY_VALUE);
+    } else if (_accept(p, "[")) {
+        return _parse_filter(p);
+    } else if (_accept(p, "(")) {
+        if (!(node = _parse_expression(p))) return NULL;
+        if (!_accept(p, ")")) {
+            _parse_error(p, "')' expected");
+            _node_free(node);
+            return NULL;
+        }
+        if (!_accept(p, "*")) return node;
+        if (!(closure = _node_new(TMRM_PATH_NODE_CLOSURE)) ||
+                _node_add_child(closure, node)) {
+            if (closure) _node_free(closure); else _node_free(node);
+            return NULL;
+        }
+        return closure;
+    }
+    _parse_error(p, "step expected");
+    return NULL;
+}
+
+
+static int
+_at_item(tmrm_path_parser* p)
+{
+    _skip_space(p);
+    return strncmp(p->pos, "->", 2) == 0 || strncmp(p->pos, "<-", 2) == 0 ||
+        *p->pos == '/' || *p->pos == '[' || *p->pos == '(';
+}
+
+
+static tmrm_path_node*
+_parse_sequence(tmrm_path_parser* p)
+{
+    tmrm_path_node *node, *item;
+
+    if (!(item = _parse_item(p))) return NULL;
+    if (!_at_item(p)) return item;
+
+    if (!(node = _node_new(TMRM_PATH_NODE_SEQUENCE)) ||
+            _node_add_child(node, item)) {
+        if (node) _node_free(node); else _node_free(item);
+        return NULL;
+    }
+    while (_at_item(p)) {
+        if (!(item = _parse_item(p)) || _node_add_child(node, item)) {
+            _node_free(node);
+            return NULL;
+        }
+    }
+    return node;
+}
+
+
+static tmrm_path_node*
+_parse_expression(tmrm_path_parser* p)
+{
+    tmrm_path_node *node, *left, *right;
+    tmrm_path_node_type type;
+
+    if (!(left = _parse_sequence(p))) return NULL;
+    for (;;) {
+        if (_accept(p, "++")) {
+            type = TMRM_PATH_NODE_UNION;
+        } else if (_accept(p, "==")) {
+            type = TMRM_PATH_NODE_INTERSECTION;
+        } else if (_accept(p, "--")) {
+            type = TMRM_PATH_NODE_DIFFERENCE;
+        } else {
+            return left;
+        }
+        if (!(right = _parse_sequence(p))) {
+            _node_free(left);
+            return NULL;
+        }
+        if (!(node = _node_new(type)) || _node_add_child(node, left)) {
+            if (node) _node_free(node); else _node_free(left);
+            _node_free(right);
+            return NULL;
+        }
+        if (_node_add_child(node, right)) {
+            _node_free(node);
+            return NULL;
+        }
+        left = node;
+    }
+}
+
+
+/* ======================================================================= */
+/* Planner and executor */
+
+/*
+ * Decides whether the storage evaluates the steps in nodes itself, given
+ * the size of the input.
+ */
+static int
+_plan_pushdown(tmrm_path* path, tmrm_path_node* const* nodes, int count,
+        int closure, int input_size)
+{
+    tmrm_storage_factory* factory = path->map->storage->factory;
+    long cost = 0;
+    int i, keys;
+
+    if (!factory->path) return 0;
+    for (i = 0; i < count; i++) {
+        keys = nodes[i]->step.key_count > 0 ? nodes[i]->step.key_count : 1;
+        if (nodes[i]->step.axis == TMRM_PATH_AXIS_IS_VALUE_BY_KEY &&
+                factory->is_value_by_key_many) {
+            cost += keys;
+        } else {
+            cost += (long)keys * input_size;
+        }
+    }
+    if (closure) cost *= TMRM_PATH_CLOSURE_ROUNDS;
+    return cost > 1;
+}
+
+
+/* Returns 1 if the node is a step or a sequence of steps */
+static int
+_only_steps(tmrm_path_node* node)
+{
+    int i;
+
+    if (node->type == TMRM_PATH_NODE_STEP) return 1;
+    if (node->type != TMRM_PATH_NODE_SEQUENCE) return 0;
+    for (i = 0; i < node->child_count; i++) {
+        if (node->children[i]->type != TMRM_PATH_NODE_STEP) return 0;
+    }
+    return 1;
+}
+
+
+static int
+_eval_pushdown(tmrm_path* path, tmrm_path_node* const* nodes, int count,
+        int closure, tmrm_path_set* in, tmrm_path_set* out)
+{
+    tmrm_storage* s = path->map->storage;
+    tmrm_path_step* steps;
+    int i, ret;
+
+    TMRM_DEBUG3("Storage evaluates %d steps for %d objects\n", count,
+            in->size);
+    steps = (tmrm_path_step*)TMRM_CALLOC(tmrm_path_step, count,
+            sizeof(tmrm_path_step));
+    if (!steps) return 1;
+    for (i = 0; i < count; i++) {
+        steps[i] = nodes[i]->step;
+    }
+    ret = _set_add_iterator(out, tmrm_storage_path(s, path->map,
+                in->items, in->size, steps, count, closure));
+    TMRM_FREE(tmrm_path_step, steps);
+    _set_clear(in);
+    return ret;
+}
+
+
+static int
+_eval_step(tmrm_path* path, tmrm_path_node* node, tmrm_path_set* in,
+        tmrm_path_set* out)
+{
+    tmrm_storage* s = path->map->storage;
+    tmrm_object* object;
+    int i, k, ret = 0;
+
+    if (node->step.axis == TMRM_PATH_AXIS_IS_VALUE_BY_KEY) {
+        for (k = 0; k < node->step.key_count && ret == 0; k++) {
+            ret = _set_add_iterator(out, tmrm_storage_is_value_by_key_many(s,
+                        in->items, in->size, node->keys[k]));
+        }
+        _set_clear(in);
+        return ret;
+    }
+    for (i = 0; i < in->size && ret == 0; i++) {
+        object = in->items[i];
+        if (node->step.axis == TMRM_PATH_AXIS_KEYS_BY_VALUE) {
+            if (tmrm_object_get_type(object) == TMRM_TYPE_PROXY) {
+                ret = _set_add_iterator(out, tmrm_storage_proxy_keys_by_value(
+                            s, (tmrm_proxy*)object));
+            } else if (tmrm_object_get_type(object) == TMRM_TYPE_LITERAL) {
+                ret = _set_add_iterator(out,
+                        tmrm_storage_literal_keys_by_value(s,
+                            (tmrm_literal*)object, path->map));
+            }
+            continue;
+        }
+        /* Literals have no values */
+        if (tmrm_object_get_type(object) != TMRM_TYPE_PROXY) continue;
+        for (k = 0; k < node->step.key_count && ret == 0; k++) {
+            ret = _set_add_iterator(out, tmrm_storage_proxy_values_by_key(s,
+                        (tmrm_proxy*)object, node->keys[k]));
+        }
+    }
+    _set_clear(in);
+    return ret;
+}
+
+
+static int
+_eval_filter(tmrm_path* path, tmrm_path_node* node, tmrm_path_set* in,
+        tmrm_path_set* out)
+{
+    tmrm_storage* s = path->map->storage;
+    tmrm_path_set matches = { NULL, 0, 0 };
+    tmrm_iterator* it;
+    int i, keep, ret = 0;
+
+    if (node->value) {
+        /* The proxies with this property, in a single request */
+        ret = _set_add_iterator(&matches, tmrm_storage_is_value_by_key_many(
+                    s, &node->value, 1, node->keys[0]));
+        _set_sort(&matches);
+    }
+    for (i = 0; i < in->size; i++) {
+        keep = 0;
+        if (ret == 0 && tmrm_object_get_type(in->items[i]) == TMRM_TYPE_PROXY) {
+            if (node->value) {
+                keep = bsearch(&in->items[i], matches.items, matches.size,
+                        sizeof(tmrm_object*), _object_compare) != NULL;
+            } else if ((it = tmrm_storage_proxy_values_by_key(s,
+                            (tmrm_proxy*)in->items[i], node->keys[0]))) {
+                keep = !tmrm_iterator_end(it);
+                tmrm_iterator_free(it);
+            } else {
+                ret = 1;
+            }
+        }
+        if (keep && ret == 0) {
+            ret = _set_add(out, in->items[i]);
+        } else {
+            tmrm_object_free(in->items[i]);
+        }
+    }
+    in->size = 0;
+    _set_clear(in);
+    _set_clear(&matches);
+    return ret;
+}
+
+
+static int
+_eval_closure(tmrm_path* path, tmrm_path_node* node, tmrm_path_set* in,
+        tmrm_path_set* out)
+{
+    tmrm_path_set seen = { NULL, 0, 0 };
+    tmrm_path_set frontier = { NULL, 0, 0 };
+    tmrm_path_set next = { NULL, 0, 0 };
+    int ret;
+
+    _set_distinct(in);
+    _set_move(&frontier, in);
+    ret = _set_add_copies(&seen, &frontier);
+    while (ret == 0 && frontier.size > 0) {
+        ret = _eval(path, node->children[0], &frontier, &next);
+        if (ret) break;
+        _set_distinct(&next);
+        /* Only objects that were not seen before go into the next round */
+        ret = _set_merge(&next, &seen, 0, &frontier);
+        if (ret == 0) ret = _set_add_copies(&seen, &frontier);
+    }
+    _set_clear(&frontier);
+    _set_clear(&next);
+    if (ret == 0) ret = _set_move(out, &seen);
+    _set_clear(&seen);
+    return ret;
+}
+
+
+static int
+_eval_sequence(tmrm_path* path, tmrm_path_node* node, tmrm_path_set* in,
+        tmrm_path_set* out)
+{
+    tmrm_path_set current = { NULL, 0, 0 };
+    tmrm_path_set next = { NULL, 0, 0 };
+    tmrm_path_node* child;
+    int i = 0, j, ret = 0;
+
+    _set_move(&current, in);
+    while (i < node->child_count && ret == 0) {
+        child = node->children[i];
+        j = i;
+        while (j < node->child_count &&
+                node->children[j]->type == TMRM_PATH_NODE_STEP) {
+            j++;
+        }
+        /* The run of steps is planned again after each step, as the
+           number of objects changes */
+        if (j - i > 1 && current.size > 0 &&
+                _plan_pushdown(path, &node->children[i], j - i, 0,
+                    current.size)) {
+            ret = _eval_pushdown(path, &node->children[i], j - i, 0,
+                    &current, &next);
+            i = j;
+        } else {
+            ret = _eval(path, child, &current, &next);
+            i++;
+        }
+        if (ret == 0) ret = _set_move(&current, &next);
+    }
+    _set_clear(&next);
+    if (ret == 0) ret = _set_move(out, &current);
+    _set_clear(&current);
+    return ret;
+}
+
+
+/*
+ * Evaluates node for the objects in the input. The results are added to
+ * out, and the input is used up.
+ */
+static int
+_eval(tmrm_path* path, tmrm_path_node* node, tmrm_path_set* in,
+        tmrm_path_set* out)
+{
+    tmrm_path_set copy = { NULL, 0, 0 };
+    tmrm_path_set left = { NULL, 0, 0 };
+    tmrm_path_set right = { NULL, 0, 0 };
+    tmrm_path_node* child;
+    int ret;
+
+    if (in->size == 0) return 0;
+
+    switch (node->type) {
+        case TMRM_PATH_NODE_STEP:
+            if (_plan_pushdown(path, &node, 1, 0, in->size)) {
+                return _eval_pushdown(path, &node, 1, 0, in, out);
+            }
+            return _eval_step(path, node, in, out);
+        case TMRM_PATH_NODE_FILTER:
+            return _eval_filter(path, node, in, out);
+        case TMRM_PATH_NODE_SEQUENCE:
+            return _eval_sequence(path, node, in, out);
+        case TMRM_PATH_NODE_CLOSURE:
+            child = node->children[0];
+            if (_only_steps(child)) {
+                if (child->type == TMRM_PATH_NODE_STEP &&
+                        _plan_pushdown(path, &child, 1, 1, in->size)) {
+                    return _eval_pushdown(path, &child, 1, 1, in, out);
+                }
+                if (child->type == TMRM_PATH_NODE_SEQUENCE &&
+                        _plan_pushdown(path, child->children,
+                            child->child_count, 1, in->size)) {
+                    return _eval_pushdown(path, child->children,
+                            child->child_count, 1, in, out);
+                }
+            }
+            return _eval_closure(path, node, in, out);
+        default:
+            break;
+    }
+
+    /* Set operators: both operands start from the same input */
+    ret = _set_add_copies(&copy, in);
+    if (ret == 0) ret = _eval(path, node->children[0], in, &left);
+    if (ret == 0) ret = _eval(path, node->children[1], &copy, &right);
+    if (ret == 0) {
+        switch (node->type) {
+            case TMRM_PATH_NODE_UNION:
+                if ((ret = _set_move(out, &left)) == 0) {
+                    ret = _set_move(out, &right);
+                }
+                break;
+            case TMRM_PATH_NODE_INTERSECTION:
+                ret = _set_merge(&left, &right, 1, out);
+                break;
+            default:
+                ret = _set_merge(&left, &right, 0, out);
+        }
+    }
+    _set_clear(in);
+    _set_clear(&copy);
+    _set_clear(&left);
+    _set_clear(&right);
+    return ret;
+}
+
+
+/* Evaluates the path for the objects of start and returns a new multiset */
+static tmrm_multiset*
+_evaluate(tmrm_path* path, tmrm_multiset* start)
+{
+    tmrm_path_set in = { NULL, 0, 0 };
+    tmrm_path_set out = { NULL, 0, 0 };
+    tmrm_multiset* result;
+    tmrm_list* list;
+    tmrm_list_elmt* node;
+    tmrm_object* copy;
+    int i, ret = 0;
+
+    if (!(list = tmrm_multiset_as_list(start))) return NULL;
+    for (node = tmrm_list_head(list); node && ret == 0;
+            node = tmrm_list_next(node)) {
+        if (!(copy = _object_clone(tmrm_list_data(node)))) continue;
+        ret = _set_add(&in, copy);
+    }
+    tmrm_list_free(list);
+
+    if (ret == 0) ret = _eval(path, path->root, &in, &out);
+    _set_clear(&in);
+    if (ret || !(result = tmrm_multiset_new_result(path->map))) {
+        _set_clear(&out);
+        return NULL;
+    }
+    for (i = 0; i < out.size; i++) {
+        if (tmrm_multiset_insert(result, out.items[i])) {
+            tmrm_object_free(out.items[i]);
+        }
+    }
+    out.size = 0;
+    _set_clear(&out);
+    return result;
+}
+
+
+/* ======================================================================= */
+/* Public functions */
+
+/**
+ * Constructor: Compiles a path expression for the subject map map. The
+ * proxies that the expression refers to must exist, and the subclasses
+ * of "key *" are looked up here.
+ *
+ * @see The grammar at the top of tmrm_path.c
+ * @returns NULL if the expression is invalid or an error occurs.
+ */
+/*@null@*/ tmrm_path*
+tmrm_path_new(tmrm_subject_map* map, const char* expression)
+{
+    tmrm_path_parser parser;
+    tmrm_path* path;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, NULL);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(expression, cstring, NULL);
+
+    if (!(path = (tmrm_path*)TMRM_CALLOC(tmrm_path, 1, sizeof(tmrm_path)))) {
+        return NULL;
+    }
+    path->map = map;
+    parser.map = map;
+    parser.expression = expression;
+    parser.pos = expression;
+    path->root = _parse_expression(&parser);
+    if (path->root && (_skip_space(&parser), *parser.pos != '\0')) {
+        _parse_error(&parser, "unexpected input");
+        _node_free(path->root);
+        path->root = NULL;
+    }
+    if (!path->root) {
+        TMRM_FREE(tmrm_path, path);
+        return NULL;
+    }
+    return path;
+}
+
+
+/**
+ * Evaluates the path for the proxies and literals in start. Sequences of
+ * steps are handed to the storage as a whole if it supports this and the
+ * planner expects it to be cheaper than step by step evaluation.
+ *
+ * The objects in the returned multiset are new and belong to the caller.
+ *
+ * @returns NULL on failure.
+ */
+/*@null@*/ tmrm_multiset*
+tmrm_path_evaluate(tmrm_path* path, tmrm_multiset* start)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(path, tmrm_path, NULL);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(start, tmrm_multiset, NULL);
+
+    return _evaluate(path, start);
+}
+
+
+/* Destructor */
+void
+tmrm_path_free(tmrm_path* path)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN(path, tmrm_path);
+
+    _node_free(path->root);
+    TMRM_FREE(tmrm_path, path);
+}
+
+
+/**
+ * All proxies in which the proxies are the value for a particular key or
+ * one of its subclasses.
+ *
+ * Notation: "PROXY <- KEY *"
+ *
+ * PHP-prototype: TMRM_SubjectMap::isValueByKeyWithSubtyping()
+ */
+/*@null@*/ tmrm_multiset*
+tmrm_subject_map_is_value_by_key_star(tmrm_multiset* proxies, tmrm_proxy* key)
+{
+    tmrm_path path;
+    tmrm_proxy* copy;
+    tmrm_multiset* result;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(proxies, tmrm_multiset, NULL);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(key, tmrm_proxy, NULL);
+
+    path.map = key->subject_map;
+    if (!(path.root = _node_new(TMRM_PATH_NODE_STEP))) return NULL;
+    path.root->step.axis = TMRM_PATH_AXIS_IS_VALUE_BY_KEY;
+    if (!(copy = tmrm_proxy_clone(key)) || _node_set_key(path.root, copy, 1)) {
+        _node_free(path.root);
+        return NULL;
+    }
+    result = _evaluate(&path, proxies);
+    _node_free(path.root);
+    return result;
+}
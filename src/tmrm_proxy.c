@@ -43,6 +43,10 @@
 #include <yaml.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 
 #include <libtmrm.h>
 #include <tmrm_internal.h>
@@ -50,18 +54,6 @@
 #include <tmrm_hash.h>
 
 
-/* TODO Move this to one of the header files */
-struct tmrm_streaming_handler_s {
-    int (*subject_map_start)(void *context, tmrm_char_t *name);
-    int (*subject_map_end)(void *context);
-    int (*proxy_start)(void *context, tmrm_char_t *label);
-    int (*property)(void *context, tmrm_char_t *key, tmrm_char_t *value);
-    int (*property_literal)(void *context, tmrm_char_t *key, tmrm_char_t *value, tmrm_char_t *datatype);
-    int (*proxy_end)(void *context);
-};
-
-typedef struct tmrm_streaming_handler_s tmrm_streaming_handler;
-
 struct tmrm_yaml_export_context_s {
     FILE *fh;
     yaml_emitter_t emitter;
@@ -74,20 +66,119 @@ struct tmrm_yaml_import_context_s {
 };
 typedef struct tmrm_yaml_import_context_s tmrm_yaml_import_context;
 
-static int tmrm_subject_map_export_streamer(tmrm_subject_map *map,
-    tmrm_streaming_handler *h, void *handler_context);
+/* Maps the proxy labels of an imported document to the proxies created for
+   them. The import owns the proxies until it is finished. */
+struct tmrm_import_label_s {
+    char *name;
+    unsigned long hash;
+    tmrm_proxy *proxy;
+};
+typedef struct tmrm_import_label_s tmrm_import_label;
+
+struct tmrm_import_labels_s {
+    tmrm_import_label *slots;
+    size_t size;
+    size_t count;
+};
+typedef struct tmrm_import_labels_s tmrm_import_labels;
+
+/* Tuples produced by the parse stage of the YAML import. A property is
+   sent as its KEY followed by one VALUE_* tuple per value. */
+typedef enum {
+    TMRM_IMPORT_PROXY,
+    TMRM_IMPORT_KEY,
+    TMRM_IMPORT_VALUE_PROXY,
+    TMRM_IMPORT_VALUE_LITERAL
+} tmrm_import_tuple_type;
+
+typedef int (*tmrm_import_emit)(void *data, tmrm_import_tuple_type type,
+    const char *value);
+
+/* State of the resolve and write stages of the YAML import */
+struct tmrm_import_writer_s {
+    tmrm_subject_map *map;
+    tmrm_import_labels labels;
+    /* Both belong to labels */
+    tmrm_proxy *proxy;
+    tmrm_proxy *key_proxy;
+};
+typedef struct tmrm_import_writer_s tmrm_import_writer;
+
+#ifdef HAVE_PTHREAD
+/* Number of tuples handed from the parser thread to the writer at once */
+#define TMRM_IMPORT_BATCH_SIZE 512
+/* Number of filled batches the parser thread may run ahead */
+#define TMRM_IMPORT_QUEUE_SIZE 8
+
+struct tmrm_import_batch_s {
+    struct tmrm_import_batch_s *next;
+    size_t count;
+    unsigned char types[TMRM_IMPORT_BATCH_SIZE];
+    /* Offsets of the tuple values in strings */
+    size_t offsets[TMRM_IMPORT_BATCH_SIZE];
+    char *strings;
+    size_t strings_len;
+    size_t strings_size;
+};
+typedef struct tmrm_import_batch_s tmrm_import_batch;
+
+struct tmrm_import_pipeline_s {
+    yaml_parser_t *parser;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    /* Ring of filled batches */
+    tmrm_import_batch *queue[TMRM_IMPORT_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    /* Consumed batches, ready to be refilled */
+    tmrm_import_batch *spare;
+    /* The batch the parser thread is filling */
+    tmrm_import_batch *current;
+    int done;
+    int error;
+    int aborted;
+};
+typedef struct tmrm_import_pipeline_s tmrm_import_pipeline;
+#endif
+
 static int tmrm_subject_map_import_streamer(tmrm_subject_map *map,
     tmrm_streaming_handler *h, void *handler_context);
 
-static int tmrm_yaml_export_subject_map_start(void *context, tmrm_char_t *name);
+static int tmrm_yaml_export_subject_map_start(void *context, const tmrm_char_t *name);
 static int tmrm_yaml_export_subject_map_end(void *context);
-static int tmrm_yaml_export_proxy_start(void *context, tmrm_char_t *label);
+static int tmrm_yaml_export_proxy_start(void *context, tmrm_label label);
 static int tmrm_yaml_export_proxy_end(void *context);
-static int tmrm_yaml_export_property(void *context, tmrm_char_t *key, tmrm_char_t *value);
-static int tmrm_yaml_export_property_literal(void *context, tmrm_char_t *key, tmrm_char_t *value, tmrm_char_t *datatype);
+static int tmrm_yaml_export_property(void *context, tmrm_label key, tmrm_label value);
+static int tmrm_yaml_export_property_literal(void *context, tmrm_label key, const tmrm_char_t *value, const tmrm_char_t *datatype);
+
+static tmrm_proxy* tmrm_import_labels_proxy(tmrm_subject_map *map,
+    tmrm_import_labels *labels, const char *name);
+static void tmrm_import_labels_free(tmrm_import_labels *labels);
+static int tmrm_import_parse(yaml_parser_t *parser, tmrm_import_emit emit,
+    void *data);
+static int tmrm_import_write(void *data, tmrm_import_tuple_type type,
+    const char *value);
+#ifdef HAVE_PTHREAD
+static int tmrm_subject_map_import_pipeline(tmrm_subject_map *map,
+    tmrm_yaml_import_context *c);
+#endif
 
 /* /testing */
 
+/* Reads the iterator of a storage query into a multiset and frees it */
+static tmrm_multiset*
+_multiset_from_iterator(tmrm_subject_map *map, tmrm_iterator *it)
+{
+    tmrm_multiset *set;
+
+    if (it == NULL) return NULL;
+    set = tmrm_multiset_new_from_iterator(map, it);
+    tmrm_iterator_free(it);
+    return set;
+}
+
+
 /**
  * Creates a new proxy object. The proxy is written to the backend immediately.
  *
@@ -118,7 +209,7 @@ tmrm_proxy_clone(tmrm_proxy* p) {
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(p, tmrm_proxy, NULL);
     
     /* FIXME: call the storage backend to clone the internal structure */
-    copy = (tmrm_proxy*)TMRM_CALLOC(tmrm_proxy, 1, sizeof(tmrm_proxy));
+    copy = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
     if (!copy) {
         return NULL;
     }
@@ -143,7 +234,7 @@ int tmrm_proxy_update(tmrm_proxy *p)
 
 /**
  * Returns the label of the proxy p. The caller is responsible to free the
- * returned string with free()
+ * returned string with tmrm_free()
  *
  * PHP-prototype: TMRM_Proxy::getLabel()
  *
@@ -171,7 +262,7 @@ tmrm_proxy_keys(tmrm_proxy *p)
 {
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(p, tmrm_proxy,
             NULL);
-    return tmrm_multiset_new_from_iterator(p->subject_map, 
+    return _multiset_from_iterator(p->subject_map,
             tmrm_storage_proxy_keys(p->subject_map->storage, p));
 }
 
@@ -194,7 +285,7 @@ tmrm_proxy_values_by_key(tmrm_proxy* p, tmrm_proxy* key)
 {
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(p, tmrm_proxy, NULL);
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(key, tmrm_proxy, NULL);
-    return tmrm_multiset_new_from_iterator(p->subject_map, 
+    return _multiset_from_iterator(p->subject_map,
             tmrm_storage_proxy_values_by_key(p->subject_map->storage, p, key));
 }
 
@@ -240,7 +331,7 @@ tmrm_proxy_values_by_key(tmrm_proxy* p, tmrm_proxy* key)
 /*@null@*/ tmrm_multiset*
 tmrm_proxy_keys_by_value(tmrm_proxy* p) {
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(p, tmrm_proxy, NULL);
-    return tmrm_multiset_new_from_iterator(p->subject_map, 
+    return _multiset_from_iterator(p->subject_map,
             tmrm_storage_proxy_keys_by_value(p->subject_map->storage, p));
 }
 
@@ -248,7 +339,9 @@ tmrm_proxy_keys_by_value(tmrm_proxy* p) {
 /**
  * All proxies in which the proxies are the value for a particular key.
  * Is is the generalized version of the function. See
- * tmrm_proxy_is_value_by_key() for details.
+ * tmrm_proxy_is_value_by_key() for details. All proxies and literals
+ * are passed to the storage at once, so storages that support it need
+ * only a single request.
  *
  * Notation: "PROXY <- KEY"
  *
@@ -256,42 +349,39 @@ tmrm_proxy_keys_by_value(tmrm_proxy* p) {
  */
 /*@null@*/ tmrm_multiset*
 tmrm_subject_map_is_value_by_key(tmrm_multiset* proxies, tmrm_proxy* key) {
-    void *object;
     tmrm_list *list;
     tmrm_list_elmt *node;
     tmrm_multiset *set;
-    tmrm_multiset *subset;
-    tmrm_object_type type;
+    tmrm_object **values;
+    tmrm_iterator *it;
+    int count = 0;
     
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(proxies, tmrm_iterator, NULL);
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(key, tmrm_proxy, NULL);
 
-    set = tmrm_multiset_new(key->subject_map);
-    if (set == NULL) return NULL;
+    if (tmrm_multiset_size(proxies) == 0) {
+        return tmrm_multiset_new_result(key->subject_map);
+    }
+    values = (tmrm_object**)TMRM_CALLOC(tmrm_object,
+            tmrm_multiset_size(proxies), sizeof(tmrm_object*));
+    if (values == NULL) return NULL;
 
     list = tmrm_multiset_as_list(proxies);
     node = tmrm_list_head(list);
     while (node != NULL) {
-        object = (tmrm_object*)tmrm_list_data(node);
-        subset = NULL;
-        type = tmrm_object_get_type((tmrm_object*)object);
-        switch (type) {
-            case TMRM_TYPE_PROXY:
-                subset = tmrm_proxy_is_value_by_key((tmrm_proxy*)object, key);
-                break;
-            case TMRM_TYPE_LITERAL:
-                subset = tmrm_literal_is_value_by_key((tmrm_literal*)object, key);
-                break;
-            default: /* */ 
-                TMRM_DEBUG2("Unknown object type %d\n", (int)type);
-        }
-        if (subset != NULL) {
-            tmrm_multiset_add(set, subset);
-            tmrm_multiset_free(subset);
-        }
+        values[count++] = (tmrm_object*)tmrm_list_data(node);
         node = tmrm_list_next(node);
     }
     tmrm_list_free(list);
+
+    set = NULL;
+    it = tmrm_storage_is_value_by_key_many(key->subject_map->storage,
+            values, count, key);
+    if (it != NULL) {
+        set = tmrm_multiset_new_from_iterator(key->subject_map, it);
+        tmrm_iterator_free(it);
+    }
+    TMRM_FREE(tmrm_object**, values);
     return set;
 }
 
@@ -310,7 +400,7 @@ tmrm_proxy_is_value_by_key(tmrm_proxy* p, tmrm_proxy* key) {
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(p, tmrm_proxy, NULL);
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(key, tmrm_proxy, NULL);
 
-    return tmrm_multiset_new_from_iterator(p->subject_map, 
+    return _multiset_from_iterator(p->subject_map,
             tmrm_storage_proxy_is_value_by_key(p->subject_map->storage, p, key));
 }
 
@@ -327,7 +417,7 @@ tmrm_literal_is_value_by_key(tmrm_literal* lit, tmrm_proxy* key) {
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(lit, tmrm_literal, NULL);
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(key, tmrm_proxy, NULL);
 
-    return tmrm_multiset_new_from_iterator(key->subject_map,
+    return _multiset_from_iterator(key->subject_map,
         tmrm_storage_literal_is_value_by_key(key->subject_map->storage, lit, key));
 }
 
@@ -353,7 +443,7 @@ tmrm_literal_is_value_by_key(tmrm_literal* lit, tmrm_proxy* key) {
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(lit, tmrm_literal, NULL);
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, NULL);
 
-    return tmrm_multiset_new_from_iterator(map,
+    return _multiset_from_iterator(map,
             tmrm_storage_literal_keys_by_value(map->storage, lit, map));
 }
 
@@ -643,7 +733,7 @@ tmrm_proxy_free(/*@only@*/ tmrm_proxy* p)
 
     /* TODO: Reference counting when the copy contructor has been implemented */
     /* FIXME: Free the proxy structure of the storage module */
-    TMRM_FREE(tmrm_proxy, p);
+    TMRM_POOL_FREE(tmrm_proxy, TMRM_POOL_PROXY, p);
 }
 
 
@@ -783,7 +873,7 @@ tmrm_subject_map_proxies(tmrm_subject_map *map)
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map,
             NULL);
 
-    return tmrm_multiset_new_from_iterator(map, 
+    return _multiset_from_iterator(map,
             tmrm_storage_proxies(map->storage, map));
 }
 
@@ -801,8 +891,58 @@ tmrm_subject_map_iterator(tmrm_subject_map *map) {
 }
 
 
+/**
+ * Returns an iterator over all proxies that have all the given properties.
+ * Each element of properties is a tmrm_tuple <key, value> where key is a
+ * proxy and value a proxy or literal. The proxies are returned in label
+ * order, each one once. An empty list of properties matches no proxy.
+ *
+ * PHP-prototype: TMRM_SubjectMap::getProxiesByProperties()
+ *
+ * @returns NULL on error.
+ */
+tmrm_iterator*
+tmrm_proxies_by_properties(tmrm_subject_map* map, tmrm_list* properties)
+{
+    tmrm_list_elmt *node;
+    tmrm_tuple *t;
+    tmrm_proxy **keys;
+    tmrm_object **values;
+    tmrm_iterator *it = NULL;
+    int count = 0;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, NULL);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(properties, tmrm_list, NULL);
+
+    keys = (tmrm_proxy**)TMRM_CALLOC(tmrm_proxy*,
+            tmrm_list_size(properties) + 1, sizeof(tmrm_proxy*));
+    values = (tmrm_object**)TMRM_CALLOC(tmrm_object*,
+            tmrm_list_size(properties) + 1, sizeof(tmrm_object*));
+    if (keys == NULL || values == NULL) goto out;
+
+    for (node = tmrm_list_head(properties); node != NULL;
+            node = tmrm_list_next(node)) {
+        t = tmrm_object_to_tuple(tmrm_list_data(node));
+        if (t == NULL || tmrm_tuple_size(t) != 2 ||
+                !tmrm_object_is_proxy(tmrm_tuple_get_at(t, 0))) {
+            TMRM_LOG(TMRM_LOG_ERROR,
+                    "Properties must be tuples <key, value>");
+            goto out;
+        }
+        keys[count] = (tmrm_proxy*)tmrm_tuple_get_at(t, 0);
+        values[count++] = tmrm_tuple_get_at(t, 1);
+    }
+    it = tmrm_storage_proxies_by_properties(map->storage, map, keys, values,
+            count);
+out:
+    if (keys) TMRM_FREE(tmrm_proxy**, keys);
+    if (values) TMRM_FREE(tmrm_object**, values);
+    return it;
+}
+
+
 static int
-tmrm_yaml_export_subject_map_start(void *context, tmrm_char_t *name) {
+tmrm_yaml_export_subject_map_start(void *context, const tmrm_char_t *name) {
     tmrm_yaml_export_context *c;
     yaml_event_t event;
     yaml_version_directive_t version;
@@ -833,6 +973,7 @@ tmrm_yaml_export_subject_map_start(void *context, tmrm_char_t *name) {
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
     yaml_mapping_start_event_initialize(&event, NULL, NULL, 0, YAML_BLOCK_MAPPING_STYLE);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
+    return 0;
 }
 
 static int
@@ -849,21 +990,25 @@ tmrm_yaml_export_subject_map_end(void *context) {
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
     yaml_stream_end_event_initialize(&event);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
+    return 0;
 }
 
 static int
-tmrm_yaml_export_proxy_start(void *context, tmrm_char_t *label) {
+tmrm_yaml_export_proxy_start(void *context, tmrm_label label) {
     tmrm_yaml_export_context *c;
     yaml_event_t event;
+    char buf[INT_DIGITS + 1];
 
     c = (tmrm_yaml_export_context*)context;
+    (void)snprintf(buf, sizeof(buf), "%d", (int)label);
     yaml_scalar_event_initialize(&event,
             NULL, NULL,
-            (yaml_char_t*)label, -1,
+            (yaml_char_t*)buf, -1,
             1, 1, YAML_PLAIN_SCALAR_STYLE);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
     yaml_mapping_start_event_initialize(&event, NULL, NULL, 0, YAML_BLOCK_MAPPING_STYLE);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
+    return 0;
 }
 
 static int
@@ -875,38 +1020,45 @@ tmrm_yaml_export_proxy_end(void *context) {
 
     yaml_mapping_end_event_initialize(&event);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
+    return 0;
 }
 
 static int
-tmrm_yaml_export_property(void *context, tmrm_char_t *key, tmrm_char_t *value) {
+tmrm_yaml_export_property(void *context, tmrm_label key, tmrm_label value) {
     tmrm_yaml_export_context *c;
     yaml_event_t event;
+    char buf[INT_DIGITS + 1];
 
     c = (tmrm_yaml_export_context*)context;
 
+    (void)snprintf(buf, sizeof(buf), "%d", (int)key);
     yaml_scalar_event_initialize(&event,
             NULL, NULL,
-            (yaml_char_t*)key, -1,
+            (yaml_char_t*)buf, -1,
             1, 1, YAML_ANY_SCALAR_STYLE);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
+    (void)snprintf(buf, sizeof(buf), "%d", (int)value);
     yaml_scalar_event_initialize(&event,
             NULL, (yaml_char_t*)"!proxy",
-            (yaml_char_t*)value, -1,
+            (yaml_char_t*)buf, -1,
             0, 0, YAML_ANY_SCALAR_STYLE);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
+    return 0;
 }
 
 static int
-tmrm_yaml_export_property_literal(void *context, tmrm_char_t *key,
-    tmrm_char_t *value, tmrm_char_t *datatype) {
+tmrm_yaml_export_property_literal(void *context, tmrm_label key,
+    const tmrm_char_t *value, const tmrm_char_t *datatype) {
     tmrm_yaml_export_context *c;
     yaml_event_t event;
+    char buf[INT_DIGITS + 1];
 
     c = (tmrm_yaml_export_context*)context;
 
+    (void)snprintf(buf, sizeof(buf), "%d", (int)key);
     yaml_scalar_event_initialize(&event,
             NULL, NULL,
-            (yaml_char_t*)key, -1,
+            (yaml_char_t*)buf, -1,
             1, 1, YAML_ANY_SCALAR_STYLE);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
 /*
@@ -938,6 +1090,7 @@ tmrm_yaml_export_property_literal(void *context, tmrm_char_t *key,
     yaml_mapping_end_event_initialize(&event);
     if (!yaml_emitter_emit(&c->emitter, &event)) return -1;
 */
+    return 0;
 }
 
 /**
@@ -961,111 +1114,122 @@ tmrm_subject_map_export_to_yaml(tmrm_subject_map *map, FILE *fh) {
     handler.property_literal = tmrm_yaml_export_property_literal;
     handler.proxy_end = tmrm_yaml_export_proxy_end;
     res = tmrm_subject_map_export_streamer(map, &handler, &context);
+    if (res == 0 && !yaml_emitter_flush(&context.emitter)) res = -1;
 
     yaml_emitter_delete(&context.emitter);
     return res;
 }
 
-static int tmrm_subject_map_export_streamer(tmrm_subject_map *map,
-    tmrm_streaming_handler *h, void *handler_context) {
-    tmrm_proxy *p, *proxy_res, *key;
-    tmrm_literal *lit;
-    tmrm_iterator *it, *proxy_it;
-    tmrm_object *obj = NULL;
-    tmrm_object_type object_type;
 
-    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, -1);
-    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(h, tmrm_streaming_handler, -1);
+/* Adapts the proxy scan of the storage to a streaming handler */
+struct tmrm_export_scan_s {
+    const tmrm_streaming_handler *h;
+    void *context;
+    int in_proxy;
+};
+typedef struct tmrm_export_scan_s tmrm_export_scan;
 
-    if (h->subject_map_start) h->subject_map_start(handler_context, (unsigned char*)tmrm_subject_map_name(map));
-
-    it = tmrm_subject_map_iterator(map);
-    if (!it) return -1;
-
-    while (!tmrm_iterator_end(it)) {
-        obj = tmrm_iterator_get_value(it);
-        if (tmrm_object_get_type(obj) != TMRM_TYPE_PROXY) goto error;
-        /* FIXME potential memory leak! define how tmrm_object_to_proxy handles
-           memory allocation */
-        p = tmrm_object_to_proxy(obj);
-        if (!p) goto error;
-        if (h->proxy_start) h->proxy_start(handler_context, (unsigned char*)tmrm_proxy_label(p));
-
-        /* => Iterator over properties */
-        /* Try to list all properties of a proxy */
-        proxy_it = tmrm_proxy_get_properties(p);
-        if (!proxy_it) goto error;
-
-        while(!tmrm_iterator_end(proxy_it)) {
-            /* Get the key of the property: */
-            if (!(obj = tmrm_iterator_get_key(proxy_it))) goto error_proxy_it;
-            if ((object_type = tmrm_object_get_type(obj)) != TMRM_TYPE_PROXY) {
-                tmrm_iterator_free(proxy_it);
-                tmrm_iterator_free(it);
-                /* FIXME: How can we free value? */
-                return -1;
-            }
-            key = tmrm_object_to_proxy(obj);
+static int
+tmrm_export_scan_proxy(void *data, tmrm_label label)
+{
+    tmrm_export_scan *e = (tmrm_export_scan*)data;
 
-            if (!(obj = tmrm_iterator_get_value(proxy_it))) {
-                tmrm_proxy_free(key);
-                goto error_proxy_it;
-            }
-            object_type = tmrm_object_get_type(obj);
-            if (object_type != TMRM_TYPE_PROXY && object_type != TMRM_TYPE_LITERAL) {
-                tmrm_proxy_free(key);
-                goto error_proxy_it;
-            }
-            if (object_type == TMRM_TYPE_PROXY) {
-                proxy_res = tmrm_object_to_proxy(obj);
-                if (h->property)
-                    h->property(handler_context, (unsigned char*)tmrm_proxy_label(key), (unsigned char*)tmrm_proxy_label(proxy_res)); 
-                tmrm_proxy_free(proxy_res);
-            } else {
-                lit = tmrm_object_to_literal(obj);
-                if (h->property_literal)
-                    h->property_literal(handler_context, (unsigned char*)tmrm_proxy_label(key),
-                            (unsigned char*)tmrm_literal_value(lit), (unsigned char*)tmrm_literal_datatype(lit));
-                tmrm_literal_free(lit);
-            }
-            tmrm_proxy_free(key);
+    if (e->in_proxy && e->h->proxy_end && e->h->proxy_end(e->context)) {
+        return -1;
+    }
+    e->in_proxy = 1;
+    if (e->h->proxy_start) return e->h->proxy_start(e->context, label);
+    return 0;
+}
 
-            if (tmrm_iterator_next(proxy_it)) goto error_proxy_it;
-        }
-        if (h->proxy_end) h->proxy_end(handler_context);
+static int
+tmrm_export_scan_property(void *data, tmrm_label proxy, tmrm_label key,
+    tmrm_label value)
+{
+    tmrm_export_scan *e = (tmrm_export_scan*)data;
+
+    if (e->h->property) return e->h->property(e->context, key, value);
+    return 0;
+}
+
+static int
+tmrm_export_scan_property_literal(void *data, tmrm_label proxy,
+    tmrm_label key, const tmrm_char_t *value, const tmrm_char_t *datatype)
+{
+    tmrm_export_scan *e = (tmrm_export_scan*)data;
 
-        tmrm_iterator_free(proxy_it);
-        if (tmrm_iterator_next(it)) goto error;
+    if (e->h->property_literal) {
+        return e->h->property_literal(e->context, key, value, datatype);
     }
-    tmrm_iterator_free(it);
-    if (h->subject_map_end) h->subject_map_end(handler_context);
     return 0;
+}
 
-error_proxy_it:
-    tmrm_iterator_free(proxy_it);
-error:
-    if (obj) tmrm_object_free(obj);
-    tmrm_iterator_free(it);
-    return -1;
+static const tmrm_property_visitor tmrm_export_scan_visitor = {
+    tmrm_export_scan_proxy,
+    tmrm_export_scan_property,
+    tmrm_export_scan_property_literal
+};
+
+/**
+ * Walks through all proxies and properties of the subject map and passes
+ * them to the callbacks of the streaming handler h. The walk is a single
+ * scan of the storage (see tmrm_storage_scan_properties()); no labels or
+ * literals are allocated for the handler.
+ *
+ * @returns -1 on failure
+ */
+int
+tmrm_subject_map_export_streamer(tmrm_subject_map *map,
+    const tmrm_streaming_handler *h, void *handler_context) {
+    tmrm_export_scan e;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, -1);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(h, tmrm_streaming_handler, -1);
+
+    if (h->subject_map_start && h->subject_map_start(handler_context,
+                (const tmrm_char_t*)tmrm_subject_map_name(map))) {
+        return -1;
+    }
+
+    e.h = h;
+    e.context = handler_context;
+    e.in_proxy = 0;
+    if (tmrm_storage_scan_properties(map->storage, map,
+                &tmrm_export_scan_visitor, &e)) {
+        return -1;
+    }
+    if (e.in_proxy && h->proxy_end && h->proxy_end(handler_context)) {
+        return -1;
+    }
+    if (h->subject_map_end && h->subject_map_end(handler_context)) return -1;
+    return 0;
 }
 
 
 /**
- * Parses a subject map from a YAML-file.
+ * Parses a subject map from a YAML-file. When libtmrm is built with POSIX
+ * threads, the file is parsed in a separate thread while the caller's
+ * thread resolves the labels and writes to the storage.
  *
  * @returns -1 on failure
  */
 int
 tmrm_subject_map_import_from_yaml(tmrm_subject_map *map, FILE *fh)
 {
+#ifndef HAVE_PTHREAD
     tmrm_streaming_handler handler;
+#endif
     tmrm_yaml_import_context context;
     int res;
 
     context.fh = fh;
     yaml_parser_initialize(&context.parser);
     yaml_parser_set_input_file(&context.parser, fh);
+#ifdef HAVE_PTHREAD
+    res = tmrm_subject_map_import_pipeline(map, &context);
+#else
     res = tmrm_subject_map_import_streamer(map, &handler, &context);
+#endif
 
     yaml_parser_delete(&context.parser);
     return res;
@@ -1097,19 +1261,174 @@ tmrm_subject_map_import_from_yaml_string(tmrm_subject_map *map, const unsigned c
 
 
 
+static unsigned long
+tmrm_import_labels_hash(const char *name)
+{
+    unsigned long h = 5381;
+
+    while (*name) h = h * 33 + (unsigned char)*name++;
+    return h;
+}
+
+
+/**
+ * Returns the proxy for the document label name. A proxy is created (or,
+ * for TMRM_BOTTOM_PROXY_LABEL, looked up) the first time a label is seen;
+ * later references reuse the same proxy without asking the storage.
+ * The returned proxy belongs to labels.
+ *
+ * @returns NULL on failure.
+ */
+static tmrm_proxy*
+tmrm_import_labels_proxy(tmrm_subject_map *map, tmrm_import_labels *labels,
+    const char *name)
+{
+    tmrm_import_label *slots, *slot;
+    unsigned long h;
+    size_t i, j, size;
+
+    h = tmrm_import_labels_hash(name);
+    if (labels->size > 0) {
+        for (i = h & (labels->size - 1); labels->slots[i].name;
+                i = (i + 1) & (labels->size - 1)) {
+            if (labels->slots[i].hash == h &&
+                    !strcmp(labels->slots[i].name, name)) {
+                return labels->slots[i].proxy;
+            }
+        }
+    }
+
+    /* Keep the table at most half full */
+    if (2 * (labels->count + 1) > labels->size) {
+        size = labels->size ? 2 * labels->size : 256;
+        slots = (tmrm_import_label*)TMRM_CALLOC(tmrm_import_label, size,
+                sizeof(tmrm_import_label));
+        if (!slots) return NULL;
+        for (j = 0; j < labels->size; j++) {
+            if (!labels->slots[j].name) continue;
+            for (i = labels->slots[j].hash & (size - 1); slots[i].name;
+                    i = (i + 1) & (size - 1)) ;
+            slots[i] = labels->slots[j];
+        }
+        if (labels->slots) TMRM_FREE(tmrm_import_label, labels->slots);
+        labels->slots = slots;
+        labels->size = size;
+    }
+    for (i = h & (labels->size - 1); labels->slots[i].name;
+            i = (i + 1) & (labels->size - 1)) ;
+    slot = &labels->slots[i];
+
+    if (!(slot->name = (char*)TMRM_MALLOC(cstring, strlen(name) + 1))) {
+        return NULL;
+    }
+    /* Recognise the special label 'libtmrm_bottom' for bootstrapping
+       purposes. */
+    if (strcmp(TMRM_BOTTOM_PROXY_LABEL, name)) {
+        slot->proxy = tmrm_proxy_new(map);
+    } else {
+        slot->proxy = tmrm_subject_map_bottom(map);
+    }
+    if (!slot->proxy) {
+        TMRM_FREE(cstring, slot->name);
+        slot->name = NULL;
+        return NULL;
+    }
+    strcpy(slot->name, name);
+    slot->hash = h;
+    labels->count++;
+    return slot->proxy;
+}
+
+
+static void
+tmrm_import_labels_free(tmrm_import_labels *labels)
+{
+    size_t i;
+
+    for (i = 0; i < labels->size; i++) {
+        if (!labels->slots[i].name) continue;
+        TMRM_FREE(cstring, labels->slots[i].name);
+        tmrm_proxy_free(labels->slots[i].proxy);
+    }
+    if (labels->slots) TMRM_FREE(tmrm_import_label, labels->slots);
+    labels->slots = NULL;
+    labels->size = labels->count = 0;
+}
+
+
 /**
  * Imports a subject map from a YAML file.
  */
 static int tmrm_subject_map_import_streamer(tmrm_subject_map *map,
     tmrm_streaming_handler *h, void *handler_context)
 {
-    yaml_event_t event;
     tmrm_yaml_import_context *c = (tmrm_yaml_import_context*)handler_context;
-    int done = 0, state = 0, i;
-    tmrm_proxy *proxy = NULL, *key_proxy = NULL, *value_proxy = NULL;
-    tmrm_hash* labels;
-    char *label;
+    tmrm_import_writer writer;
+    int res;
+
+    memset(&writer, 0, sizeof(writer));
+    writer.map = map;
+    res = tmrm_import_parse(&c->parser, &tmrm_import_write, &writer);
+    tmrm_import_labels_free(&writer.labels);
+    return res;
+}
+
+
+/**
+ * Resolves the labels of a tuple from the parse stage and writes it to the
+ * storage.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int
+tmrm_import_write(void *data, tmrm_import_tuple_type type, const char *value)
+{
+    tmrm_import_writer *w = (tmrm_import_writer*)data;
+    tmrm_proxy *value_proxy;
     tmrm_literal *lit;
+    int res;
+
+    switch (type) {
+        case TMRM_IMPORT_PROXY: {
+            w->proxy = tmrm_import_labels_proxy(w->map, &w->labels, value);
+            w->key_proxy = NULL;
+            return w->proxy == NULL;
+        }
+        case TMRM_IMPORT_KEY: {
+            w->key_proxy = tmrm_import_labels_proxy(w->map, &w->labels, value);
+            return w->key_proxy == NULL;
+        }
+        case TMRM_IMPORT_VALUE_PROXY: {
+            /* assert(w->proxy && w->key_proxy); */
+            value_proxy = tmrm_import_labels_proxy(w->map, &w->labels, value);
+            if (!value_proxy) return 1;
+            return tmrm_proxy_add_property(w->proxy, w->key_proxy,
+                value_proxy) != 0;
+        }
+        case TMRM_IMPORT_VALUE_LITERAL: {
+            lit = tmrm_literal_new((tmrm_char_t*)value,
+                (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+            if (!lit) return 1;
+            res = tmrm_proxy_add_property_literal(w->proxy, w->key_proxy, lit);
+            tmrm_literal_free(lit);
+            return res != 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * The parse stage of the YAML import. Runs the parser over a document and
+ * passes each proxy label, property key and property value to emit.
+ *
+ * @returns 0 on success, -1 if the document is invalid or emit failed.
+ */
+static int
+tmrm_import_parse(yaml_parser_t *parser, tmrm_import_emit emit, void *data)
+{
+    yaml_event_t event;
+    int done = 0, state = 0, i;
 
     /* FIXME: Add meaningful constants and refactor the transition table */
     typedef enum state_e {
@@ -1179,13 +1498,10 @@ static int tmrm_subject_map_import_streamer(tmrm_subject_map *map,
 /*11 */ {  -1,   -1,  -1,     -1,    -1,    -1,     -1,     -1,     6,     -1}
     };
 
-    /* We could use an external hash table here since we only store labels and
-       not pointers to proxies */
-    labels = tmrm_hash_new(map->sms, "memory");
-    if (!labels) return -1;
+    memset(&event, 0, sizeof(event));
     while (!done)
     {
-        if (!yaml_parser_parse(&c->parser, &event))
+        if (!yaml_parser_parse(parser, &event))
             goto error_cleanup;
 
         for(i = 0; i<11 && event_types[i] != event.type; i++) ;
@@ -1195,7 +1511,7 @@ static int tmrm_subject_map_import_streamer(tmrm_subject_map *map,
             state = transitions[state][i-1];
         }
         if (state == -1) {
-            TMRM_DEBUG4("Unexpected %s in line %d, column %d\n",
+            TMRM_LOG(TMRM_LOG_ERROR, "Unexpected %s in line %d, column %d",
                 event_names[i], (int)event.start_mark.line,
                 (int)event.start_mark.column);
             goto error_cleanup;
@@ -1206,19 +1522,6 @@ static int tmrm_subject_map_import_streamer(tmrm_subject_map *map,
                     (char*)event.data.scalar.value);
                 break;
             }
-            case STATE_5: {
-                if (event.type == YAML_MAPPING_END_EVENT) {
-                    if (proxy) {
-                        tmrm_proxy_free(proxy);
-                        proxy = NULL;
-                    }
-                    if (key_proxy) {
-                        tmrm_proxy_free(key_proxy);
-                        key_proxy = value_proxy = NULL;
-                    }
-                }
-                break;
-            }
             case STATE_9: {
                 if (event.type == YAML_SCALAR_EVENT) {
                     TMRM_DEBUG2(" - found property: '%s'\n",
@@ -1229,117 +1532,240 @@ static int tmrm_subject_map_import_streamer(tmrm_subject_map *map,
             }
             case STATE_6: {
                 if (event.type == YAML_SCALAR_EVENT) {
-                    /* assert(key_proxy); */
                     /* Check if value is proxy or literal */
                     if (event.data.scalar.tag &&
                         !strcmp("!proxy", (char*)event.data.scalar.tag)) {
-                        /* assert(value_proxy == NULL); */
-                        /* assert(proxy != NULL); */
-                        if (!(label = tmrm_hash_get(labels,
-                                        (char*)event.data.scalar.value))) {
-                            if (strcmp(TMRM_BOTTOM_PROXY_LABEL, (char*)event.data.scalar.value)) {
-                                value_proxy = tmrm_proxy_new(map);
-                            } else {
-                                value_proxy = tmrm_subject_map_bottom(map);
-                            }
-                            tmrm_hash_put_strings(labels,
-                                    (char*)event.data.scalar.value,
-                                    (char*)tmrm_proxy_label(value_proxy));
-                        }
-                        if (!value_proxy) {
-                            value_proxy = tmrm_proxy_by_label(map, label);
-                            if (!value_proxy) goto error_cleanup;
-                        }
-                        if (label) {
-                            TMRM_FREE(cstring, label);
-                            label = NULL;
-                        }
-                        tmrm_proxy_add_property(proxy, key_proxy, value_proxy);
-                        tmrm_proxy_free(value_proxy);
+                        if (emit(data, TMRM_IMPORT_VALUE_PROXY,
+                                (char*)event.data.scalar.value))
+                            goto error_cleanup;
                     } else {
                         /* property is a literal */
-                        lit = tmrm_literal_new((tmrm_char_t*)event.data.scalar.value,
-                            (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
-                        tmrm_proxy_add_property_literal(proxy, key_proxy, lit);
-                        
-                        tmrm_literal_free(lit);
-                        lit = NULL;
+                        if (emit(data, TMRM_IMPORT_VALUE_LITERAL,
+                                (char*)event.data.scalar.value))
+                            goto error_cleanup;
                     }
                 }
                 break;
             }
             case STATE_8: {
-                if (key_proxy) {
-                    tmrm_proxy_free(key_proxy);
-                    key_proxy = value_proxy = NULL;
-                }
-                if (!(label = tmrm_hash_get(labels,
-                            (char*)event.data.scalar.value))) {
-                    if (strcmp(TMRM_BOTTOM_PROXY_LABEL, (char*)event.data.scalar.value)) {
-                        key_proxy = tmrm_proxy_new(map);
-                    } else {
-                        key_proxy = tmrm_subject_map_bottom(map);
-                    }
-                    tmrm_hash_put_strings(labels, (char*)event.data.scalar.value,
-                            (char*)tmrm_proxy_label(key_proxy));
-                }
-                if (!key_proxy) {
-                    key_proxy = tmrm_proxy_by_label(map, label);
-                    if (!key_proxy) goto error_cleanup;
-                }
-                /* assert(key_proxy != NULL); */
-                if (label) {
-                    TMRM_FREE(cstring, label);
-                    label = NULL;
-                }
+                if (emit(data, TMRM_IMPORT_KEY, (char*)event.data.scalar.value))
+                    goto error_cleanup;
                 break;
             }
             case STATE_11: {
                 /*TMRM_DEBUG2(" - found proxy label: '%s'\n",
                     (unsigned char*)event.data.scalar.value);*/
-                /* assert(proxy == NULL); */
-                /* Check if the proxy exists */
-                if (!(label = tmrm_hash_get(labels,
-                            (char*)event.data.scalar.value))) {
-                    /* Recognise the special label 'libtmrm:bottom' for
-                       bootstrapping purposes. */
-                    if (strcmp(TMRM_BOTTOM_PROXY_LABEL, (char*)event.data.scalar.value)) {
-                        proxy = tmrm_proxy_new(map);
-                    } else {
-                        proxy = tmrm_subject_map_bottom(map);
-                    }
-                    tmrm_hash_put_strings(labels, (char*)event.data.scalar.value,
-                        (char*)tmrm_proxy_label(proxy));
-                }
-                if (!proxy) {
-                    proxy = tmrm_proxy_by_label(map, label);
-                }
-                if (label) {
-                    TMRM_FREE(cstring, label);
-                    label = NULL;
-                }
-                /* assert(proxy); */
-                /* labels[label] = proxy; */
+                if (emit(data, TMRM_IMPORT_PROXY,
+                        (char*)event.data.scalar.value))
+                    goto error_cleanup;
                 break;
             }
             case STATE_END: done = 1; break;
             default: break;
         }
+        yaml_event_delete(&event);
     }
-    tmrm_hash_free(labels);
 
     return 0;
 error_cleanup:
-    if (labels) tmrm_hash_free(labels);
-    if (proxy) tmrm_proxy_free(proxy);
-    if (key_proxy) tmrm_proxy_free(key_proxy);
-    if (value_proxy) tmrm_proxy_free(value_proxy);
-    if (lit) tmrm_literal_free(lit);
-    if (label) TMRM_FREE(cstring, label);
+    yaml_event_delete(&event);
     return -1;
 }
 
 
+#ifdef HAVE_PTHREAD
+/*
+ * Pipelined YAML import. A parser thread runs tmrm_import_parse() and
+ * collects the tuples into batches; the calling thread takes the batches
+ * from a bounded queue, resolves the labels and writes to the storage.
+ * Storages are not thread-safe, so all storage calls stay in the calling
+ * thread.
+ */
+
+static tmrm_import_batch*
+tmrm_import_pipeline_batch(tmrm_import_pipeline *p)
+{
+    tmrm_import_batch *b;
+
+    pthread_mutex_lock(&p->lock);
+    b = p->spare;
+    if (b) p->spare = b->next;
+    pthread_mutex_unlock(&p->lock);
+    if (b) return b;
+
+    b = (tmrm_import_batch*)TMRM_CALLOC(tmrm_import_batch, 1,
+            sizeof(tmrm_import_batch));
+    return b;
+}
+
+
+/* Hands the current batch to the writer. Blocks while the queue is full.
+   Returns non-zero if the writer has given up. */
+static int
+tmrm_import_pipeline_push(tmrm_import_pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->count == TMRM_IMPORT_QUEUE_SIZE && !p->aborted) {
+        pthread_cond_wait(&p->not_full, &p->lock);
+    }
+    if (p->aborted) {
+        pthread_mutex_unlock(&p->lock);
+        return 1;
+    }
+    p->queue[(p->head + p->count) % TMRM_IMPORT_QUEUE_SIZE] = p->current;
+    p->count++;
+    p->current = NULL;
+    pthread_cond_signal(&p->not_empty);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+
+static int
+tmrm_import_pipeline_emit(void *data, tmrm_import_tuple_type type,
+    const char *value)
+{
+    tmrm_import_pipeline *p = (tmrm_import_pipeline*)data;
+    tmrm_import_batch *b = p->current;
+    size_t len = strlen(value) + 1, size;
+    char *strings;
+
+    if (!b && !(b = p->current = tmrm_import_pipeline_batch(p))) return 1;
+    if (b->strings_len + len > b->strings_size) {
+        size = b->strings_size ? 2 * b->strings_size : 8192;
+        while (size < b->strings_len + len) size *= 2;
+        strings = (char*)TMRM_REALLOC(cstring, b->strings, size);
+        if (!strings) return 1;
+        b->strings = strings;
+        b->strings_size = size;
+    }
+    memcpy(b->strings + b->strings_len, value, len);
+    b->types[b->count] = (unsigned char)type;
+    b->offsets[b->count] = b->strings_len;
+    b->strings_len += len;
+    b->count++;
+
+    if (b->count == TMRM_IMPORT_BATCH_SIZE) return tmrm_import_pipeline_push(p);
+    return 0;
+}
+
+
+static void*
+tmrm_import_pipeline_parse(void *arg)
+{
+    tmrm_import_pipeline *p = (tmrm_import_pipeline*)arg;
+    int res;
+
+    res = tmrm_import_parse(p->parser, &tmrm_import_pipeline_emit, p);
+    if (!res && p->current && p->current->count) {
+        res = tmrm_import_pipeline_push(p);
+    }
+    pthread_mutex_lock(&p->lock);
+    p->error = res;
+    p->done = 1;
+    pthread_cond_signal(&p->not_empty);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+
+static void
+tmrm_import_batch_free(tmrm_import_batch *b)
+{
+    if (b->strings) TMRM_FREE(cstring, b->strings);
+    TMRM_FREE(tmrm_import_batch, b);
+}
+
+
+/**
+ * Imports a subject map from a YAML file, parsing it in a separate thread.
+ * Falls back to a sequential import if the thread cannot be started.
+ *
+ * @returns -1 on failure
+ */
+static int
+tmrm_subject_map_import_pipeline(tmrm_subject_map *map,
+    tmrm_yaml_import_context *c)
+{
+    yaml_parser_t *parser = &c->parser;
+    tmrm_import_pipeline p;
+    tmrm_import_writer writer;
+    tmrm_import_batch *b;
+    pthread_t thread;
+    size_t i;
+    int res = 0;
+
+    memset(&p, 0, sizeof(p));
+    p.parser = parser;
+    memset(&writer, 0, sizeof(writer));
+    writer.map = map;
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.not_empty, NULL);
+    pthread_cond_init(&p.not_full, NULL);
+    if (pthread_create(&thread, NULL, &tmrm_import_pipeline_parse, &p)) {
+        TMRM_DEBUG1("Could not start the parser thread, importing sequentially\n");
+        res = tmrm_import_parse(parser, &tmrm_import_write, &writer);
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    for (;;) {
+        while (!p.count && !p.done) {
+            pthread_cond_wait(&p.not_empty, &p.lock);
+        }
+        if (!p.count) {
+            if (p.error) res = -1;
+            break;
+        }
+        b = p.queue[p.head];
+        p.head = (p.head + 1) % TMRM_IMPORT_QUEUE_SIZE;
+        p.count--;
+        pthread_cond_signal(&p.not_full);
+        pthread_mutex_unlock(&p.lock);
+
+        for (i = 0; i < b->count; i++) {
+            if (tmrm_import_write(&writer, (tmrm_import_tuple_type)b->types[i],
+                    b->strings + b->offsets[i])) {
+                res = -1;
+                break;
+            }
+        }
+        b->count = b->strings_len = 0;
+
+        pthread_mutex_lock(&p.lock);
+        b->next = p.spare;
+        p.spare = b;
+        if (res) {
+            /* Stop the parser thread */
+            p.aborted = 1;
+            pthread_cond_signal(&p.not_full);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p.lock);
+    pthread_join(thread, NULL);
+
+cleanup:
+    while (p.count) {
+        tmrm_import_batch_free(p.queue[p.head]);
+        p.head = (p.head + 1) % TMRM_IMPORT_QUEUE_SIZE;
+        p.count--;
+    }
+    while ((b = p.spare)) {
+        p.spare = b->next;
+        tmrm_import_batch_free(b);
+    }
+    if (p.current) tmrm_import_batch_free(p.current);
+    pthread_cond_destroy(&p.not_full);
+    pthread_cond_destroy(&p.not_empty);
+    pthread_mutex_destroy(&p.lock);
+    tmrm_import_labels_free(&writer.labels);
+    return res;
+}
+#endif
+
+
 /**
  * Adds the proxy type as a type to p. p and type must not be NULL.
  *
@@ -1717,8 +2143,8 @@ tmrm_proxy_isa(tmrm_proxy* p, tmrm_proxy* type)
     if (types_it == NULL) return -1;
 
     types = tmrm_list_from_iterator(types_it, tmrm_object_free);
-    if (types == NULL) return -1;
     tmrm_iterator_free(types_it);
+    if (types == NULL) return -1;
 
     /* Loop through all subclasses of type */
     subclasses = tmrm_proxy_subclasses(type);
@@ -1742,6 +2168,7 @@ tmrm_proxy_isa(tmrm_proxy* p, tmrm_proxy* type)
                     tmrm_object_to_proxy(current_obj))) {
                     tmrm_object_free(current_obj);
                     tmrm_list_free(subclasses);
+                    tmrm_list_free(types);
                     return 1;
                 }
                 elem = tmrm_list_next(elem);
@@ -35,7 +35,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <db.h>
+#include <stdarg.h>
+#include <time.h>
 
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
@@ -62,23 +63,31 @@ tmrm_storage_register_factory(tmrm_subject_map_sphere* sms,
         sizeof(tmrm_storage_factory));
     if (!storage) {
         TMRM_DEBUG1("Out of memory\n");
-        TMRM_ASSERT_DIE; /* FIXME FATAL ERROR */
-    }
-    storage->name = (char*)TMRM_MALLOC(cstring, strlen(name)+1);
-    if (!storage->name) {
-        TMRM_FREE(cstring, storage->name);
         return /* -1 */;
     }
-    strcpy(storage->name, name);
-    storage->label = (char*)TMRM_MALLOC(cstring, strlen(label)+1);
-    if (!storage->label) {
-        TMRM_FREE(cstring, storage->name);
-        TMRM_FREE(tmrm_storage_factory, storage);
+    storage->name = tmrm_strdup(name);
+    storage->label = tmrm_strdup(label);
+    if (!storage->name || !storage->label) {
+        tmrm_storage_factory_free((tmrm_object*)storage);
+        return /* -1 */;
     }
-    strcpy(storage->label, label);
     /* Call the storage registration function on the new object */
     (*factory)(storage);
-    tmrm_list_ins_next(sms->factories, NULL, (void*)storage);
+    if (tmrm_list_ins_next(sms->factories, NULL, (void*)storage)) {
+        tmrm_storage_factory_free((tmrm_object*)storage);
+    }
+}
+
+
+/* Frees a factory registered with tmrm_storage_register_factory() */
+void
+tmrm_storage_factory_free(tmrm_object *factory)
+{
+    tmrm_storage_factory* f = (tmrm_storage_factory*)factory;
+
+    if (f->name) TMRM_FREE(cstring, f->name);
+    if (f->label) TMRM_FREE(cstring, f->label);
+    TMRM_FREE(tmrm_storage_factory, f);
 }
 
 tmrm_storage*
@@ -113,16 +122,32 @@ tmrm_storage_new_from_factory(tmrm_subject_map_sphere* sms, tmrm_storage_factory
 {
     tmrm_storage* storage;
     tmrm_hash* options = NULL;
+    int res;
     TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(factory, tmrm_storage_factory, NULL);
     storage = (tmrm_storage*)TMRM_CALLOC(tmrm_storage, 1, sizeof(tmrm_storage));
     if (!storage) return (tmrm_storage*)NULL;
     storage->subject_map_sphere = sms;
     storage->factory = factory;
     storage->context = NULL;
+    tmrm_storage_stats_reset(storage);
+#ifdef HAVE_PTHREAD
+    if (pthread_rwlock_init(&storage->lock, NULL)) {
+        TMRM_FREE(tmrm_storage, storage);
+        return (tmrm_storage*)NULL;
+    }
+    if (pthread_key_create(&storage->depth, NULL)) {
+        pthread_rwlock_destroy(&storage->lock);
+        TMRM_FREE(tmrm_storage, storage);
+        return (tmrm_storage*)NULL;
+    }
+#endif
     if (params != NULL) {
         options = tmrm_hash_new_from_string(sms, "memory", params);
     }
-    if (factory->init(storage, options)) {
+    /* The storages copy what they need from the options */
+    res = factory->init(storage, options);
+    if (options) tmrm_hash_free(options);
+    if (res) {
         tmrm_storage_free(storage);
         return (tmrm_storage*)NULL;
     }
@@ -134,6 +159,10 @@ void
 tmrm_storage_free(tmrm_storage* s)
 {
     s->factory->free(s);
+#ifdef HAVE_PTHREAD
+    pthread_key_delete(s->depth);
+    pthread_rwlock_destroy(&s->lock);
+#endif
     TMRM_FREE(tmrm_storage, s);
 }
 
@@ -144,178 +173,2449 @@ tmrm_storage_init(tmrm_storage* s, tmrm_hash* options)
     return s->factory->init(s, options);
 }
 
+/* ------------------------------------------------------------------------ */
+/* Statistics */
+
+/*
+ * Every factory call is timed with the monotonic clock and counted in the
+ * tmrm_op_stats of its callback. The counters are updated with atomic
+ * additions, so the statistics stay on without taking any lock. Rows and
+ * bytes are counted by the iterator wrapper below as the caller reads the
+ * results.
+ */
+
+/* Names of the callbacks, in the order of tmrm_storage_op */
+static const char* const _op_names[TMRM_STORAGE_OP_COUNT] = {
+    "bootstrap", "remove", "bottom", "merge", "proxy_create",
+    "proxy_update", "add_property", "add_property_literal",
+    "proxy_by_label", "proxies", "proxy_label", "proxy_keys",
+    "proxy_values_by_key", "proxy_is_value_by_key",
+    "literal_is_value_by_key", "is_value_by_key_many", "posting_list",
+    "path", "proxy_keys_by_value", "literal_keys_by_value",
+    "proxy_add_type", "proxy_add_superclass", "proxy_direct_subclasses",
+    "proxy_direct_superclasses", "proxy_direct_types",
+    "proxy_direct_instances", "proxy_remove_properties_by_key",
+    "proxy_properties", "proxy_remove", "scan_properties", "poll_changes",
+    "snapshot_acquire", "snapshot_release"
+};
+
+#ifdef HAVE_PTHREAD
+#define _stats_add(counter, n) (void)__sync_fetch_and_add(&(counter), (n))
+#define _stats_cas(counter, old, new) \
+    __sync_bool_compare_and_swap(&(counter), (old), (new))
+#define _stats_get(counter) __sync_fetch_and_add(&(counter), 0)
+#else
+#define _stats_add(counter, n) ((counter) += (n))
+#define _stats_cas(counter, old, new) ((counter) = (new), 1)
+#define _stats_get(counter) (counter)
+#endif
+
+/* Calls a factory callback, records it in the statistics of op and
+   reports it to the tracer of the sphere. proxy and key are labels or 0;
+   failed is evaluated after the call. */
+#define _stats_call(s, op, proxy, key, ret, call, failed) do { \
+    tmrm_span _stats_span; \
+    int _stats_traced = tmrm_trace_begin((s), &_stats_span, _op_names[op], \
+            (proxy), (key), NULL); \
+    unsigned long long _stats_start = _stats_clock(); \
+    (ret) = (call); \
+    _stats_record((s), (op), _stats_start, (failed)); \
+    if (_stats_traced) tmrm_trace_end((s), &_stats_span, (failed), -1); \
+} while (0)
+
+static unsigned long long
+_stats_clock(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) return 0;
+    return (unsigned long long)ts.tv_sec * 1000000000ULL +
+        (unsigned long long)ts.tv_nsec;
+}
+
+/* Latencies below 4ns have a bucket each; above, every power of two is
+   split into four buckets by the two bits below the highest one */
+static int
+_stats_bucket(unsigned long long ns)
+{
+    int e = 0;
+
+    if (ns < 4) return (int)ns;
+#ifdef __GNUC__
+    e = 63 - __builtin_clzll(ns);
+#else
+    while (ns >> (e + 1)) e++;
+#endif
+    if (e > TMRM_STATS_BUCKETS / 4) return TMRM_STATS_BUCKETS - 1;
+    return (e - 1) * 4 + (int)((ns >> (e - 2)) & 3);
+}
+
+static void
+_stats_record(tmrm_storage* s, tmrm_storage_op op, unsigned long long start,
+        int failed)
+{
+    tmrm_op_stats* st = &s->stats[op];
+    unsigned long long ns = _stats_clock() - start;
+    unsigned long long max;
+
+    _stats_add(st->calls, 1);
+    if (failed) {
+        _stats_add(st->errors, 1);
+        /* proxy_by_label also fails for labels that are not in the map */
+        if (op != TMRM_STORAGE_OP_PROXY_BY_LABEL) {
+            TMRM_SET_ERROR(s->subject_map_sphere, TMRM_STORAGE_ERROR,
+                    "Storage %s: %s failed", s->factory->name,
+                    _op_names[op]);
+        }
+    }
+    _stats_add(st->total_ns, ns);
+    _stats_add(st->histogram[_stats_bucket(ns)], 1);
+    while ((max = _stats_get(st->max_ns)) < ns &&
+            !_stats_cas(st->max_ns, max, ns)) {
+    }
+}
+
+
+
+/* The innermost open span of the calling thread, the parent of new spans */
+#ifdef HAVE_PTHREAD
+static pthread_key_t _span_key;
+static pthread_once_t _span_key_once = PTHREAD_ONCE_INIT;
+
+static void
+_span_key_create(void)
+{
+    (void)pthread_key_create(&_span_key, NULL);
+}
+
+#define _span_current() ((tmrm_span*)pthread_getspecific(_span_key))
+#define _span_set_current(span) (void)pthread_setspecific(_span_key, (span))
+#else
+static tmrm_span* _span_open = NULL;
+
+#define _span_current() _span_open
+#define _span_set_current(span) (_span_open = (span))
+#endif
+
+
 /**
- * Removes a given subject map and its storage (e.g. by removing associated
- * files or databases). 
- * If the storage supports several subject maps, only the parts affecting the
- * subject map are removed. If map is null, all subject maps are removed from
- * the storage.
- * Note that this function does not free the memory occupied by the subject
- * map and the storage (and the subject map system) objects. You still have
- * to call tmrm_subject_map_free() and tmrm_storage_free(). Other calls than
- * there are not guaranteed to work.
+ * Opens a span for the tracer of the sphere of s (see
+ * tmrm_subject_map_sphere_set_tracer()). Spans opened on the same thread
+ * until tmrm_trace_end() become its children.
  *
- * @param s The storage object
- * @param map The subject map object.
- * @returns 0 on success or a non-zero value on failure.
+ * @param operation Name of the operation, must outlive the span
+ * @param sql Statement text or NULL, must outlive the span
+ * @returns 1 if the span is traced and tmrm_trace_end() must be called,
+ *          0 if no tracer is installed
  */
 int
-tmrm_storage_remove(tmrm_storage* s, tmrm_subject_map* map) {
-    /* Ignore if not applicable or not implemented */
-    if (!s->factory->remove) return 0;
+tmrm_trace_begin(tmrm_storage* s, tmrm_span* span, const char* operation,
+        int proxy, int key, const char* sql)
+{
+    const tmrm_tracer* tracer = &s->subject_map_sphere->tracer;
 
-    return s->factory->remove(s, map);
+    if (!tracer->begin && !tracer->end) return 0;
+#ifdef HAVE_PTHREAD
+    (void)pthread_once(&_span_key_once, _span_key_create);
+#endif
+    memset(span, 0, sizeof(tmrm_span));
+    span->operation = operation;
+    span->storage = s->factory->name;
+    span->proxy = proxy;
+    span->key = key;
+    span->sql = sql;
+    span->rows = -1;
+    span->parent = _span_current();
+    _span_set_current(span);
+    if (tracer->begin) tracer->begin(tracer->data, span);
+    span->start_ns = _stats_clock();
+    return 1;
 }
 
-int tmrm_storage_bootstrap(tmrm_storage* s, tmrm_subject_map* map)
+
+/**
+ * Closes a span that tmrm_trace_begin() opened and hands it to the end
+ * callback of the tracer.
+ *
+ * @param rows Rows returned or changed, -1 if unknown
+ */
+void
+tmrm_trace_end(tmrm_storage* s, tmrm_span* span, int failed, long rows)
 {
-    return s->factory->bootstrap(s, map);
+    const tmrm_tracer* tracer = &s->subject_map_sphere->tracer;
+
+    span->duration_ns = _stats_clock() - span->start_ns;
+    span->failed = failed;
+    span->rows = rows;
+    _span_set_current((tmrm_span*)span->parent);
+    if (tracer->end) tracer->end(tracer->data, span);
 }
 
-tmrm_proxy* tmrm_storage_bottom(tmrm_storage* s, tmrm_subject_map* map) {
-    return s->factory->bottom(s, map);
+
+/**
+ * Returns the exclusive upper bound of a latency bucket of tmrm_op_stats
+ * in nanoseconds.
+ */
+unsigned long long
+tmrm_stats_bucket_limit(int bucket)
+{
+    int e;
+
+    if (bucket < 4) return (unsigned long long)bucket + 1;
+    e = bucket / 4 + 1;
+    return (unsigned long long)(5 + bucket % 4) << (e - 2);
 }
 
-int tmrm_storage_merge(tmrm_storage* s, tmrm_subject_map* map) {
-    return s->factory->merge(s, map);
+
+/**
+ * Estimates a latency percentile from the histogram of stats. The result
+ * is the upper bound of the bucket that holds the percentile, so it is
+ * at most 25% too high.
+ *
+ * @param percentile A value from 0 to 100
+ * @returns the latency in nanoseconds, or 0 if there were no calls
+ */
+unsigned long long
+tmrm_op_stats_percentile(const tmrm_op_stats* stats, double percentile)
+{
+    unsigned long total = 0, seen = 0, rank;
+    unsigned long long limit;
+    int i;
+
+    for (i = 0; i < TMRM_STATS_BUCKETS; i++) total += stats->histogram[i];
+    if (total == 0) return 0;
+    rank = (unsigned long)(percentile / 100.0 * (double)total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+    for (i = 0; i < TMRM_STATS_BUCKETS; i++) {
+        seen += stats->histogram[i];
+        if (seen >= rank) break;
+    }
+    limit = tmrm_stats_bucket_limit(i);
+    return limit > stats->max_ns && stats->max_ns ? stats->max_ns : limit;
 }
 
-tmrm_proxy*
-tmrm_storage_proxy_create(tmrm_storage* s, tmrm_subject_map* map)
+
+/**
+ * Returns a copy of the call statistics of the storage, one entry per
+ * factory callback, in a new array that must be free'd with tmrm_free().
+ * The counters of running calls may be slightly out of step.
+ *
+ * @returns NULL on failure
+ */
+tmrm_op_stats*
+tmrm_storage_stats(tmrm_storage* s, int* count)
 {
-    return s->factory->proxy_create(s, map);
+    tmrm_op_stats* stats;
+
+    *count = 0;
+    stats = (tmrm_op_stats*)TMRM_MALLOC(tmrm_op_stats, sizeof(s->stats));
+    if (!stats) return NULL;
+    memcpy(stats, s->stats, sizeof(s->stats));
+    *count = TMRM_STORAGE_OP_COUNT;
+    return stats;
 }
 
-int
-tmrm_storage_proxy_update(tmrm_storage* s, tmrm_proxy* p)
+
+/* Clears the call statistics of the storage */
+void
+tmrm_storage_stats_reset(tmrm_storage* s)
 {
-    /* Ignore if not applicable or not implemented */
-    if (s->factory->proxy_update == NULL) return 0;
+    int i;
 
-    return s->factory->proxy_update(s, p);
+    memset(s->stats, 0, sizeof(s->stats));
+    for (i = 0; i < TMRM_STORAGE_OP_COUNT; i++) {
+        s->stats[i].name = _op_names[i];
+    }
 }
 
-int
-tmrm_storage_add_property(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value)
+
+/**
+ * Formats the statistics of all callbacks that were called, with their
+ * mean, median, 99th percentile and maximum latency, as text (one line per
+ * callback) or as a JSON object. The string must be free'd with
+ * tmrm_free().
+ *
+ * @returns NULL on failure
+ */
+char*
+tmrm_storage_stats_dump(tmrm_storage* s, tmrm_stats_format format)
 {
-    return s->factory->add_property(s, p, key, value);
+    tmrm_op_stats* stats;
+    char* buffer;
+    size_t length = 0, capacity = 1024;
+    int count, i, first = 1, failed = 0;
+
+    if (!(stats = tmrm_storage_stats(s, &count))) return NULL;
+    if (!(buffer = (char*)TMRM_MALLOC(char, capacity))) {
+        TMRM_FREE(tmrm_op_stats, stats);
+        return NULL;
+    }
+    buffer[0] = '\0';
+    if (format == TMRM_STATS_JSON) {
+        failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                "{\"storage\": \"%s\", \"operations\": {", s->factory->name);
+    }
+    for (i = 0; i < count; i++) {
+        if (stats[i].calls == 0) continue;
+        if (format == TMRM_STATS_JSON) {
+            failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                    "%s\"%s\": {\"calls\": %lu, \"errors\": %lu, "
+                    "\"rows\": %lu, \"bytes\": %lu, \"mean_ns\": %llu, "
+                    "\"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+                    first ? "" : ", ", stats[i].name, stats[i].calls,
+                    stats[i].errors, stats[i].rows, stats[i].bytes,
+                    stats[i].total_ns / stats[i].calls,
+                    tmrm_op_stats_percentile(&stats[i], 50),
+                    tmrm_op_stats_percentile(&stats[i], 99),
+                    stats[i].max_ns);
+        } else {
+            failed |= tmrm_printf_append(&buffer, &length, &capacity,
+                    "%-32s calls %lu errors %lu rows %lu bytes %lu "
+                    "mean %lluns p50 %lluns p99 %lluns max %lluns\n",
+                    stats[i].name, stats[i].calls, stats[i].errors,
+                    stats[i].rows, stats[i].bytes,
+                    stats[i].total_ns / stats[i].calls,
+                    tmrm_op_stats_percentile(&stats[i], 50),
+                    tmrm_op_stats_percentile(&stats[i], 99),
+                    stats[i].max_ns);
+        }
+        first = 0;
+    }
+    if (format == TMRM_STATS_JSON) {
+        failed |= tmrm_printf_append(&buffer, &length, &capacity, "}}");
+    }
+    TMRM_FREE(tmrm_op_stats, stats);
+    if (failed) {
+        TMRM_FREE(char, buffer);
+        return NULL;
+    }
+    return buffer;
 }
 
-int
-tmrm_storage_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value)
+/* ------------------------------------------------------------------------ */
+/* Locking */
+
+/*
+ * The wrappers below take the lock of the storage as its factory asks for:
+ * TMRM_STORAGE_SERIALIZED storages get one call at a time,
+ * TMRM_STORAGE_CONCURRENT_READS storages any number of reads or a single
+ * write, and TMRM_STORAGE_CONCURRENT storages are not locked at all. The
+ * lock is reentrant per thread, so storages may call back into the
+ * library; a write nested in a read does not upgrade the lock, though.
+ */
+
+static void
+_lock(tmrm_storage* s, int write)
 {
-    return s->factory->add_property_literal(s, p, key, value);
+#ifdef HAVE_PTHREAD
+    long depth;
+
+    if (s->factory->concurrency == TMRM_STORAGE_CONCURRENT) return;
+    depth = (long)pthread_getspecific(s->depth);
+    if (depth == 0) {
+        if (write || s->factory->concurrency == TMRM_STORAGE_SERIALIZED) {
+            pthread_rwlock_wrlock(&s->lock);
+        } else {
+            pthread_rwlock_rdlock(&s->lock);
+        }
+    }
+    (void)pthread_setspecific(s->depth, (void*)(depth + 1));
+#endif
 }
 
-int
-tmrm_storage_remove_properties_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+#define _read_lock(s) _lock(s, 0)
+#define _write_lock(s) _lock(s, 1)
+
+static void
+_unlock(tmrm_storage* s)
 {
-    /* TODO Could also be implemented independent of the storage (get all
-       properties with key 'key' and remove all of them) */
-    return s->factory->proxy_remove_properties_by_key(s, p, key);
+#ifdef HAVE_PTHREAD
+    long depth;
+
+    if (s->factory->concurrency == TMRM_STORAGE_CONCURRENT) return;
+    depth = (long)pthread_getspecific(s->depth) - 1;
+    (void)pthread_setspecific(s->depth, (void*)depth);
+    if (depth == 0) pthread_rwlock_unlock(&s->lock);
+#endif
 }
 
 
-tmrm_iterator*
-tmrm_storage_proxy_get_properties(tmrm_storage* s, tmrm_proxy* p) {
-    return s->factory->proxy_properties(s, p);
+void
+tmrm_storage_lock(tmrm_storage* s, int write)
+{
+    _lock(s, write);
 }
 
+void
+tmrm_storage_unlock(tmrm_storage* s)
+{
+    _unlock(s);
+}
 
-tmrm_proxy*
-tmrm_storage_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
-        const char *label)
+/* Storage iterators may read shared state of the storage on every call,
+   so they are wrapped in an iterator that holds the read lock meanwhile.
+   The wrapper also counts the rows and bytes that the caller reads. */
+typedef struct {
+    tmrm_storage* storage;
+    tmrm_storage_op op;
+    tmrm_iterator* inner;
+} tmrm_storage_locked_context;
+
+static int
+_locked_next(void* context)
 {
-    return s->factory->proxy_by_label(s, map, label);
+    tmrm_storage_locked_context* c = (tmrm_storage_locked_context*)context;
+    int ret;
+
+    _read_lock(c->storage);
+    ret = tmrm_iterator_next(c->inner);
+    _unlock(c->storage);
+    return ret;
 }
 
-tmrm_iterator*
-tmrm_storage_proxies(tmrm_storage* s, tmrm_subject_map* map)
+static int
+_locked_end(void* context)
 {
-    return s->factory->proxies(s, map);
+    tmrm_storage_locked_context* c = (tmrm_storage_locked_context*)context;
+    int ret;
+
+    _read_lock(c->storage);
+    ret = tmrm_iterator_end(c->inner);
+    _unlock(c->storage);
+    return ret;
 }
 
+static tmrm_object*
+_locked_get_element(void* context, tmrm_iterator_flag flag)
+{
+    tmrm_storage_locked_context* c = (tmrm_storage_locked_context*)context;
+    tmrm_object* object;
 
-/** 
- * Returns the label of a proxy from the backend.
- * Returns NULL on failure.
+    _read_lock(c->storage);
+    object = c->inner->get_element_method(c->inner->context, flag);
+    _unlock(c->storage);
+    if (!object) return NULL;
+    /* Properties are read as key and value, the rest as objects */
+    if (flag == TMRM_ITERATOR_GET_METHOD_GET_OBJECT ||
+            flag == TMRM_ITERATOR_GET_METHOD_GET_KEY) {
+        _stats_add(c->storage->stats[c->op].rows, 1);
+    }
+    if (flag != TMRM_ITERATOR_GET_METHOD_GET_KEY &&
+            tmrm_object_get_type(object) == TMRM_TYPE_LITERAL) {
+        _stats_add(c->storage->stats[c->op].bytes, strlen((const char*)
+                    tmrm_literal_value((tmrm_literal*)object)));
+    }
+    return object;
+}
+
+static void
+_locked_free(void* context)
+{
+    tmrm_storage_locked_context* c = (tmrm_storage_locked_context*)context;
+
+    _read_lock(c->storage);
+    tmrm_iterator_free(c->inner);
+    _unlock(c->storage);
+    TMRM_FREE(tmrm_storage_locked_context, c);
+}
+
+/* Returns it wrapped for locking and for the statistics of op. Frees it
+   on failure. */
+static tmrm_iterator*
+_locked_iterator(tmrm_storage* s, tmrm_storage_op op, tmrm_iterator* it)
+{
+    tmrm_storage_locked_context* c;
+    tmrm_iterator* locked = NULL;
+
+    if (!it) return it;
+    if ((c = (tmrm_storage_locked_context*)TMRM_CALLOC(
+                    tmrm_storage_locked_context, 1,
+                    sizeof(tmrm_storage_locked_context)))) {
+        c->storage = s;
+        c->op = op;
+        c->inner = it;
+        locked = tmrm_iterator_new(s->subject_map_sphere, (void*)c,
+                _locked_next, _locked_end, _locked_get_element, _locked_free);
+        if (!locked) TMRM_FREE(tmrm_storage_locked_context, c);
+    }
+    if (!locked) {
+        _read_lock(s);
+        tmrm_iterator_free(it);
+        _unlock(s);
+    }
+    return locked;
+}
+
+/* Subject map snapshots only read */
+static int
+_read_only(const tmrm_subject_map* map)
+{
+    if (!map->snapshot) return 0;
+    TMRM_LOG(TMRM_LOG_ERROR, "Subject map snapshots are read-only");
+    return 1;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Read cache */
+
+/* Operations whose results are cached */
+typedef enum {
+    TMRM_CACHE_VALUES_BY_KEY,
+    TMRM_CACHE_KEYS,
+    TMRM_CACHE_DIRECT_TYPES
+} tmrm_storage_cache_op;
+
+/* A cached result. The entry is kept alive by the cache and by every
+   iterator that reads it, so it can be evicted while it is iterated. */
+typedef struct tmrm_storage_cache_entry_s {
+    tmrm_storage_cache_op op;
+    tmrm_label proxy;
+    tmrm_label key;           /* only used for TMRM_CACHE_VALUES_BY_KEY */
+    tmrm_object** objects;
+    int count;
+    int refs;
+    struct tmrm_storage_cache_entry_s* hash_next;
+    /* Least recently used list, most recently used first */
+    struct tmrm_storage_cache_entry_s* prev;
+    struct tmrm_storage_cache_entry_s* next;
+} tmrm_storage_cache_entry;
+
+struct tmrm_storage_cache_s {
+    tmrm_storage_cache_entry** buckets;
+    size_t bucket_count;      /* a power of two */
+    size_t size;
+    size_t capacity;
+    tmrm_storage_cache_entry* head;
+    tmrm_storage_cache_entry* tail;
+    unsigned long hits;
+    unsigned long misses;
+    /* Counts the drops, so that a result read from the storage while one
+       happened is not cached */
+    unsigned long generation;
+#ifdef HAVE_PTHREAD
+    /* Reads update the cache too, so it has a lock of its own */
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+#define _cache_lock(cache) pthread_mutex_lock(&(cache)->lock)
+#define _cache_unlock(cache) pthread_mutex_unlock(&(cache)->lock)
+#else
+#define _cache_lock(cache) do {} while (0)
+#define _cache_unlock(cache) do {} while (0)
+#endif
+
+/* Context of the iterators over cached results. Inside of an arena, the
+   iterator may never be freed, so it reads a copy of the objects instead
+   of holding a reference to the entry. */
+typedef struct {
+    tmrm_storage_cache* cache;
+    tmrm_storage_cache_entry* entry;    /* NULL for a copy */
+    tmrm_object** objects;
+    int count;
+    int index;
+} tmrm_storage_cache_iterator_context;
+
+
+/**
+ * Creates a read cache that holds the results of up to capacity calls of
+ * tmrm_storage_proxy_values_by_key(), tmrm_storage_proxy_keys() and
+ * tmrm_storage_proxy_direct_types(). The cache is attached to a subject map
+ * (see tmrm_subject_map_set_cache_size()), and entries are evicted least
+ * recently used first.
+ *
+ * @returns NULL on failure
  */
-const char*
-tmrm_storage_proxy_label(tmrm_storage* s, tmrm_proxy* p)
+tmrm_storage_cache*
+tmrm_storage_cache_new(size_t capacity)
 {
-    return s->factory->proxy_label(s, p);
+    tmrm_storage_cache* cache;
+
+    tmrm_arena_suspend();
+    cache = (tmrm_storage_cache*)TMRM_CALLOC(tmrm_storage_cache, 1,
+            sizeof(tmrm_storage_cache));
+    if (!cache) {
+        tmrm_arena_resume();
+        return NULL;
+    }
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->bucket_count = 16;
+    while (cache->bucket_count < cache->capacity) cache->bucket_count *= 2;
+    cache->buckets = (tmrm_storage_cache_entry**)TMRM_CALLOC(
+            tmrm_storage_cache_entry*, cache->bucket_count,
+            sizeof(tmrm_storage_cache_entry*));
+    tmrm_arena_resume();
+#ifdef HAVE_PTHREAD
+    if (cache->buckets && pthread_mutex_init(&cache->lock, NULL)) {
+        TMRM_FREE(tmrm_storage_cache_entry*, cache->buckets);
+        cache->buckets = NULL;
+    }
+#endif
+    if (!cache->buckets) {
+        TMRM_FREE(tmrm_storage_cache, cache);
+        return NULL;
+    }
+    return cache;
 }
 
-tmrm_iterator*
-tmrm_storage_proxy_keys(tmrm_storage* s, tmrm_proxy* p)
+
+static void
+_cache_entry_release(tmrm_storage_cache_entry* e)
 {
-    return s->factory->proxy_keys(s, p);
+    int i;
+
+    if (--e->refs > 0) return;
+    for (i = 0; i < e->count; i++) {
+        tmrm_object_free(e->objects[i]);
+    }
+    if (e->objects) TMRM_FREE(tmrm_object*, e->objects);
+    TMRM_FREE(tmrm_storage_cache_entry, e);
 }
 
-tmrm_iterator*
-tmrm_storage_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+
+static size_t
+_cache_bucket(tmrm_storage_cache* cache, tmrm_storage_cache_op op,
+        tmrm_label proxy, tmrm_label key)
 {
-    return s->factory->proxy_values_by_key(s, p, key);
+    unsigned long h;
+
+    h = (unsigned long)proxy * 2654435761UL;
+    h ^= ((unsigned long)key + 0x9e3779b9UL + (h << 6) + (h >> 2));
+    h ^= (unsigned long)op;
+    return (size_t)(h & (cache->bucket_count - 1));
 }
 
-tmrm_iterator*
-tmrm_storage_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key) {
-    return s->factory->proxy_is_value_by_key(s, p, key);
+
+/* Removes an entry from the cache */
+static void
+_cache_unlink(tmrm_storage_cache* cache, tmrm_storage_cache_entry* e)
+{
+    tmrm_storage_cache_entry** slot;
+
+    slot = &cache->buckets[_cache_bucket(cache, e->op, e->proxy, e->key)];
+    while (*slot != e) slot = &(*slot)->hash_next;
+    *slot = e->hash_next;
+    if (e->prev) e->prev->next = e->next;
+    else cache->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else cache->tail = e->prev;
+    cache->size--;
+    _cache_entry_release(e);
 }
 
-tmrm_iterator*
-tmrm_storage_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key) {
-    tmrm_iterator* it;
-    it = s->factory->literal_is_value_by_key(s, lit, key);
-    return it;
+
+/* Drops all entries */
+static void
+_cache_clear(tmrm_storage_cache* cache)
+{
+    cache->generation++;
+    while (cache->head) _cache_unlink(cache, cache->head);
 }
 
-tmrm_iterator*
-tmrm_storage_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map) {
-    tmrm_iterator* it;
-    it = s->factory->literal_keys_by_value(s, lit, map);
-    return it;
+
+void
+tmrm_storage_cache_free(tmrm_storage_cache* cache)
+{
+    _cache_clear(cache);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    TMRM_FREE(tmrm_storage_cache_entry*, cache->buckets);
+    TMRM_FREE(tmrm_storage_cache, cache);
 }
 
-int
-tmrm_storage_proxy_remove(tmrm_storage* s, const tmrm_proxy* p)
+
+/* Returns the number of results that were served from the cache (hits)
+   and that had to be read from the storage (misses) */
+void
+tmrm_storage_cache_stats(const tmrm_storage_cache* cache,
+        unsigned long* hits, unsigned long* misses)
 {
-    return s->factory->proxy_remove(s, p);
+    if (hits) *hits = cache->hits;
+    if (misses) *misses = cache->misses;
 }
 
-int
-tmrm_storage_proxy_add_type(tmrm_storage* s, tmrm_proxy *p, tmrm_proxy *type)
+
+static tmrm_storage_cache_entry*
+_cache_find(tmrm_storage_cache* cache, tmrm_storage_cache_op op,
+        tmrm_label proxy, tmrm_label key)
 {
-    return s->factory->proxy_add_type(s, p, type);
+    tmrm_storage_cache_entry* e;
+
+    e = cache->buckets[_cache_bucket(cache, op, proxy, key)];
+    while (e && (e->op != op || e->proxy != proxy || e->key != key)) {
+        e = e->hash_next;
+    }
+    return e;
 }
 
-int
-tmrm_storage_proxy_add_superclass(tmrm_storage* s, tmrm_proxy *p, tmrm_proxy *superclass)
+
+/* Drops the result of op for proxy and key, if it is cached */
+static void
+_cache_drop(tmrm_storage_cache* cache, tmrm_storage_cache_op op,
+        tmrm_label proxy, tmrm_label key)
 {
-    return s->factory->proxy_add_superclass(s, p, superclass);
+    tmrm_storage_cache_entry* e;
+
+    cache->generation++;
+    if ((e = _cache_find(cache, op, proxy, key))) _cache_unlink(cache, e);
 }
 
-tmrm_iterator*
-tmrm_storage_proxy_direct_subclasses(tmrm_storage* s, tmrm_proxy *p)
+
+/* A result that a write changes */
+typedef struct {
+    tmrm_storage_cache_op op;
+    tmrm_label proxy;
+    tmrm_label key;
+} tmrm_storage_cache_drop;
+
+/* The results that a write changes. Some of them can only be found by
+   reading the storage before the write, but all of them are dropped after
+   it, so that no reader caches the state in between. */
+typedef struct {
+    tmrm_storage_cache_drop* drops;
+    int count;
+    int size;
+    /* The results that contain this proxy, if it is removed */
+    const tmrm_proxy* removed;
+    int all_types;      /* the instances are unknown */
+    int all;            /* a drop could not be recorded */
+} tmrm_storage_cache_drops;
+
+
+static void
+_drops_add(tmrm_storage_cache_drops* d, tmrm_storage_cache_op op,
+        tmrm_label proxy, tmrm_label key)
 {
-    return s->factory->proxy_direct_subclasses(s, p);
+    tmrm_storage_cache_drop* drops;
+    int size;
+
+    if (d->all) return;
+    if (d->count == d->size) {
+        size = d->size ? 2 * d->size : 8;
+        tmrm_arena_suspend();
+        drops = (tmrm_storage_cache_drop*)TMRM_REALLOC(
+                tmrm_storage_cache_drop, d->drops,
+                size * sizeof(tmrm_storage_cache_drop));
+        tmrm_arena_resume();
+        if (!drops) {
+            d->all = 1;
+            return;
+        }
+        d->drops = drops;
+        d->size = size;
+    }
+    d->drops[d->count].op = op;
+    d->drops[d->count].proxy = proxy;
+    d->drops[d->count].key = key;
+    d->count++;
 }
 
-tmrm_iterator*
-tmrm_storage_proxy_direct_superclasses(tmrm_storage* s, tmrm_proxy *p)
+
+/* The cached keys of p and its values for key */
+static void
+_drops_property(tmrm_storage_cache_drops* d, tmrm_label p, tmrm_label key)
 {
-    return s->factory->proxy_direct_superclasses(s, p);
+    _drops_add(d, TMRM_CACHE_VALUES_BY_KEY, p, key);
+    _drops_add(d, TMRM_CACHE_KEYS, p, 0);
 }
 
-tmrm_iterator*
-tmrm_storage_proxy_direct_types(tmrm_storage* s, tmrm_proxy *p)
+
+/* The cached direct types of all proxies that p makes an instance.
+   Types are bound by a proxy with the properties type: <type> and
+   instance: <instance> (see the add_type callback of the storages). */
+static void
+_drops_instances(tmrm_storage* s, tmrm_storage_cache_drops* d,
+        tmrm_proxy* p)
 {
-    return s->factory->proxy_direct_types(s, p);
+    tmrm_iterator* it;
+    tmrm_object* object;
+
+    if (!p->subject_map->instance) return;
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_VALUES_BY_KEY, p->label,
+            p->subject_map->instance->label, it,
+            s->factory->proxy_values_by_key(s, p, p->subject_map->instance),
+            it == NULL);
+    if (!it) {
+        /* The instances are unknown, so all types have to go */
+        d->all_types = 1;
+        tmrm_arena_resume();
+        return;
+    }
+    while (!tmrm_iterator_end(it)) {
+        object = tmrm_iterator_get_object(it);
+        if (object && tmrm_object_is_proxy(object)) {
+            _drops_add(d, TMRM_CACHE_DIRECT_TYPES,
+                    ((tmrm_proxy*)object)->label, 0);
+        }
+        if (object) tmrm_object_free(object);
+        if (tmrm_iterator_next(it)) break;
+    }
+    tmrm_iterator_free(it);
+    tmrm_arena_resume();
 }
 
-tmrm_iterator*
-tmrm_storage_proxy_direct_instances(tmrm_storage* s, tmrm_proxy *p)
+
+/* The results that a new, changed or removed property of p with key
+   changes. value is NULL for literal values. */
+static void
+_drops_property_changed(tmrm_storage* s, tmrm_storage_cache_drops* d,
+        tmrm_proxy* p, tmrm_label key, const tmrm_label* value)
 {
-    return s->factory->proxy_direct_instances(s, p);
+    tmrm_subject_map* map = p->subject_map;
+
+    _drops_property(d, p->label, key);
+    if (map->instance && key == map->instance->label) {
+        if (value) _drops_add(d, TMRM_CACHE_DIRECT_TYPES, *value, 0);
+    } else if (map->type && key == map->type->label) {
+        _drops_instances(s, d, p);
+    }
 }
 
+
+/* Context of _cache_changed() */
+typedef struct {
+    tmrm_storage* storage;
+    tmrm_storage_cache_drops* drops;
+    tmrm_subject_map* map;
+} tmrm_storage_cache_poll_context;
+
+/* Records the results that a property written by another process
+   changes */
+static void
+_cache_changed(void* data, tmrm_label proxy, tmrm_label key,
+        const tmrm_label* value)
+{
+    tmrm_storage_cache_poll_context* c =
+        (tmrm_storage_cache_poll_context*)data;
+    tmrm_proxy p;
+
+    memset(&p, 0, sizeof(p));
+    p.type = TMRM_TYPE_PROXY;
+    p.subject_map = c->map;
+    p.label = proxy;
+    _drops_property_changed(c->storage, c->drops, &p, key, value);
+}
+
+
+/* Everything that the removal of p changes: the results for p and with p
+   as key, the results that contain p and the results of the proxies that
+   have p as a value. The proxies that refer to p are only known before
+   the removal. */
+static void
+_drops_proxy(tmrm_storage* s, tmrm_storage_cache_drops* d,
+        const tmrm_proxy* p)
+{
+    tmrm_iterator *keys, *proxies;
+    tmrm_object *key, *object;
+
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_KEYS_BY_VALUE, p->label, 0, keys,
+            s->factory->proxy_keys_by_value(s, (tmrm_proxy*)p), keys == NULL);
+    while (keys && !tmrm_iterator_end(keys)) {
+        key = tmrm_iterator_get_object(keys);
+        proxies = NULL;
+        if (key) {
+            _stats_call(s, TMRM_STORAGE_OP_PROXY_IS_VALUE_BY_KEY, p->label,
+                    ((tmrm_proxy*)key)->label, proxies,
+                    s->factory->proxy_is_value_by_key(s, (tmrm_proxy*)p,
+                        (tmrm_proxy*)key), proxies == NULL);
+        }
+        while (proxies && !tmrm_iterator_end(proxies)) {
+            object = tmrm_iterator_get_object(proxies);
+            if (object) {
+                _drops_property(d, ((tmrm_proxy*)object)->label,
+                        ((tmrm_proxy*)key)->label);
+                tmrm_object_free(object);
+            }
+            if (tmrm_iterator_next(proxies)) break;
+        }
+        if (proxies) tmrm_iterator_free(proxies);
+        if (key) tmrm_object_free(key);
+        if (tmrm_iterator_next(keys)) break;
+    }
+    if (keys) tmrm_iterator_free(keys);
+    tmrm_arena_resume();
+    _drops_instances(s, d, (tmrm_proxy*)p);
+    d->removed = p;
+}
+
+
+/* Drops the results recorded in d and frees them. Must be called with the
+   cache locked. */
+static void
+_cache_drop_all(tmrm_storage_cache* cache, tmrm_storage_cache_drops* d)
+{
+    tmrm_storage_cache_entry *e, *next;
+    const tmrm_proxy* p = d->removed;
+    int i, drop;
+
+    if (d->all) {
+        _cache_clear(cache);
+    } else {
+        for (i = 0; i < d->count; i++) {
+            _cache_drop(cache, d->drops[i].op, d->drops[i].proxy,
+                    d->drops[i].key);
+        }
+        if (d->all_types || p) {
+            cache->generation++;
+            for (e = cache->head; e; e = next) {
+                next = e->next;
+                drop = d->all_types && e->op == TMRM_CACHE_DIRECT_TYPES;
+                if (p && !drop) {
+                    drop = e->proxy == p->label ||
+                        (e->op == TMRM_CACHE_VALUES_BY_KEY &&
+                         e->key == p->label);
+                }
+                for (i = 0; p && !drop && i < e->count; i++) {
+                    drop = tmrm_object_is_proxy(e->objects[i]) &&
+                        ((tmrm_proxy*)e->objects[i])->label == p->label;
+                }
+                if (drop) _cache_unlink(cache, e);
+            }
+        }
+    }
+    if (d->drops) TMRM_FREE(tmrm_storage_cache_drop, d->drops);
+    memset(d, 0, sizeof(*d));
+}
+
+
+/* Drops the results recorded in d, if the subject map has a cache */
+static void
+_cache_drop_changes(tmrm_storage_cache* cache, tmrm_storage_cache_drops* d)
+{
+    if (!cache) return;
+    _cache_lock(cache);
+    _cache_drop_all(cache, d);
+    _cache_unlock(cache);
+}
+
+
+static int
+_cache_iterator_next(void* context)
+{
+    tmrm_storage_cache_iterator_context* c =
+        (tmrm_storage_cache_iterator_context*)context;
+    if (c->index >= c->count) return 1;
+    c->index++;
+    return 0;
+}
+
+static int
+_cache_iterator_end(void* context)
+{
+    tmrm_storage_cache_iterator_context* c =
+        (tmrm_storage_cache_iterator_context*)context;
+    return c->index >= c->count;
+}
+
+/* Returns a copy of a cached proxy or literal */
+static tmrm_object*
+_cache_object_copy(tmrm_object* object)
+{
+    tmrm_proxy* p;
+    tmrm_literal* lit;
+
+    if (tmrm_object_is_proxy(object)) {
+        p = tmrm_proxy_clone((tmrm_proxy*)object);
+        return p ? tmrm_proxy_to_object(p) : NULL;
+    }
+    lit = tmrm_literal_clone((tmrm_literal*)object);
+    return lit ? tmrm_literal_to_object(lit) : NULL;
+}
+
+/* Returns a copy of the current object, as the storage iterators do */
+static tmrm_object*
+_cache_iterator_get_element(void* context, tmrm_iterator_flag flag)
+{
+    tmrm_storage_cache_iterator_context* c =
+        (tmrm_storage_cache_iterator_context*)context;
+
+    if (c->index >= c->count) return NULL;
+    return _cache_object_copy(c->objects[c->index]);
+}
+
+static void
+_cache_iterator_free(void* context)
+{
+    tmrm_storage_cache_iterator_context* c =
+        (tmrm_storage_cache_iterator_context*)context;
+    int i;
+
+    if (c->entry) {
+        _cache_lock(c->cache);
+        _cache_entry_release(c->entry);
+        _cache_unlock(c->cache);
+    } else {
+        for (i = 0; i < c->count; i++) tmrm_object_free(c->objects[i]);
+        if (c->objects) TMRM_FREE(tmrm_object*, c->objects);
+    }
+    TMRM_FREE(tmrm_storage_cache_iterator_context, c);
+}
+
+
+/* Must be called with the cache locked */
+static tmrm_iterator*
+_cache_iterator_new(tmrm_storage* s, tmrm_storage_cache* cache,
+        tmrm_storage_cache_entry* e)
+{
+    tmrm_storage_cache_iterator_context* c;
+    tmrm_iterator* it;
+    int copy = tmrm_arena_active();
+
+    if (!(c = (tmrm_storage_cache_iterator_context*)TMRM_CALLOC(
+                    tmrm_storage_cache_iterator_context, 1,
+                    sizeof(tmrm_storage_cache_iterator_context)))) {
+        return NULL;
+    }
+    c->cache = cache;
+    if (copy) {
+        if (e->count > 0 && !(c->objects = (tmrm_object**)TMRM_CALLOC(
+                        tmrm_object*, e->count, sizeof(tmrm_object*)))) {
+            _cache_iterator_free(c);
+            return NULL;
+        }
+        for (c->count = 0; c->count < e->count; c->count++) {
+            c->objects[c->count] = _cache_object_copy(e->objects[c->count]);
+            if (!c->objects[c->count]) {
+                _cache_iterator_free(c);
+                return NULL;
+            }
+        }
+    } else {
+        c->objects = e->objects;
+        c->count = e->count;
+    }
+    it = tmrm_iterator_new(s->subject_map_sphere, (void*)c,
+            _cache_iterator_next, _cache_iterator_end,
+            _cache_iterator_get_element, _cache_iterator_free);
+    if (!it) {
+        if (copy) _cache_iterator_free(c);
+        else TMRM_FREE(tmrm_storage_cache_iterator_context, c);
+        return NULL;
+    }
+    if (!copy) {
+        c->entry = e;
+        e->refs++;
+    }
+    return it;
+}
+
+
+/* Reads all objects of it into a new cache entry, which is not yet in the
+   cache.
+
+   @returns NULL if it fails or the storage could not be read */
+static tmrm_storage_cache_entry*
+_cache_entry_read(tmrm_storage_cache_op op, tmrm_label proxy, tmrm_label key,
+        tmrm_iterator* it)
+{
+    tmrm_storage_cache_entry* e;
+    tmrm_object** objects;
+    tmrm_object* object;
+    tmrm_literal* lit;
+    int capacity = 0;
+
+    if (!(e = (tmrm_storage_cache_entry*)TMRM_CALLOC(
+                    tmrm_storage_cache_entry, 1,
+                    sizeof(tmrm_storage_cache_entry)))) {
+        return NULL;
+    }
+    e->op = op;
+    e->proxy = proxy;
+    e->key = key;
+    e->refs = 1;
+    while (!tmrm_iterator_end(it)) {
+        /* A partial result must not be cached */
+        if (!(object = tmrm_iterator_get_object(it))) {
+            _cache_entry_release(e);
+            return NULL;
+        }
+        /* Do not keep the result a borrowed value points into */
+        if (tmrm_object_is_literal(object) &&
+                ((tmrm_literal*)object)->storage == TMRM_LITERAL_BORROWED) {
+            lit = tmrm_literal_new(tmrm_literal_value((tmrm_literal*)object),
+                    tmrm_literal_datatype((tmrm_literal*)object));
+            tmrm_object_free(object);
+            if (!lit) {
+                _cache_entry_release(e);
+                return NULL;
+            }
+            object = tmrm_literal_to_object(lit);
+        }
+        if (e->count == capacity) {
+            capacity = capacity ? 2 * capacity : 8;
+            objects = (tmrm_object**)TMRM_REALLOC(tmrm_object*, e->objects,
+                    capacity * sizeof(tmrm_object*));
+            if (!objects) {
+                tmrm_object_free(object);
+                _cache_entry_release(e);
+                return NULL;
+            }
+            e->objects = objects;
+        }
+        e->objects[e->count++] = object;
+        if (tmrm_iterator_next(it) && !tmrm_iterator_end(it)) {
+            _cache_entry_release(e);
+            return NULL;
+        }
+    }
+    return e;
+}
+
+
+/* Adds an entry from _cache_entry_read() to the cache. Evicts the least
+   recently used entry if the cache is full. Must be called with the cache
+   locked. */
+static void
+_cache_link(tmrm_storage_cache* cache, tmrm_storage_cache_entry* e)
+{
+    size_t bucket;
+
+    if (cache->size >= cache->capacity) _cache_unlink(cache, cache->tail);
+    bucket = _cache_bucket(cache, e->op, e->proxy, e->key);
+    e->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = e;
+    e->next = cache->head;
+    if (cache->head) cache->head->prev = e;
+    else cache->tail = e;
+    cache->head = e;
+    cache->size++;
+}
+
+
+/* Reads the result of op from the storage */
+static tmrm_iterator*
+_cache_fetch(tmrm_storage* s, tmrm_storage_cache_op op, tmrm_proxy* p,
+        tmrm_proxy* key)
+{
+    tmrm_iterator* it;
+
+    switch (op) {
+        case TMRM_CACHE_VALUES_BY_KEY:
+            _stats_call(s, TMRM_STORAGE_OP_PROXY_VALUES_BY_KEY, p->label,
+                    key->label, it, s->factory->proxy_values_by_key(s, p, key),
+                    it == NULL);
+            break;
+        case TMRM_CACHE_KEYS:
+            _stats_call(s, TMRM_STORAGE_OP_PROXY_KEYS, p->label, 0, it,
+                    s->factory->proxy_keys(s, p), it == NULL);
+            break;
+        default:
+            _stats_call(s, TMRM_STORAGE_OP_PROXY_DIRECT_TYPES, p->label, 0, it,
+                    s->factory->proxy_direct_types(s, p), it == NULL);
+            break;
+    }
+    return it;
+}
+
+/* The statistics that _cache_fetch() records op in */
+static tmrm_storage_op
+_cache_stats_op(tmrm_storage_cache_op op)
+{
+    switch (op) {
+        case TMRM_CACHE_VALUES_BY_KEY:
+            return TMRM_STORAGE_OP_PROXY_VALUES_BY_KEY;
+        case TMRM_CACHE_KEYS:
+            return TMRM_STORAGE_OP_PROXY_KEYS;
+        default:
+            return TMRM_STORAGE_OP_PROXY_DIRECT_TYPES;
+    }
+}
+
+
+/* Returns an iterator over the cached result of op, or reads the result
+   from the storage and caches it. The cache is not locked while the
+   storage is read. */
+static tmrm_iterator*
+_cache_lookup(tmrm_storage* s, tmrm_storage_cache* cache,
+        tmrm_storage_cache_op op, tmrm_proxy* p, tmrm_proxy* key)
+{
+    tmrm_storage_cache_entry *e, *cached;
+    tmrm_iterator* it;
+    tmrm_storage_cache_poll_context poll;
+    tmrm_storage_cache_drops drops;
+    unsigned long generation;
+    int ret;
+    tmrm_label k = op == TMRM_CACHE_VALUES_BY_KEY ? key->label : 0;
+
+    if (s->factory->poll_changes) {
+        memset(&drops, 0, sizeof(drops));
+        poll.storage = s;
+        poll.drops = &drops;
+        poll.map = p->subject_map;
+        tmrm_arena_suspend();
+        _stats_call(s, TMRM_STORAGE_OP_POLL_CHANGES, 0, 0, ret,
+                s->factory->poll_changes(s, _cache_changed, &poll), ret != 0);
+        tmrm_arena_resume();
+        _cache_drop_changes(cache, &drops);
+    }
+    _cache_lock(cache);
+    if ((e = _cache_find(cache, op, p->label, k))) {
+        cache->hits++;
+        /* Move to the front of the LRU list */
+        if (e->prev) {
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev;
+            else cache->tail = e->prev;
+            e->prev = NULL;
+            e->next = cache->head;
+            cache->head->prev = e;
+            cache->head = e;
+        }
+        it = _cache_iterator_new(s, cache, e);
+        _cache_unlock(cache);
+        return it;
+    }
+    cache->misses++;
+    generation = cache->generation;
+    _cache_unlock(cache);
+
+    /* Cached results outlive any arena */
+    tmrm_arena_suspend();
+    e = NULL;
+    if ((it = _cache_fetch(s, op, p, key))) {
+        e = _cache_entry_read(op, p->label, k, it);
+        if (e) _stats_add(s->stats[_cache_stats_op(op)].rows, e->count);
+        tmrm_iterator_free(it);
+    }
+    tmrm_arena_resume();
+    if (!e) return NULL;
+
+    _cache_lock(cache);
+    if (cache->generation != generation) {
+        /* A write dropped results while the storage was read, and this
+           one may predate it. It is only handed to this caller. */
+        it = _cache_iterator_new(s, cache, e);
+        _cache_entry_release(e);
+    } else {
+        if ((cached = _cache_find(cache, op, p->label, k))) {
+            /* Another thread has cached the result in the meantime */
+            _cache_entry_release(e);
+            e = cached;
+        } else {
+            _cache_link(cache, e);
+        }
+        it = _cache_iterator_new(s, cache, e);
+    }
+    _cache_unlock(cache);
+    return it;
+}
+
+
+/**
+ * Removes a given subject map and its storage (e.g. by removing associated
+ * files or databases). 
+ * If the storage supports several subject maps, only the parts affecting the
+ * subject map are removed. If map is null, all subject maps are removed from
+ * the storage.
+ * Note that this function does not free the memory occupied by the subject
+ * map and the storage (and the subject map system) objects. You still have
+ * to call tmrm_subject_map_free() and tmrm_storage_free(). Other calls than
+ * there are not guaranteed to work.
+ *
+ * @param s The storage object
+ * @param map The subject map object.
+ * @returns 0 on success or a non-zero value on failure.
+ */
+int
+tmrm_storage_remove(tmrm_storage* s, tmrm_subject_map* map) {
+    int ret = 0;
+
+    if (map && _read_only(map)) return 1;
+    _write_lock(s);
+    /* Ignore if not applicable or not implemented */
+    if (s->factory->remove) {
+        tmrm_arena_suspend();
+        _stats_call(s, TMRM_STORAGE_OP_REMOVE, 0, 0, ret,
+                s->factory->remove(s, map), ret != 0);
+        tmrm_arena_resume();
+    }
+    if (map && map->cache) {
+        _cache_lock(map->cache);
+        _cache_clear(map->cache);
+        _cache_unlock(map->cache);
+    }
+    _unlock(s);
+    return ret;
+}
+
+int tmrm_storage_bootstrap(tmrm_storage* s, tmrm_subject_map* map)
+{
+    int ret;
+
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_BOOTSTRAP, 0, 0, ret,
+            s->factory->bootstrap(s, map), ret != 0);
+    tmrm_arena_resume();
+    _unlock(s);
+    return ret;
+}
+
+tmrm_proxy* tmrm_storage_bottom(tmrm_storage* s, tmrm_subject_map* map) {
+    tmrm_proxy* ret;
+
+    /* Creates the bottom proxy if it is missing */
+    _write_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_BOTTOM, 0, 0, ret,
+            s->factory->bottom(s, map), ret == NULL);
+    _unlock(s);
+    return ret;
+}
+
+int tmrm_storage_merge(tmrm_storage* s, tmrm_subject_map* map) {
+    int ret;
+
+    if (_read_only(map)) return 1;
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_MERGE, 0, 0, ret, s->factory->merge(s, map),
+            ret != 0);
+    tmrm_arena_resume();
+    if (map->cache) {
+        _cache_lock(map->cache);
+        _cache_clear(map->cache);
+        _cache_unlock(map->cache);
+    }
+    _unlock(s);
+    return ret;
+}
+
+tmrm_proxy*
+tmrm_storage_proxy_create(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_proxy* ret;
+
+    if (_read_only(map)) return NULL;
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_CREATE, 0, 0, ret,
+            s->factory->proxy_create(s, map), ret == NULL);
+    tmrm_arena_resume();
+    _unlock(s);
+    return ret;
+}
+
+int
+tmrm_storage_proxy_update(tmrm_storage* s, tmrm_proxy* p)
+{
+    int ret;
+
+    if (_read_only(p->subject_map)) return 1;
+    /* Ignore if not applicable or not implemented */
+    if (s->factory->proxy_update == NULL) return 0;
+
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_UPDATE, p->label, 0, ret,
+            s->factory->proxy_update(s, p), ret != 0);
+    tmrm_arena_resume();
+    _unlock(s);
+    return ret;
+}
+
+int
+tmrm_storage_add_property(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value)
+{
+    int ret;
+    tmrm_storage_cache* cache = p->subject_map->cache;
+    tmrm_storage_cache_drops drops;
+
+    if (_read_only(p->subject_map)) return 1;
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_ADD_PROPERTY, p->label, key->label, ret,
+            s->factory->add_property(s, p, key, value), ret != 0);
+    tmrm_arena_resume();
+    if (cache) {
+        memset(&drops, 0, sizeof(drops));
+        _drops_property_changed(s, &drops, p, key->label, &value->label);
+        _cache_drop_changes(cache, &drops);
+    }
+    _unlock(s);
+    return ret;
+}
+
+int
+tmrm_storage_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value)
+{
+    int ret;
+    tmrm_storage_cache* cache = p->subject_map->cache;
+    tmrm_storage_cache_drops drops;
+
+    if (_read_only(p->subject_map)) return 1;
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_ADD_PROPERTY_LITERAL, p->label, key->label,
+            ret, s->factory->add_property_literal(s, p, key, value), ret != 0);
+    tmrm_arena_resume();
+    if (cache) {
+        memset(&drops, 0, sizeof(drops));
+        _drops_property(&drops, p->label, key->label);
+        _cache_drop_changes(cache, &drops);
+    }
+    _unlock(s);
+    return ret;
+}
+
+int
+tmrm_storage_remove_properties_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    int ret;
+    tmrm_storage_cache* cache = p->subject_map->cache;
+    tmrm_subject_map* map = p->subject_map;
+    tmrm_storage_cache_drops drops;
+
+    if (_read_only(p->subject_map)) return 1;
+    _write_lock(s);
+    memset(&drops, 0, sizeof(drops));
+    /* The instances are only known before the removal */
+    if (cache && ((map->instance && key->label == map->instance->label) ||
+                (map->type && key->label == map->type->label))) {
+        _drops_instances(s, &drops, p);
+    }
+    /* TODO Could also be implemented independent of the storage (get all
+       properties with key 'key' and remove all of them) */
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_REMOVE_PROPERTIES_BY_KEY, p->label,
+            key->label, ret,
+            s->factory->proxy_remove_properties_by_key(s, p, key), ret != 0);
+    tmrm_arena_resume();
+    if (cache) {
+        _drops_property(&drops, p->label, key->label);
+        _cache_drop_changes(cache, &drops);
+    }
+    _unlock(s);
+    return ret;
+}
+
+
+tmrm_iterator*
+tmrm_storage_proxy_get_properties(tmrm_storage* s, tmrm_proxy* p) {
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_PROPERTIES, p->label, 0, it,
+            s->factory->proxy_properties(s, p), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_PROXY_PROPERTIES, it);
+}
+
+
+tmrm_proxy*
+tmrm_storage_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
+        const char *label)
+{
+    tmrm_proxy* ret;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_BY_LABEL, 0, 0, ret,
+            s->factory->proxy_by_label(s, map, label), ret == NULL);
+    _unlock(s);
+    return ret;
+}
+
+tmrm_iterator*
+tmrm_storage_proxies(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXIES, 0, 0, it,
+            s->factory->proxies(s, map), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_PROXIES, it);
+}
+
+
+/**
+ * Passes every proxy of the subject map to the callbacks of visitor, each
+ * followed by its properties. The labels are handed over as integers and
+ * the literal strings are borrowed, so visitors need not free anything.
+ * Storages that implement the scan_properties callback do this in a single
+ * pass; for the others, the proxies and their properties are read with the
+ * proxies and proxy_properties iterators.
+ *
+ * @returns 0 on success or a non-zero value on failure or if a callback
+ *          returned a non-zero value.
+ */
+int
+tmrm_storage_scan_properties(tmrm_storage* s, tmrm_subject_map* map,
+        const tmrm_property_visitor* visitor, void* data)
+{
+    tmrm_iterator *it, *prop_it;
+    tmrm_object *obj, *key, *value;
+    tmrm_proxy *p, *value_proxy;
+    tmrm_literal *value_literal;
+    int ret = 0;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(visitor, tmrm_property_visitor, 1);
+
+    /* A snapshot stays consistent without holding the lock for the whole
+       scan, so it reads proxy by proxy and lets writers in between */
+    if (!map->snapshot) {
+        _read_lock(s);
+        if (s->factory->scan_properties) {
+            _stats_call(s, TMRM_STORAGE_OP_SCAN_PROPERTIES, 0, 0, ret,
+                    s->factory->scan_properties(s, map, visitor, data),
+                    ret != 0);
+            _unlock(s);
+            return ret;
+        }
+    }
+
+    if (!(it = tmrm_storage_proxies(s, map))) {
+        if (!map->snapshot) _unlock(s);
+        return 1;
+    }
+
+    while (!tmrm_iterator_end(it) && ret == 0) {
+        obj = tmrm_iterator_get_object(it);
+        if (!obj || !(p = tmrm_object_to_proxy(obj))) {
+            if (obj) tmrm_object_free(obj);
+            ret = 1;
+            break;
+        }
+        if ((ret = visitor->proxy(data, p->label)) ||
+                !(prop_it = tmrm_storage_proxy_get_properties(s, p))) {
+            tmrm_proxy_free(p);
+            if (!ret) ret = 1;
+            break;
+        }
+        while (!tmrm_iterator_end(prop_it) && ret == 0) {
+            key = tmrm_iterator_get_key(prop_it);
+            value = tmrm_iterator_get_value(prop_it);
+            if (!key || !value || !tmrm_object_to_proxy(key)) {
+                TMRM_LOG(TMRM_LOG_ERROR, "Could not read property of proxy %d",
+                        (int)p->label);
+                ret = 1;
+            } else if ((value_proxy = tmrm_object_to_proxy(value))) {
+                ret = visitor->property(data, p->label,
+                        tmrm_object_to_proxy(key)->label, value_proxy->label);
+            } else if ((value_literal = tmrm_object_to_literal(value))) {
+                ret = visitor->property_literal(data, p->label,
+                        tmrm_object_to_proxy(key)->label,
+                        tmrm_literal_value(value_literal),
+                        tmrm_literal_datatype(value_literal));
+            }
+            if (key) tmrm_object_free(key);
+            if (value) tmrm_object_free(value);
+            if (ret == 0 && tmrm_iterator_next(prop_it)) break;
+        }
+        tmrm_iterator_free(prop_it);
+        tmrm_proxy_free(p);
+        if (ret == 0 && tmrm_iterator_next(it)) break;
+    }
+    tmrm_iterator_free(it);
+    if (!map->snapshot) _unlock(s);
+    return ret;
+}
+
+
+/** 
+ * Returns the label of a proxy from the backend.
+ * Returns NULL on failure.
+ */
+const char*
+tmrm_storage_proxy_label(tmrm_storage* s, tmrm_proxy* p)
+{
+    const char* ret;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_LABEL, p->label, 0, ret,
+            s->factory->proxy_label(s, p), ret == NULL);
+    _unlock(s);
+    return ret;
+}
+
+tmrm_iterator*
+tmrm_storage_proxy_keys(tmrm_storage* s, tmrm_proxy* p)
+{
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    if (p->subject_map->cache) {
+        it = _cache_lookup(s, p->subject_map->cache, TMRM_CACHE_KEYS,
+                p, NULL);
+    } else {
+        _stats_call(s, TMRM_STORAGE_OP_PROXY_KEYS, p->label, 0, it,
+                s->factory->proxy_keys(s, p), it == NULL);
+        it = _locked_iterator(s, TMRM_STORAGE_OP_PROXY_KEYS, it);
+    }
+    _unlock(s);
+    return it;
+}
+
+tmrm_iterator*
+tmrm_storage_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    if (p->subject_map->cache) {
+        it = _cache_lookup(s, p->subject_map->cache,
+                TMRM_CACHE_VALUES_BY_KEY, p, key);
+    } else {
+        _stats_call(s, TMRM_STORAGE_OP_PROXY_VALUES_BY_KEY, p->label,
+                key->label, it, s->factory->proxy_values_by_key(s, p, key),
+                it == NULL);
+        it = _locked_iterator(s, TMRM_STORAGE_OP_PROXY_VALUES_BY_KEY, it);
+    }
+    _unlock(s);
+    return it;
+}
+
+tmrm_iterator*
+tmrm_storage_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key) {
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_IS_VALUE_BY_KEY, p->label, key->label,
+            it, s->factory->proxy_is_value_by_key(s, p, key), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_PROXY_IS_VALUE_BY_KEY, it);
+}
+
+tmrm_iterator*
+tmrm_storage_proxy_keys_by_value(tmrm_storage* s, tmrm_proxy* p) {
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_KEYS_BY_VALUE, p->label, 0, it,
+            s->factory->proxy_keys_by_value(s, p), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_PROXY_KEYS_BY_VALUE, it);
+}
+
+tmrm_iterator*
+tmrm_storage_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key) {
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_LITERAL_IS_VALUE_BY_KEY, 0, key->label, it,
+            s->factory->literal_is_value_by_key(s, lit, key), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_LITERAL_IS_VALUE_BY_KEY, it);
+}
+
+/* Context of the iterator that tmrm_storage_is_value_by_key_many() returns
+   for storages without the is_value_by_key_many callback */
+typedef struct {
+    tmrm_storage* storage;
+    tmrm_object* const* values;
+    int count;
+    int index;
+    tmrm_proxy* key;
+    tmrm_iterator* current; /* NULL at the end */
+} tmrm_storage_many_context;
+
+
+/* Moves on to the next input that has a match. Returns 0 on success. */
+static int
+_many_advance(tmrm_storage_many_context* c)
+{
+    tmrm_object* object;
+    tmrm_object_type type;
+
+    while (c->current == NULL || tmrm_iterator_end(c->current)) {
+        if (c->current) {
+            tmrm_iterator_free(c->current);
+            c->current = NULL;
+        }
+        if (c->index >= c->count) return 0;
+        object = c->values[c->index++];
+        type = tmrm_object_get_type(object);
+        switch (type) {
+            case TMRM_TYPE_PROXY:
+                c->current = tmrm_storage_proxy_is_value_by_key(c->storage,
+                        (tmrm_proxy*)object, c->key);
+                break;
+            case TMRM_TYPE_LITERAL:
+                c->current = tmrm_storage_literal_is_value_by_key(c->storage,
+                        (tmrm_literal*)object, c->key);
+                break;
+            default:
+                TMRM_DEBUG2("Unknown object type %d\n", (int)type);
+                continue;
+        }
+        if (c->current == NULL) return 1;
+    }
+    return 0;
+}
+
+static int
+_many_next(void* context)
+{
+    tmrm_storage_many_context* c = (tmrm_storage_many_context*)context;
+    if (c->current == NULL) return 1;
+    if (tmrm_iterator_next(c->current)) return 1;
+    return _many_advance(c);
+}
+
+static int
+_many_end(void* context)
+{
+    return ((tmrm_storage_many_context*)context)->current == NULL;
+}
+
+static tmrm_object*
+_many_get_element(void* context, tmrm_iterator_flag flag)
+{
+    tmrm_storage_many_context* c = (tmrm_storage_many_context*)context;
+    if (c->current == NULL) return NULL;
+    switch (flag) {
+        case TMRM_ITERATOR_GET_METHOD_GET_KEY:
+            return tmrm_iterator_get_key(c->current);
+        case TMRM_ITERATOR_GET_METHOD_GET_VALUE:
+            return tmrm_iterator_get_value(c->current);
+        default:
+            return tmrm_iterator_get_object(c->current);
+    }
+}
+
+static void
+_many_free(void* context)
+{
+    tmrm_storage_many_context* c = (tmrm_storage_many_context*)context;
+    if (c->current) tmrm_iterator_free(c->current);
+    TMRM_FREE(tmrm_storage_many_context, c);
+}
+
+
+/* Inputs of tmrm_storage_is_value_by_key_many() are split into chunks of
+   this size when the sphere has an executor */
+#define TMRM_STORAGE_PARALLEL_CHUNK 256
+
+/* Chunks of a parallel tmrm_storage_is_value_by_key_many() */
+typedef struct {
+    tmrm_storage* storage;
+    tmrm_object* const* values;
+    int count;
+    tmrm_proxy* key;
+    tmrm_object*** objects; /* results of each chunk */
+    int* counts;            /* -1 if the chunk failed */
+} tmrm_storage_parallel_context;
+
+
+/* Returns the executor if tmrm_storage_is_value_by_key_many() should split
+   count inputs into chunks */
+static tmrm_executor*
+_parallel_executor(tmrm_storage* s, int count)
+{
+    if (count < 2 * TMRM_STORAGE_PARALLEL_CHUNK) return NULL;
+    if (s->factory->concurrency == TMRM_STORAGE_SERIALIZED) return NULL;
+    /* The results of the workers would not come from the arena */
+    if (tmrm_arena_active()) return NULL;
+    return s->subject_map_sphere->executor;
+}
+
+
+static void
+_parallel_chunk(void* data, int index)
+{
+    tmrm_storage_parallel_context* c = (tmrm_storage_parallel_context*)data;
+    int start = index * TMRM_STORAGE_PARALLEL_CHUNK;
+    int count = c->count - start;
+    tmrm_object** objects = NULL;
+    tmrm_object** grown;
+    tmrm_object* object;
+    tmrm_iterator* it;
+    int n = 0, max = 0;
+
+    if (count > TMRM_STORAGE_PARALLEL_CHUNK) {
+        count = TMRM_STORAGE_PARALLEL_CHUNK;
+    }
+    c->counts[index] = -1;
+    if (!(it = tmrm_storage_is_value_by_key_many(c->storage,
+                    c->values + start, count, c->key))) {
+        return;
+    }
+    while (!tmrm_iterator_end(it)) {
+        if (!(object = tmrm_iterator_get_object(it))) break;
+        if (n == max) {
+            max = max ? 2 * max : 16;
+            if (!(grown = (tmrm_object**)TMRM_REALLOC(tmrm_object*, objects,
+                            max * sizeof(tmrm_object*)))) {
+                tmrm_object_free(object);
+                break;
+            }
+            objects = grown;
+        }
+        objects[n++] = object;
+        if (tmrm_iterator_next(it)) break;
+    }
+    if (tmrm_iterator_end(it)) c->counts[index] = n;
+    tmrm_iterator_free(it);
+    if (c->counts[index] < 0) {
+        while (n > 0) tmrm_object_free(objects[--n]);
+    }
+    c->objects[index] = objects;
+}
+
+
+/* Runs the chunks of tmrm_storage_is_value_by_key_many() on e and returns
+   the results in input order */
+static tmrm_iterator*
+_is_value_by_key_parallel(tmrm_storage* s, tmrm_executor* e,
+        tmrm_object* const* values, int count, tmrm_proxy* key)
+{
+    tmrm_storage_parallel_context pc;
+    tmrm_storage_cache_iterator_context* c = NULL;
+    tmrm_iterator* it = NULL;
+    int chunks = (count + TMRM_STORAGE_PARALLEL_CHUNK - 1) /
+        TMRM_STORAGE_PARALLEL_CHUNK;
+    int i, j, total = 0, failed = 0;
+
+    pc.storage = s;
+    pc.values = values;
+    pc.count = count;
+    pc.key = key;
+    pc.objects = (tmrm_object***)TMRM_CALLOC(tmrm_object**, chunks,
+            sizeof(tmrm_object**));
+    pc.counts = (int*)TMRM_CALLOC(int, chunks, sizeof(int));
+    if (pc.objects && pc.counts) {
+        tmrm_executor_run(e, chunks, _parallel_chunk, &pc);
+        for (i = 0; i < chunks; i++) {
+            if (pc.counts[i] < 0) failed = 1;
+            else total += pc.counts[i];
+        }
+    } else {
+        failed = 1;
+    }
+
+    if (!failed) {
+        c = (tmrm_storage_cache_iterator_context*)TMRM_CALLOC(
+                tmrm_storage_cache_iterator_context, 1,
+                sizeof(tmrm_storage_cache_iterator_context));
+        if (c && total > 0 && !(c->objects = (tmrm_object**)TMRM_CALLOC(
+                        tmrm_object*, total, sizeof(tmrm_object*)))) {
+            TMRM_FREE(tmrm_storage_cache_iterator_context, c);
+            c = NULL;
+        }
+    }
+    /* Hand the objects over to c, or free them */
+    for (i = 0; pc.objects && pc.counts && i < chunks; i++) {
+        for (j = 0; j < pc.counts[i]; j++) {
+            if (c) c->objects[c->count++] = pc.objects[i][j];
+            else tmrm_object_free(pc.objects[i][j]);
+        }
+        if (pc.objects[i]) TMRM_FREE(tmrm_object*, pc.objects[i]);
+    }
+    if (pc.objects) TMRM_FREE(tmrm_object**, pc.objects);
+    if (pc.counts) TMRM_FREE(int, pc.counts);
+    if (!c) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Parallel is_value_by_key failed");
+        return NULL;
+    }
+
+    it = tmrm_iterator_new(s->subject_map_sphere, (void*)c,
+            _cache_iterator_next, _cache_iterator_end,
+            _cache_iterator_get_element, _cache_iterator_free);
+    if (!it) _cache_iterator_free(c);
+    return it;
+}
+
+
+/**
+ * All proxies in which one of the proxies or literals in values is the
+ * value for key. The result holds one match per input and property, as
+ * if proxy_is_value_by_key or literal_is_value_by_key had been called for
+ * each input. Storages that implement the is_value_by_key_many callback
+ * answer this with a single request; for the others, the returned iterator
+ * runs the single-value queries one after the other.
+ *
+ * Large inputs are split into chunks that run in parallel on the
+ * executor of the sphere (see tmrm_subject_map_sphere_set_threads()),
+ * unless the storage serializes its calls or an arena is open.
+ *
+ * The values array is borrowed and must stay valid until the iterator is
+ * freed.
+ *
+ * @returns NULL on failure
+ */
+tmrm_iterator*
+tmrm_storage_is_value_by_key_many(tmrm_storage* s,
+        tmrm_object* const* values, int count, tmrm_proxy* key)
+{
+    tmrm_storage_many_context* c;
+    tmrm_executor* e;
+    tmrm_iterator* it;
+
+    if ((e = _parallel_executor(s, count))) {
+        return _is_value_by_key_parallel(s, e, values, count, key);
+    }
+    if (s->factory->is_value_by_key_many) {
+        _read_lock(s);
+        _stats_call(s, TMRM_STORAGE_OP_IS_VALUE_BY_KEY_MANY, 0, key->label, it,
+                s->factory->is_value_by_key_many(s, values, count, key),
+                it == NULL);
+        _unlock(s);
+        return _locked_iterator(s, TMRM_STORAGE_OP_IS_VALUE_BY_KEY_MANY, it);
+    }
+
+    if (!(c = (tmrm_storage_many_context*)TMRM_CALLOC(
+                    tmrm_storage_many_context, 1,
+                    sizeof(tmrm_storage_many_context)))) {
+        return NULL;
+    }
+    c->storage = s;
+    c->values = values;
+    c->count = count;
+    c->key = key;
+    if (_many_advance(c)) {
+        _many_free(c);
+        return NULL;
+    }
+    it = tmrm_iterator_new(s->subject_map_sphere, (void*)c, _many_next,
+            _many_end, _many_get_element, _many_free);
+    if (!it) _many_free(c);
+    return it;
+}
+
+
+/* Orders labels for qsort() */
+static int
+_label_compare(const void* a, const void* b)
+{
+    tmrm_label la = *(const tmrm_label*)a;
+    tmrm_label lb = *(const tmrm_label*)b;
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+
+/* Sorts labels and removes duplicates. Returns the new count. */
+static int
+_labels_sort_unique(tmrm_label* labels, int count)
+{
+    int i, n;
+
+    if (count < 2) return count;
+    qsort(labels, (size_t)count, sizeof(tmrm_label), _label_compare);
+    for (i = 1, n = 1; i < count; i++) {
+        if (labels[i] != labels[n - 1]) labels[n++] = labels[i];
+    }
+    return n;
+}
+
+
+/**
+ * The posting list of a (key, value) pair: the labels of all proxies that
+ * have the proxy or literal value as value for key, sorted and without
+ * duplicates. The labels are returned in a new array that must be free'd
+ * with TMRM_FREE; it is NULL if count is 0.
+ *
+ * @returns 0 on success
+ */
+int
+tmrm_storage_posting_list(tmrm_storage* s, tmrm_object* value,
+        tmrm_proxy* key, tmrm_label** labels, int* count)
+{
+    tmrm_iterator* it;
+    tmrm_object* object;
+    tmrm_label* items = NULL;
+    tmrm_label* tmp;
+    int size = 0, capacity = 0;
+
+    *labels = NULL;
+    *count = 0;
+    if (s->factory->posting_list) {
+        _read_lock(s);
+        _stats_call(s, TMRM_STORAGE_OP_POSTING_LIST, 0, key->label, size,
+                s->factory->posting_list(s, value, key, labels, count),
+                size != 0);
+        _unlock(s);
+        return size;
+    }
+
+    it = tmrm_storage_is_value_by_key_many(s, &value, 1, key);
+    if (!it) return 1;
+    while (!tmrm_iterator_end(it)) {
+        object = tmrm_iterator_get_object(it);
+        if (object && tmrm_object_get_type(object) == TMRM_TYPE_PROXY) {
+            if (size == capacity) {
+                capacity = capacity ? 2 * capacity : 16;
+                tmp = (tmrm_label*)TMRM_REALLOC(tmrm_label, items,
+                        capacity * sizeof(tmrm_label));
+                if (!tmp) {
+                    tmrm_object_free(object);
+                    tmrm_iterator_free(it);
+                    TMRM_FREE(tmrm_label, items);
+                    return 1;
+                }
+                items = tmp;
+            }
+            items[size++] = ((tmrm_proxy*)object)->label;
+        }
+        if (object) tmrm_object_free(object);
+        if (tmrm_iterator_next(it)) break;
+    }
+    tmrm_iterator_free(it);
+
+    *labels = items;
+    *count = _labels_sort_unique(items, size);
+    return 0;
+}
+
+
+/* A posting list and the read position of the intersection in it */
+typedef struct {
+    tmrm_label* labels;
+    int count;
+    int position;
+} tmrm_storage_posting;
+
+/* Context of the iterator that tmrm_storage_proxies_by_properties()
+   returns. The posting lists are ordered by size, so the smallest one
+   drives the intersection and the others are only probed. */
+typedef struct {
+    tmrm_subject_map* map;
+    tmrm_storage_posting* lists;
+    int count;
+    int end;
+} tmrm_storage_properties_context;
+
+
+/* Orders posting lists by size for qsort() */
+static int
+_posting_compare(const void* a, const void* b)
+{
+    return ((const tmrm_storage_posting*)a)->count -
+        ((const tmrm_storage_posting*)b)->count;
+}
+
+
+/* Moves the position of the list forward to the first label that is not
+   less than target. The distance is doubled until the target is passed,
+   and the last step is then bisected, so skipping n labels costs
+   O(log n) comparisons. */
+static void
+_posting_gallop(tmrm_storage_posting* list, tmrm_label target)
+{
+    int low = list->position;
+    int step = 1;
+    int high, mid;
+
+    if (low >= list->count || list->labels[low] >= target) return;
+    /* labels[low] < target */
+    while (low + step < list->count && list->labels[low + step] < target) {
+        low += step;
+        step *= 2;
+    }
+    high = low + step < list->count ? low + step : list->count;
+    /* labels[low] < target <= labels[high] (or high is the end) */
+    while (high - low > 1) {
+        mid = low + (high - low) / 2;
+        if (list->labels[mid] < target) low = mid;
+        else high = mid;
+    }
+    list->position = high;
+}
+
+
+/* Moves the smallest list to the next label that is in all lists, or sets
+   end */
+static void
+_properties_advance(tmrm_storage_properties_context* c)
+{
+    tmrm_storage_posting* first = &c->lists[0];
+    tmrm_storage_posting* list;
+    tmrm_label candidate;
+    int i;
+
+    for (;;) {
+        if (first->position >= first->count) {
+            c->end = 1;
+            return;
+        }
+        candidate = first->labels[first->position];
+        list = NULL;
+        for (i = 1; i < c->count; i++) {
+            _posting_gallop(&c->lists[i], candidate);
+            if (c->lists[i].position >= c->lists[i].count) {
+                c->end = 1;
+                return;
+            }
+            if (c->lists[i].labels[c->lists[i].position] != candidate) {
+                list = &c->lists[i];
+                break;
+            }
+        }
+        /* candidate is in all lists */
+        if (list == NULL) return;
+        /* list holds a larger label; no smaller one can match */
+        _posting_gallop(first, list->labels[list->position]);
+    }
+}
+
+static int
+_properties_next(void* context)
+{
+    tmrm_storage_properties_context* c =
+        (tmrm_storage_properties_context*)context;
+    if (c->end) return 1;
+    c->lists[0].position++;
+    _properties_advance(c);
+    return 0;
+}
+
+static int
+_properties_end(void* context)
+{
+    return ((tmrm_storage_properties_context*)context)->end;
+}
+
+static tmrm_object*
+_properties_get_element(void* context, tmrm_iterator_flag flag)
+{
+    tmrm_storage_properties_context* c =
+        (tmrm_storage_properties_context*)context;
+    tmrm_proxy* p;
+
+    if (c->end) return NULL;
+    p = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
+    if (!p) return NULL;
+    p->type = TMRM_TYPE_PROXY;
+    p->subject_map = c->map;
+    p->label = c->lists[0].labels[c->lists[0].position];
+    return tmrm_proxy_to_object(p);
+}
+
+static void
+_properties_free(void* context)
+{
+    tmrm_storage_properties_context* c =
+        (tmrm_storage_properties_context*)context;
+    int i;
+
+    for (i = 0; i < c->count; i++) {
+        if (c->lists[i].labels) TMRM_FREE(tmrm_label, c->lists[i].labels);
+    }
+    TMRM_FREE(tmrm_storage_posting, c->lists);
+    TMRM_FREE(tmrm_storage_properties_context, c);
+}
+
+
+/**
+ * All proxies that have all count properties keys[i]: values[i]. Each
+ * property is looked up as a posting list (see
+ * tmrm_storage_posting_list()), and the lists are intersected starting
+ * with the shortest one. The intersection runs while iterating, so the
+ * matches are streamed in label order. Once a posting list comes back
+ * empty, the remaining properties are not looked up at all.
+ *
+ * keys and values are only used during the call.
+ *
+ * @returns NULL on failure
+ */
+tmrm_iterator*
+tmrm_storage_proxies_by_properties(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_proxy* const* keys, tmrm_object* const* values, int count)
+{
+    tmrm_storage_properties_context* c;
+    tmrm_storage_posting empty;
+    tmrm_iterator* it;
+    int i;
+
+    if (!(c = (tmrm_storage_properties_context*)TMRM_CALLOC(
+                    tmrm_storage_properties_context, 1,
+                    sizeof(tmrm_storage_properties_context)))) {
+        return NULL;
+    }
+    c->map = map;
+    /* Without properties, nothing is selected */
+    c->count = count > 0 ? count : 1;
+    if (!(c->lists = (tmrm_storage_posting*)TMRM_CALLOC(tmrm_storage_posting,
+                    c->count, sizeof(tmrm_storage_posting)))) {
+        TMRM_FREE(tmrm_storage_properties_context, c);
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (tmrm_storage_posting_list(s, values[i], keys[i],
+                    &c->lists[i].labels, &c->lists[i].count)) {
+            _properties_free(c);
+            return NULL;
+        }
+        if (c->lists[i].count == 0) break;
+    }
+    if (i == count) {
+        qsort(c->lists, (size_t)count, sizeof(tmrm_storage_posting),
+                _posting_compare);
+    } else {
+        /* Let the empty list drive the intersection */
+        empty = c->lists[i];
+        c->lists[i] = c->lists[0];
+        c->lists[0] = empty;
+        c->count = i + 1;
+    }
+    _properties_advance(c);
+    it = tmrm_iterator_new(s->subject_map_sphere, (void*)c, _properties_next,
+            _properties_end, _properties_get_element, _properties_free);
+    if (!it) _properties_free(c);
+    return it;
+}
+
+tmrm_iterator*
+tmrm_storage_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map) {
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_LITERAL_KEYS_BY_VALUE, 0, 0, it,
+            s->factory->literal_keys_by_value(s, lit, map), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_LITERAL_KEYS_BY_VALUE, it);
+}
+
+/**
+ * Lets the storage evaluate a sequence of path steps for count proxies
+ * and literals (see the path callback of tmrm_storage_factory).
+ *
+ * @returns NULL on failure
+ */
+tmrm_iterator*
+tmrm_storage_path(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_object* const* values, int count,
+        const tmrm_path_step* steps, int step_count, int closure)
+{
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PATH, 0, 0, it,
+            s->factory->path(s, map, values, count, steps, step_count,
+                closure), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_PATH, it);
+}
+
+int
+tmrm_storage_proxy_remove(tmrm_storage* s, const tmrm_proxy* p)
+{
+    int ret;
+    tmrm_storage_cache* cache = p->subject_map->cache;
+    tmrm_storage_cache_drops drops;
+
+    if (_read_only(p->subject_map)) return 1;
+    _write_lock(s);
+    memset(&drops, 0, sizeof(drops));
+    if (cache) _drops_proxy(s, &drops, p);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_REMOVE, p->label, 0, ret,
+            s->factory->proxy_remove(s, p), ret != 0);
+    tmrm_arena_resume();
+    _cache_drop_changes(cache, &drops);
+    _unlock(s);
+    return ret;
+}
+
+int
+tmrm_storage_proxy_add_type(tmrm_storage* s, tmrm_proxy *p, tmrm_proxy *type)
+{
+    int ret;
+    tmrm_storage_cache* cache = p->subject_map->cache;
+
+    if (_read_only(p->subject_map)) return 1;
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_ADD_TYPE, p->label, 0, ret,
+            s->factory->proxy_add_type(s, p, type), ret != 0);
+    tmrm_arena_resume();
+    if (cache) {
+        _cache_lock(cache);
+        _cache_drop(cache, TMRM_CACHE_DIRECT_TYPES, p->label, 0);
+        _cache_unlock(cache);
+    }
+    _unlock(s);
+    return ret;
+}
+
+/* The superclass is bound by a new proxy, so no cached result changes */
+int
+tmrm_storage_proxy_add_superclass(tmrm_storage* s, tmrm_proxy *p, tmrm_proxy *superclass)
+{
+    int ret;
+
+    if (_read_only(p->subject_map)) return 1;
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_ADD_SUPERCLASS, p->label, 0, ret,
+            s->factory->proxy_add_superclass(s, p, superclass), ret != 0);
+    tmrm_arena_resume();
+    _unlock(s);
+    return ret;
+}
+
+tmrm_iterator*
+tmrm_storage_proxy_direct_subclasses(tmrm_storage* s, tmrm_proxy *p)
+{
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_DIRECT_SUBCLASSES, p->label, 0, it,
+            s->factory->proxy_direct_subclasses(s, p), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_PROXY_DIRECT_SUBCLASSES, it);
+}
+
+tmrm_iterator*
+tmrm_storage_proxy_direct_superclasses(tmrm_storage* s, tmrm_proxy *p)
+{
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_DIRECT_SUPERCLASSES, p->label, 0, it,
+            s->factory->proxy_direct_superclasses(s, p), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_PROXY_DIRECT_SUPERCLASSES, it);
+}
+
+tmrm_iterator*
+tmrm_storage_proxy_direct_types(tmrm_storage* s, tmrm_proxy *p)
+{
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    if (p->subject_map->cache) {
+        it = _cache_lookup(s, p->subject_map->cache,
+                TMRM_CACHE_DIRECT_TYPES, p, NULL);
+    } else {
+        _stats_call(s, TMRM_STORAGE_OP_PROXY_DIRECT_TYPES, p->label, 0, it,
+                s->factory->proxy_direct_types(s, p), it == NULL);
+        it = _locked_iterator(s, TMRM_STORAGE_OP_PROXY_DIRECT_TYPES, it);
+    }
+    _unlock(s);
+    return it;
+}
+
+tmrm_iterator*
+tmrm_storage_proxy_direct_instances(tmrm_storage* s, tmrm_proxy *p)
+{
+    tmrm_iterator* it;
+
+    _read_lock(s);
+    _stats_call(s, TMRM_STORAGE_OP_PROXY_DIRECT_INSTANCES, p->label, 0, it,
+            s->factory->proxy_direct_instances(s, p), it == NULL);
+    _unlock(s);
+    return _locked_iterator(s, TMRM_STORAGE_OP_PROXY_DIRECT_INSTANCES, it);
+}
+
+/**
+ * Pins the current state of the storage for a subject map snapshot (see
+ * tmrm_subject_map_snapshot()).
+ *
+ * @returns the version of the snapshot, or 0 if the storage does not
+ *          support snapshots or on failure
+ */
+unsigned long
+tmrm_storage_snapshot_acquire(tmrm_storage* s, tmrm_subject_map* map)
+{
+    unsigned long version;
+
+    if (!s->factory->snapshot_acquire) return 0;
+    _write_lock(s);
+    tmrm_arena_suspend();
+    _stats_call(s, TMRM_STORAGE_OP_SNAPSHOT_ACQUIRE, 0, 0, version,
+            s->factory->snapshot_acquire(s, map), version == 0);
+    tmrm_arena_resume();
+    _unlock(s);
+    return version;
+}
+
+/* Releases a version returned by tmrm_storage_snapshot_acquire() */
+void
+tmrm_storage_snapshot_release(tmrm_storage* s, unsigned long version)
+{
+    unsigned long long start;
+    tmrm_span span;
+    int traced;
+
+    if (!s->factory->snapshot_release) return;
+    _write_lock(s);
+    tmrm_arena_suspend();
+    traced = tmrm_trace_begin(s, &span,
+            _op_names[TMRM_STORAGE_OP_SNAPSHOT_RELEASE], 0, 0, NULL);
+    start = _stats_clock();
+    s->factory->snapshot_release(s, version);
+    _stats_record(s, TMRM_STORAGE_OP_SNAPSHOT_RELEASE, start, 0);
+    if (traced) tmrm_trace_end(s, &span, 0, -1);
+    tmrm_arena_resume();
+    _unlock(s);
+}
+
+/**
+ * Starts a read that the storage runs without blocking (see the query_send
+ * callback). Subject maps with a read cache or a snapshot are read through
+ * the synchronous wrappers, which serve them from the cache or from the
+ * pinned version.
+ *
+ * @returns NULL if the storage cannot run op without blocking, or on
+ *          failure
+ */
+tmrm_storage_query*
+tmrm_storage_query_send(tmrm_storage* s, tmrm_storage_op op,
+        tmrm_subject_map* map, tmrm_proxy* p, tmrm_proxy* key,
+        const char* label)
+{
+    tmrm_storage_query* q;
+
+    if (!s->factory->query_send || map->cache || map->snapshot) return NULL;
+    tmrm_arena_suspend();
+    q = (tmrm_storage_query*)TMRM_CALLOC(tmrm_storage_query, 1,
+            sizeof(tmrm_storage_query));
+    if (q) {
+        q->storage = s;
+        q->op = op;
+        q->map = map;
+        q->fd = -1;
+        q->start = _stats_clock();
+        _read_lock(s);
+        if (s->factory->query_send(s, q, p, key, label)) {
+            s->factory->query_free(s, q);
+            TMRM_FREE(tmrm_storage_query, q);
+            q = NULL;
+        }
+        _unlock(s);
+    }
+    tmrm_arena_resume();
+    return q;
+}
+
+/**
+ * Reads what has arrived for q without blocking. Once the query has
+ * finished, it is recorded in the statistics of its operation, and
+ * q->result holds its rows (NULL on failure).
+ *
+ * @returns 1 while the query runs, 0 once it has finished
+ */
+int
+tmrm_storage_query_poll(tmrm_storage_query* q)
+{
+    tmrm_storage* s = q->storage;
+    int ret;
+
+    _read_lock(s);
+    tmrm_arena_suspend();
+    ret = s->factory->query_poll(s, q);
+    tmrm_arena_resume();
+    if (ret == 0) {
+        _stats_record(s, q->op, q->start, q->result == NULL);
+        q->result = _locked_iterator(s, q->op, q->result);
+    }
+    _unlock(s);
+    return ret;
+}
+
+/* Frees q and its result, and cancels it if it still runs */
+void
+tmrm_storage_query_free(tmrm_storage_query* q)
+{
+    tmrm_storage* s = q->storage;
+
+    if (q->result) tmrm_iterator_free(q->result);
+    _read_lock(s);
+    s->factory->query_free(s, q);
+    _unlock(s);
+    TMRM_FREE(tmrm_storage_query, q);
+}
@@ -73,6 +73,11 @@ const char* tmrm_storage_proxy_label(tmrm_storage* s, tmrm_proxy* p);
 
 tmrm_iterator* tmrm_storage_proxies(tmrm_storage* s, tmrm_subject_map* map);
 
+/* Passes every proxy of the subject map to visitor, each followed by its
+   properties. */
+int tmrm_storage_scan_properties(tmrm_storage* s, tmrm_subject_map* map,
+        const tmrm_property_visitor* visitor, void* data);
+
 tmrm_iterator* tmrm_storage_proxy_keys(tmrm_storage* s, tmrm_proxy* p);
 tmrm_iterator* tmrm_storage_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
 
@@ -97,11 +102,49 @@ tmrm_iterator* tmrm_storage_proxy_is_value_by_key(tmrm_storage* s,
 tmrm_iterator* tmrm_storage_literal_is_value_by_key(tmrm_storage* s,
         tmrm_literal* lit, tmrm_proxy* key);
 
+tmrm_iterator* tmrm_storage_is_value_by_key_many(tmrm_storage* s,
+        tmrm_object* const* values, int count, tmrm_proxy* key);
+
+tmrm_storage_cache* tmrm_storage_cache_new(size_t capacity);
+
+void tmrm_storage_cache_free(tmrm_storage_cache* cache);
+
+void tmrm_storage_cache_stats(const tmrm_storage_cache* cache,
+        unsigned long* hits, unsigned long* misses);
+
+tmrm_op_stats* tmrm_storage_stats(tmrm_storage* s, int* count);
+
+void tmrm_storage_stats_reset(tmrm_storage* s);
+
+char* tmrm_storage_stats_dump(tmrm_storage* s, tmrm_stats_format format);
+
+int tmrm_storage_posting_list(tmrm_storage* s, tmrm_object* value,
+        tmrm_proxy* key, tmrm_label** labels, int* count);
+
+tmrm_iterator* tmrm_storage_proxies_by_properties(tmrm_storage* s,
+        tmrm_subject_map* map, tmrm_proxy* const* keys,
+        tmrm_object* const* values, int count);
+
+unsigned long tmrm_storage_snapshot_acquire(tmrm_storage* s,
+        tmrm_subject_map* map);
+void tmrm_storage_snapshot_release(tmrm_storage* s, unsigned long version);
+
+/* Non-blocking reads for tmrm_async.c. Returns NULL if the storage
+   cannot run op without blocking for the map. */
+tmrm_storage_query* tmrm_storage_query_send(tmrm_storage* s,
+        tmrm_storage_op op, tmrm_subject_map* map, tmrm_proxy* p,
+        tmrm_proxy* key, const char* label);
+int tmrm_storage_query_poll(tmrm_storage_query* q);
+void tmrm_storage_query_free(tmrm_storage_query* q);
+
 tmrm_iterator* tmrm_storage_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map);
 
+tmrm_iterator* tmrm_storage_path(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_object* const* values, int count,
+        const tmrm_path_step* steps, int step_count, int closure);
+
 /* TODO:
 
-tmrm_list* tmrm_proxies_by_properties(tmrm_subject_map* map, tmrm_list* properties); => TMRM_SubjectMap::getProxiesByProperties()
 tmrm_iterator* tmrm_subject_map_proxies(tmrm_subject_map* map); => TMRM_SubjectMap::getProxies()
 PATH LANGUAGE:
 tmrm_iterator* tmrm_subject_map_values_by_key(tmrm_iterator* proxies, tmrm_proxy* key);
@@ -125,6 +168,12 @@ tmrm_init_storage_pgsql(tmrm_subject_map_sphere *sms);
 extern void
 tmrm_init_storage_db(tmrm_subject_map_sphere *sms);
 
+extern void
+tmrm_init_storage_snapshot(tmrm_subject_map_sphere *sms);
+
+extern void
+tmrm_init_storage_log(tmrm_subject_map_sphere *sms);
+
 #ifdef __cplusplus
 }
 #endif
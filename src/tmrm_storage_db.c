@@ -40,19 +40,105 @@
 #include <sys/types.h>
 
 #include <libtmrm.h>
+#include <tmrm_internal.h>
 #include <tmrm_storage_internal.h>
 #include <tmrm_storage.h>
+#include <tmrm_hash.h>
 
 /* BDB-support */
 #include <db.h>
 /* /BDB-support */
 
+/*
+ * Layout of the storage: All databases live in one file (option 'file',
+ * default "tmrm.db") of a private environment in the directory given by the
+ * option 'dir' (default "."). Labels are packed as 4 byte big-endian
+ * integers, so that the byte order of the B-tree equals the numerical order
+ * and every lookup becomes a cursor range scan over a common key prefix.
+ *
+ *   proxy:   label               -> (empty)
+ *   forward: proxy . key         -> value        (sorted duplicates)
+ *   reverse: key . value         -> proxy        (sorted duplicates)
+ *   value:   value               -> key . proxy  (sorted duplicates)
+ *
+ * A value is a tag byte followed either by the label of a proxy or by the
+ * zero terminated value and datatype of a literal. Each property is stored
+ * once in each of the three property databases, so adding the same
+ * property twice has no effect.
+ */
+#define TMRM_DB_LABEL_SIZE 4
+#define TMRM_DB_VALUE_PROXY 0x00
+#define TMRM_DB_VALUE_LITERAL 0x01
+
 struct tmrm_storage_db_context_s {
-    DB* dbp;
+    DB_ENV* env;
+    char* file;
+    DB* proxies;
+    DB* forward;
+    DB* reverse;
+    DB* values;
+    tmrm_label next_label;
 };
 
 typedef struct tmrm_storage_db_context_s tmrm_storage_db_context;
 
+/* Part of a cursor position that an iterator returns */
+enum tmrm_storage_db_element_e {
+    TMRM_DB_ELEMENT_PROXY,          /* proxy label at the start of the key */
+    TMRM_DB_ELEMENT_PROPERTY_KEY,   /* key label behind the proxy label */
+    TMRM_DB_ELEMENT_PROPERTY,       /* key label and value of the forward index */
+    TMRM_DB_ELEMENT_VALUE,          /* value stored as data */
+    TMRM_DB_ELEMENT_DATA_PROXY      /* proxy label at the start of the data */
+};
+
+typedef enum tmrm_storage_db_element_e tmrm_storage_db_element;
+
+struct tmrm_storage_db_iterator_context_s {
+    tmrm_subject_map *subject_map;
+    tmrm_storage_db_element element;
+    DBC* cursor;
+    DBT key;
+    DBT data;
+    /* Only positions with this key prefix are part of the range */
+    unsigned char* prefix;
+    size_t prefix_len;
+    /* DB_SET_RANGE/DB_NEXT for prefix scans, DB_SET/DB_NEXT_DUP for
+       exact keys and DB_FIRST/DB_NEXT for full scans */
+    u_int32_t first_flag;
+    u_int32_t next_flag;
+    int end;
+    /* Joins only: for each proxy returned by the outer cursor, the inner
+       cursor returns the values of the proxy's property 'join_key'. */
+    DBC* outer;
+    DBT outer_key;
+    DBT outer_data;
+    unsigned char* outer_prefix;
+    size_t outer_prefix_len;
+    tmrm_label join_key;
+};
+
+typedef struct tmrm_storage_db_iterator_context_s tmrm_storage_db_iterator_context;
+
+/* Properties packed like the records of _put_property(): the labels of
+   proxy and key followed by the value */
+struct tmrm_storage_db_records_s {
+    unsigned char** recs;
+    size_t* value_lens;
+    size_t size;
+    size_t max;
+};
+
+typedef struct tmrm_storage_db_records_s tmrm_storage_db_records;
+
+/* The properties of a proxy as compared by merge */
+struct tmrm_storage_db_signature_s {
+    tmrm_label label;
+    unsigned char* bytes;
+    size_t len;
+};
+
+typedef struct tmrm_storage_db_signature_s tmrm_storage_db_signature;
+
 /* ---------------------------------------------------------------------------
 Prototypes for the DB storage factory
 */
@@ -62,182 +148,1773 @@ tmrm_storage_db_register_factory(tmrm_storage_factory *factory);
 void
 tmrm_init_storage_db(tmrm_subject_map_sphere *sms);
 
+static int
+tmrm_storage_db_init(tmrm_storage* s, tmrm_hash* options);
+
 static void
 tmrm_storage_db_free(tmrm_storage* storage);
 
+static int 
+tmrm_storage_db_bootstrap(tmrm_storage* s, tmrm_subject_map* map);
+
+static int
+tmrm_storage_db_remove(tmrm_storage* storage, tmrm_subject_map* map);
+
+static tmrm_proxy*
+tmrm_storage_db_bottom(tmrm_storage* storage, tmrm_subject_map* map);
+
+static int
+tmrm_storage_db_merge(tmrm_storage* storage, tmrm_subject_map* map);
+
+static tmrm_proxy*
+tmrm_storage_db_proxy_create(tmrm_storage* storage, tmrm_subject_map* map);
+
 static int
 tmrm_storage_db_add_property(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value);
 
 static int
 tmrm_storage_db_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value);
 
-/*
 static int
-tmrm_storage_db_put_property(tmrm_storage* storage, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value);
-*/
+tmrm_storage_db_proxy_remove_properties_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
 
-/* ------------------------------------------------------------------------ */
 static int
-tmrm_storage_db_init(tmrm_storage* s, tmrm_hash* options);
+tmrm_storage_db_proxy_remove(tmrm_storage* s, const tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_properties(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_proxy*
+tmrm_storage_db_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
+        const char* label);
+
+static tmrm_iterator*
+tmrm_storage_db_proxies(tmrm_storage* s, tmrm_subject_map* map);
+
+static char*
+tmrm_storage_db_proxy_label(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_keys(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_keys_by_value(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_db_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map);
+
+static tmrm_iterator*
+tmrm_storage_db_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key);
+
+static tmrm_proxy*
+tmrm_storage_db_proxy_by_literal(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key);
+
+static int
+tmrm_storage_db_proxy_add_type(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* type);
+
+static int
+tmrm_storage_db_proxy_add_superclass(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* superclass);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_class(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* a, tmrm_proxy* b);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_subclasses(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_superclasses(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_types(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_instances(tmrm_storage* s, tmrm_proxy* p);
+
+static int
+tmrm_storage_db_list_next(void* context);
+
+static int
+tmrm_storage_db_list_end(void* context);
+
+static tmrm_object*
+tmrm_storage_db_list_get_element(void* context, tmrm_iterator_flag flag);
+
+static void
+tmrm_storage_db_list_free(void* context);
+
+/* Internal helper functions */
+static void
+_pack_label(unsigned char* buf, tmrm_label label);
+
+static tmrm_label
+_unpack_label(const unsigned char* buf);
+
+static unsigned char*
+_pack_value(size_t offset, const tmrm_proxy* p, const tmrm_literal* lit,
+        size_t* len);
+
+static tmrm_object*
+_value_to_object(tmrm_subject_map* m, const unsigned char* value, size_t len);
+
+static tmrm_proxy*
+_create_proxy_struct(tmrm_subject_map* m, tmrm_label label);
+
+static int
+_open_db(tmrm_storage_db_context* c, DB** dbp, const char* name, int dup);
+
+static void
+_close_dbs(tmrm_storage_db_context* c);
+
+static int
+_put_property(tmrm_storage* s, unsigned char* rec, size_t value_len,
+        int* added);
+
+static int
+_del_pair(DB* dbp, void* key, size_t key_len, void* data, size_t data_len);
+
+static int
+_del_property(tmrm_storage_db_context* c, tmrm_label proxy, tmrm_label key,
+        const void* value, size_t value_len, const DB* skip);
+
+static int
+_records_add(tmrm_storage_db_records* r, const unsigned char* proxy,
+        const unsigned char* key, const unsigned char* value,
+        size_t value_len);
+
+static void
+_records_free(tmrm_storage_db_records* r);
+
+static int
+_collect_properties(tmrm_storage_db_context* c, tmrm_label label,
+        tmrm_storage_db_records* r);
+
+static int
+_signature(tmrm_storage_db_context* c, tmrm_label label,
+        tmrm_storage_db_signature* sig);
+
+static int
+_merge_proxy(tmrm_storage* s, tmrm_label p1, tmrm_label p2);
+
+static tmrm_iterator*
+_iterator_by_range(tmrm_storage* s, tmrm_subject_map* map, DB* dbp,
+        const unsigned char* prefix, size_t prefix_len, int exact,
+        tmrm_storage_db_element element);
+
+static tmrm_iterator*
+_iterator_by_join(tmrm_storage* s, tmrm_subject_map* map,
+        const unsigned char* outer_key, size_t outer_key_len,
+        tmrm_label join_key);
+
+static int
+_iterator_fetch(tmrm_storage_db_iterator_context* c, u_int32_t flag);
 
 /* ======================================================================= */
 static int 
-tmrm_storage_db_init(tmrm_storage* s, tmrm_hash* options) {
+tmrm_storage_db_init(tmrm_storage* s, tmrm_hash* options)
+{
     tmrm_storage_db_context* c;
+    char *dir, *file;
+    DB* dbp;
+    DBC* cursor;
+    DBT key, data;
     int ret;
-    u_int32_t flags;
 
     TMRM_DEBUG1("tmrm_storage_db_init()\n");
-    c = (tmrm_storage_db_context*)TMRM_CALLOC(tmrm_storage_db_context, 1, sizeof(tmrm_storage_db_context));
+    c = (tmrm_storage_db_context*)TMRM_CALLOC(tmrm_storage_db_context, 1,
+            sizeof(tmrm_storage_db_context));
     if (!c) return 1;
-    ret = db_create(&c->dbp, NULL, 0);
-    if (ret) {
-        TMRM_FREE(tmrm_storage_db_context, c);
-        return ret;
+    s->context = c;
+
+    dir = options ? tmrm_hash_get(options, "dir") : NULL;
+    file = options ? tmrm_hash_get(options, "file") : NULL;
+    if (file == NULL) {
+        if (!(file = (char*)TMRM_MALLOC(cstring, strlen("tmrm.db") + 1))) {
+            TMRM_FREE(cstring, dir);
+            return 1;
+        }
+        (void)strcpy(file, "tmrm.db");
     }
-    flags = DB_CREATE;
+    c->file = file;
 
-    ret = c->dbp->open(c->dbp, NULL, "tmrm.db", NULL, DB_BTREE, flags, 0);
+    if ((ret = db_env_create(&c->env, 0)) != 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Creating the environment failed: %s",
+                db_strerror(ret));
+        TMRM_FREE(cstring, dir);
+        return 1;
+    }
+    ret = c->env->open(c->env, dir == NULL ? "." : dir,
+            DB_CREATE | DB_INIT_MPOOL | DB_PRIVATE, 0);
+    TMRM_FREE(cstring, dir);
     if (ret) {
-        TMRM_FREE(tmrm_storage_db_context, c);
-        return ret;
+        TMRM_LOG(TMRM_LOG_ERROR, "Opening the environment failed: %s",
+                db_strerror(ret));
+        return 1;
     }
 
-    s->context = c;
+    if (options && tmrm_hash_get_as_boolean(options, "new") > 0) {
+        TMRM_DEBUG2("Creating storage %s\n", c->file);
+        /* The file may not exist yet */
+        ret = c->env->dbremove(c->env, NULL, c->file, NULL, 0);
+        if (ret) {
+            TMRM_DEBUG3("Removing %s failed: %s\n", c->file, db_strerror(ret));
+        }
+    }
+
+    if (_open_db(c, &c->proxies, "proxy", 0) ||
+            _open_db(c, &c->forward, "forward", 1) ||
+            _open_db(c, &c->reverse, "reverse", 1) ||
+            _open_db(c, &c->values, "value", 1)) {
+        return 1;
+    }
+
+    /* The next label follows the highest label in use; 0 is reserved for
+       the bottom proxy. */
+    c->next_label = 1;
+    dbp = c->proxies;
+    if ((ret = dbp->cursor(dbp, NULL, &cursor, 0)) != 0) {
+        return 1;
+    }
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    if (cursor->get(cursor, &key, &data, DB_LAST) == 0 &&
+            key.size == TMRM_DB_LABEL_SIZE) {
+        c->next_label = _unpack_label((unsigned char*)key.data) + 1;
+    }
+    (void)cursor->close(cursor);
+
+    return 0;
+}
+
+
+/**
+ * Imports the bootstrap ontology unless the storage already contains it and
+ * stores the bootstrap proxies in the subject map object.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int 
+tmrm_storage_db_bootstrap(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_literal *lit;
+    const unsigned char* bootstrap_ontology =
+        (unsigned char*)TMRM_STORAGE_BOOTSTRAP_ONTOLOGY;
+
+    map->bottom = tmrm_storage_db_bottom(s, map);
+    if (!map->bottom) return 1;
+
+    lit = tmrm_literal_new((tmrm_char_t*)"libtmrm:superclass", (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    if (!lit) return 1;
+    map->superclass = tmrm_storage_db_proxy_by_literal(s, lit, map->bottom);
+    tmrm_literal_free(lit);
+
+    if (map->superclass == NULL) {
+        TMRM_DEBUG1("bootstrapping...\n");
+        tmrm_subject_map_import_from_yaml_string(map, bootstrap_ontology,
+            strlen((char*)bootstrap_ontology));
+
+        lit = tmrm_literal_new((tmrm_char_t*)"libtmrm:superclass", (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+        if (!lit) return 1;
+        map->superclass = tmrm_storage_db_proxy_by_literal(s, lit, map->bottom);
+        tmrm_literal_free(lit);
+    }
+
+    lit = tmrm_literal_new((tmrm_char_t*)"libtmrm:subclass", (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    if (!lit) return 1;
+    map->subclass = tmrm_storage_db_proxy_by_literal(s, lit, map->bottom);
+    tmrm_literal_free(lit);
+
+    lit = tmrm_literal_new((tmrm_char_t*)"libtmrm:type", (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    if (!lit) return 1;
+    map->type = tmrm_storage_db_proxy_by_literal(s, lit, map->bottom);
+    tmrm_literal_free(lit);
+
+    lit = tmrm_literal_new((tmrm_char_t*)"libtmrm:instance", (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    if (!lit) return 1;
+    map->instance = tmrm_storage_db_proxy_by_literal(s, lit, map->bottom);
+    tmrm_literal_free(lit);
+
     return 0;
 }
 
+
 static void
-tmrm_storage_db_free(tmrm_storage* s) {
-    int ret;
-    TMRM_DEBUG1("tmrm_storage_db_free\n");
+tmrm_storage_db_free(tmrm_storage* s)
+{
     tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
-    if (c->dbp != NULL) {
-        ret = c->dbp->close(c->dbp, 0);
-        if (ret) {
-            TMRM_DEBUG2("Closing tmrm-database failed: %s\n", db_strerror(ret));
-        }
+    TMRM_DEBUG1("tmrm_storage_db_free\n");
+    if (!c) return;
+
+    _close_dbs(c);
+    if (c->env != NULL) {
+        (void)c->env->close(c->env, 0);
     }
+    TMRM_FREE(cstring, c->file);
     TMRM_FREE(tmrm_storage_db_context, s->context);
 }
 
-int
-tmrm_storage_db_add_property(tmrm_storage* storage, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value) {
-    TMRM_DEBUG1("PUT_PROPERTY\n");
+
+/* Removes the database file. The map parameter is ignored since the storage
+   holds exactly one subject map. */
+static int
+tmrm_storage_db_remove(tmrm_storage* s, tmrm_subject_map* map)
+{
+    int ret;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return -1;
+
+    _close_dbs(c);
+    ret = c->env->dbremove(c->env, NULL, c->file, NULL, 0);
+    if (ret) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Removing %s failed: %s", c->file,
+                db_strerror(ret));
+        return -1;
+    }
     return 0;
 }
 
-int
-tmrm_storage_db_add_property_literal(tmrm_storage* storage, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value) {
-    TMRM_DEBUG1("PUT_PROPERTY_LITERAL\n");
-    return 0;
+
+static tmrm_proxy*
+tmrm_storage_db_bottom(tmrm_storage* s, tmrm_subject_map* map)
+{
+    unsigned char buf[TMRM_DB_LABEL_SIZE];
+    DBT key, data;
+    int ret;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    /* The bottom proxy always has the label 0 */
+    _pack_label(buf, 0);
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = buf;
+    key.size = TMRM_DB_LABEL_SIZE;
+    ret = c->proxies->put(c->proxies, NULL, &key, &data, DB_NOOVERWRITE);
+    if (ret && ret != DB_KEYEXIST) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Creating the bottom proxy failed: %s",
+                db_strerror(ret));
+        return NULL;
+    }
+    return _create_proxy_struct(map, 0);
 }
 
-/*
-int
-tmrm_storage_db_put_property(tmrm_storage* storage, tmrm_property* pr) {
-    TMRM_DEBUG1("FOO\n");
-    TMRM_DEBUG2("property-id = %d\n", pr->statement_id); 
+
+static int
+_compare_signature(const void* a, const void* b)
+{
+    const tmrm_storage_db_signature* x = (const tmrm_storage_db_signature*)a;
+    const tmrm_storage_db_signature* y = (const tmrm_storage_db_signature*)b;
+    int cmp;
+
+    if (x->len != y->len) return x->len < y->len ? -1 : 1;
+    if ((cmp = memcmp(x->bytes, y->bytes, x->len)) != 0) return cmp;
+    return x->label < y->label ? -1 : (x->label > y->label ? 1 : 0);
+}
+
+
+/* Merges each set of proxies with equal properties into the proxy with
+   the lowest label, until no two proxies are equal. Merging rewrites the
+   properties that refer to the merged proxies, which can make further
+   proxies equal. Proxies without properties, such as the bottom proxy,
+   are never merged. */
+static int
+tmrm_storage_db_merge(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_storage_db_signature *sigs = NULL, *tmp;
+    size_t num, max = 0, i, first;
+    DBC* cursor;
+    DBT key, data;
+    int ret = 0, merged;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return 1;
+
+    do {
+        merged = 0;
+        num = 0;
+        if ((ret = c->proxies->cursor(c->proxies, NULL, &cursor, 0)) != 0) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Opening cursor failed: %s",
+                    db_strerror(ret));
+            ret = 1;
+            break;
+        }
+        memset(&key, 0, sizeof(DBT));
+        memset(&data, 0, sizeof(DBT));
+        ret = cursor->get(cursor, &key, &data, DB_FIRST);
+        while (ret == 0) {
+            if (num == max) {
+                max = max ? 2 * max : 64;
+                if (!(tmp = (tmrm_storage_db_signature*)TMRM_REALLOC(
+                                tmrm_storage_db_signature, sigs,
+                                max * sizeof(tmrm_storage_db_signature)))) {
+                    ret = 1;
+                    break;
+                }
+                sigs = tmp;
+            }
+            if ((ret = _signature(c, _unpack_label(key.data), &sigs[num]))) {
+                break;
+            }
+            if (sigs[num].len > 0) num++;
+            ret = cursor->get(cursor, &key, &data, DB_NEXT);
+        }
+        (void)cursor->close(cursor);
+        ret = (ret == 0 || ret == DB_NOTFOUND) ? 0 : 1;
+
+        if (ret == 0 && num > 1) {
+            qsort(sigs, num, sizeof(tmrm_storage_db_signature),
+                    _compare_signature);
+        }
+        for (i = 1, first = 0; i < num && ret == 0; i++) {
+            if (sigs[i].len == sigs[first].len &&
+                    memcmp(sigs[i].bytes, sigs[first].bytes,
+                        sigs[i].len) == 0) {
+                ret = _merge_proxy(s, sigs[first].label, sigs[i].label);
+                merged++;
+            } else {
+                first = i;
+            }
+        }
+        for (i = 0; i < num; i++) TMRM_FREE(cstring, sigs[i].bytes);
+    } while (ret == 0 && merged > 0);
+
+    if (sigs) TMRM_FREE(tmrm_storage_db_signature, sigs);
+    if (ret) TMRM_LOG(TMRM_LOG_ERROR, "Merging proxies failed");
+    return ret;
+}
+
+
+static tmrm_proxy*
+tmrm_storage_db_proxy_create(tmrm_storage* s, tmrm_subject_map* map)
+{
+    unsigned char buf[TMRM_DB_LABEL_SIZE];
     DBT key, data;
-    size_t recordsize, recordlen;
-    char* record;
-    recordsize = sizeof(int) * 4;
-    record = TMRM_MALLOC(void, recordsize);
-
-    memset(record, 0, recordsize);
-    memcpy(record, &(pr->proxy->proxy_id), sizeof(int));
-    recordlen = sizeof(int);
-    memcpy(record + recordlen, &(pr->statement_id), sizeof(int));
-    recordlen += sizeof(int);
-    memcpy(record + recordlen, &(pr->label_id), sizeof(int));
-    recordlen += sizeof(int);
+    int ret;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
 
+    _pack_label(buf, c->next_label);
     memset(&key, 0, sizeof(DBT));
     memset(&data, 0, sizeof(DBT));
+    key.data = buf;
+    key.size = TMRM_DB_LABEL_SIZE;
+    ret = c->proxies->put(c->proxies, NULL, &key, &data, DB_NOOVERWRITE);
+    if (ret) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Creating proxy %d failed: %s",
+                (int)c->next_label, db_strerror(ret));
+        return NULL;
+    }
+    return _create_proxy_struct(map, c->next_label++);
+}
+
+
+static int
+tmrm_storage_db_add_property(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value)
+{
+    unsigned char* rec;
+    size_t len;
+    int ret;
 
-    key.data = &(pr->statement_id);
-    key.size = sizeof(int);
+    if (!(rec = _pack_value(2 * TMRM_DB_LABEL_SIZE, value, NULL, &len))) {
+        return 1;
+    }
+    _pack_label(rec, p->label);
+    _pack_label(rec + TMRM_DB_LABEL_SIZE, key->label);
+    ret = _put_property(s, rec, len, NULL);
+    TMRM_FREE(cstring, rec);
+    return ret;
+}
 
-    data.data = record;
-    data.size = recordlen;
 
-    tmrm_storage_db_context* c = (tmrm_storage_db_context*)storage->context;
-    c->dbp->put(c->dbp, NULL, &key, &data, DB_NOOVERWRITE);
+static int
+tmrm_storage_db_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value)
+{
+    unsigned char* rec;
+    size_t len;
+    int ret;
 
-    TMRM_FREE(void, record);
-    return 0;
+    if (!(rec = _pack_value(2 * TMRM_DB_LABEL_SIZE, NULL, value, &len))) {
+        return 1;
+    }
+    _pack_label(rec, p->label);
+    _pack_label(rec + TMRM_DB_LABEL_SIZE, key->label);
+    ret = _put_property(s, rec, len, NULL);
+    TMRM_FREE(cstring, rec);
+    return ret;
 }
-*/
-/*
-int 
-tmrm_storage_db_put_proxy(tmrm_storage* storage, tmrm_proxy* p) {
-    TMRM_DEBUG1("BAR\n");
+
+
+static int
+tmrm_storage_db_proxy_remove_properties_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    unsigned char buf[2 * TMRM_DB_LABEL_SIZE];
+    DBC* cursor;
+    DBT k, data;
+    int ret;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return 1;
+
+    _pack_label(buf, p->label);
+    _pack_label(buf + TMRM_DB_LABEL_SIZE, key->label);
+    if (c->forward->cursor(c->forward, NULL, &cursor, 0) != 0) {
+        return 1;
+    }
+    memset(&k, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    k.data = buf;
+    k.size = sizeof(buf);
+    ret = cursor->get(cursor, &k, &data, DB_SET);
+    while (ret == 0) {
+        if (_del_property(c, p->label, key->label, data.data, data.size,
+                    c->forward) || cursor->del(cursor, 0)) {
+            break;
+        }
+        ret = cursor->get(cursor, &k, &data, DB_NEXT_DUP);
+    }
+    (void)cursor->close(cursor);
+    return ret == DB_NOTFOUND ? 0 : 1;
 }
-*/
-/*
-tmrm_property*
-tmrm_storage_db_get_property(tmrm_storage* storage, int label) {
-    TMRM_DEBUG2("get_property(%d)\n", label);
-    DBT key, data;
-    char* record;
-    tmrm_property* pr;
 
-    pr = (tmrm_property*)TMRM_CALLOC(tmrm_property, 1, sizeof(tmrm_property));
 
+/* Removes the proxy and all properties where p is the proxy, the key or the
+   value. */
+static int
+tmrm_storage_db_proxy_remove(tmrm_storage* s, const tmrm_proxy* p)
+{
+    unsigned char buf[TMRM_DB_LABEL_SIZE];
+    unsigned char *rec, *d;
+    size_t len;
+    DBC* cursor;
+    DBT key, data;
+    int ret;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return 1;
+
+    _pack_label(buf, p->label);
     memset(&key, 0, sizeof(DBT));
     memset(&data, 0, sizeof(DBT));
 
-    key.data = &label;
-    key.size = sizeof(int);
+    /* p is the proxy: forward scan over 'p . *' */
+    if (c->forward->cursor(c->forward, NULL, &cursor, 0) != 0) return 1;
+    key.data = buf;
+    key.size = TMRM_DB_LABEL_SIZE;
+    ret = cursor->get(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0 && key.size == 2 * TMRM_DB_LABEL_SIZE &&
+            memcmp(key.data, buf, TMRM_DB_LABEL_SIZE) == 0) {
+        if (_del_property(c, p->label,
+                    _unpack_label((unsigned char*)key.data + TMRM_DB_LABEL_SIZE),
+                    data.data, data.size, c->forward) ||
+                cursor->del(cursor, 0)) {
+            ret = -1;
+            break;
+        }
+        ret = cursor->get(cursor, &key, &data, DB_NEXT);
+    }
+    (void)cursor->close(cursor);
+    if (ret != 0 && ret != DB_NOTFOUND) return 1;
 
-    tmrm_storage_db_context* c = (tmrm_storage_db_context*)storage->context;
-    c->dbp->get(c->dbp, NULL, &key, &data, 0);
+    /* p is the key: reverse scan over 'p . *' */
+    if (c->reverse->cursor(c->reverse, NULL, &cursor, 0) != 0) return 1;
+    key.data = buf;
+    key.size = TMRM_DB_LABEL_SIZE;
+    ret = cursor->get(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0 && key.size > TMRM_DB_LABEL_SIZE &&
+            memcmp(key.data, buf, TMRM_DB_LABEL_SIZE) == 0) {
+        if (_del_property(c, _unpack_label((unsigned char*)data.data),
+                    p->label, (unsigned char*)key.data + TMRM_DB_LABEL_SIZE,
+                    key.size - TMRM_DB_LABEL_SIZE, c->reverse) ||
+                cursor->del(cursor, 0)) {
+            ret = -1;
+            break;
+        }
+        ret = cursor->get(cursor, &key, &data, DB_NEXT);
+    }
+    (void)cursor->close(cursor);
+    if (ret != 0 && ret != DB_NOTFOUND) return 1;
 
-    record = data.data;
+    /* p is the value: exact scan over the value index */
+    if (!(rec = _pack_value(0, p, NULL, &len))) return 1;
+    if (c->values->cursor(c->values, NULL, &cursor, 0) != 0) {
+        TMRM_FREE(cstring, rec);
+        return 1;
+    }
+    key.data = rec;
+    key.size = (u_int32_t)len;
+    ret = cursor->get(cursor, &key, &data, DB_SET);
+    while (ret == 0) {
+        d = (unsigned char*)data.data;
+        if (_del_property(c, _unpack_label(d + TMRM_DB_LABEL_SIZE),
+                    _unpack_label(d), rec, len, c->values) ||
+                cursor->del(cursor, 0)) {
+            ret = -1;
+            break;
+        }
+        ret = cursor->get(cursor, &key, &data, DB_NEXT_DUP);
+    }
+    (void)cursor->close(cursor);
+    TMRM_FREE(cstring, rec);
+    if (ret != 0 && ret != DB_NOTFOUND) return 1;
 
-    pr->proxy = (tmrm_proxy*)NULL;
-    pr->statement_id = *((int *)record);
-    TMRM_DEBUG2("pr->proxy_id\t= %d\n", pr->statement_id);
-    record += sizeof(int);
-    pr->statement_id = *((int *)record);
-    TMRM_DEBUG2("pr->statement_id\t= %d\n", pr->statement_id);
-    record += sizeof(int);
-    pr->label_id = *((int *)record);
-    TMRM_DEBUG2("pr->label_id\t= %d\n", pr->label_id);
-    
-    return pr;
+    key.data = buf;
+    key.size = TMRM_DB_LABEL_SIZE;
+    ret = c->proxies->del(c->proxies, NULL, &key, 0);
+    return (ret == 0 || ret == DB_NOTFOUND) ? 0 : 1;
 }
-*/
-static void
-tmrm_storage_db_register_factory(tmrm_storage_factory *factory) {
-    factory->init = tmrm_storage_db_init; 
-    factory->free = tmrm_storage_db_free; 
-    factory->bottom = NULL;
-    factory->remove = NULL;
-    factory->proxy_create = NULL;
-    factory->proxy_update = NULL;
-    factory->add_property = tmrm_storage_db_add_property;
-    factory->add_property_literal = tmrm_storage_db_add_property_literal;
-    factory->proxy_remove_properties_by_key = NULL;
-    factory->proxy_properties = NULL;
-    factory->proxy_remove = NULL;
-    factory->proxy_by_label = NULL;
-    factory->proxies = NULL;
-    factory->proxy_label = NULL;
-    factory->proxy_keys = NULL;
-    factory->proxy_values_by_key = NULL;
-    factory->proxy_is_value_by_key = NULL;
-    factory->proxy_keys_by_value = NULL;
-    factory->literal_keys_by_value = NULL;
-    factory->literal_is_value_by_key = NULL;
-    factory->proxy_add_type = NULL;
-    factory->proxy_add_superclass = NULL;
-    factory->proxy_direct_subclasses = NULL;
-    factory->proxy_direct_superclasses = NULL;
-    factory->proxy_direct_types = NULL;
-    factory->proxy_direct_instances = NULL;
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_properties(tmrm_storage* s, tmrm_proxy* p)
+{
+    unsigned char buf[TMRM_DB_LABEL_SIZE];
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    _pack_label(buf, p->label);
+    return _iterator_by_range(s, p->subject_map, c->forward, buf, sizeof(buf),
+            0, TMRM_DB_ELEMENT_PROPERTY);
+}
+
+
+static tmrm_proxy*
+tmrm_storage_db_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
+        const char* label)
+{
+    unsigned char buf[TMRM_DB_LABEL_SIZE];
+    DBT key, data;
+    char* end;
+    long proxy_id;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    /* Check that label is valid */
+    proxy_id = strtol(label, &end, 10);
+    if (strlen(label) == 0 || *end != '\0' || proxy_id < 0) {
+        return NULL;
+    }
+
+    _pack_label(buf, (tmrm_label)proxy_id);
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = buf;
+    key.size = TMRM_DB_LABEL_SIZE;
+    if (c->proxies->get(c->proxies, NULL, &key, &data, 0) != 0) {
+        return NULL;
+    }
+    return _create_proxy_struct(map, (tmrm_label)proxy_id);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxies(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    return _iterator_by_range(s, map, c->proxies, NULL, 0, 0,
+            TMRM_DB_ELEMENT_PROXY);
 }
 
+
+static char*
+tmrm_storage_db_proxy_label(tmrm_storage* s, tmrm_proxy* p)
+{
+    size_t len;
+    char *label;
+
+    len = 1 * INT_DIGITS;
+    if (!(label = (char*)TMRM_MALLOC(cstring, len + 1))) {
+        return NULL;
+    }
+
+    (void)snprintf(label, len, "%d", (int)p->label);
+    return label;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_keys(tmrm_storage* s, tmrm_proxy* p)
+{
+    unsigned char buf[TMRM_DB_LABEL_SIZE];
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    _pack_label(buf, p->label);
+    return _iterator_by_range(s, p->subject_map, c->forward, buf, sizeof(buf),
+            0, TMRM_DB_ELEMENT_PROPERTY_KEY);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    unsigned char buf[2 * TMRM_DB_LABEL_SIZE];
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    _pack_label(buf, p->label);
+    _pack_label(buf + TMRM_DB_LABEL_SIZE, key->label);
+    return _iterator_by_range(s, p->subject_map, c->forward, buf, sizeof(buf),
+            1, TMRM_DB_ELEMENT_VALUE);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    unsigned char* rec;
+    size_t len;
+    tmrm_iterator* iterator;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    if (!(rec = _pack_value(TMRM_DB_LABEL_SIZE, p, NULL, &len))) {
+        return NULL;
+    }
+    _pack_label(rec, key->label);
+    iterator = _iterator_by_range(s, p->subject_map, c->reverse, rec,
+            TMRM_DB_LABEL_SIZE + len, 1, TMRM_DB_ELEMENT_DATA_PROXY);
+    TMRM_FREE(cstring, rec);
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_keys_by_value(tmrm_storage* s, tmrm_proxy* p)
+{
+    unsigned char* rec;
+    size_t len;
+    tmrm_iterator* iterator;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    if (!(rec = _pack_value(0, p, NULL, &len))) {
+        return NULL;
+    }
+    iterator = _iterator_by_range(s, p->subject_map, c->values, rec, len, 1,
+            TMRM_DB_ELEMENT_DATA_PROXY);
+    TMRM_FREE(cstring, rec);
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map)
+{
+    unsigned char* rec;
+    size_t len;
+    tmrm_iterator* iterator;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    if (!(rec = _pack_value(0, NULL, lit, &len))) {
+        return NULL;
+    }
+    iterator = _iterator_by_range(s, map, c->values, rec, len, 1,
+            TMRM_DB_ELEMENT_DATA_PROXY);
+    TMRM_FREE(cstring, rec);
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key)
+{
+    unsigned char* rec;
+    size_t len;
+    tmrm_iterator* iterator;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    if (!(rec = _pack_value(TMRM_DB_LABEL_SIZE, NULL, lit, &len))) {
+        return NULL;
+    }
+    _pack_label(rec, key->label);
+    iterator = _iterator_by_range(s, key->subject_map, c->reverse, rec,
+            TMRM_DB_LABEL_SIZE + len, 1, TMRM_DB_ELEMENT_DATA_PROXY);
+    TMRM_FREE(cstring, rec);
+    return iterator;
+}
+
+
+/**
+ * Internal short cut function for the previous function.
+ *
+ * @returns One of the proxies that have lit as value for key or NULL if no
+ * proxy is found (or a error occurs).
+ * @see tmrm_storage_db_literal_is_value_by_key
+ */
+static tmrm_proxy*
+tmrm_storage_db_proxy_by_literal(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key)
+{
+    tmrm_iterator *it;
+    tmrm_object *obj = NULL;
+
+    it = tmrm_storage_db_literal_is_value_by_key(s, lit, key);
+    if (!it) {
+        TMRM_DEBUG1("internal error\n");
+        return NULL;
+    }
+    if (!tmrm_iterator_end(it)) {
+        obj = tmrm_iterator_get_object(it);
+    }
+    tmrm_iterator_free(it);
+    if (!obj) return NULL;
+    return tmrm_object_to_proxy(obj);
+}
+
+
+static int
+tmrm_storage_db_proxy_add_type(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* type)
+{
+    tmrm_proxy *anon;
+
+    anon = tmrm_storage_db_proxy_create(s, p->subject_map);
+    if (!anon) 
+        return -1;
+
+    tmrm_storage_db_add_property(s, anon, p->subject_map->type, type);
+    tmrm_storage_db_add_property(s, anon, p->subject_map->instance, p);
+    tmrm_proxy_free(anon);
+
+    return 0;
+}
+
+
+static int
+tmrm_storage_db_proxy_add_superclass(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* superclass)
+{
+    tmrm_proxy *anon;
+
+    anon = tmrm_storage_db_proxy_create(s, p->subject_map);
+    if (!anon) 
+        return -1;
+
+    tmrm_storage_db_add_property(s, anon, p->subject_map->superclass, superclass);
+    tmrm_storage_db_add_property(s, anon, p->subject_map->subclass, p);
+    tmrm_proxy_free(anon);
+    return 0;
+}
+
+
+/* Helper function for superclass-subclass or type-instance relations:
+   Returns the values for key a of all proxies that have p as value for
+   key b. */
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_class(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* a, tmrm_proxy* b)
+{
+    unsigned char* rec;
+    size_t len;
+    tmrm_iterator* iterator;
+
+    if (!(rec = _pack_value(TMRM_DB_LABEL_SIZE, p, NULL, &len))) {
+        return NULL;
+    }
+    _pack_label(rec, b->label);
+    iterator = _iterator_by_join(s, p->subject_map, rec,
+            TMRM_DB_LABEL_SIZE + len, a->label);
+    TMRM_FREE(cstring, rec);
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_subclasses(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_db_proxy_direct_class(s, p,
+        p->subject_map->subclass, p->subject_map->superclass);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_superclasses(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_db_proxy_direct_class(s, p,
+        p->subject_map->superclass, p->subject_map->subclass);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_types(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_db_proxy_direct_class(s, p,
+        p->subject_map->type, p->subject_map->instance);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_db_proxy_direct_instances(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_db_proxy_direct_class(s, p,
+        p->subject_map->instance, p->subject_map->type);
+}
+
+
+/**
+ * Helper function to iterate over a cursor range.
+ */
+static int
+tmrm_storage_db_list_next(void* context)
+{
+    tmrm_storage_db_iterator_context *c;
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(context, void, -1);
+    c = (tmrm_storage_db_iterator_context*)context;
+
+    if (c->end) return 1;
+    (void)_iterator_fetch(c, c->next_flag);
+    return 0;
+}
+
+
+/**
+ * Helper function to iterate over a cursor range.
+ */
+static int
+tmrm_storage_db_list_end(void* context)
+{
+    tmrm_storage_db_iterator_context *c;
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(context, void, -1);
+    c = (tmrm_storage_db_iterator_context*)context;
+
+    return c->end;
+}
+
+
+/**
+ * Helper function that decodes a proxy or literal from the current cursor
+ * position.
+ */
+static tmrm_object*
+tmrm_storage_db_list_get_element(void* context, tmrm_iterator_flag flag)
+{
+    tmrm_storage_db_iterator_context *c;
+    unsigned char *key, *data;
+    tmrm_proxy *p = NULL;
+
+    c = (tmrm_storage_db_iterator_context*)context;
+    if (c->end) return NULL;
+
+    key = (unsigned char*)c->key.data;
+    data = (unsigned char*)c->data.data;
+
+    switch (c->element) {
+        case TMRM_DB_ELEMENT_PROXY:
+            p = _create_proxy_struct(c->subject_map, _unpack_label(key));
+            break;
+        case TMRM_DB_ELEMENT_PROPERTY_KEY:
+            p = _create_proxy_struct(c->subject_map,
+                    _unpack_label(key + TMRM_DB_LABEL_SIZE));
+            break;
+        case TMRM_DB_ELEMENT_PROPERTY:
+            if (flag == TMRM_ITERATOR_GET_METHOD_GET_KEY) {
+                p = _create_proxy_struct(c->subject_map,
+                        _unpack_label(key + TMRM_DB_LABEL_SIZE));
+                break;
+            }
+            return _value_to_object(c->subject_map, data, c->data.size);
+        case TMRM_DB_ELEMENT_VALUE:
+            return _value_to_object(c->subject_map, data, c->data.size);
+        case TMRM_DB_ELEMENT_DATA_PROXY:
+            p = _create_proxy_struct(c->subject_map, _unpack_label(data));
+            break;
+    }
+    if (!p) return NULL;
+    return tmrm_proxy_to_object(p);
+}
+
+
+/**
+ * Helper function that closes the cursors of an iterator.
+ */
+static void
+tmrm_storage_db_list_free(void* context)
+{
+    tmrm_storage_db_iterator_context *c;
+    c = (tmrm_storage_db_iterator_context*)context;
+
+    if (c->cursor) (void)c->cursor->close(c->cursor);
+    if (c->outer) (void)c->outer->close(c->outer);
+    if (c->prefix) TMRM_FREE(cstring, c->prefix);
+    if (c->outer_prefix) TMRM_FREE(cstring, c->outer_prefix);
+    TMRM_FREE(tmrm_storage_db_iterator_context, c);
+}
+
+
+/* Packs label as 4 byte big-endian integer into buf. */
+static void
+_pack_label(unsigned char* buf, tmrm_label label)
+{
+    u_int32_t l = (u_int32_t)label;
+
+    buf[0] = (unsigned char)(l >> 24);
+    buf[1] = (unsigned char)(l >> 16);
+    buf[2] = (unsigned char)(l >> 8);
+    buf[3] = (unsigned char)l;
+}
+
+
+static tmrm_label
+_unpack_label(const unsigned char* buf)
+{
+    return (tmrm_label)(((u_int32_t)buf[0] << 24) | ((u_int32_t)buf[1] << 16) |
+            ((u_int32_t)buf[2] << 8) | (u_int32_t)buf[3]);
+}
+
+
+/**
+ * Packs the proxy p or the literal lit into a new buffer behind offset
+ * bytes that are reserved for the caller. The length of the value
+ * (without the offset) is stored in len.
+ *
+ * @returns a buffer that has to be freed with TMRM_FREE() or NULL on
+ * failure.
+ */
+static unsigned char*
+_pack_value(size_t offset, const tmrm_proxy* p, const tmrm_literal* lit,
+        size_t* len)
+{
+    unsigned char* rec;
+    const char *value, *datatype;
+    size_t value_len, datatype_len;
+
+    if (p != NULL) {
+        *len = 1 + TMRM_DB_LABEL_SIZE;
+        if (!(rec = (unsigned char*)TMRM_MALLOC(cstring, offset + *len))) {
+            return NULL;
+        }
+        rec[offset] = TMRM_DB_VALUE_PROXY;
+        _pack_label(rec + offset + 1, p->label);
+        return rec;
+    }
+
+    value = (const char*)tmrm_literal_value(lit);
+    datatype = (const char*)tmrm_literal_datatype(lit);
+    if (!value || !datatype) return NULL;
+    value_len = strlen(value) + 1;
+    datatype_len = strlen(datatype) + 1;
+    *len = 1 + value_len + datatype_len;
+    if (!(rec = (unsigned char*)TMRM_MALLOC(cstring, offset + *len))) {
+        return NULL;
+    }
+    rec[offset] = TMRM_DB_VALUE_LITERAL;
+    memcpy(rec + offset + 1, value, value_len);
+    memcpy(rec + offset + 1 + value_len, datatype, datatype_len);
+    return rec;
+}
+
+
+/* Creates a proxy or literal object from a packed value */
+static tmrm_object*
+_value_to_object(tmrm_subject_map* m, const unsigned char* value, size_t len)
+{
+    const tmrm_char_t *value_str, *datatype_str;
+    tmrm_proxy* p;
+    tmrm_literal* lit;
+
+    if (len < 1) return NULL;
+
+    if (value[0] == TMRM_DB_VALUE_PROXY) {
+        if (len < 1 + TMRM_DB_LABEL_SIZE) return NULL;
+        if (!(p = _create_proxy_struct(m, _unpack_label(value + 1)))) {
+            return NULL;
+        }
+        return tmrm_proxy_to_object(p);
+    }
+    value_str = (const tmrm_char_t*)value + 1;
+    datatype_str = value_str + strlen((const char*)value_str) + 1;
+    if (!(lit = tmrm_literal_new(value_str, datatype_str))) {
+        return NULL;
+    }
+    return tmrm_literal_to_object(lit);
+}
+
+
+/**
+* Allocates memory for a new tmrm_proxy structure.
+*/
+static tmrm_proxy*
+_create_proxy_struct(tmrm_subject_map* m, tmrm_label label)
+{
+    tmrm_proxy *p;
+
+    p = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
+    if (!p) {
+        return NULL;
+    }
+    p->type = TMRM_TYPE_PROXY;
+    p->label = label;
+    p->subject_map = m;
+    return p;
+}
+
+
+/* Opens the database name in the storage file. Indexes (dup != 0) store
+   sorted duplicates. Returns 0 on success. */
+static int
+_open_db(tmrm_storage_db_context* c, DB** dbp, const char* name, int dup)
+{
+    int ret;
+
+    if ((ret = db_create(dbp, c->env, 0)) != 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Creating database %s failed: %s", name,
+                db_strerror(ret));
+        *dbp = NULL;
+        return 1;
+    }
+    if (dup && (ret = (*dbp)->set_flags(*dbp, DB_DUP | DB_DUPSORT)) != 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Configuring database %s failed: %s", name,
+                db_strerror(ret));
+        return 1;
+    }
+    ret = (*dbp)->open(*dbp, NULL, c->file, name, DB_BTREE, DB_CREATE, 0);
+    if (ret) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Opening database %s in %s failed: %s", name,
+                c->file, db_strerror(ret));
+        return 1;
+    }
+    return 0;
+}
+
+
+static void
+_close_dbs(tmrm_storage_db_context* c)
+{
+    DB** dbs[4];
+    int i, ret;
+
+    dbs[0] = &c->proxies;
+    dbs[1] = &c->forward;
+    dbs[2] = &c->reverse;
+    dbs[3] = &c->values;
+    for (i = 0; i < 4; i++) {
+        if (*dbs[i] == NULL) continue;
+        if ((ret = (*dbs[i])->close(*dbs[i], 0)) != 0) {
+            TMRM_DEBUG2("Closing tmrm-database failed: %s\n", db_strerror(ret));
+        }
+        *dbs[i] = NULL;
+    }
+}
+
+
+/**
+ * Stores a property in all indexes. rec contains the labels of the proxy
+ * and the key followed by the packed value of value_len bytes. Unless
+ * added is NULL, it is set to 1 if the property was not stored before,
+ * even if storing it fails afterwards, and to 0 otherwise.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int
+_put_property(tmrm_storage* s, unsigned char* rec, size_t value_len,
+        int* added)
+{
+    unsigned char key_proxy[2 * TMRM_DB_LABEL_SIZE];
+    DBT key, data;
+    int ret;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return 1;
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+
+    /* forward: proxy . key -> value */
+    key.data = rec;
+    key.size = 2 * TMRM_DB_LABEL_SIZE;
+    data.data = rec + 2 * TMRM_DB_LABEL_SIZE;
+    data.size = (u_int32_t)value_len;
+    if (added) *added = 0;
+    ret = c->forward->put(c->forward, NULL, &key, &data, DB_NODUPDATA);
+    if (ret == DB_KEYEXIST) return 0;
+    if (ret) goto error;
+    if (added) *added = 1;
+
+    /* reverse: key . value -> proxy */
+    key.data = rec + TMRM_DB_LABEL_SIZE;
+    key.size = (u_int32_t)(TMRM_DB_LABEL_SIZE + value_len);
+    data.data = rec;
+    data.size = TMRM_DB_LABEL_SIZE;
+    ret = c->reverse->put(c->reverse, NULL, &key, &data, DB_NODUPDATA);
+    if (ret && ret != DB_KEYEXIST) goto error;
+
+    /* value: value -> key . proxy */
+    memcpy(key_proxy, rec + TMRM_DB_LABEL_SIZE, TMRM_DB_LABEL_SIZE);
+    memcpy(key_proxy + TMRM_DB_LABEL_SIZE, rec, TMRM_DB_LABEL_SIZE);
+    key.data = rec + 2 * TMRM_DB_LABEL_SIZE;
+    key.size = (u_int32_t)value_len;
+    data.data = key_proxy;
+    data.size = sizeof(key_proxy);
+    ret = c->values->put(c->values, NULL, &key, &data, DB_NODUPDATA);
+    if (ret && ret != DB_KEYEXIST) goto error;
+
+    return 0;
+
+error:
+    TMRM_LOG(TMRM_LOG_ERROR, "Storing property failed: %s", db_strerror(ret));
+    return 1;
+}
+
+
+/* Deletes one key/data pair from a database with sorted duplicates. A
+   missing pair is not an error. */
+static int
+_del_pair(DB* dbp, void* key, size_t key_len, void* data, size_t data_len)
+{
+    DBC* cursor;
+    DBT k, d;
+    int ret;
+
+    if (dbp->cursor(dbp, NULL, &cursor, 0) != 0) return 1;
+    memset(&k, 0, sizeof(DBT));
+    memset(&d, 0, sizeof(DBT));
+    k.data = key;
+    k.size = (u_int32_t)key_len;
+    d.data = data;
+    d.size = (u_int32_t)data_len;
+    ret = cursor->get(cursor, &k, &d, DB_GET_BOTH);
+    if (ret == 0) {
+        ret = cursor->del(cursor, 0);
+    }
+    (void)cursor->close(cursor);
+    return (ret == 0 || ret == DB_NOTFOUND) ? 0 : 1;
+}
+
+
+/**
+ * Deletes a property from all indexes except skip, which is the database
+ * that the caller iterates over and deletes from with its cursor. The
+ * forward index goes first and a failure stops the deletion, so a property
+ * that is still in the forward index is still in all indexes.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int
+_del_property(tmrm_storage_db_context* c, tmrm_label proxy, tmrm_label key,
+        const void* value, size_t value_len, const DB* skip)
+{
+    unsigned char* rec;
+    unsigned char key_proxy[2 * TMRM_DB_LABEL_SIZE];
+    int ret = 0;
+
+    if (!(rec = (unsigned char*)TMRM_MALLOC(cstring,
+                    2 * TMRM_DB_LABEL_SIZE + value_len))) {
+        return 1;
+    }
+    _pack_label(rec, proxy);
+    _pack_label(rec + TMRM_DB_LABEL_SIZE, key);
+    memcpy(rec + 2 * TMRM_DB_LABEL_SIZE, value, value_len);
+    _pack_label(key_proxy, key);
+    _pack_label(key_proxy + TMRM_DB_LABEL_SIZE, proxy);
+
+    if (c->forward != skip) {
+        ret = _del_pair(c->forward, rec, 2 * TMRM_DB_LABEL_SIZE,
+                rec + 2 * TMRM_DB_LABEL_SIZE, value_len);
+    }
+    if (ret == 0 && c->reverse != skip) {
+        ret = _del_pair(c->reverse, rec + TMRM_DB_LABEL_SIZE,
+                TMRM_DB_LABEL_SIZE + value_len, rec, TMRM_DB_LABEL_SIZE);
+    }
+    if (ret == 0 && c->values != skip) {
+        ret = _del_pair(c->values, rec + 2 * TMRM_DB_LABEL_SIZE, value_len,
+                key_proxy, sizeof(key_proxy));
+    }
+    TMRM_FREE(cstring, rec);
+    return ret;
+}
+
+
+/* Appends a copy of the property proxy . key -> value to r */
+static int
+_records_add(tmrm_storage_db_records* r, const unsigned char* proxy,
+        const unsigned char* key, const unsigned char* value,
+        size_t value_len)
+{
+    unsigned char **recs, *rec;
+    size_t* lens;
+    size_t max;
+
+    if (r->size == r->max) {
+        max = r->max ? 2 * r->max : 16;
+        if (!(recs = (unsigned char**)TMRM_REALLOC(cstring, r->recs,
+                        max * sizeof(unsigned char*)))) {
+            return 1;
+        }
+        r->recs = recs;
+        if (!(lens = (size_t*)TMRM_REALLOC(size_t, r->value_lens,
+                        max * sizeof(size_t)))) {
+            return 1;
+        }
+        r->value_lens = lens;
+        r->max = max;
+    }
+    if (!(rec = (unsigned char*)TMRM_MALLOC(cstring,
+                    2 * TMRM_DB_LABEL_SIZE + value_len))) {
+        return 1;
+    }
+    memcpy(rec, proxy, TMRM_DB_LABEL_SIZE);
+    memcpy(rec + TMRM_DB_LABEL_SIZE, key, TMRM_DB_LABEL_SIZE);
+    memcpy(rec + 2 * TMRM_DB_LABEL_SIZE, value, value_len);
+    r->recs[r->size] = rec;
+    r->value_lens[r->size++] = value_len;
+    return 0;
+}
+
+
+static void
+_records_free(tmrm_storage_db_records* r)
+{
+    size_t i;
+
+    for (i = 0; i < r->size; i++) TMRM_FREE(cstring, r->recs[i]);
+    if (r->recs) TMRM_FREE(cstring, r->recs);
+    if (r->value_lens) TMRM_FREE(size_t, r->value_lens);
+    r->recs = NULL;
+    r->value_lens = NULL;
+    r->size = r->max = 0;
+}
+
+
+/**
+ * Collects the properties that have the proxy label as proxy (forward
+ * index), as key (reverse index) or as value (value index). A property
+ * may be collected more than once.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int
+_collect_properties(tmrm_storage_db_context* c, tmrm_label label,
+        tmrm_storage_db_records* r)
+{
+    unsigned char prefix[1 + TMRM_DB_LABEL_SIZE];
+    const unsigned char *k, *d;
+    DB* dbs[3];
+    DBC* cursor;
+    DBT key, data;
+    int i, ret;
+
+    dbs[0] = c->forward;
+    dbs[1] = c->reverse;
+    dbs[2] = c->values;
+    prefix[0] = TMRM_DB_VALUE_PROXY;
+    _pack_label(prefix + 1, label);
+    for (i = 0; i < 3; i++) {
+        if (dbs[i]->cursor(dbs[i], NULL, &cursor, 0) != 0) return 1;
+        memset(&key, 0, sizeof(DBT));
+        memset(&data, 0, sizeof(DBT));
+        /* The value index is keyed by the packed value of the proxy */
+        key.data = i == 2 ? prefix : prefix + 1;
+        key.size = i == 2 ? sizeof(prefix) : TMRM_DB_LABEL_SIZE;
+        ret = cursor->get(cursor, &key, &data, i == 2 ? DB_SET : DB_SET_RANGE);
+        while (ret == 0) {
+            k = (const unsigned char*)key.data;
+            d = (const unsigned char*)data.data;
+            if (i < 2 && memcmp(k, prefix + 1, TMRM_DB_LABEL_SIZE) != 0) {
+                ret = DB_NOTFOUND;
+                break;
+            }
+            if (i == 0) {
+                ret = _records_add(r, k, k + TMRM_DB_LABEL_SIZE, d,
+                        data.size);
+            } else if (i == 1) {
+                ret = _records_add(r, d, k, k + TMRM_DB_LABEL_SIZE,
+                        key.size - TMRM_DB_LABEL_SIZE);
+            } else {
+                ret = _records_add(r, d + TMRM_DB_LABEL_SIZE, d, k, key.size);
+            }
+            if (ret) break;
+            ret = cursor->get(cursor, &key, &data,
+                    i == 2 ? DB_NEXT_DUP : DB_NEXT);
+        }
+        (void)cursor->close(cursor);
+        if (ret != DB_NOTFOUND) return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Stores the properties of the proxy label in sig as a sequence of key
+ * label, value length and value in the order of the forward index, so that
+ * proxies with equal properties get equal signatures. A proxy without
+ * properties gets an empty signature.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int
+_signature(tmrm_storage_db_context* c, tmrm_label label,
+        tmrm_storage_db_signature* sig)
+{
+    unsigned char prefix[TMRM_DB_LABEL_SIZE];
+    unsigned char* bytes;
+    size_t max = 0, len;
+    DBC* cursor;
+    DBT key, data;
+    int ret;
+
+    sig->label = label;
+    sig->bytes = NULL;
+    sig->len = 0;
+    if (c->forward->cursor(c->forward, NULL, &cursor, 0) != 0) return 1;
+    _pack_label(prefix, label);
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = prefix;
+    key.size = sizeof(prefix);
+    ret = cursor->get(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0) {
+        if (memcmp(key.data, prefix, sizeof(prefix)) != 0) {
+            ret = DB_NOTFOUND;
+            break;
+        }
+        len = 2 * TMRM_DB_LABEL_SIZE + data.size;
+        if (sig->len + len > max) {
+            max = 2 * (sig->len + len);
+            if (!(bytes = (unsigned char*)TMRM_REALLOC(cstring, sig->bytes,
+                            max))) {
+                ret = 1;
+                break;
+            }
+            sig->bytes = bytes;
+        }
+        memcpy(sig->bytes + sig->len,
+                (unsigned char*)key.data + TMRM_DB_LABEL_SIZE,
+                TMRM_DB_LABEL_SIZE);
+        _pack_label(sig->bytes + sig->len + TMRM_DB_LABEL_SIZE,
+                (tmrm_label)data.size);
+        memcpy(sig->bytes + sig->len + 2 * TMRM_DB_LABEL_SIZE, data.data,
+                data.size);
+        sig->len += len;
+        ret = cursor->get(cursor, &key, &data, DB_NEXT);
+    }
+    (void)cursor->close(cursor);
+    if (ret != DB_NOTFOUND) {
+        if (sig->bytes) TMRM_FREE(cstring, sig->bytes);
+        sig->bytes = NULL;
+        sig->len = 0;
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Deletes the property rec of value_len bytes from all indexes */
+static int
+_del_record(tmrm_storage_db_context* c, const unsigned char* rec,
+        size_t value_len)
+{
+    return _del_property(c, _unpack_label(rec),
+            _unpack_label(rec + TMRM_DB_LABEL_SIZE),
+            rec + 2 * TMRM_DB_LABEL_SIZE, value_len, NULL);
+}
+
+
+/**
+ * Merges the proxy p2 into p1: every property that refers to p2 as proxy,
+ * key or value is stored again with p1 in its place, and p2 is removed.
+ * Properties that p1 has already are not stored twice.
+ *
+ * The storage has no transactions, so the new properties are stored before
+ * the old ones are deleted. If a write fails, the deleted properties are
+ * stored again and the added ones deleted, which leaves p2 as it was.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int
+_merge_proxy(tmrm_storage* s, tmrm_label p1, tmrm_label p2)
+{
+    tmrm_storage_db_records r, m;
+    unsigned char buf[TMRM_DB_LABEL_SIZE];
+    unsigned char* rec;
+    int* added = NULL;
+    size_t i, stored = 0, deleted = 0;
+    DBT key;
+    int ret, undo = 0;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+
+    TMRM_DEBUG3("Merging proxy %d into %d\n", (int)p2, (int)p1);
+    memset(&r, 0, sizeof(r));
+    memset(&m, 0, sizeof(m));
+    ret = _collect_properties(c, p2, &r);
+    for (i = 0; i < r.size && ret == 0; i++) {
+        rec = r.recs[i];
+        ret = _records_add(&m, rec, rec + TMRM_DB_LABEL_SIZE,
+                rec + 2 * TMRM_DB_LABEL_SIZE, r.value_lens[i]);
+        if (ret) break;
+        rec = m.recs[i];
+        if (_unpack_label(rec) == p2) _pack_label(rec, p1);
+        if (_unpack_label(rec + TMRM_DB_LABEL_SIZE) == p2) {
+            _pack_label(rec + TMRM_DB_LABEL_SIZE, p1);
+        }
+        if (rec[2 * TMRM_DB_LABEL_SIZE] == TMRM_DB_VALUE_PROXY &&
+                _unpack_label(rec + 2 * TMRM_DB_LABEL_SIZE + 1) == p2) {
+            _pack_label(rec + 2 * TMRM_DB_LABEL_SIZE + 1, p1);
+        }
+    }
+    if (ret == 0 && m.size > 0 &&
+            !(added = (int*)TMRM_CALLOC(int, m.size, sizeof(int)))) {
+        ret = 1;
+    }
+    if (ret) goto done;
+
+    /* A failed write may have changed its property partly, so it is
+       undone as well */
+    while (stored < m.size && ret == 0) {
+        ret = _put_property(s, m.recs[stored], m.value_lens[stored],
+                &added[stored]);
+        stored++;
+    }
+    while (deleted < r.size && ret == 0) {
+        ret = _del_record(c, r.recs[deleted], r.value_lens[deleted]);
+        deleted++;
+    }
+    if (ret == 0) {
+        _pack_label(buf, p2);
+        memset(&key, 0, sizeof(DBT));
+        key.data = buf;
+        key.size = TMRM_DB_LABEL_SIZE;
+        ret = c->proxies->del(c->proxies, NULL, &key, 0);
+        ret = (ret == 0 || ret == DB_NOTFOUND) ? 0 : 1;
+    }
+
+    if (ret) {
+        for (i = 0; i < deleted; i++) {
+            undo |= _put_property(s, r.recs[i], r.value_lens[i], NULL);
+        }
+        for (i = 0; i < stored; i++) {
+            if (added[i]) undo |= _del_record(c, m.recs[i], m.value_lens[i]);
+        }
+        if (undo) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Undoing the merge of proxy %d into "
+                    "%d failed", (int)p2, (int)p1);
+        }
+    }
+
+done:
+    if (added) TMRM_FREE(int, added);
+    _records_free(&m);
+    _records_free(&r);
+    return ret;
+}
+
+
+/**
+ * Creates an iterator over all entries of dbp whose key starts with
+ * prefix (exact == 0) or equals prefix (exact != 0). An empty prefix
+ * iterates over the whole database.
+ */
+static tmrm_iterator*
+_iterator_by_range(tmrm_storage* s, tmrm_subject_map* map, DB* dbp,
+        const unsigned char* prefix, size_t prefix_len, int exact,
+        tmrm_storage_db_element element)
+{
+    tmrm_storage_db_iterator_context *context;
+    tmrm_iterator* iterator;
+
+    context = (tmrm_storage_db_iterator_context*)
+        TMRM_CALLOC(tmrm_storage_db_iterator_context, 1,
+                sizeof(tmrm_storage_db_iterator_context));
+    if (!context) return NULL;
+
+    context->subject_map = map;
+    context->element = element;
+    if (prefix_len == 0) {
+        context->first_flag = DB_FIRST;
+        context->next_flag = DB_NEXT;
+    } else if (exact) {
+        context->first_flag = DB_SET;
+        context->next_flag = DB_NEXT_DUP;
+    } else {
+        context->first_flag = DB_SET_RANGE;
+        /* The duplicates of a key would return the same key again */
+        context->next_flag = element == TMRM_DB_ELEMENT_PROPERTY_KEY ?
+            DB_NEXT_NODUP : DB_NEXT;
+    }
+    if (prefix_len > 0) {
+        if (!(context->prefix = (unsigned char*)TMRM_MALLOC(cstring,
+                        prefix_len))) {
+            TMRM_FREE(tmrm_storage_db_iterator_context, context);
+            return NULL;
+        }
+        memcpy(context->prefix, prefix, prefix_len);
+        context->prefix_len = prefix_len;
+    }
+    if (dbp->cursor(dbp, NULL, &context->cursor, 0) != 0) {
+        tmrm_storage_db_list_free(context);
+        return NULL;
+    }
+    if (_iterator_fetch(context, context->first_flag) > 0) {
+        tmrm_storage_db_list_free(context);
+        return NULL;
+    }
+
+    iterator = tmrm_iterator_new(s->subject_map_sphere, (void*)context,
+            tmrm_storage_db_list_next,
+            tmrm_storage_db_list_end,
+            tmrm_storage_db_list_get_element,
+            tmrm_storage_db_list_free);
+    if (!iterator) tmrm_storage_db_list_free(context);
+    return iterator;
+}
+
+
+/**
+ * Creates an iterator that joins the reverse index with the forward index:
+ * For each proxy stored under outer_key in the reverse index, it returns
+ * the values of the proxy's property join_key.
+ */
+static tmrm_iterator*
+_iterator_by_join(tmrm_storage* s, tmrm_subject_map* map,
+        const unsigned char* outer_key, size_t outer_key_len,
+        tmrm_label join_key)
+{
+    tmrm_storage_db_iterator_context *context;
+    tmrm_iterator* iterator;
+    tmrm_storage_db_context* c = (tmrm_storage_db_context*)s->context;
+    if (!c) return NULL;
+
+    context = (tmrm_storage_db_iterator_context*)
+        TMRM_CALLOC(tmrm_storage_db_iterator_context, 1,
+                sizeof(tmrm_storage_db_iterator_context));
+    if (!context) return NULL;
+
+    context->subject_map = map;
+    context->element = TMRM_DB_ELEMENT_VALUE;
+    context->first_flag = DB_SET;
+    context->next_flag = DB_NEXT_DUP;
+    context->join_key = join_key;
+    context->prefix_len = 2 * TMRM_DB_LABEL_SIZE;
+    context->outer_prefix_len = outer_key_len;
+    context->prefix = (unsigned char*)TMRM_MALLOC(cstring, context->prefix_len);
+    context->outer_prefix = (unsigned char*)TMRM_MALLOC(cstring, outer_key_len);
+    if (!context->prefix || !context->outer_prefix) {
+        tmrm_storage_db_list_free(context);
+        return NULL;
+    }
+    memcpy(context->outer_prefix, outer_key, outer_key_len);
+    if (c->reverse->cursor(c->reverse, NULL, &context->outer, 0) != 0 ||
+            c->forward->cursor(c->forward, NULL, &context->cursor, 0) != 0) {
+        tmrm_storage_db_list_free(context);
+        return NULL;
+    }
+    if (_iterator_fetch(context, context->first_flag) > 0) {
+        tmrm_storage_db_list_free(context);
+        return NULL;
+    }
+
+    iterator = tmrm_iterator_new(s->subject_map_sphere, (void*)context,
+            tmrm_storage_db_list_next,
+            tmrm_storage_db_list_end,
+            tmrm_storage_db_list_get_element,
+            tmrm_storage_db_list_free);
+    if (!iterator) tmrm_storage_db_list_free(context);
+    return iterator;
+}
+
+
+/**
+ * Moves the cursor(s) of an iterator to the next position in its range.
+ * Sets c->end when the range is exhausted.
+ *
+ * @returns 0 on success, a negative value at the end of the range and a
+ * positive value on failure.
+ */
+static int
+_iterator_fetch(tmrm_storage_db_iterator_context* c, u_int32_t flag)
+{
+    u_int32_t outer_flag;
+    int ret;
+
+    if (c->outer == NULL) {
+        if (flag == DB_SET || flag == DB_SET_RANGE) {
+            c->key.data = c->prefix;
+            c->key.size = (u_int32_t)c->prefix_len;
+        }
+        ret = c->cursor->get(c->cursor, &c->key, &c->data, flag);
+        if (ret == 0 && c->prefix_len > 0 && (c->key.size < c->prefix_len ||
+                    memcmp(c->key.data, c->prefix, c->prefix_len) != 0)) {
+            ret = DB_NOTFOUND;
+        }
+    } else {
+        /* Join: try the next value of the current outer proxy first */
+        ret = DB_NOTFOUND;
+        outer_flag = DB_SET;
+        if (flag != DB_SET) {
+            ret = c->cursor->get(c->cursor, &c->key, &c->data, DB_NEXT_DUP);
+            outer_flag = DB_NEXT_DUP;
+        }
+        while (ret == DB_NOTFOUND) {
+            if (outer_flag == DB_SET) {
+                c->outer_key.data = c->outer_prefix;
+                c->outer_key.size = (u_int32_t)c->outer_prefix_len;
+            }
+            ret = c->outer->get(c->outer, &c->outer_key, &c->outer_data,
+                    outer_flag);
+            outer_flag = DB_NEXT_DUP;
+            if (ret) break;
+
+            memcpy(c->prefix, c->outer_data.data, TMRM_DB_LABEL_SIZE);
+            _pack_label(c->prefix + TMRM_DB_LABEL_SIZE, c->join_key);
+            c->key.data = c->prefix;
+            c->key.size = (u_int32_t)c->prefix_len;
+            ret = c->cursor->get(c->cursor, &c->key, &c->data, DB_SET);
+        }
+    }
+
+    if (ret == 0) {
+        c->end = 0;
+        return 0;
+    }
+    c->end = 1;
+    if (ret != DB_NOTFOUND) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Cursor operation failed: %s",
+                db_strerror(ret));
+        return 1;
+    }
+    return -1;
+}
+
+
+static void
+tmrm_storage_db_register_factory(tmrm_storage_factory *factory)
+{
+    factory->init = tmrm_storage_db_init; 
+    factory->free = tmrm_storage_db_free; 
+    /* The databases are opened without DB_THREAD */
+    factory->concurrency = TMRM_STORAGE_SERIALIZED;
+
+    factory->bootstrap = tmrm_storage_db_bootstrap;
+    factory->remove = tmrm_storage_db_remove;
+    factory->bottom = tmrm_storage_db_bottom;
+    factory->merge = tmrm_storage_db_merge;
+    factory->proxy_create = tmrm_storage_db_proxy_create;
+    /* Merge compares the properties in the forward index directly, so
+       there is no hash of the properties to keep up to date */
+    factory->proxy_update = NULL;
+    factory->add_property = tmrm_storage_db_add_property;
+    factory->add_property_literal = tmrm_storage_db_add_property_literal;
+    factory->proxy_remove_properties_by_key = tmrm_storage_db_proxy_remove_properties_by_key;
+    factory->proxy_properties = tmrm_storage_db_proxy_properties;
+    factory->proxy_remove = tmrm_storage_db_proxy_remove;
+    factory->proxy_by_label = tmrm_storage_db_proxy_by_label;
+    factory->proxies = tmrm_storage_db_proxies;
+    factory->proxy_label = tmrm_storage_db_proxy_label;
+    factory->proxy_keys = tmrm_storage_db_proxy_keys;
+    factory->proxy_values_by_key = tmrm_storage_db_proxy_values_by_key;
+    factory->proxy_is_value_by_key = tmrm_storage_db_proxy_is_value_by_key;
+    factory->proxy_keys_by_value = tmrm_storage_db_proxy_keys_by_value;
+    factory->literal_keys_by_value = tmrm_storage_db_literal_keys_by_value;
+    factory->literal_is_value_by_key = tmrm_storage_db_literal_is_value_by_key;
+    factory->proxy_add_type = tmrm_storage_db_proxy_add_type;
+    factory->proxy_add_superclass = tmrm_storage_db_proxy_add_superclass;
+    factory->proxy_direct_subclasses = tmrm_storage_db_proxy_direct_subclasses;
+    factory->proxy_direct_superclasses = tmrm_storage_db_proxy_direct_superclasses;
+    factory->proxy_direct_types = tmrm_storage_db_proxy_direct_types;
+    factory->proxy_direct_instances = tmrm_storage_db_proxy_direct_instances;
+}
+
+
 void
 tmrm_init_storage_db(tmrm_subject_map_sphere *sms)
 {
@@ -34,22 +34,146 @@
 
 #include "tmrm_internal.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * The bootstrap ontology that every storage imports into a new subject map.
+ * The proxies for superclass, subclass, type and instance are identified by
+ * their libtmrm_bottom literal.
+ */
+#define TMRM_STORAGE_BOOTSTRAP_ONTOLOGY "%YAML 1.1\n" \
+    "---\n" \
+    "subject_map: 'bootstrap'\n" \
+    "proxies:\n" \
+    "    libtmrm_bottom: {libtmrm_bottom: libtmrm_bottom}\n" \
+    "    ontology: {libtmrm_bottom: 'libtmrm:ontology'}\n" \
+    "    ontology_version_major: {libtmrm_bottom: 'libtmrm:ontology-version-major'}\n" \
+    "    ontology_version_minor: {libtmrm_bottom: 'libtmrm:ontology-version-minor'}\n" \
+    "    bootstrap:\n" \
+    "        ontology: 'bootstrap'\n" \
+    "        ontology_version_major: 0\n" \
+    "        ontology_version_minor: 1\n" \
+    "    superclass: {libtmrm_bottom: 'libtmrm:superclass'}\n" \
+    "    subclass: {libtmrm_bottom: 'libtmrm:subclass'}\n" \
+    "    type: {libtmrm_bottom: 'libtmrm:type'}\n" \
+    "    instance: {libtmrm_bottom: 'libtmrm:instance'}\n" \
+    "...\n"
+
 void tmrm_storage_register_factory(tmrm_subject_map_sphere *sms,
         const char* name, const char* label,
         void (*factory)(tmrm_storage_factory*));
 
+/* Factory callbacks in the call statistics of a storage (see
+   tmrm_storage_stats()) */
+typedef enum {
+    TMRM_STORAGE_OP_BOOTSTRAP = 0,
+    TMRM_STORAGE_OP_REMOVE,
+    TMRM_STORAGE_OP_BOTTOM,
+    TMRM_STORAGE_OP_MERGE,
+    TMRM_STORAGE_OP_PROXY_CREATE,
+    TMRM_STORAGE_OP_PROXY_UPDATE,
+    TMRM_STORAGE_OP_ADD_PROPERTY,
+    TMRM_STORAGE_OP_ADD_PROPERTY_LITERAL,
+    TMRM_STORAGE_OP_PROXY_BY_LABEL,
+    TMRM_STORAGE_OP_PROXIES,
+    TMRM_STORAGE_OP_PROXY_LABEL,
+    TMRM_STORAGE_OP_PROXY_KEYS,
+    TMRM_STORAGE_OP_PROXY_VALUES_BY_KEY,
+    TMRM_STORAGE_OP_PROXY_IS_VALUE_BY_KEY,
+    TMRM_STORAGE_OP_LITERAL_IS_VALUE_BY_KEY,
+    TMRM_STORAGE_OP_IS_VALUE_BY_KEY_MANY,
+    TMRM_STORAGE_OP_POSTING_LIST,
+    TMRM_STORAGE_OP_PATH,
+    TMRM_STORAGE_OP_PROXY_KEYS_BY_VALUE,
+    TMRM_STORAGE_OP_LITERAL_KEYS_BY_VALUE,
+    TMRM_STORAGE_OP_PROXY_ADD_TYPE,
+    TMRM_STORAGE_OP_PROXY_ADD_SUPERCLASS,
+    TMRM_STORAGE_OP_PROXY_DIRECT_SUBCLASSES,
+    TMRM_STORAGE_OP_PROXY_DIRECT_SUPERCLASSES,
+    TMRM_STORAGE_OP_PROXY_DIRECT_TYPES,
+    TMRM_STORAGE_OP_PROXY_DIRECT_INSTANCES,
+    TMRM_STORAGE_OP_PROXY_REMOVE_PROPERTIES_BY_KEY,
+    TMRM_STORAGE_OP_PROXY_PROPERTIES,
+    TMRM_STORAGE_OP_PROXY_REMOVE,
+    TMRM_STORAGE_OP_SCAN_PROPERTIES,
+    TMRM_STORAGE_OP_POLL_CHANGES,
+    TMRM_STORAGE_OP_SNAPSHOT_ACQUIRE,
+    TMRM_STORAGE_OP_SNAPSHOT_RELEASE,
+    TMRM_STORAGE_OP_COUNT
+} tmrm_storage_op;
+
 /** A storage object */
 struct tmrm_storage_s
 {
     tmrm_subject_map_sphere* subject_map_sphere;
     struct tmrm_storage_factory_s* factory;
     void *context;
+    /* Updated by the wrappers in tmrm_storage.c on every factory call */
+    tmrm_op_stats stats[TMRM_STORAGE_OP_COUNT];
+#ifdef HAVE_PTHREAD
+    /* Taken by the wrappers in tmrm_storage.c according to the concurrency
+       of the factory. depth counts how often the calling thread holds it,
+       so that storages may call back into the library. */
+    pthread_rwlock_t lock;
+    pthread_key_t depth;
+#endif
 };
 
+/* How many calls a storage can serve at the same time */
+typedef enum {
+    /* One call at a time (the default) */
+    TMRM_STORAGE_SERIALIZED = 0,
+    /* Any number of reads, or a single write */
+    TMRM_STORAGE_CONCURRENT_READS,
+    /* The storage does its own locking, or never changes */
+    TMRM_STORAGE_CONCURRENT
+} tmrm_storage_concurrency;
+
+typedef struct tmrm_property_visitor_s tmrm_property_visitor;
+
+/* A read that a storage runs without blocking the caller, for
+   tmrm_async.c (see tmrm_storage_query_send()) */
+struct tmrm_storage_query_s {
+    tmrm_storage* storage;
+    tmrm_storage_op op;
+    tmrm_subject_map* map;
+    /* Set by the storage: the descriptor to wait for, and whether to wait
+       until it is writable instead of readable */
+    int fd;
+    int want_write;
+    /* Set by the storage when the query has finished, NULL on failure */
+    tmrm_iterator* result;
+    void* context;
+    unsigned long long start;
+};
+typedef struct tmrm_storage_query_s tmrm_storage_query;
+
+/* Axes of the path language (see tmrm_path.c) */
+typedef enum {
+    /* "-> key": the values of the proxies for the key */
+    TMRM_PATH_AXIS_VALUES_BY_KEY = 0,
+    /* "<- key": the proxies that have the objects as value for the key */
+    TMRM_PATH_AXIS_IS_VALUE_BY_KEY = 1,
+    /* "/": the keys for which the objects are a value */
+    TMRM_PATH_AXIS_KEYS_BY_VALUE = 2
+} tmrm_path_axis;
+
+/* A single step of a path expression. A step matches any of its keys;
+   "key *" lists the key and all its subclasses. Steps on the
+   TMRM_PATH_AXIS_KEYS_BY_VALUE axis have no keys. */
+struct tmrm_path_step_s {
+    tmrm_path_axis axis;
+    tmrm_label* keys;
+    int key_count;
+};
+typedef struct tmrm_path_step_s tmrm_path_step;
+
 struct tmrm_storage_factory_s {
     char* name;
     char* label;
@@ -57,6 +181,7 @@ struct tmrm_storage_factory_s {
     /* the rest of this structure is populated by the
      *      storage-specific register function */
     size_t context_length;
+    tmrm_storage_concurrency concurrency;
 
     /* Contructor */
     int (*init)(tmrm_storage* storage, tmrm_hash* options);
@@ -86,6 +211,22 @@ struct tmrm_storage_factory_s {
             tmrm_proxy* key);
     tmrm_iterator* (*literal_is_value_by_key)(tmrm_storage* storage,
             tmrm_literal* lit, tmrm_proxy* key);
+    /* Optional: proxy_is_value_by_key and literal_is_value_by_key for all
+       count proxies and literals in values in one request */
+    tmrm_iterator* (*is_value_by_key_many)(tmrm_storage* storage,
+            tmrm_object* const* values, int count, tmrm_proxy* key);
+    /* Optional: the labels of the proxies that have value for key, sorted
+       and without duplicates, in a new array (see
+       tmrm_storage_posting_list()) */
+    int (*posting_list)(tmrm_storage* storage, tmrm_object* value,
+            tmrm_proxy* key, tmrm_label** labels, int* count);
+    /* Optional: evaluates a sequence of path steps for all count proxies
+       and literals in values in one request. With closure set, the steps
+       are repeated until no new objects turn up, and the distinct objects
+       of all rounds (values included) are returned. */
+    tmrm_iterator* (*path)(tmrm_storage* storage, tmrm_subject_map* map,
+            tmrm_object* const* values, int count,
+            const tmrm_path_step* steps, int step_count, int closure);
     tmrm_iterator* (*proxy_keys_by_value)(tmrm_storage* storage, tmrm_proxy* p);
     tmrm_iterator* (*literal_keys_by_value)(tmrm_storage* storage, tmrm_literal* lit, tmrm_subject_map* map);
     int (*proxy_add_type)(tmrm_storage* storage, tmrm_proxy* p,
@@ -102,7 +243,82 @@ struct tmrm_storage_factory_s {
             tmrm_proxy* key);
     tmrm_iterator* (*proxy_properties)(tmrm_storage* storage, tmrm_proxy* p);
     int (*proxy_remove)(tmrm_storage* storage, const tmrm_proxy* p);
+    /* Optional: visits all proxies of a map in label order, each followed
+       by its properties, in a single pass over the storage. The visitor
+       must not modify the storage. */
+    int (*scan_properties)(tmrm_storage* storage, tmrm_subject_map* map,
+            const tmrm_property_visitor* visitor, void* data);
+    /* Optional: reports the properties that other processes have added,
+       changed or removed since the last call. value is NULL for literal
+       values. Used to keep the read cache coherent. */
+    int (*poll_changes)(tmrm_storage* storage,
+            void (*changed)(void* data, tmrm_label proxy, tmrm_label key,
+                const tmrm_label* value),
+            void* data);
+    /* Optional: pins the current state for a subject map snapshot and
+       returns its version (0 on failure). Reads through subject maps with
+       that version in their snapshot field must see the pinned state until
+       snapshot_release() is called. */
+    unsigned long (*snapshot_acquire)(tmrm_storage* storage,
+            tmrm_subject_map* map);
+    void (*snapshot_release)(tmrm_storage* storage, unsigned long version);
+    /* Optional: starts q->op (proxy_by_label with label, or
+       proxy_values_by_key, proxy_is_value_by_key or proxy_keys_by_value
+       with p and key) without blocking and sets q->fd. query_poll() is
+       called whenever q->fd is ready; it reads what has arrived without
+       blocking and returns 1 while the query runs, or 0 once q->result is
+       set. proxy_by_label results in at most one proxy. query_free()
+       releases the query and cancels it if it still runs. */
+    int (*query_send)(tmrm_storage* storage, tmrm_storage_query* q,
+            tmrm_proxy* p, tmrm_proxy* key, const char* label);
+    int (*query_poll)(tmrm_storage* storage, tmrm_storage_query* q);
+    void (*query_free)(tmrm_storage* storage, tmrm_storage_query* q);
+
+};
+
+/* Tracing spans for storages, e.g. around SQL statements (see
+   tmrm_trace_begin()) */
+int tmrm_trace_begin(tmrm_storage* s, tmrm_span* span, const char* operation,
+        int proxy, int key, const char* sql);
+void tmrm_trace_end(tmrm_storage* s, tmrm_span* span, int failed, long rows);
+
+/* Builder for snapshot files (see tmrm_storage_snapshot.c) */
+typedef struct tmrm_snapshot_builder_s tmrm_snapshot_builder;
 
+tmrm_snapshot_builder* tmrm_snapshot_builder_new(void);
+int tmrm_snapshot_builder_add_proxy(tmrm_snapshot_builder* b, tmrm_label label);
+int tmrm_snapshot_builder_add_property(tmrm_snapshot_builder* b,
+        tmrm_label proxy, tmrm_label key, tmrm_label value);
+int tmrm_snapshot_builder_add_property_literal(tmrm_snapshot_builder* b,
+        tmrm_label proxy, tmrm_label key, const tmrm_char_t* value,
+        const tmrm_char_t* datatype);
+int tmrm_snapshot_builder_write(tmrm_snapshot_builder* b,
+        const char* filename);
+void tmrm_snapshot_builder_free(tmrm_snapshot_builder* b);
+
+/* Callbacks for tmrm_snapshot_load() and tmrm_storage_scan_properties().
+   Returning a non-zero value stops the scan. Literal strings are only
+   valid during the call. */
+struct tmrm_property_visitor_s {
+    int (*proxy)(void* data, tmrm_label label);
+    int (*property)(void* data, tmrm_label proxy, tmrm_label key,
+            tmrm_label value);
+    int (*property_literal)(void* data, tmrm_label proxy, tmrm_label key,
+            const tmrm_char_t* value, const tmrm_char_t* datatype);
 };
 
+int tmrm_snapshot_load(const char* filename,
+        const tmrm_property_visitor* visitor, void* data);
+
+/* Visitor that adds everything to the tmrm_snapshot_builder passed as data */
+extern const tmrm_property_visitor tmrm_snapshot_builder_visitor;
+
+/* Makes files created, renamed or removed in dir durable */
+int tmrm_sync_directory(const char* dir);
+
+/* Take and release the lock of a storage like the wrappers in
+   tmrm_storage.c do, for storages that work in threads of their own */
+void tmrm_storage_lock(tmrm_storage* s, int write);
+void tmrm_storage_unlock(tmrm_storage* s);
+
 #endif
@@ -0,0 +1,2747 @@
+/*
+ * tmrm_storage_log.c - log-structured append-only storage
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the 
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */ 
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include <libtmrm.h>
+#include <tmrm_internal.h>
+#include <tmrm_storage_internal.h>
+#include <tmrm_storage.h>
+#include <tmrm_hash.h>
+
+/*
+ * The log storage keeps the whole subject map in memory and appends every
+ * modification to a segment file <dir>/<name>.log.NNNNNN. A segment starts
+ * with an 8 byte magic and a byte order marker, followed by records:
+ *
+ *   uint32 length, uint32 checksum, length bytes payload
+ *
+ * The first byte of the payload is the operation, followed by 32 bit
+ * labels (and the zero terminated value and datatype of literals).
+ *
+ * When a segment exceeds segment_size a new one is started. After
+ * compact_segments segments the in-memory state is written as a snapshot
+ * <dir>/<name>.snapshot.NNNNNN (see tmrm_storage_snapshot.c) that replaces
+ * all segments up to NNNNNN. At open the latest snapshot is loaded and the
+ * remaining segments are replayed. Compaction runs in a thread of its own:
+ * it pins the version of the last write in segment NNNNNN like a subject
+ * map snapshot, so writers go on meanwhile, and only takes the write lock
+ * to replace the old files at the end.
+ *
+ * Reads through a subject map snapshot (see tmrm_subject_map_snapshot())
+ * see the indexes as they were when the snapshot was taken. Every entry
+ * and proxy carries the version that added it and the version that
+ * removed it; taking a snapshot pins the current version and starts a new
+ * one. While snapshots are open, removed entries are only marked, and
+ * they are reclaimed once no open snapshot can see them anymore.
+ */
+#define TMRM_LOG_MAGIC "TMRMLOG1"
+#define TMRM_LOG_BYTE_ORDER 0x01020304
+#define TMRM_LOG_HEADER_SIZE 12
+#define TMRM_LOG_RECORD_HEADER_SIZE 8
+#define TMRM_LOG_BUFFER_SIZE 65536
+
+#define TMRM_LOG_OP_PROXY 1             /* label */
+#define TMRM_LOG_OP_PROPERTY 2          /* proxy, key, value */
+#define TMRM_LOG_OP_PROPERTY_LITERAL 3  /* proxy, key, value, datatype */
+#define TMRM_LOG_OP_REMOVE_BY_KEY 4     /* proxy, key */
+#define TMRM_LOG_OP_REMOVE_PROXY 5      /* label */
+
+#define TMRM_LOG_VALUE_PROXY 0
+#define TMRM_LOG_VALUE_LITERAL 1
+
+/* Defaults for the options of the same name */
+#define TMRM_LOG_GROUP_COMMIT 64
+#define TMRM_LOG_SEGMENT_SIZE (16 * 1024 * 1024)
+#define TMRM_LOG_COMPACT_SEGMENTS 4
+
+/* Marks literal indexes in the garbage list */
+#define TMRM_LOG_GARBAGE_LITERAL 0x80000000u
+
+/* The version that plain reads see */
+#define TMRM_LOG_CURRENT ((uint32_t)-1)
+
+/* Proxies that compaction visits per read lock */
+#define TMRM_LOG_COMPACT_CHUNK 1024
+
+/* States of the compaction */
+#define TMRM_LOG_COMPACT_IDLE 0
+#define TMRM_LOG_COMPACT_RUNNING 1
+#define TMRM_LOG_COMPACT_DONE 2     /* the thread still has to be joined */
+
+/* A property. The value is a proxy label or a literal index, depending on
+   kind. removed is 0 until the property is removed. */
+struct tmrm_storage_log_entry_s {
+    uint32_t proxy;
+    uint32_t key;
+    uint32_t kind;
+    uint32_t value;
+    uint32_t added;
+    uint32_t removed;
+};
+
+typedef struct tmrm_storage_log_entry_s tmrm_storage_log_entry;
+
+struct tmrm_storage_log_entries_s {
+    tmrm_storage_log_entry* items;
+    uint32_t size;
+    uint32_t max;
+};
+
+typedef struct tmrm_storage_log_entries_s tmrm_storage_log_entries;
+
+/* Index of a proxy: its own properties, the properties that have the
+   proxy as value and the properties that have it as key. added is 0 if the
+   proxy was never created. garbage is set while the node is listed in the
+   garbage of the context. */
+struct tmrm_storage_log_node_s {
+    uint32_t added;
+    uint32_t removed;
+    int garbage;
+    tmrm_storage_log_entries properties;
+    tmrm_storage_log_entries references;
+    tmrm_storage_log_entries keyed;
+};
+
+typedef struct tmrm_storage_log_node_s tmrm_storage_log_node;
+
+struct tmrm_storage_log_literal_s {
+    char* value;
+    char* datatype;
+    uint32_t hash;
+    int garbage;
+    tmrm_storage_log_entries references;
+};
+
+typedef struct tmrm_storage_log_literal_s tmrm_storage_log_literal;
+
+struct tmrm_storage_log_context_s {
+    tmrm_storage* storage;
+    char* dir;
+    char* name;
+
+    /* In-memory indexes. Proxies are indexed by label. */
+    tmrm_storage_log_node* proxies;
+    uint32_t max_proxies;
+    tmrm_label next_label;
+    tmrm_storage_log_literal* literals;
+    uint32_t num_literals;
+    uint32_t max_literals;
+    /* Open addressing hash of literal indexes + 1, 0 is an empty slot */
+    uint32_t* literal_table;
+    uint32_t literal_table_size;
+
+    /* Current segment */
+    int fd;
+    uint32_t segment;
+    uint32_t first_segment;
+    off_t segment_offset;
+    unsigned char* buffer;
+    size_t buffered;
+    long pending;
+
+    long group_commit;
+    long segment_size;
+    long compact_segments;
+
+    /* Version of all writes since the last snapshot was taken, and the
+       versions of the open snapshots */
+    uint32_t version;
+    uint32_t* snapshots;
+    uint32_t num_snapshots;
+    uint32_t max_snapshots;
+    /* The proxies and literals (TMRM_LOG_GARBAGE_LITERAL | index) whose
+       indexes keep removed entries for snapshots. If the list could not
+       grow, garbage_all is set and every index is checked. */
+    uint32_t* garbage;
+    uint32_t num_garbage;
+    uint32_t max_garbage;
+    int garbage_all;
+
+    /* Compaction: the pinned version and the last segment it replaces.
+       The state and cancelled are changed under the write lock. */
+    int compacting;
+    int compact_cancelled;
+    uint32_t compact_version;
+    uint32_t compact_covered;
+#ifdef HAVE_PTHREAD
+    pthread_t compactor;
+#endif
+};
+
+typedef struct tmrm_storage_log_context_s tmrm_storage_log_context;
+
+/* Part of an entry that an iterator returns */
+enum tmrm_storage_log_element_e {
+    TMRM_LOG_ELEMENT_KEY,       /* key of a property */
+    TMRM_LOG_ELEMENT_PROPERTY,  /* key and value of a property */
+    TMRM_LOG_ELEMENT_VALUE,     /* value of a property */
+    TMRM_LOG_ELEMENT_PROXY      /* proxy of a property */
+};
+
+typedef enum tmrm_storage_log_element_e tmrm_storage_log_element;
+
+/* Iterators work on a copy of the entries, so the indexes may be modified
+   while iterating. */
+struct tmrm_storage_log_iterator_context_s {
+    tmrm_subject_map* subject_map;
+    tmrm_storage_log_context* log;
+    tmrm_storage_log_element element;
+    tmrm_storage_log_entries entries;
+    uint32_t current;
+};
+
+typedef struct tmrm_storage_log_iterator_context_s tmrm_storage_log_iterator_context;
+
+/* The current properties of a proxy as compared by merge: size sorted
+   (key, kind, value) triples */
+struct tmrm_storage_log_signature_s {
+    uint32_t label;
+    uint32_t* triples;
+    uint32_t size;
+};
+
+typedef struct tmrm_storage_log_signature_s tmrm_storage_log_signature;
+
+/* ---------------------------------------------------------------------------
+Prototypes for the log storage factory
+*/
+static void
+tmrm_storage_log_register_factory(tmrm_storage_factory *factory);
+
+void
+tmrm_init_storage_log(tmrm_subject_map_sphere *sms);
+
+static int
+tmrm_storage_log_init(tmrm_storage* s, tmrm_hash* options);
+
+static void
+tmrm_storage_log_free(tmrm_storage* storage);
+
+static int 
+tmrm_storage_log_bootstrap(tmrm_storage* s, tmrm_subject_map* map);
+
+static int
+tmrm_storage_log_remove(tmrm_storage* storage, tmrm_subject_map* map);
+
+static tmrm_proxy*
+tmrm_storage_log_bottom(tmrm_storage* storage, tmrm_subject_map* map);
+
+static int
+tmrm_storage_log_merge(tmrm_storage* storage, tmrm_subject_map* map);
+
+static tmrm_proxy*
+tmrm_storage_log_proxy_create(tmrm_storage* storage, tmrm_subject_map* map);
+
+static int
+tmrm_storage_log_add_property(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value);
+
+static int
+tmrm_storage_log_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value);
+
+static int
+tmrm_storage_log_proxy_remove_properties_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
+
+static int
+tmrm_storage_log_proxy_remove(tmrm_storage* s, const tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_properties(tmrm_storage* s, tmrm_proxy* p);
+
+static int
+tmrm_storage_log_scan_properties(tmrm_storage* s, tmrm_subject_map* map,
+        const tmrm_property_visitor* visitor, void* data);
+
+static tmrm_proxy*
+tmrm_storage_log_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
+        const char* label);
+
+static tmrm_iterator*
+tmrm_storage_log_proxies(tmrm_storage* s, tmrm_subject_map* map);
+
+static char*
+tmrm_storage_log_proxy_label(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_keys(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_keys_by_value(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_log_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map);
+
+static tmrm_iterator*
+tmrm_storage_log_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_log_is_value_by_key_many(tmrm_storage* s,
+        tmrm_object* const* values, int count, tmrm_proxy* key);
+
+static int
+tmrm_storage_log_posting_list(tmrm_storage* s, tmrm_object* value,
+        tmrm_proxy* key, tmrm_label** labels, int* count);
+
+static int
+tmrm_storage_log_proxy_add_type(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* type);
+
+static int
+tmrm_storage_log_proxy_add_superclass(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* superclass);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_class(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* a, tmrm_proxy* b);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_subclasses(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_superclasses(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_types(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_instances(tmrm_storage* s, tmrm_proxy* p);
+
+static int
+tmrm_storage_log_list_next(void* context);
+
+static int
+tmrm_storage_log_list_end(void* context);
+
+static tmrm_object*
+tmrm_storage_log_list_get_element(void* context, tmrm_iterator_flag flag);
+
+static void
+tmrm_storage_log_list_free(void* context);
+
+/* Internal helper functions */
+static tmrm_proxy*
+_create_proxy_struct(tmrm_subject_map* m, tmrm_label label);
+
+static char*
+_file_name(tmrm_storage_log_context* c, const char* kind, uint32_t n);
+
+static int
+_entries_add(tmrm_storage_log_entries* e, uint32_t proxy, uint32_t key,
+        uint32_t kind, uint32_t value, uint32_t added);
+
+static void
+_entries_remove(tmrm_storage_log_context* c, tmrm_storage_log_entries* e,
+        uint32_t owner, uint32_t proxy, uint32_t key, uint32_t kind,
+        uint32_t value);
+
+static int
+_retain(tmrm_storage_log_context* c, tmrm_storage_log_entry* e,
+        uint32_t owner);
+
+static void
+_reclaim(tmrm_storage_log_context* c);
+
+static void
+_entries_free(tmrm_storage_log_entries* e);
+
+static void
+_indexes_clear(tmrm_storage_log_context* c);
+
+static tmrm_storage_log_node*
+_node(tmrm_storage_log_context* c, tmrm_label label, int create);
+
+static long
+_literal_find(tmrm_storage_log_context* c, const char* value,
+        const char* datatype, int create);
+
+static int
+_apply_proxy(void* data, tmrm_label label);
+
+static int
+_apply_property(void* data, tmrm_label proxy, tmrm_label key,
+        tmrm_label value);
+
+static int
+_apply_property_literal(void* data, tmrm_label proxy, tmrm_label key,
+        const tmrm_char_t* value, const tmrm_char_t* datatype);
+
+static int
+_apply_entry(tmrm_storage_log_context* c, uint32_t proxy, uint32_t key,
+        uint32_t kind, uint32_t value);
+
+static int
+_write_entry(tmrm_storage_log_context* c, uint32_t proxy, uint32_t key,
+        uint32_t kind, uint32_t value);
+
+static void
+_unlink_entry(tmrm_storage_log_context* c, const tmrm_storage_log_entry* e);
+
+static int
+_apply_remove_by_key(tmrm_storage_log_context* c, tmrm_label proxy,
+        tmrm_label key);
+
+static int
+_apply_remove_proxy(tmrm_storage_log_context* c, tmrm_label label);
+
+static int
+_log_append(tmrm_storage_log_context* c, int op, const uint32_t* labels,
+        int num_labels, const char* value, const char* datatype);
+
+static int
+_log_flush(tmrm_storage_log_context* c);
+
+static int
+_log_sync(tmrm_storage_log_context* c);
+
+static int
+_log_commit(tmrm_storage_log_context* c);
+
+static int
+_log_open_segment(tmrm_storage_log_context* c, uint32_t n, int create);
+
+static int
+_log_replay(tmrm_storage_log_context* c, uint32_t n, int last);
+
+static int
+_log_visit(const tmrm_storage_log_context* c, uint32_t version,
+        uint32_t first, uint32_t last, const tmrm_property_visitor* visitor,
+        void* data);
+
+static int
+_log_compact(tmrm_storage_log_context* c);
+
+static int
+_log_compact_run(tmrm_storage_log_context* c);
+
+static uint32_t
+_pin(tmrm_storage_log_context* c);
+
+static void
+_unpin(tmrm_storage_log_context* c, uint32_t version);
+
+static int
+_log_files(tmrm_storage_log_context* c, const char* kind, uint32_t** numbers,
+        uint32_t* count);
+
+static tmrm_iterator*
+_iterator_new(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_storage_log_element element);
+
+static int
+_iterator_add(tmrm_iterator* iterator, const tmrm_storage_log_entry* e);
+
+static tmrm_proxy*
+_proxy_by_literal(tmrm_storage* s, tmrm_subject_map* map, const char* value,
+        tmrm_label key);
+
+static unsigned long
+tmrm_storage_log_snapshot_acquire(tmrm_storage* s, tmrm_subject_map* map);
+
+static void
+tmrm_storage_log_snapshot_release(tmrm_storage* s, unsigned long version);
+
+/* Whether an entry or proxy is seen by reads of version v */
+#define _visible(added, removed, v) \
+    ((added) != 0 && (added) <= (v) && ((removed) == 0 || (removed) > (v)))
+#define _entry_visible(e, v) _visible((e)->added, (e)->removed, v)
+#define _node_visible(n, v) _visible((n)->added, (n)->removed, v)
+
+/* The version that reads through map see */
+#define _version(map) \
+    ((map)->snapshot ? (uint32_t)(map)->snapshot : TMRM_LOG_CURRENT)
+
+static const tmrm_property_visitor _apply_visitor = {
+    _apply_proxy,
+    _apply_property,
+    _apply_property_literal
+};
+
+/* ======================================================================= */
+static int 
+tmrm_storage_log_init(tmrm_storage* s, tmrm_hash* options)
+{
+    tmrm_storage_log_context* c;
+    uint32_t *numbers = NULL, count = 0, i, snapshot = 0;
+    char* file;
+    int ret = 0;
+
+    c = (tmrm_storage_log_context*)TMRM_CALLOC(tmrm_storage_log_context, 1,
+            sizeof(tmrm_storage_log_context));
+    if (!c) return 1;
+    s->context = c;
+    c->storage = s;
+    c->fd = -1;
+    c->version = 1;
+
+    c->dir = options ? tmrm_hash_get(options, "dir") : NULL;
+    c->name = options ? tmrm_hash_get(options, "name") : NULL;
+    if (!c->dir) c->dir = tmrm_strdup(".");
+    if (!c->name) c->name = tmrm_strdup("tmrm");
+    if (!c->dir || !c->name) return 1;
+
+    c->group_commit = TMRM_LOG_GROUP_COMMIT;
+    c->segment_size = TMRM_LOG_SEGMENT_SIZE;
+    c->compact_segments = TMRM_LOG_COMPACT_SEGMENTS;
+    if (options) {
+        if (tmrm_hash_get_as_long(options, "group_commit") >= 0) {
+            c->group_commit = tmrm_hash_get_as_long(options, "group_commit");
+        }
+        if (tmrm_hash_get_as_long(options, "segment_size") > 0) {
+            c->segment_size = tmrm_hash_get_as_long(options, "segment_size");
+        }
+        if (tmrm_hash_get_as_long(options, "compact_segments") > 0) {
+            c->compact_segments = tmrm_hash_get_as_long(options,
+                    "compact_segments");
+        }
+    }
+
+    c->buffer = (unsigned char*)TMRM_MALLOC(cstring, TMRM_LOG_BUFFER_SIZE);
+    if (!c->buffer) return 1;
+
+    if (options && tmrm_hash_get_as_boolean(options, "new") > 0) {
+        TMRM_DEBUG1("Creating storage\n");
+        (void)tmrm_storage_log_remove(s, NULL);
+    }
+
+    /* Load the latest snapshot and remove what it replaces */
+    if (_log_files(c, "snapshot", &numbers, &count)) return 1;
+    if (count > 0) {
+        snapshot = numbers[count - 1];
+        if (!(file = _file_name(c, "snapshot", snapshot))) {
+            TMRM_FREE(uint32_t, numbers);
+            return 1;
+        }
+        ret = tmrm_snapshot_load(file, &_apply_visitor, c);
+        TMRM_FREE(cstring, file);
+        for (i = 0; i + 1 < count && ret == 0; i++) {
+            if ((file = _file_name(c, "snapshot", numbers[i]))) {
+                (void)unlink(file);
+                TMRM_FREE(cstring, file);
+            }
+        }
+    }
+    if (numbers) TMRM_FREE(uint32_t, numbers);
+    numbers = NULL;
+    if (ret) return 1;
+
+    /* Replay the segments written after the snapshot */
+    if (_log_files(c, "log", &numbers, &count)) return 1;
+    c->first_segment = snapshot + 1;
+    c->segment = snapshot;
+    for (i = 0; i < count && ret == 0; i++) {
+        if (numbers[i] <= snapshot) {
+            if ((file = _file_name(c, "log", numbers[i]))) {
+                (void)unlink(file);
+                TMRM_FREE(cstring, file);
+            }
+            continue;
+        }
+        if (c->segment == snapshot) c->first_segment = numbers[i];
+        c->segment = numbers[i];
+        ret = _log_replay(c, numbers[i], i + 1 == count);
+    }
+    if (numbers) TMRM_FREE(uint32_t, numbers);
+    if (ret) return 1;
+
+    /* Continue the last segment or start the first one */
+    if (c->segment == snapshot) {
+        return _log_open_segment(c, snapshot + 1, 1);
+    }
+    return _log_open_segment(c, c->segment, 0);
+}
+
+
+static int 
+tmrm_storage_log_bootstrap(tmrm_storage* s, tmrm_subject_map* map)
+{
+    const unsigned char* bootstrap_ontology =
+        (unsigned char*)TMRM_STORAGE_BOOTSTRAP_ONTOLOGY;
+
+    map->bottom = tmrm_storage_log_bottom(s, map);
+    if (!map->bottom) return 1;
+
+    map->superclass = _proxy_by_literal(s, map, "libtmrm:superclass", 0);
+    if (map->superclass == NULL) {
+        TMRM_DEBUG1("bootstrapping...\n");
+        tmrm_subject_map_import_from_yaml_string(map, bootstrap_ontology,
+            strlen((char*)bootstrap_ontology));
+        map->superclass = _proxy_by_literal(s, map, "libtmrm:superclass", 0);
+    }
+    map->subclass = _proxy_by_literal(s, map, "libtmrm:subclass", 0);
+    map->type = _proxy_by_literal(s, map, "libtmrm:type", 0);
+    map->instance = _proxy_by_literal(s, map, "libtmrm:instance", 0);
+
+    return 0;
+}
+
+
+static void
+tmrm_storage_log_free(tmrm_storage* s)
+{
+#ifdef HAVE_PTHREAD
+    int compacting;
+#endif
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    TMRM_DEBUG1("tmrm_storage_log_free\n");
+    if (!c) return;
+
+#ifdef HAVE_PTHREAD
+    /* A running compaction is allowed to finish */
+    tmrm_storage_lock(s, 1);
+    compacting = c->compacting;
+    tmrm_storage_unlock(s);
+    if (compacting != TMRM_LOG_COMPACT_IDLE) {
+        (void)pthread_join(c->compactor, NULL);
+    }
+#endif
+    if (c->fd >= 0) {
+        (void)_log_sync(c);
+        (void)close(c->fd);
+    }
+    _indexes_clear(c);
+    if (c->snapshots) TMRM_FREE(uint32_t, c->snapshots);
+    if (c->buffer) TMRM_FREE(cstring, c->buffer);
+    if (c->dir) TMRM_FREE(cstring, c->dir);
+    if (c->name) TMRM_FREE(cstring, c->name);
+    TMRM_FREE(tmrm_storage_log_context, s->context);
+}
+
+
+/* Removes all segments and snapshots and empties the indexes. The map
+   parameter is ignored since the storage holds exactly one subject map. */
+static int
+tmrm_storage_log_remove(tmrm_storage* s, tmrm_subject_map* map)
+{
+    const char* kinds[2] = {"log", "snapshot"};
+    uint32_t *numbers, count, i;
+    char* file;
+    int k, ret = 0;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return -1;
+
+    /* The lock is reentrant, so this also holds when init calls remove.
+       A running compaction waits for the lock, so it cannot be joined
+       here: it sees compact_cancelled before it reads the indexes again
+       and removes its snapshot once it gets the write lock. */
+    tmrm_storage_lock(s, 1);
+    if (c->compacting == TMRM_LOG_COMPACT_RUNNING) c->compact_cancelled = 1;
+    if (c->fd >= 0) {
+        (void)close(c->fd);
+        c->fd = -1;
+        c->buffered = 0;
+        c->pending = 0;
+    }
+    _indexes_clear(c);
+    for (k = 0; k < 2 && ret == 0; k++) {
+        if (_log_files(c, kinds[k], &numbers, &count)) {
+            ret = -1;
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            if ((file = _file_name(c, kinds[k], numbers[i]))) {
+                (void)unlink(file);
+                TMRM_FREE(cstring, file);
+            }
+        }
+        if (numbers) TMRM_FREE(uint32_t, numbers);
+    }
+    if (ret == 0) ret = tmrm_sync_directory(c->dir);
+    tmrm_storage_unlock(s);
+    return ret;
+}
+
+
+static tmrm_proxy*
+tmrm_storage_log_bottom(tmrm_storage* s, tmrm_subject_map* map)
+{
+    uint32_t label = 0;
+    tmrm_storage_log_node* n;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    /* The bottom proxy always has the label 0 */
+    n = _node(c, 0, 0);
+    if (!n || !_node_visible(n, TMRM_LOG_CURRENT)) {
+        if (_log_append(c, TMRM_LOG_OP_PROXY, &label, 1, NULL, NULL) ||
+                _apply_proxy(c, 0) || _log_commit(c)) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Creating the bottom proxy failed");
+            return NULL;
+        }
+    }
+    return _create_proxy_struct(map, 0);
+}
+
+
+static int
+_compare_signature(const void* a, const void* b)
+{
+    const tmrm_storage_log_signature* x = (const tmrm_storage_log_signature*)a;
+    const tmrm_storage_log_signature* y = (const tmrm_storage_log_signature*)b;
+    int cmp;
+
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    if ((cmp = memcmp(x->triples, y->triples,
+                    3 * x->size * sizeof(uint32_t))) != 0) {
+        return cmp;
+    }
+    return x->label < y->label ? -1 : (x->label > y->label ? 1 : 0);
+}
+
+
+static int
+_compare_triple(const void* a, const void* b)
+{
+    const uint32_t* x = (const uint32_t*)a;
+    const uint32_t* y = (const uint32_t*)b;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (x[i] != y[i]) return x[i] < y[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/* Fills sig with the sorted (key, kind, value) triples of the current
+   properties of proxy label. */
+static int
+_signature(tmrm_storage_log_context* c, uint32_t label,
+        tmrm_storage_log_signature* sig)
+{
+    const tmrm_storage_log_entries* e = &c->proxies[label].properties;
+    uint32_t i;
+
+    sig->label = label;
+    sig->size = 0;
+    sig->triples = NULL;
+    if (e->size == 0) return 0;
+    if (!(sig->triples = (uint32_t*)TMRM_MALLOC(uint32_t,
+                    3 * e->size * sizeof(uint32_t)))) {
+        return 1;
+    }
+    for (i = 0; i < e->size; i++) {
+        if (e->items[i].removed != 0) continue;
+        sig->triples[3 * sig->size] = e->items[i].key;
+        sig->triples[3 * sig->size + 1] = e->items[i].kind;
+        sig->triples[3 * sig->size + 2] = e->items[i].value;
+        sig->size++;
+    }
+    qsort(sig->triples, sig->size, 3 * sizeof(uint32_t), _compare_triple);
+    return 0;
+}
+
+
+/* Merges the proxy p2 into p1: every property that refers to p2 as proxy,
+   key or value is written again with p1 in its place, then p2 is removed.
+   Everything goes through the log, so replay repeats the merge. */
+static int
+_merge_proxy(tmrm_storage_log_context* c, uint32_t p1, uint32_t p2)
+{
+    tmrm_storage_log_entries copies;
+    const tmrm_storage_log_entries* lists[3];
+    tmrm_storage_log_entry* e;
+    tmrm_storage_log_node* n;
+    uint32_t i, k;
+    int ret = 0;
+
+    TMRM_DEBUG3("Merging proxy %d into %d\n", (int)p2, (int)p1);
+    /* The writes change the indexes, so the properties are copied first */
+    memset(&copies, 0, sizeof(copies));
+    n = &c->proxies[p2];
+    lists[0] = &n->properties;
+    lists[1] = &n->references;
+    lists[2] = &n->keyed;
+    for (k = 0; k < 3 && ret == 0; k++) {
+        for (i = 0; i < lists[k]->size && ret == 0; i++) {
+            e = &lists[k]->items[i];
+            if (e->removed != 0) continue;
+            ret = _entries_add(&copies, e->proxy == p2 ? p1 : e->proxy,
+                    e->key == p2 ? p1 : e->key, e->kind,
+                    (e->kind == TMRM_LOG_VALUE_PROXY && e->value == p2) ?
+                        p1 : e->value, 0);
+        }
+    }
+    for (i = 0; i < copies.size && ret == 0; i++) {
+        e = &copies.items[i];
+        ret = _write_entry(c, e->proxy, e->key, e->kind, e->value);
+    }
+    _entries_free(&copies);
+    if (ret) return 1;
+
+    if (_log_append(c, TMRM_LOG_OP_REMOVE_PROXY, &p2, 1, NULL, NULL) ||
+            _apply_remove_proxy(c, (tmrm_label)p2)) {
+        return 1;
+    }
+    return _log_commit(c);
+}
+
+
+/* Merges each set of proxies with equal properties into the proxy with
+   the lowest label, until no two proxies are equal. Merging rewrites the
+   properties that refer to the merged proxies, which can make further
+   proxies equal. Proxies without properties, such as the bottom proxy,
+   are never merged. */
+static int
+tmrm_storage_log_merge(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_storage_log_signature* sigs = NULL;
+    uint32_t num, i, first;
+    int ret = 0, merged;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return 1;
+
+    do {
+        merged = 0;
+        num = 0;
+        if (c->max_proxies > 0 && !(sigs = (tmrm_storage_log_signature*)
+                    TMRM_MALLOC(tmrm_storage_log_signature,
+                        c->max_proxies *
+                        sizeof(tmrm_storage_log_signature)))) {
+            ret = 1;
+            break;
+        }
+        for (i = 0; i < c->max_proxies && ret == 0; i++) {
+            if (!_node_visible(&c->proxies[i], TMRM_LOG_CURRENT)) continue;
+            if ((ret = _signature(c, i, &sigs[num]))) break;
+            if (sigs[num].size > 0) {
+                num++;
+            } else if (sigs[num].triples) {
+                TMRM_FREE(uint32_t, sigs[num].triples);
+            }
+        }
+        if (ret == 0 && num > 1) {
+            qsort(sigs, num, sizeof(tmrm_storage_log_signature),
+                    _compare_signature);
+        }
+        for (i = 1, first = 0; i < num && ret == 0; i++) {
+            if (sigs[i].size == sigs[first].size &&
+                    memcmp(sigs[i].triples, sigs[first].triples,
+                        3 * sigs[i].size * sizeof(uint32_t)) == 0) {
+                ret = _merge_proxy(c, sigs[first].label, sigs[i].label);
+                merged++;
+            } else {
+                first = i;
+            }
+        }
+        for (i = 0; i < num; i++) TMRM_FREE(uint32_t, sigs[i].triples);
+        if (sigs) TMRM_FREE(tmrm_storage_log_signature, sigs);
+        sigs = NULL;
+    } while (ret == 0 && merged > 0);
+
+    if (ret) TMRM_LOG(TMRM_LOG_ERROR, "Merging proxies failed");
+    return ret;
+}
+
+
+static tmrm_proxy*
+tmrm_storage_log_proxy_create(tmrm_storage* s, tmrm_subject_map* map)
+{
+    uint32_t label;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    label = (uint32_t)c->next_label;
+    if (_log_append(c, TMRM_LOG_OP_PROXY, &label, 1, NULL, NULL) ||
+            _apply_proxy(c, (tmrm_label)label) || _log_commit(c)) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Creating proxy %d failed", (int)label);
+        return NULL;
+    }
+    return _create_proxy_struct(map, (tmrm_label)label);
+}
+
+
+static int
+tmrm_storage_log_add_property(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value)
+{
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return 1;
+
+    return _write_entry(c, (uint32_t)p->label, (uint32_t)key->label,
+            TMRM_LOG_VALUE_PROXY, (uint32_t)value->label);
+}
+
+
+static int
+tmrm_storage_log_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value)
+{
+    long idx;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return 1;
+
+    idx = _literal_find(c, (const char*)tmrm_literal_value(value),
+            (const char*)tmrm_literal_datatype(value), 1);
+    if (idx < 0) return 1;
+    return _write_entry(c, (uint32_t)p->label, (uint32_t)key->label,
+            TMRM_LOG_VALUE_LITERAL, (uint32_t)idx);
+}
+
+
+static int
+tmrm_storage_log_proxy_remove_properties_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    uint32_t labels[2];
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return 1;
+
+    labels[0] = (uint32_t)p->label;
+    labels[1] = (uint32_t)key->label;
+    if (_log_append(c, TMRM_LOG_OP_REMOVE_BY_KEY, labels, 2, NULL, NULL) ||
+            _apply_remove_by_key(c, p->label, key->label)) {
+        return 1;
+    }
+    return _log_commit(c);
+}
+
+
+static int
+tmrm_storage_log_proxy_remove(tmrm_storage* s, const tmrm_proxy* p)
+{
+    uint32_t label;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return 1;
+
+    label = (uint32_t)p->label;
+    if (_log_append(c, TMRM_LOG_OP_REMOVE_PROXY, &label, 1, NULL, NULL) ||
+            _apply_remove_proxy(c, p->label)) {
+        return 1;
+    }
+    return _log_commit(c);
+}
+
+
+static int
+tmrm_storage_log_scan_properties(tmrm_storage* s, tmrm_subject_map* map,
+        const tmrm_property_visitor* visitor, void* data)
+{
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return 1;
+
+    return _log_visit(c, _version(map), 0, c->max_proxies, visitor, data);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_properties(tmrm_storage* s, tmrm_proxy* p)
+{
+    tmrm_iterator* iterator;
+    tmrm_storage_log_node* n;
+    uint32_t i, v;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    v = _version(p->subject_map);
+    iterator = _iterator_new(s, p->subject_map, TMRM_LOG_ELEMENT_PROPERTY);
+    if (!iterator || !(n = _node(c, p->label, 0))) return iterator;
+    for (i = 0; i < n->properties.size; i++) {
+        if (!_entry_visible(&n->properties.items[i], v)) continue;
+        if (_iterator_add(iterator, &n->properties.items[i])) {
+            tmrm_iterator_free(iterator);
+            return NULL;
+        }
+    }
+    return iterator;
+}
+
+
+static tmrm_proxy*
+tmrm_storage_log_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
+        const char* label)
+{
+    char* end;
+    long proxy_id;
+    tmrm_storage_log_node* n;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    /* Check that label is valid */
+    proxy_id = strtol(label, &end, 10);
+    if (strlen(label) == 0 || *end != '\0' || proxy_id < 0) {
+        return NULL;
+    }
+    n = _node(c, (tmrm_label)proxy_id, 0);
+    if (!n || !_node_visible(n, _version(map))) return NULL;
+    return _create_proxy_struct(map, (tmrm_label)proxy_id);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxies(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_iterator* iterator;
+    tmrm_storage_log_entry e;
+    uint32_t i, v;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    v = _version(map);
+    iterator = _iterator_new(s, map, TMRM_LOG_ELEMENT_PROXY);
+    if (!iterator) return NULL;
+    memset(&e, 0, sizeof(e));
+    for (i = 0; i < c->max_proxies; i++) {
+        if (!_node_visible(&c->proxies[i], v)) continue;
+        e.proxy = i;
+        if (_iterator_add(iterator, &e)) {
+            tmrm_iterator_free(iterator);
+            return NULL;
+        }
+    }
+    return iterator;
+}
+
+
+static char*
+tmrm_storage_log_proxy_label(tmrm_storage* s, tmrm_proxy* p)
+{
+    size_t len;
+    char *label;
+
+    len = 1 * INT_DIGITS;
+    if (!(label = (char*)TMRM_MALLOC(cstring, len + 1))) {
+        return NULL;
+    }
+
+    (void)snprintf(label, len, "%d", (int)p->label);
+    return label;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_keys(tmrm_storage* s, tmrm_proxy* p)
+{
+    tmrm_iterator* iterator;
+    tmrm_storage_log_node* n;
+    uint32_t i, v;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    v = _version(p->subject_map);
+    iterator = _iterator_new(s, p->subject_map, TMRM_LOG_ELEMENT_KEY);
+    if (!iterator || !(n = _node(c, p->label, 0))) return iterator;
+    for (i = 0; i < n->properties.size; i++) {
+        if (!_entry_visible(&n->properties.items[i], v)) continue;
+        if (_iterator_add(iterator, &n->properties.items[i])) {
+            tmrm_iterator_free(iterator);
+            return NULL;
+        }
+    }
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    tmrm_iterator* iterator;
+    tmrm_storage_log_node* n;
+    uint32_t i, v;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    v = _version(p->subject_map);
+    iterator = _iterator_new(s, p->subject_map, TMRM_LOG_ELEMENT_VALUE);
+    if (!iterator || !(n = _node(c, p->label, 0))) return iterator;
+    for (i = 0; i < n->properties.size; i++) {
+        if (n->properties.items[i].key != (uint32_t)key->label ||
+                !_entry_visible(&n->properties.items[i], v)) {
+            continue;
+        }
+        if (_iterator_add(iterator, &n->properties.items[i])) {
+            tmrm_iterator_free(iterator);
+            return NULL;
+        }
+    }
+    return iterator;
+}
+
+
+/* Returns the properties that have the proxy or literal as value, or NULL
+   if there are none */
+static tmrm_storage_log_entries*
+_references(tmrm_storage_log_context* c, const tmrm_object* object)
+{
+    tmrm_storage_log_node* n;
+    tmrm_literal* lit;
+    long idx;
+
+    if (tmrm_object_get_type(object) == TMRM_TYPE_PROXY) {
+        if (!(n = _node(c, ((const tmrm_proxy*)object)->label, 0))) return NULL;
+        return &n->references;
+    }
+    lit = (tmrm_literal*)object;
+    idx = _literal_find(c, (const char*)tmrm_literal_value(lit),
+            (const char*)tmrm_literal_datatype(lit), 0);
+    if (idx < 0) return NULL;
+    return &c->literals[idx].references;
+}
+
+
+/* Adds the properties with key that have the proxy or literal as value */
+static int
+_add_references(tmrm_iterator* iterator, tmrm_storage_log_context* c,
+        const tmrm_object* object, tmrm_proxy* key, uint32_t v)
+{
+    tmrm_storage_log_entries* refs;
+    uint32_t i;
+
+    if (!(refs = _references(c, object))) return 0;
+    for (i = 0; i < refs->size; i++) {
+        if (refs->items[i].key != (uint32_t)key->label ||
+                !_entry_visible(&refs->items[i], v)) {
+            continue;
+        }
+        if (_iterator_add(iterator, &refs->items[i])) return 1;
+    }
+    return 0;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    return tmrm_storage_log_is_value_by_key_many(s,
+            (tmrm_object* const*)&p, 1, key);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_keys_by_value(tmrm_storage* s, tmrm_proxy* p)
+{
+    tmrm_iterator* iterator;
+    tmrm_storage_log_node* n;
+    uint32_t i, v;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    v = _version(p->subject_map);
+    iterator = _iterator_new(s, p->subject_map, TMRM_LOG_ELEMENT_KEY);
+    if (!iterator || !(n = _node(c, p->label, 0))) return iterator;
+    for (i = 0; i < n->references.size; i++) {
+        if (!_entry_visible(&n->references.items[i], v)) continue;
+        if (_iterator_add(iterator, &n->references.items[i])) {
+            tmrm_iterator_free(iterator);
+            return NULL;
+        }
+    }
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map)
+{
+    tmrm_iterator* iterator;
+    tmrm_storage_log_entries* refs;
+    long idx;
+    uint32_t i;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    iterator = _iterator_new(s, map, TMRM_LOG_ELEMENT_KEY);
+    if (!iterator) return NULL;
+    idx = _literal_find(c, (const char*)tmrm_literal_value(lit),
+            (const char*)tmrm_literal_datatype(lit), 0);
+    if (idx < 0) return iterator;
+    refs = &c->literals[idx].references;
+    for (i = 0; i < refs->size; i++) {
+        if (!_entry_visible(&refs->items[i], _version(map))) continue;
+        if (_iterator_add(iterator, &refs->items[i])) {
+            tmrm_iterator_free(iterator);
+            return NULL;
+        }
+    }
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key)
+{
+    return tmrm_storage_log_is_value_by_key_many(s,
+            (tmrm_object* const*)&lit, 1, key);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_is_value_by_key_many(tmrm_storage* s,
+        tmrm_object* const* values, int count, tmrm_proxy* key)
+{
+    tmrm_iterator* iterator;
+    tmrm_object_type type;
+    int i;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    iterator = _iterator_new(s, key->subject_map, TMRM_LOG_ELEMENT_PROXY);
+    if (!iterator) return NULL;
+    for (i = 0; i < count; i++) {
+        type = tmrm_object_get_type(values[i]);
+        if (type != TMRM_TYPE_PROXY && type != TMRM_TYPE_LITERAL) {
+            TMRM_DEBUG2("Unknown object type %d\n", (int)type);
+            continue;
+        }
+        if (_add_references(iterator, c, values[i], key,
+                    _version(key->subject_map))) {
+            tmrm_iterator_free(iterator);
+            return NULL;
+        }
+    }
+    return iterator;
+}
+
+
+/* Orders labels for qsort() */
+static int
+_label_compare(const void* a, const void* b)
+{
+    tmrm_label la = *(const tmrm_label*)a;
+    tmrm_label lb = *(const tmrm_label*)b;
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+
+/* Reads the posting list straight from the reference index, without
+   creating an object per match */
+static int
+tmrm_storage_log_posting_list(tmrm_storage* s, tmrm_object* value,
+        tmrm_proxy* key, tmrm_label** labels, int* count)
+{
+    tmrm_storage_log_entries* refs;
+    tmrm_label* items;
+    uint32_t i;
+    int n = 0;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return 1;
+
+    *labels = NULL;
+    *count = 0;
+    if (!tmrm_object_is_proxy(value) && !tmrm_object_is_literal(value)) {
+        TMRM_DEBUG2("Unknown object type %d\n",
+                (int)tmrm_object_get_type(value));
+        return 0;
+    }
+    if (!(refs = _references(c, value)) || refs->size == 0) return 0;
+    items = (tmrm_label*)TMRM_MALLOC(tmrm_label,
+            refs->size * sizeof(tmrm_label));
+    if (!items) return 1;
+    for (i = 0; i < refs->size; i++) {
+        if (refs->items[i].key == (uint32_t)key->label &&
+                _entry_visible(&refs->items[i], _version(key->subject_map))) {
+            items[n++] = (tmrm_label)refs->items[i].proxy;
+        }
+    }
+    if (n == 0) {
+        TMRM_FREE(tmrm_label, items);
+        return 0;
+    }
+    qsort(items, (size_t)n, sizeof(tmrm_label), _label_compare);
+    *count = 1;
+    for (i = 1; i < (uint32_t)n; i++) {
+        if (items[i] != items[*count - 1]) items[(*count)++] = items[i];
+    }
+    *labels = items;
+    return 0;
+}
+
+
+static int
+tmrm_storage_log_proxy_add_type(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* type)
+{
+    tmrm_proxy* anon;
+
+    anon = tmrm_storage_log_proxy_create(s, p->subject_map);
+    if (!anon) return -1;
+    if (tmrm_storage_log_add_property(s, anon, p->subject_map->type, type) ||
+        tmrm_storage_log_add_property(s, anon, p->subject_map->instance, p)) {
+        tmrm_proxy_free(anon);
+        return -1;
+    }
+    tmrm_proxy_free(anon);
+    return 0;
+}
+
+
+static int
+tmrm_storage_log_proxy_add_superclass(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* superclass)
+{
+    tmrm_proxy* anon;
+
+    anon = tmrm_storage_log_proxy_create(s, p->subject_map);
+    if (!anon) return -1;
+    if (tmrm_storage_log_add_property(s, anon, p->subject_map->superclass,
+                superclass) ||
+        tmrm_storage_log_add_property(s, anon, p->subject_map->subclass, p)) {
+        tmrm_proxy_free(anon);
+        return -1;
+    }
+    tmrm_proxy_free(anon);
+    return 0;
+}
+
+
+/* Helper function for superclass-subclass or type-instance relations:
+   Returns the values for key a of all proxies that have p as value for
+   key b. */
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_class(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* a, tmrm_proxy* b)
+{
+    tmrm_iterator* iterator;
+    tmrm_storage_log_node *n, *anon;
+    uint32_t i, j, v;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return NULL;
+
+    v = _version(p->subject_map);
+    iterator = _iterator_new(s, p->subject_map, TMRM_LOG_ELEMENT_VALUE);
+    if (!iterator || !(n = _node(c, p->label, 0))) return iterator;
+    for (i = 0; i < n->references.size; i++) {
+        if (n->references.items[i].key != (uint32_t)b->label ||
+                !_entry_visible(&n->references.items[i], v)) {
+            continue;
+        }
+        anon = _node(c, (tmrm_label)n->references.items[i].proxy, 0);
+        if (!anon) continue;
+        for (j = 0; j < anon->properties.size; j++) {
+            if (anon->properties.items[j].key != (uint32_t)a->label ||
+                    !_entry_visible(&anon->properties.items[j], v)) {
+                continue;
+            }
+            if (_iterator_add(iterator, &anon->properties.items[j])) {
+                tmrm_iterator_free(iterator);
+                return NULL;
+            }
+        }
+    }
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_subclasses(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_log_proxy_direct_class(s, p,
+        p->subject_map->subclass, p->subject_map->superclass);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_superclasses(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_log_proxy_direct_class(s, p,
+        p->subject_map->superclass, p->subject_map->subclass);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_types(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_log_proxy_direct_class(s, p,
+        p->subject_map->type, p->subject_map->instance);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_log_proxy_direct_instances(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_log_proxy_direct_class(s, p,
+        p->subject_map->instance, p->subject_map->type);
+}
+
+
+/**
+ * Helper function to iterate over the entries of an iterator.
+ */
+static int
+tmrm_storage_log_list_next(void* context)
+{
+    tmrm_storage_log_iterator_context *c;
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(context, void, -1);
+    c = (tmrm_storage_log_iterator_context*)context;
+
+    if (c->current >= c->entries.size) return 1;
+    c->current++;
+    return 0;
+}
+
+
+/**
+ * Helper function to iterate over the entries of an iterator.
+ */
+static int
+tmrm_storage_log_list_end(void* context)
+{
+    tmrm_storage_log_iterator_context *c;
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(context, void, -1);
+    c = (tmrm_storage_log_iterator_context*)context;
+
+    return c->current >= c->entries.size;
+}
+
+
+/**
+ * Helper function that creates a proxy or literal object for the current
+ * entry.
+ */
+static tmrm_object*
+tmrm_storage_log_list_get_element(void* context, tmrm_iterator_flag flag)
+{
+    tmrm_storage_log_iterator_context *c;
+    const tmrm_storage_log_entry* e;
+    const tmrm_storage_log_literal* lit;
+    tmrm_literal* new_literal;
+    tmrm_proxy* p = NULL;
+
+    c = (tmrm_storage_log_iterator_context*)context;
+    if (c->current >= c->entries.size) return NULL;
+
+    e = &c->entries.items[c->current];
+    switch (c->element) {
+        case TMRM_LOG_ELEMENT_KEY:
+            p = _create_proxy_struct(c->subject_map, (tmrm_label)e->key);
+            break;
+        case TMRM_LOG_ELEMENT_PROXY:
+            p = _create_proxy_struct(c->subject_map, (tmrm_label)e->proxy);
+            break;
+        case TMRM_LOG_ELEMENT_PROPERTY:
+            if (flag == TMRM_ITERATOR_GET_METHOD_GET_KEY) {
+                p = _create_proxy_struct(c->subject_map, (tmrm_label)e->key);
+                break;
+            }
+            /* fall through */
+        case TMRM_LOG_ELEMENT_VALUE:
+            if (e->kind == TMRM_LOG_VALUE_LITERAL) {
+                lit = &c->log->literals[e->value];
+                new_literal = tmrm_literal_new((const tmrm_char_t*)lit->value,
+                        (const tmrm_char_t*)lit->datatype);
+                return new_literal ? tmrm_literal_to_object(new_literal) : NULL;
+            }
+            p = _create_proxy_struct(c->subject_map, (tmrm_label)e->value);
+            break;
+        default:
+            break;
+    }
+    return p ? tmrm_proxy_to_object(p) : NULL;
+}
+
+
+static void
+tmrm_storage_log_list_free(void* context)
+{
+    tmrm_storage_log_iterator_context *c;
+    c = (tmrm_storage_log_iterator_context*)context;
+
+    _entries_free(&c->entries);
+    TMRM_FREE(tmrm_storage_log_iterator_context, c);
+}
+
+
+/**
+* Allocates memory for a new tmrm_proxy structure.
+*/
+static tmrm_proxy*
+_create_proxy_struct(tmrm_subject_map* m, tmrm_label label)
+{
+    tmrm_proxy *p;
+
+    p = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
+    if (!p) {
+        return NULL;
+    }
+    p->type = TMRM_TYPE_PROXY;
+    p->label = label;
+    p->subject_map = m;
+    return p;
+}
+
+
+/* Returns <dir>/<name>.<kind>.<n> in a new string. */
+static char*
+_file_name(tmrm_storage_log_context* c, const char* kind, uint32_t n)
+{
+    size_t len;
+    char* file;
+
+    len = strlen(c->dir) + strlen(c->name) + strlen(kind) + INT_DIGITS + 4;
+    if (!(file = (char*)TMRM_MALLOC(cstring, len))) return NULL;
+    (void)snprintf(file, len, "%s/%s.%s.%06u", c->dir, c->name, kind,
+            (unsigned)n);
+    return file;
+}
+
+
+static int
+_entries_add(tmrm_storage_log_entries* e, uint32_t proxy, uint32_t key,
+        uint32_t kind, uint32_t value, uint32_t added)
+{
+    tmrm_storage_log_entry* items;
+    uint32_t max;
+
+    if (e->size == e->max) {
+        max = e->max ? 2 * e->max : 4;
+        if (!(items = (tmrm_storage_log_entry*)TMRM_REALLOC(
+                        tmrm_storage_log_entry, e->items,
+                        max * sizeof(tmrm_storage_log_entry)))) {
+            return 1;
+        }
+        e->items = items;
+        e->max = max;
+    }
+    items = &e->items[e->size++];
+    items->proxy = proxy;
+    items->key = key;
+    items->kind = kind;
+    items->value = value;
+    items->added = added;
+    items->removed = 0;
+    return 0;
+}
+
+
+/* Removes the first matching entry, keeping the order of the others. owner
+   is the proxy or literal whose index e is, see _retain(). */
+static void
+_entries_remove(tmrm_storage_log_context* c, tmrm_storage_log_entries* e,
+        uint32_t owner, uint32_t proxy, uint32_t key, uint32_t kind,
+        uint32_t value)
+{
+    uint32_t i;
+
+    for (i = 0; i < e->size; i++) {
+        if (e->items[i].removed == 0 &&
+                e->items[i].proxy == proxy && e->items[i].key == key &&
+                e->items[i].kind == kind && e->items[i].value == value) {
+            if (_retain(c, &e->items[i], owner)) return;
+            memmove(&e->items[i], &e->items[i + 1],
+                    (e->size - i - 1) * sizeof(tmrm_storage_log_entry));
+            e->size--;
+            return;
+        }
+    }
+}
+
+
+/* Lists owner in the garbage of c, unless it is listed already */
+static void
+_garbage_add(tmrm_storage_log_context* c, uint32_t owner)
+{
+    uint32_t* garbage;
+    uint32_t max;
+    int* listed;
+
+    listed = (owner & TMRM_LOG_GARBAGE_LITERAL) ?
+        &c->literals[owner & ~TMRM_LOG_GARBAGE_LITERAL].garbage :
+        &c->proxies[owner].garbage;
+    if (*listed || c->garbage_all) return;
+    if (c->num_garbage == c->max_garbage) {
+        max = c->max_garbage ? 2 * c->max_garbage : 64;
+        if (!(garbage = (uint32_t*)TMRM_REALLOC(uint32_t, c->garbage,
+                        max * sizeof(uint32_t)))) {
+            /* The next _reclaim() checks every index instead */
+            c->garbage_all = 1;
+            return;
+        }
+        c->garbage = garbage;
+        c->max_garbage = max;
+    }
+    c->garbage[c->num_garbage++] = owner;
+    *listed = 1;
+}
+
+
+/* Marks e as removed if a snapshot is open, and lists owner, the proxy
+   label or TMRM_LOG_GARBAGE_LITERAL | literal index whose index holds e,
+   for _reclaim(). Returns 0 if e can be dropped right away. */
+static int
+_retain(tmrm_storage_log_context* c, tmrm_storage_log_entry* e,
+        uint32_t owner)
+{
+    if (c->num_snapshots == 0) return 0;
+    e->removed = c->version;
+    _garbage_add(c, owner);
+    return 1;
+}
+
+
+/* Drops the removed entries of e that no open snapshot sees anymore.
+   Returns the number of removed entries that are kept. */
+static uint32_t
+_reclaim_entries(tmrm_storage_log_context* c, tmrm_storage_log_entries* e)
+{
+    tmrm_storage_log_entry* item;
+    uint32_t i, j, k, kept = 0;
+
+    for (i = 0, j = 0; i < e->size; i++) {
+        item = &e->items[i];
+        if (item->removed != 0) {
+            for (k = 0; k < c->num_snapshots; k++) {
+                if (_entry_visible(item, c->snapshots[k])) break;
+            }
+            if (k == c->num_snapshots) continue;
+            kept++;
+        }
+        e->items[j++] = *item;
+    }
+    e->size = j;
+    return kept;
+}
+
+
+/* Reclaims the removed entries in the indexes of owner. Returns the number
+   of removed entries that are kept. */
+static uint32_t
+_reclaim_owner(tmrm_storage_log_context* c, uint32_t owner)
+{
+    tmrm_storage_log_node* n;
+
+    if (owner & TMRM_LOG_GARBAGE_LITERAL) {
+        return _reclaim_entries(c,
+                &c->literals[owner & ~TMRM_LOG_GARBAGE_LITERAL].references);
+    }
+    n = &c->proxies[owner];
+    return _reclaim_entries(c, &n->properties) +
+        _reclaim_entries(c, &n->references) +
+        _reclaim_entries(c, &n->keyed);
+}
+
+
+/* Reclaims the removed entries that were kept for snapshots. Called when a
+   snapshot is released, which may make the versions up to the oldest open
+   snapshot unreachable. Only the indexes listed in the garbage are
+   visited. */
+static void
+_reclaim(tmrm_storage_log_context* c)
+{
+    uint32_t i, j, owner;
+
+    if (c->garbage_all) {
+        c->garbage_all = 0;
+        c->num_garbage = 0;
+        for (i = 0; i < c->max_proxies; i++) c->proxies[i].garbage = 0;
+        for (i = 0; i < c->num_literals; i++) c->literals[i].garbage = 0;
+        for (i = 0; i < c->max_proxies; i++) {
+            if (_reclaim_owner(c, i) > 0) _garbage_add(c, i);
+        }
+        for (i = 0; i < c->num_literals; i++) {
+            owner = TMRM_LOG_GARBAGE_LITERAL | i;
+            if (_reclaim_owner(c, owner) > 0) _garbage_add(c, owner);
+        }
+        return;
+    }
+    for (i = 0, j = 0; i < c->num_garbage; i++) {
+        owner = c->garbage[i];
+        if (_reclaim_owner(c, owner) > 0) {
+            c->garbage[j++] = owner;
+        } else if (owner & TMRM_LOG_GARBAGE_LITERAL) {
+            c->literals[owner & ~TMRM_LOG_GARBAGE_LITERAL].garbage = 0;
+        } else {
+            c->proxies[owner].garbage = 0;
+        }
+    }
+    c->num_garbage = j;
+}
+
+
+static void
+_entries_free(tmrm_storage_log_entries* e)
+{
+    if (e->items) TMRM_FREE(tmrm_storage_log_entry, e->items);
+    e->items = NULL;
+    e->size = e->max = 0;
+}
+
+
+/* Frees the in-memory indexes, leaving an empty subject map. */
+static void
+_indexes_clear(tmrm_storage_log_context* c)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->max_proxies; i++) {
+        _entries_free(&c->proxies[i].properties);
+        _entries_free(&c->proxies[i].references);
+        _entries_free(&c->proxies[i].keyed);
+    }
+    for (i = 0; i < c->num_literals; i++) {
+        TMRM_FREE(cstring, c->literals[i].value);
+        TMRM_FREE(cstring, c->literals[i].datatype);
+        _entries_free(&c->literals[i].references);
+    }
+    if (c->proxies) TMRM_FREE(tmrm_storage_log_node, c->proxies);
+    if (c->literals) TMRM_FREE(tmrm_storage_log_literal, c->literals);
+    if (c->literal_table) TMRM_FREE(uint32_t, c->literal_table);
+    if (c->garbage) TMRM_FREE(uint32_t, c->garbage);
+    c->proxies = NULL;
+    c->max_proxies = 0;
+    c->next_label = 0;
+    c->literals = NULL;
+    c->num_literals = c->max_literals = 0;
+    c->literal_table = NULL;
+    c->literal_table_size = 0;
+    c->garbage = NULL;
+    c->num_garbage = c->max_garbage = 0;
+    c->garbage_all = 0;
+}
+
+
+/* Returns the index node of label, growing the index if create is set. */
+static tmrm_storage_log_node*
+_node(tmrm_storage_log_context* c, tmrm_label label, int create)
+{
+    tmrm_storage_log_node* proxies;
+    uint32_t max;
+
+    if (label < 0) return NULL;
+    if ((uint32_t)label >= c->max_proxies) {
+        if (!create) return NULL;
+        max = c->max_proxies ? c->max_proxies : 1024;
+        while (max <= (uint32_t)label) max *= 2;
+        if (!(proxies = (tmrm_storage_log_node*)TMRM_REALLOC(
+                        tmrm_storage_log_node, c->proxies,
+                        max * sizeof(tmrm_storage_log_node)))) {
+            return NULL;
+        }
+        memset(proxies + c->max_proxies, 0,
+                (max - c->max_proxies) * sizeof(tmrm_storage_log_node));
+        c->proxies = proxies;
+        c->max_proxies = max;
+    }
+    return &c->proxies[label];
+}
+
+
+static uint32_t
+_literal_hash(const char* value, const char* datatype)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *value; value++) h = (h ^ (unsigned char)*value) * 16777619u;
+    h = (h ^ 0xff) * 16777619u;
+    for (; *datatype; datatype++) h = (h ^ (unsigned char)*datatype) * 16777619u;
+    return h;
+}
+
+
+/* Returns the index of a literal or -1 if it is not known and create is not
+   set (or on failure). */
+static long
+_literal_find(tmrm_storage_log_context* c, const char* value,
+        const char* datatype, int create)
+{
+    tmrm_storage_log_literal* literals;
+    tmrm_storage_log_literal* lit;
+    uint32_t *table, size, h, i, j, max;
+
+    if (!value || !datatype) return -1;
+    h = _literal_hash(value, datatype);
+    if (c->literal_table_size > 0) {
+        for (i = h & (c->literal_table_size - 1); c->literal_table[i] != 0;
+                i = (i + 1) & (c->literal_table_size - 1)) {
+            lit = &c->literals[c->literal_table[i] - 1];
+            if (lit->hash == h && strcmp(lit->value, value) == 0 &&
+                    strcmp(lit->datatype, datatype) == 0) {
+                return (long)c->literal_table[i] - 1;
+            }
+        }
+    }
+    if (!create) return -1;
+
+    /* Keep the table at most half full */
+    if (2 * (c->num_literals + 1) > c->literal_table_size) {
+        size = c->literal_table_size ? 2 * c->literal_table_size : 1024;
+        table = (uint32_t*)TMRM_CALLOC(uint32_t, size, sizeof(uint32_t));
+        if (!table) return -1;
+        for (j = 0; j < c->num_literals; j++) {
+            for (i = c->literals[j].hash & (size - 1); table[i] != 0;
+                    i = (i + 1) & (size - 1));
+            table[i] = j + 1;
+        }
+        if (c->literal_table) TMRM_FREE(uint32_t, c->literal_table);
+        c->literal_table = table;
+        c->literal_table_size = size;
+    }
+    if (c->num_literals == c->max_literals) {
+        max = c->max_literals ? 2 * c->max_literals : 256;
+        if (!(literals = (tmrm_storage_log_literal*)TMRM_REALLOC(
+                        tmrm_storage_log_literal, c->literals,
+                        max * sizeof(tmrm_storage_log_literal)))) {
+            return -1;
+        }
+        c->literals = literals;
+        c->max_literals = max;
+    }
+    lit = &c->literals[c->num_literals];
+    memset(lit, 0, sizeof(tmrm_storage_log_literal));
+    lit->value = tmrm_strdup(value);
+    lit->datatype = tmrm_strdup(datatype);
+    if (!lit->value || !lit->datatype) {
+        if (lit->value) TMRM_FREE(cstring, lit->value);
+        if (lit->datatype) TMRM_FREE(cstring, lit->datatype);
+        return -1;
+    }
+    lit->hash = h;
+    for (i = h & (c->literal_table_size - 1); c->literal_table[i] != 0;
+            i = (i + 1) & (c->literal_table_size - 1));
+    c->literal_table[i] = ++c->num_literals;
+    return (long)c->num_literals - 1;
+}
+
+
+static int
+_apply_proxy(void* data, tmrm_label label)
+{
+    tmrm_storage_log_node* n;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)data;
+
+    if (!(n = _node(c, label, 1))) return 1;
+    n->added = c->version;
+    n->removed = 0;
+    if (label >= c->next_label) c->next_label = label + 1;
+    return 0;
+}
+
+
+static int
+_apply_property(void* data, tmrm_label proxy, tmrm_label key,
+        tmrm_label value)
+{
+    return _apply_entry((tmrm_storage_log_context*)data, (uint32_t)proxy,
+            (uint32_t)key, TMRM_LOG_VALUE_PROXY, (uint32_t)value);
+}
+
+
+static int
+_apply_property_literal(void* data, tmrm_label proxy, tmrm_label key,
+        const tmrm_char_t* value, const tmrm_char_t* datatype)
+{
+    long idx;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)data;
+
+    idx = _literal_find(c, (const char*)value, (const char*)datatype, 1);
+    if (idx < 0) return 1;
+    return _apply_entry(c, (uint32_t)proxy, (uint32_t)key,
+            TMRM_LOG_VALUE_LITERAL, (uint32_t)idx);
+}
+
+
+/* Adds a property to the forward index of the proxy, the reverse index of
+   the value and the key index of the key. */
+static int
+_apply_entry(tmrm_storage_log_context* c, uint32_t proxy, uint32_t key,
+        uint32_t kind, uint32_t value)
+{
+    tmrm_storage_log_entries *properties, *refs, *keyed;
+
+    /* Creating a node may move the others, so they are looked up after */
+    if (!_node(c, (tmrm_label)proxy, 1) || !_node(c, (tmrm_label)key, 1)) {
+        return 1;
+    }
+    if (kind == TMRM_LOG_VALUE_LITERAL) {
+        refs = &c->literals[value].references;
+    } else {
+        if (!_node(c, (tmrm_label)value, 1)) return 1;
+        refs = &c->proxies[value].references;
+    }
+    properties = &c->proxies[proxy].properties;
+    keyed = &c->proxies[key].keyed;
+    if (_entries_add(properties, proxy, key, kind, value, c->version)) {
+        return 1;
+    }
+    if (_entries_add(refs, proxy, key, kind, value, c->version)) {
+        properties->size--;
+        return 1;
+    }
+    if (_entries_add(keyed, proxy, key, kind, value, c->version)) {
+        properties->size--;
+        refs->size--;
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Whether n has the property key: value */
+static int
+_has_entry(const tmrm_storage_log_node* n, uint32_t key, uint32_t kind,
+        uint32_t value)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->properties.size; i++) {
+        if (n->properties.items[i].removed == 0 &&
+                n->properties.items[i].key == key &&
+                n->properties.items[i].kind == kind &&
+                n->properties.items[i].value == value) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Logs and applies a property. Like the other indexed storages, properties
+   are stored once. */
+static int
+_write_entry(tmrm_storage_log_context* c, uint32_t proxy, uint32_t key,
+        uint32_t kind, uint32_t value)
+{
+    uint32_t labels[3];
+    const tmrm_storage_log_literal* lit;
+    tmrm_storage_log_node* n;
+
+    if ((n = _node(c, (tmrm_label)proxy, 0)) &&
+            _has_entry(n, key, kind, value)) {
+        return 0;
+    }
+    labels[0] = proxy;
+    labels[1] = key;
+    labels[2] = value;
+    if (kind == TMRM_LOG_VALUE_LITERAL) {
+        lit = &c->literals[value];
+        if (_log_append(c, TMRM_LOG_OP_PROPERTY_LITERAL, labels, 2,
+                    lit->value, lit->datatype)) {
+            return 1;
+        }
+    } else if (_log_append(c, TMRM_LOG_OP_PROPERTY, labels, 3, NULL, NULL)) {
+        return 1;
+    }
+    if (_apply_entry(c, proxy, key, kind, value)) return 1;
+    return _log_commit(c);
+}
+
+
+/* Removes e from the reverse index of its value and the key index of its
+   key. */
+static void
+_unlink_entry(tmrm_storage_log_context* c, const tmrm_storage_log_entry* e)
+{
+    tmrm_storage_log_node* n;
+
+    if (e->kind == TMRM_LOG_VALUE_LITERAL) {
+        _entries_remove(c, &c->literals[e->value].references,
+                TMRM_LOG_GARBAGE_LITERAL | e->value, e->proxy, e->key,
+                e->kind, e->value);
+    } else if ((n = _node(c, (tmrm_label)e->value, 0))) {
+        _entries_remove(c, &n->references, e->value, e->proxy, e->key,
+                e->kind, e->value);
+    }
+    if ((n = _node(c, (tmrm_label)e->key, 0))) {
+        _entries_remove(c, &n->keyed, e->key, e->proxy, e->key, e->kind,
+                e->value);
+    }
+}
+
+
+static int
+_apply_remove_by_key(tmrm_storage_log_context* c, tmrm_label proxy,
+        tmrm_label key)
+{
+    tmrm_storage_log_node* n;
+    uint32_t i, j;
+
+    if (!(n = _node(c, proxy, 0))) return 0;
+    for (i = 0, j = 0; i < n->properties.size; i++) {
+        if (n->properties.items[i].removed == 0 &&
+                n->properties.items[i].key == (uint32_t)key) {
+            _unlink_entry(c, &n->properties.items[i]);
+            if (!_retain(c, &n->properties.items[i], (uint32_t)proxy)) {
+                continue;
+            }
+        }
+        n->properties.items[j++] = n->properties.items[i];
+    }
+    n->properties.size = j;
+    return 0;
+}
+
+
+/* Removes a proxy and all properties where it is the proxy, the key or the
+   value. */
+static int
+_apply_remove_proxy(tmrm_storage_log_context* c, tmrm_label label)
+{
+    tmrm_storage_log_node *n, *m;
+    tmrm_storage_log_entry* e;
+    uint32_t i, j, owner;
+
+    if (!(n = _node(c, label, 0))) return 0;
+
+    for (i = 0, j = 0; i < n->properties.size; i++) {
+        e = &n->properties.items[i];
+        if (e->removed == 0) {
+            _unlink_entry(c, e);
+            if (!_retain(c, e, (uint32_t)label)) continue;
+        }
+        n->properties.items[j++] = *e;
+    }
+    n->properties.size = j;
+
+    for (i = 0, j = 0; i < n->references.size; i++) {
+        e = &n->references.items[i];
+        if (e->removed == 0) {
+            if ((m = _node(c, (tmrm_label)e->proxy, 0))) {
+                _entries_remove(c, &m->properties, e->proxy, e->proxy,
+                        e->key, e->kind, e->value);
+            }
+            if ((m = _node(c, (tmrm_label)e->key, 0))) {
+                _entries_remove(c, &m->keyed, e->key, e->proxy, e->key,
+                        e->kind, e->value);
+            }
+            if (!_retain(c, e, (uint32_t)label)) continue;
+        }
+        n->references.items[j++] = *e;
+    }
+    n->references.size = j;
+
+    /* Removing the properties of a proxy by key also removes them from
+       n->keyed: the entries before i are all marked as removed, and the
+       one at i is either gone or marked. */
+    for (i = 0; i < n->keyed.size; ) {
+        e = &n->keyed.items[i];
+        if (e->removed != 0) {
+            i++;
+            continue;
+        }
+        owner = e->proxy;
+        (void)_apply_remove_by_key(c, (tmrm_label)owner, label);
+        if (i < n->keyed.size && n->keyed.items[i].removed == 0 &&
+                n->keyed.items[i].proxy == owner) {
+            i++;
+        }
+    }
+
+    if (c->num_snapshots == 0) {
+        _entries_free(&n->properties);
+        _entries_free(&n->references);
+        _entries_free(&n->keyed);
+    }
+    n->removed = c->version;
+    return 0;
+}
+
+
+static uint32_t
+_checksum(const unsigned char* data, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--) h = (h ^ *data++) * 16777619u;
+    return h;
+}
+
+
+/* Appends a record to the write buffer. */
+static int
+_log_append(tmrm_storage_log_context* c, int op, const uint32_t* labels,
+        int num_labels, const char* value, const char* datatype)
+{
+    size_t len, vlen = 0, dlen = 0;
+    unsigned char *rec, *tmp = NULL;
+    uint32_t header[2];
+
+    if (c->fd < 0) return 1;
+    len = 1 + num_labels * sizeof(uint32_t);
+    if (value) {
+        vlen = strlen(value) + 1;
+        dlen = strlen(datatype) + 1;
+        len += vlen + dlen;
+    }
+    if (c->buffered + TMRM_LOG_RECORD_HEADER_SIZE + len > TMRM_LOG_BUFFER_SIZE &&
+            _log_flush(c)) {
+        return 1;
+    }
+    if (TMRM_LOG_RECORD_HEADER_SIZE + len <= TMRM_LOG_BUFFER_SIZE) {
+        rec = c->buffer + c->buffered;
+    } else {
+        if (!(tmp = (unsigned char*)TMRM_MALLOC(cstring,
+                        TMRM_LOG_RECORD_HEADER_SIZE + len))) {
+            return 1;
+        }
+        rec = tmp;
+    }
+    rec[TMRM_LOG_RECORD_HEADER_SIZE] = (unsigned char)op;
+    memcpy(rec + TMRM_LOG_RECORD_HEADER_SIZE + 1, labels,
+            num_labels * sizeof(uint32_t));
+    if (value) {
+        memcpy(rec + TMRM_LOG_RECORD_HEADER_SIZE + 1 +
+                num_labels * sizeof(uint32_t), value, vlen);
+        memcpy(rec + TMRM_LOG_RECORD_HEADER_SIZE + 1 +
+                num_labels * sizeof(uint32_t) + vlen, datatype, dlen);
+    }
+    header[0] = (uint32_t)len;
+    header[1] = _checksum(rec + TMRM_LOG_RECORD_HEADER_SIZE, len);
+    memcpy(rec, header, sizeof(header));
+
+    if (tmp) {
+        len += TMRM_LOG_RECORD_HEADER_SIZE;
+        if (write(c->fd, tmp, len) != (ssize_t)len) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Writing to segment %u failed",
+                    (unsigned)c->segment);
+            TMRM_FREE(cstring, tmp);
+            return 1;
+        }
+        c->segment_offset += len;
+        TMRM_FREE(cstring, tmp);
+    } else {
+        c->buffered += TMRM_LOG_RECORD_HEADER_SIZE + len;
+    }
+    return 0;
+}
+
+
+/* Writes the buffer to the current segment. */
+static int
+_log_flush(tmrm_storage_log_context* c)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < c->buffered) {
+        n = write(c->fd, c->buffer + done, c->buffered - done);
+        if (n <= 0) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Writing to segment %u failed",
+                    (unsigned)c->segment);
+            return 1;
+        }
+        done += (size_t)n;
+    }
+    c->segment_offset += c->buffered;
+    c->buffered = 0;
+    return 0;
+}
+
+
+static int
+_log_sync(tmrm_storage_log_context* c)
+{
+    if (_log_flush(c)) return 1;
+    c->pending = 0;
+    if (fsync(c->fd) != 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Syncing segment %u failed",
+                (unsigned)c->segment);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Called after each modification: syncs once per group_commit
+   modifications and starts a new segment when the current one is full. */
+static int
+_log_commit(tmrm_storage_log_context* c)
+{
+    c->pending++;
+    if (c->group_commit > 0 && c->pending >= c->group_commit &&
+            _log_sync(c)) {
+        return 1;
+    }
+    if (c->segment_offset + (off_t)c->buffered < (off_t)c->segment_size) {
+        return 0;
+    }
+
+    if (_log_sync(c)) return 1;
+    (void)close(c->fd);
+    c->fd = -1;
+    if (_log_open_segment(c, c->segment + 1, 1)) return 1;
+    if ((long)(c->segment - c->first_segment) >= c->compact_segments) {
+        return _log_compact(c);
+    }
+    return 0;
+}
+
+
+/* Opens segment n for appending. */
+static int
+_log_open_segment(tmrm_storage_log_context* c, uint32_t n, int create)
+{
+    unsigned char header[TMRM_LOG_HEADER_SIZE];
+    uint32_t byte_order = TMRM_LOG_BYTE_ORDER;
+    char* file;
+    int fd;
+
+    if (!(file = _file_name(c, "log", n))) return 1;
+    fd = open(file, O_WRONLY | O_APPEND | (create ? O_CREAT | O_TRUNC : 0),
+            0644);
+    if (fd < 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Opening segment %s failed", file);
+        TMRM_FREE(cstring, file);
+        return 1;
+    }
+    TMRM_FREE(cstring, file);
+    c->fd = fd;
+    c->segment = n;
+    c->buffered = 0;
+    if (create) {
+        memcpy(header, TMRM_LOG_MAGIC, 8);
+        memcpy(header + 8, &byte_order, sizeof(uint32_t));
+        if (write(fd, header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Writing to segment %u failed",
+                    (unsigned)n);
+            return 1;
+        }
+        if (tmrm_sync_directory(c->dir)) return 1;
+    }
+    c->segment_offset = lseek(fd, 0, SEEK_END);
+    return 0;
+}
+
+
+/* Applies all records of segment n to the in-memory indexes. A torn record
+   at the end of the last segment (after a crash) is cut off, any other
+   damage fails. */
+static int
+_log_replay(tmrm_storage_log_context* c, uint32_t n, int last)
+{
+    unsigned char header[TMRM_LOG_HEADER_SIZE];
+    uint32_t rec[2], labels[3], byte_order;
+    unsigned char* payload = NULL;
+    size_t max = 0;
+    off_t offset, size;
+    struct stat st;
+    const char *value, *datatype;
+    char* file;
+    FILE* fh;
+    int ret = 0, num_labels, torn = 0;
+
+    if (!(file = _file_name(c, "log", n))) return 1;
+    if (!(fh = fopen(file, "rb"))) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Opening segment %s failed", file);
+        TMRM_FREE(cstring, file);
+        return 1;
+    }
+    if (fread(header, sizeof(header), 1, fh) != 1 ||
+            memcmp(header, TMRM_LOG_MAGIC, 8) != 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "%s is not a segment", file);
+        (void)fclose(fh);
+        TMRM_FREE(cstring, file);
+        return 1;
+    }
+    memcpy(&byte_order, header + 8, sizeof(uint32_t));
+    if (byte_order != TMRM_LOG_BYTE_ORDER) {
+        TMRM_LOG(TMRM_LOG_ERROR, "%s was written on a different platform",
+                file);
+        (void)fclose(fh);
+        TMRM_FREE(cstring, file);
+        return 1;
+    }
+
+    if (fstat(fileno(fh), &st) != 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Reading segment %s failed", file);
+        (void)fclose(fh);
+        TMRM_FREE(cstring, file);
+        return 1;
+    }
+    size = st.st_size;
+
+    offset = TMRM_LOG_HEADER_SIZE;
+    while (ret == 0 && offset < size) {
+        /* The length is checked against the file before it is trusted */
+        if (size - offset < TMRM_LOG_RECORD_HEADER_SIZE ||
+                fread(rec, sizeof(rec), 1, fh) != 1 || rec[0] < 1 ||
+                (off_t)rec[0] > size - offset - TMRM_LOG_RECORD_HEADER_SIZE) {
+            torn = 1;
+            break;
+        }
+        if (rec[0] > max) {
+            if (payload) TMRM_FREE(cstring, payload);
+            max = rec[0] < 4096 ? 4096 : rec[0];
+            if (!(payload = (unsigned char*)TMRM_MALLOC(cstring, max + 1))) {
+                ret = 1;
+                break;
+            }
+        }
+        if (fread(payload, 1, rec[0], fh) != rec[0] ||
+                _checksum(payload, rec[0]) != rec[1]) {
+            torn = 1;
+            break;
+        }
+        payload[rec[0]] = '\0';
+        num_labels = (payload[0] == TMRM_LOG_OP_PROPERTY) ? 3 :
+            (payload[0] == TMRM_LOG_OP_PROXY ||
+             payload[0] == TMRM_LOG_OP_REMOVE_PROXY) ? 1 : 2;
+        if (rec[0] < 1 + num_labels * sizeof(uint32_t)) {
+            torn = 1;
+            break;
+        }
+        memcpy(labels, payload + 1, num_labels * sizeof(uint32_t));
+
+        switch (payload[0]) {
+            case TMRM_LOG_OP_PROXY:
+                ret = _apply_proxy(c, (tmrm_label)labels[0]);
+                break;
+            case TMRM_LOG_OP_PROPERTY:
+                ret = _apply_property(c, (tmrm_label)labels[0],
+                        (tmrm_label)labels[1], (tmrm_label)labels[2]);
+                break;
+            case TMRM_LOG_OP_PROPERTY_LITERAL:
+                value = (const char*)payload + 1 + 2 * sizeof(uint32_t);
+                datatype = value + strlen(value) + 1;
+                if (datatype >= (const char*)payload + rec[0]) {
+                    ret = 1;
+                    break;
+                }
+                ret = _apply_property_literal(c, (tmrm_label)labels[0],
+                        (tmrm_label)labels[1], (const tmrm_char_t*)value,
+                        (const tmrm_char_t*)datatype);
+                break;
+            case TMRM_LOG_OP_REMOVE_BY_KEY:
+                ret = _apply_remove_by_key(c, (tmrm_label)labels[0],
+                        (tmrm_label)labels[1]);
+                break;
+            case TMRM_LOG_OP_REMOVE_PROXY:
+                ret = _apply_remove_proxy(c, (tmrm_label)labels[0]);
+                break;
+            default:
+                TMRM_LOG(TMRM_LOG_ERROR, "Unknown operation %d in %s",
+                        (int)payload[0], file);
+                ret = 1;
+                break;
+        }
+        offset += TMRM_LOG_RECORD_HEADER_SIZE + rec[0];
+    }
+    (void)fclose(fh);
+    if (ret == 0 && torn && !last) {
+        /* Only the tail of the last segment can be torn by a crash */
+        TMRM_LOG(TMRM_LOG_ERROR, "%s is damaged at offset %ld", file,
+                (long)offset);
+        ret = 1;
+    } else if (ret == 0 && torn) {
+        TMRM_LOG(TMRM_LOG_WARNING, "Truncating %s at offset %ld", file,
+                (long)offset);
+        if (truncate(file, offset) != 0) {
+            TMRM_LOG(TMRM_LOG_ERROR, "Truncating %s failed", file);
+            ret = 1;
+        }
+    }
+    if (payload) TMRM_FREE(cstring, payload);
+    TMRM_FREE(cstring, file);
+    return ret;
+}
+
+
+/* Passes the proxies with labels from first up to last - 1 in label order
+   to visitor, each followed by its properties. */
+static int
+_log_visit(const tmrm_storage_log_context* c, uint32_t version,
+        uint32_t first, uint32_t last, const tmrm_property_visitor* visitor,
+        void* data)
+{
+    const tmrm_storage_log_entry* e;
+    const tmrm_storage_log_literal* lit;
+    uint32_t i, j;
+    int ret = 0;
+
+    if (last > c->max_proxies) last = c->max_proxies;
+    for (i = first; i < last && ret == 0; i++) {
+        if (!_node_visible(&c->proxies[i], version)) continue;
+        ret = visitor->proxy(data, (tmrm_label)i);
+        for (j = 0; j < c->proxies[i].properties.size && ret == 0; j++) {
+            e = &c->proxies[i].properties.items[j];
+            if (!_entry_visible(e, version)) continue;
+            if (e->kind == TMRM_LOG_VALUE_LITERAL) {
+                lit = &c->literals[e->value];
+                ret = visitor->property_literal(data,
+                        (tmrm_label)e->proxy, (tmrm_label)e->key,
+                        (const tmrm_char_t*)lit->value,
+                        (const tmrm_char_t*)lit->datatype);
+            } else {
+                ret = visitor->property(data,
+                        (tmrm_label)e->proxy, (tmrm_label)e->key,
+                        (tmrm_label)e->value);
+            }
+        }
+    }
+    return ret;
+}
+
+
+#ifdef HAVE_PTHREAD
+static void*
+_log_compact_thread(void* data)
+{
+    (void)_log_compact_run((tmrm_storage_log_context*)data);
+    return NULL;
+}
+#endif
+
+
+/* Starts writing a snapshot that replaces all segments before the current
+   one, which has just been started and is still empty. Called with the
+   write lock held. Does nothing while the previous compaction runs; the
+   next full segment tries again. */
+static int
+_log_compact(tmrm_storage_log_context* c)
+{
+    int ret;
+
+#ifdef HAVE_PTHREAD
+    if (c->compacting == TMRM_LOG_COMPACT_DONE) {
+        (void)pthread_join(c->compactor, NULL);
+        c->compacting = TMRM_LOG_COMPACT_IDLE;
+    }
+#endif
+    if (c->compacting != TMRM_LOG_COMPACT_IDLE) return 0;
+
+    /* Every write up to now is in the segments the snapshot replaces */
+    if (!(c->compact_version = _pin(c))) return 1;
+    c->compact_covered = c->segment - 1;
+    c->compact_cancelled = 0;
+    c->compacting = TMRM_LOG_COMPACT_RUNNING;
+#ifdef HAVE_PTHREAD
+    if (pthread_create(&c->compactor, NULL, _log_compact_thread, c) == 0) {
+        return 0;
+    }
+    TMRM_LOG(TMRM_LOG_WARNING, "Could not start the compaction thread");
+#endif
+    /* Runs here; the locks it takes are already held */
+    ret = _log_compact_run(c);
+    c->compacting = TMRM_LOG_COMPACT_IDLE;
+    return ret;
+}
+
+
+/* Writes the pinned version as a snapshot, then replaces the segments and
+   snapshots it covers under the write lock. The indexes are only read
+   under the read lock, a chunk of proxies at a time, so that writers do
+   not wait for the whole visit. Writes in the meantime have newer versions
+   and are not visible to it. */
+static int
+_log_compact_run(tmrm_storage_log_context* c)
+{
+    tmrm_snapshot_builder* b;
+    uint32_t *numbers, count, i, next = 0;
+    uint32_t version = c->compact_version, covered = c->compact_covered;
+    char *snapshot = NULL, *file;
+    int ret = 1, done = 0;
+
+    TMRM_DEBUG2("Compacting segments up to %u\n", (unsigned)covered);
+    if ((b = tmrm_snapshot_builder_new())) {
+        ret = 0;
+        while (ret == 0 && !done) {
+            tmrm_storage_lock(c->storage, 0);
+            done = next >= c->max_proxies || c->compact_cancelled;
+            if (!done) {
+                ret = _log_visit(c, version, next,
+                        next + TMRM_LOG_COMPACT_CHUNK,
+                        &tmrm_snapshot_builder_visitor, b);
+                next += TMRM_LOG_COMPACT_CHUNK;
+            }
+            tmrm_storage_unlock(c->storage);
+        }
+        if (ret == 0 && !(snapshot = _file_name(c, "snapshot", covered))) {
+            ret = 1;
+        }
+        if (ret == 0) ret = tmrm_snapshot_builder_write(b, snapshot);
+        tmrm_snapshot_builder_free(b);
+    }
+
+    tmrm_storage_lock(c->storage, 1);
+    if (ret == 0 && c->compact_cancelled) {
+        /* The storage was removed meanwhile */
+        (void)unlink(snapshot);
+    } else if (ret == 0) {
+        /* The new snapshot is in place, everything it covers can go */
+        if (_log_files(c, "log", &numbers, &count) == 0) {
+            for (i = 0; i < count; i++) {
+                if (numbers[i] <= covered &&
+                        (file = _file_name(c, "log", numbers[i]))) {
+                    (void)unlink(file);
+                    TMRM_FREE(cstring, file);
+                }
+            }
+            if (numbers) TMRM_FREE(uint32_t, numbers);
+        }
+        if (_log_files(c, "snapshot", &numbers, &count) == 0) {
+            for (i = 0; i < count; i++) {
+                if (numbers[i] < covered &&
+                        (file = _file_name(c, "snapshot", numbers[i]))) {
+                    (void)unlink(file);
+                    TMRM_FREE(cstring, file);
+                }
+            }
+            if (numbers) TMRM_FREE(uint32_t, numbers);
+        }
+        (void)tmrm_sync_directory(c->dir);
+        c->first_segment = covered + 1;
+    } else {
+        TMRM_LOG(TMRM_LOG_ERROR, "Compacting segments up to %u failed",
+                (unsigned)covered);
+    }
+    _unpin(c, version);
+    c->compacting = TMRM_LOG_COMPACT_DONE;
+    tmrm_storage_unlock(c->storage);
+    if (snapshot) TMRM_FREE(cstring, snapshot);
+    return ret;
+}
+
+
+static int
+_compare_number(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+/* Collects the sorted numbers of all files <name>.<kind>.NNNNNN in dir. */
+static int
+_log_files(tmrm_storage_log_context* c, const char* kind, uint32_t** numbers,
+        uint32_t* count)
+{
+    DIR* d;
+    struct dirent* entry;
+    uint32_t *list = NULL, *tmp, max = 0, num = 0;
+    size_t prefix_len;
+    char *prefix, *end;
+    unsigned long n;
+
+    *numbers = NULL;
+    *count = 0;
+    prefix_len = strlen(c->name) + strlen(kind) + 2;
+    if (!(prefix = (char*)TMRM_MALLOC(cstring, prefix_len + 1))) return 1;
+    (void)sprintf(prefix, "%s.%s.", c->name, kind);
+
+    if (!(d = opendir(c->dir))) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Opening directory %s failed", c->dir);
+        TMRM_FREE(cstring, prefix);
+        return 1;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0) continue;
+        n = strtoul(entry->d_name + prefix_len, &end, 10);
+        /* skips temporary files of the snapshot builder */
+        if (*end != '\0' || end == entry->d_name + prefix_len) continue;
+        if (num == max) {
+            max = max ? 2 * max : 16;
+            if (!(tmp = (uint32_t*)TMRM_REALLOC(uint32_t, list,
+                            max * sizeof(uint32_t)))) {
+                if (list) TMRM_FREE(uint32_t, list);
+                (void)closedir(d);
+                TMRM_FREE(cstring, prefix);
+                return 1;
+            }
+            list = tmp;
+        }
+        list[num++] = (uint32_t)n;
+    }
+    (void)closedir(d);
+    TMRM_FREE(cstring, prefix);
+
+    if (num > 0) qsort(list, num, sizeof(uint32_t), _compare_number);
+    *numbers = list;
+    *count = num;
+    return 0;
+}
+
+
+static tmrm_iterator*
+_iterator_new(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_storage_log_element element)
+{
+    tmrm_storage_log_iterator_context* context;
+    tmrm_iterator* iterator;
+
+    context = (tmrm_storage_log_iterator_context*)
+        TMRM_CALLOC(tmrm_storage_log_iterator_context, 1,
+                sizeof(tmrm_storage_log_iterator_context));
+    if (!context) return NULL;
+
+    context->subject_map = map;
+    context->log = (tmrm_storage_log_context*)s->context;
+    context->element = element;
+
+    iterator = tmrm_iterator_new(s->subject_map_sphere, (void*)context,
+            tmrm_storage_log_list_next,
+            tmrm_storage_log_list_end,
+            tmrm_storage_log_list_get_element,
+            tmrm_storage_log_list_free);
+    if (!iterator) TMRM_FREE(tmrm_storage_log_iterator_context, context);
+    return iterator;
+}
+
+
+static int
+_iterator_add(tmrm_iterator* iterator, const tmrm_storage_log_entry* e)
+{
+    tmrm_storage_log_iterator_context* context;
+
+    context = (tmrm_storage_log_iterator_context*)iterator->context;
+    return _entries_add(&context->entries, e->proxy, e->key, e->kind,
+            e->value, e->added);
+}
+
+
+/* Returns the proxy that has the string literal value for key. */
+static tmrm_proxy*
+_proxy_by_literal(tmrm_storage* s, tmrm_subject_map* map, const char* value,
+        tmrm_label key)
+{
+    tmrm_storage_log_entries* refs;
+    long idx;
+    uint32_t i;
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+
+    idx = _literal_find(c, value, TMRM_XMLSCHEMA_STRING, 0);
+    if (idx < 0) return NULL;
+    refs = &c->literals[idx].references;
+    for (i = 0; i < refs->size; i++) {
+        if (refs->items[i].key == (uint32_t)key &&
+                refs->items[i].removed == 0) {
+            return _create_proxy_struct(map, (tmrm_label)refs->items[i].proxy);
+        }
+    }
+    return NULL;
+}
+
+
+/* Pins the current version for a snapshot or a compaction and returns it,
+   or 0 on failure. Writes from now on get the next version. */
+static uint32_t
+_pin(tmrm_storage_log_context* c)
+{
+    uint32_t* snapshots;
+    uint32_t max;
+
+    if (c->version == TMRM_LOG_CURRENT - 1) {
+        TMRM_LOG(TMRM_LOG_WARNING, "No more snapshot versions");
+        return 0;
+    }
+    if (c->num_snapshots == c->max_snapshots) {
+        max = c->max_snapshots ? 2 * c->max_snapshots : 8;
+        if (!(snapshots = (uint32_t*)TMRM_REALLOC(uint32_t, c->snapshots,
+                        max * sizeof(uint32_t)))) {
+            return 0;
+        }
+        c->snapshots = snapshots;
+        c->max_snapshots = max;
+    }
+    c->snapshots[c->num_snapshots++] = c->version;
+    return c->version++;
+}
+
+
+/* Releases a version returned by _pin() */
+static void
+_unpin(tmrm_storage_log_context* c, uint32_t version)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->num_snapshots; i++) {
+        if (c->snapshots[i] == version) {
+            c->snapshots[i] = c->snapshots[--c->num_snapshots];
+            break;
+        }
+    }
+    _reclaim(c);
+}
+
+
+static unsigned long
+tmrm_storage_log_snapshot_acquire(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return 0;
+
+    return (unsigned long)_pin(c);
+}
+
+
+static void
+tmrm_storage_log_snapshot_release(tmrm_storage* s, unsigned long version)
+{
+    tmrm_storage_log_context* c = (tmrm_storage_log_context*)s->context;
+    if (!c) return;
+
+    _unpin(c, (uint32_t)version);
+}
+
+
+static void
+tmrm_storage_log_register_factory(tmrm_storage_factory *factory)
+{
+    factory->init = tmrm_storage_log_init;
+    factory->free = tmrm_storage_log_free;
+    /* Reads only look at the in-memory indexes */
+    factory->concurrency = TMRM_STORAGE_CONCURRENT_READS;
+
+    factory->bootstrap = tmrm_storage_log_bootstrap;
+    factory->remove = tmrm_storage_log_remove;
+    factory->bottom = tmrm_storage_log_bottom;
+    factory->merge = tmrm_storage_log_merge;
+    factory->proxy_create = tmrm_storage_log_proxy_create;
+    factory->proxy_update = NULL;
+    factory->add_property = tmrm_storage_log_add_property;
+    factory->add_property_literal = tmrm_storage_log_add_property_literal;
+    factory->proxy_remove_properties_by_key = tmrm_storage_log_proxy_remove_properties_by_key;
+    factory->proxy_properties = tmrm_storage_log_proxy_properties;
+    factory->proxy_remove = tmrm_storage_log_proxy_remove;
+    factory->scan_properties = tmrm_storage_log_scan_properties;
+    factory->proxy_by_label = tmrm_storage_log_proxy_by_label;
+    factory->proxies = tmrm_storage_log_proxies;
+    factory->proxy_label = tmrm_storage_log_proxy_label;
+    factory->proxy_keys = tmrm_storage_log_proxy_keys;
+    factory->proxy_values_by_key = tmrm_storage_log_proxy_values_by_key;
+    factory->proxy_is_value_by_key = tmrm_storage_log_proxy_is_value_by_key;
+    factory->proxy_keys_by_value = tmrm_storage_log_proxy_keys_by_value;
+    factory->literal_keys_by_value = tmrm_storage_log_literal_keys_by_value;
+    factory->literal_is_value_by_key = tmrm_storage_log_literal_is_value_by_key;
+    factory->is_value_by_key_many = tmrm_storage_log_is_value_by_key_many;
+    factory->posting_list = tmrm_storage_log_posting_list;
+    factory->proxy_add_type = tmrm_storage_log_proxy_add_type;
+    factory->proxy_add_superclass = tmrm_storage_log_proxy_add_superclass;
+    factory->proxy_direct_subclasses = tmrm_storage_log_proxy_direct_subclasses;
+    factory->proxy_direct_superclasses = tmrm_storage_log_proxy_direct_superclasses;
+    factory->proxy_direct_types = tmrm_storage_log_proxy_direct_types;
+    factory->proxy_direct_instances = tmrm_storage_log_proxy_direct_instances;
+    factory->snapshot_acquire = tmrm_storage_log_snapshot_acquire;
+    factory->snapshot_release = tmrm_storage_log_snapshot_release;
+}
+
+
+void
+tmrm_init_storage_log(tmrm_subject_map_sphere *sms)
+{
+    tmrm_storage_register_factory(sms, "log",
+            "Log-structured append-only storage module",
+            &tmrm_storage_log_register_factory);
+}
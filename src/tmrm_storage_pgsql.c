@@ -50,11 +50,22 @@ struct tmrm_storage_pgsql_context_s {
     const char* user;
     const char* password;
     PGconn* conn;
+    /* Listen for changes by other processes (option notify) */
+    int notify;
+    /* Connections for non-blocking queries that are not in use (see
+       tmrm_storage_pgsql_query_send) */
+    char conninfo[512];
+    PGconn** idle;
+    int idle_count;
+    int idle_max;
 };
 
 typedef struct tmrm_storage_pgsql_context_s tmrm_storage_pgsql_context;
 
 struct tmrm_storage_pgsql_iterator_context_s {
+    /* Literals borrow their values from res (see
+       tmrm_storage_pgsql_list_free) */
+    tmrm_literal_owner owner;
     tmrm_subject_map *subject_map;
     PGresult *res;
     int num_rows;
@@ -63,6 +74,57 @@ struct tmrm_storage_pgsql_iterator_context_s {
 
 typedef struct tmrm_storage_pgsql_iterator_context_s tmrm_storage_pgsql_iterator_context;
 
+/* A non-blocking query on a connection of its own */
+struct tmrm_storage_pgsql_query_s {
+    PGconn* conn;
+    /* The connection is being established with PQconnectPoll() */
+    int connecting;
+    /* The statement has been handed to libpq */
+    int sent;
+    char* sql;
+    /* The label for proxy_by_label, NULL otherwise */
+    char* param;
+    tmrm_object* (*get_element)(void*, tmrm_iterator_flag);
+    PGresult* res;
+};
+
+typedef struct tmrm_storage_pgsql_query_s tmrm_storage_pgsql_query;
+
+/* Statements shared by the blocking and non-blocking reads */
+#define TMRM_PGSQL_PROXY_BY_LABEL "SELECT id FROM proxy WHERE id=$1"
+#define TMRM_PGSQL_VALUES_BY_KEY \
+    "SELECT value, value_literal, datatype FROM property " \
+    "WHERE proxy=%d AND key=%d"
+#define TMRM_PGSQL_IS_VALUE_BY_KEY \
+    "SELECT proxy FROM property WHERE key=%d AND value=%d"
+#define TMRM_PGSQL_KEYS_BY_VALUE "SELECT key FROM property WHERE value=%d"
+
+/* Number of rows fetched at once by tmrm_storage_pgsql_scan_properties */
+#define TMRM_PGSQL_SCAN_FETCH_SIZE 10000
+
+/* Channel on which the property trigger announces changes as
+   "proxy key value" (value is empty for literals) */
+#define TMRM_PGSQL_NOTIFY_CHANNEL "tmrm_property"
+
+/* Trigger that announces every changed property row, see _notify_setup */
+#define TMRM_PGSQL_NOTIFY_TRIGGER \
+    "CREATE OR REPLACE FUNCTION tmrm_property_notify() RETURNS trigger AS $$\n" \
+    "BEGIN\n" \
+    "    IF TG_OP <> 'INSERT' THEN\n" \
+    "        PERFORM pg_notify('" TMRM_PGSQL_NOTIFY_CHANNEL "', OLD.proxy || ' ' ||\n" \
+    "            OLD.key || ' ' || COALESCE(OLD.value::text, ''));\n" \
+    "    END IF;\n" \
+    "    IF TG_OP <> 'DELETE' THEN\n" \
+    "        PERFORM pg_notify('" TMRM_PGSQL_NOTIFY_CHANNEL "', NEW.proxy || ' ' ||\n" \
+    "            NEW.key || ' ' || COALESCE(NEW.value::text, ''));\n" \
+    "    END IF;\n" \
+    "    RETURN NULL;\n" \
+    "END;\n" \
+    "$$ LANGUAGE plpgsql;\n" \
+    "CREATE TRIGGER tmrm_property_notify\n" \
+    "    AFTER INSERT OR UPDATE OR DELETE ON property\n" \
+    "    FOR EACH ROW EXECUTE PROCEDURE tmrm_property_notify();\n"
+
 
 /* ---------------------------------------------------------------------------
    Prototypes for the pgsql storage factory
@@ -112,6 +174,16 @@ tmrm_storage_pgsql_proxy_remove(tmrm_storage* s, const tmrm_proxy* p);
 static tmrm_iterator*
 tmrm_storage_pgsql_proxy_properties(tmrm_storage* s, tmrm_proxy* p);
 
+static int
+tmrm_storage_pgsql_scan_properties(tmrm_storage* s, tmrm_subject_map* map,
+        const tmrm_property_visitor* visitor, void* data);
+
+static int
+tmrm_storage_pgsql_poll_changes(tmrm_storage* s,
+        void (*changed)(void* data, tmrm_label proxy, tmrm_label key,
+            const tmrm_label* value),
+        void* data);
+
 static tmrm_proxy*
 tmrm_storage_pgsql_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
         const char* label);
@@ -140,6 +212,15 @@ tmrm_storage_pgsql_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmr
 static tmrm_iterator*
 tmrm_storage_pgsql_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key);
 
+static tmrm_iterator*
+tmrm_storage_pgsql_is_value_by_key_many(tmrm_storage* s,
+        tmrm_object* const* values, int count, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_pgsql_path(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_object* const* values, int count,
+        const tmrm_path_step* steps, int step_count, int closure);
+
 static tmrm_proxy*
 tmrm_storage_pgsql_proxy_by_literal(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key);
 
@@ -210,6 +291,29 @@ _iterator_by_sql_query(tmrm_storage* s, tmrm_subject_map *subject_map, const cha
 static tmrm_iterator*
 _iterator_by_sql_query_params(tmrm_storage* s, tmrm_subject_map *subject_map, const char* query, const char* const *param_values, int param_count);
 
+static tmrm_iterator*
+_iterator_by_sql(tmrm_storage* s, tmrm_subject_map *subject_map,
+        const char* query, const char* const *param_values, int param_count,
+        tmrm_object* (*get_element)(void*, tmrm_iterator_flag));
+
+static tmrm_iterator*
+_iterator_by_result(tmrm_storage* s, tmrm_subject_map *subject_map,
+        PGresult* res,
+        tmrm_object* (*get_element)(void*, tmrm_iterator_flag));
+
+static int
+_notify_setup(tmrm_storage* s);
+
+static int
+tmrm_storage_pgsql_query_send(tmrm_storage* s, tmrm_storage_query* q,
+        tmrm_proxy* p, tmrm_proxy* key, const char* label);
+
+static int
+tmrm_storage_pgsql_query_poll(tmrm_storage* s, tmrm_storage_query* q);
+
+static void
+tmrm_storage_pgsql_query_free(tmrm_storage* s, tmrm_storage_query* q);
+
 /* ======================================================================= */
 /* 
  * PostgreSQL-specific functions are placed here.
@@ -327,7 +431,6 @@ static int
 tmrm_storage_pgsql_init(tmrm_storage* s, tmrm_hash* options)
 {
     tmrm_storage_pgsql_context* c;
-    char conn_str[512];
 
     /* Opens a database connection */
     c = (tmrm_storage_pgsql_context*)TMRM_CALLOC(tmrm_storage_pgsql_context, 1,
@@ -340,7 +443,8 @@ tmrm_storage_pgsql_init(tmrm_storage* s, tmrm_hash* options)
     c->password = tmrm_hash_get(options, "password");
     s->context = c;
     if (c->user == NULL || c->dbname == NULL) {
-        fprintf(stderr, "Missing user or dbname - check the options string\n");
+        TMRM_LOG(TMRM_LOG_ERROR,
+                "Missing user or dbname - check the options string");
         return -1;
     }
     if (tmrm_hash_get_as_boolean(options, "new") > 0) {
@@ -349,16 +453,21 @@ tmrm_storage_pgsql_init(tmrm_storage* s, tmrm_hash* options)
             return -1;
         }
     }
-    (void)snprintf(conn_str, 512, "host=%s port=%s dbname=%s user=%s password=%s",
+    (void)snprintf(c->conninfo, sizeof(c->conninfo),
+            "host=%s port=%s dbname=%s user=%s password=%s",
             (c->host == NULL ? "localhost" : c->host),
             (c->port == NULL ? "5432" : c->port), c->dbname, c->user,
             (c->password == NULL ? "" : c->password));
-    c->conn = PQconnectdb(conn_str);
+    c->conn = PQconnectdb(c->conninfo);
     if (PQstatus(c->conn) != CONNECTION_OK ) {
-        fprintf(stderr, "Connection to postgresql database failed: %s\n",
+        TMRM_LOG(TMRM_LOG_ERROR, "Connection to postgresql database failed: %s",
                 PQerrorMessage(c->conn));
         return -1;
     }
+    if (tmrm_hash_get_as_boolean(options, "notify") > 0) {
+        c->notify = 1;
+        if (_notify_setup(s)) return -1;
+    }
 
     return 0;
 }
@@ -375,24 +484,8 @@ tmrm_storage_pgsql_bootstrap(tmrm_storage* s, tmrm_subject_map* map)
 {
     tmrm_storage_pgsql_context *c;
     tmrm_literal *lit;
-    /* TODO: move this to tmrm_proxy.h */
-    const unsigned char* bootstrap_ontology = (unsigned char*)"%YAML 1.1\n"
-        "---\n"
-        "subject_map: 'bootstrap'\n"
-        "proxies:\n"
-        "    libtmrm_bottom: {libtmrm_bottom: libtmrm_bottom}\n"
-        "    ontology: {libtmrm_bottom: 'libtmrm:ontology'}\n"
-        "    ontology_version_major: {libtmrm_bottom: 'libtmrm:ontology-version-major'}\n"
-        "    ontology_version_minor: {libtmrm_bottom: 'libtmrm:ontology-version-minor'}\n"
-        "    bootstrap:\n"
-        "        ontology: 'bootstrap'\n"
-        "        ontology_version_major: 0\n"
-        "        ontology_version_minor: 1\n"
-        "    superclass: {libtmrm_bottom: 'libtmrm:superclass'}\n"
-        "    subclass: {libtmrm_bottom: 'libtmrm:subclass'}\n"
-        "    type: {libtmrm_bottom: 'libtmrm:type'}\n"
-        "    instance: {libtmrm_bottom: 'libtmrm:instance'}\n"
-        "...\n";
+    const unsigned char* bootstrap_ontology =
+        (unsigned char*)TMRM_STORAGE_BOOTSTRAP_ONTOLOGY;
 
     c = (tmrm_storage_pgsql_context*)TMRM_CALLOC(tmrm_storage_pgsql_context, 1,
             sizeof(tmrm_storage_pgsql_context));
@@ -436,6 +529,8 @@ tmrm_storage_pgsql_free(tmrm_storage* s)
     if (c->conn != NULL)
         PQfinish(c->conn);
     c->conn = NULL;
+    while (c->idle_count > 0) PQfinish(c->idle[--c->idle_count]);
+    if (c->idle) TMRM_FREE(PGconn*, c->idle);
 
     TMRM_FREE(tmrm_storage_pgsql_context, s->context);
 }
@@ -528,17 +623,17 @@ tmrm_storage_pgsql_proxy_create(tmrm_storage* storage, tmrm_subject_map* map)
     tmrm_proxy* new_proxy;
     tmrm_label proxy;
 
-    new_proxy = (tmrm_proxy*)TMRM_CALLOC(tmrm_proxy, 1, sizeof(tmrm_proxy));
+    new_proxy = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
     if (!new_proxy) {
         return NULL;
     }
     proxy = _proxy_get_new_id(storage);
     if (proxy == 0 || !(new_proxy = _create_proxy_struct(map, proxy))) {
-        TMRM_FREE(tmrm_proxy, new_proxy);
+        TMRM_POOL_FREE(tmrm_proxy, TMRM_POOL_PROXY, new_proxy);
         return NULL;
     }
     if (_create_proxy(storage, proxy)) {
-        TMRM_FREE(tmrm_proxy, new_proxy);
+        TMRM_POOL_FREE(tmrm_proxy, TMRM_POOL_PROXY, new_proxy);
         return NULL;
     }
     return new_proxy;
@@ -684,7 +779,7 @@ tmrm_storage_pgsql_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_pro
     (void)snprintf(query, len, statement, (int)p->label, (int)key->label);
 
     paramValues[0] = (char*)(value->value);
-    paramValues[1] = (char*)(value->datatype);
+    paramValues[1] = (char*)tmrm_literal_datatype(value);
     if(!(res = PQexecParams(c->conn, (const char*)query, 2,
                     NULL /* Let the backend deduce the param type */,
                     paramValues,
@@ -831,11 +926,99 @@ tmrm_storage_pgsql_proxy_properties(tmrm_storage* s, tmrm_proxy* p)
 }
 
 
+/*
+ * Reads all proxies with their properties through one cursor, ordered by
+ * proxy. Proxies without properties come with a single row of NULLs. The
+ * literal strings passed to the visitor point into the fetched result.
+ */
+static int
+tmrm_storage_pgsql_scan_properties(tmrm_storage* s, tmrm_subject_map* map,
+        const tmrm_property_visitor* visitor, void* data)
+{
+    char declare[] = "DECLARE tmrm_scan NO SCROLL CURSOR FOR "
+        "SELECT p.id, r.key, r.value, r.value_literal, r.datatype "
+        "FROM proxy p LEFT JOIN property r ON r.proxy = p.id "
+        "ORDER BY p.id";
+    char fetch[64];
+    PGresult* res;
+    ExecStatusType status;
+    int i, rows, proxy, last = 0, first = 1, ret = 0;
+
+    tmrm_storage_pgsql_context* c = (tmrm_storage_pgsql_context*)s->context;
+    if (!c) {
+        return 1;
+    }
+
+    /* Cursors only live inside a transaction */
+    if (_exec_sql(s, "BEGIN READ ONLY") != 0) {
+        return 1;
+    }
+    if (_exec_sql(s, declare) != 0) {
+        (void)_exec_sql(s, "ROLLBACK");
+        return 1;
+    }
+    (void)snprintf(fetch, sizeof(fetch), "FETCH FORWARD %d FROM tmrm_scan",
+            TMRM_PGSQL_SCAN_FETCH_SIZE);
+
+    do {
+        if (!(res = PQexec(c->conn, fetch))) {
+            fprintf(stdout, "postgresql scan failed: %s\n",
+                    PQerrorMessage(c->conn));
+            ret = 1;
+            break;
+        }
+        status = PQresultStatus(res);
+        if (status != PGRES_TUPLES_OK) {
+            fprintf(stdout, "postgresql failed: '%s': %s / %s\n",
+                    fetch, PQresStatus(status), PQresultErrorMessage(res));
+            PQclear(res);
+            ret = 1;
+            break;
+        }
+        rows = PQntuples(res);
+        for (i = 0; i < rows && ret == 0; i++) {
+            proxy = atoi(PQgetvalue(res, i, 0));
+            if (first || proxy != last) {
+                ret = visitor->proxy(data, (tmrm_label)proxy);
+                first = 0;
+                last = proxy;
+                if (ret) break;
+            }
+            if (PQgetisnull(res, i, 1)) {
+                /* proxy without properties */
+                continue;
+            }
+            if (!PQgetisnull(res, i, 2)) {
+                ret = visitor->property(data, (tmrm_label)proxy,
+                        (tmrm_label)atoi(PQgetvalue(res, i, 1)),
+                        (tmrm_label)atoi(PQgetvalue(res, i, 2)));
+            } else {
+                ret = visitor->property_literal(data, (tmrm_label)proxy,
+                        (tmrm_label)atoi(PQgetvalue(res, i, 1)),
+                        (const tmrm_char_t*)PQgetvalue(res, i, 3),
+                        (const tmrm_char_t*)PQgetvalue(res, i, 4));
+            }
+        }
+        PQclear(res);
+    } while (ret == 0 && rows == TMRM_PGSQL_SCAN_FETCH_SIZE);
+
+    if (ret == 0) {
+        if (_exec_sql(s, "CLOSE tmrm_scan") != 0 ||
+                _exec_sql(s, "COMMIT") != 0) {
+            ret = 1;
+        }
+    } else {
+        (void)_exec_sql(s, "ROLLBACK");
+    }
+    return ret;
+}
+
+
 static tmrm_proxy*
 tmrm_storage_pgsql_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
         const char* label)
 {
-    char statement[] = "SELECT id FROM proxy WHERE id=$1";
+    char statement[] = TMRM_PGSQL_PROXY_BY_LABEL;
     PGresult* res;
     ExecStatusType status;
     const char* paramValues[1];
@@ -980,7 +1163,7 @@ tmrm_storage_pgsql_proxy_keys(tmrm_storage* s, tmrm_proxy* p)
 static tmrm_iterator*
 tmrm_storage_pgsql_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
 {
-    char statement[] = "SELECT value, value_literal, datatype FROM property WHERE proxy=%d";
+    char statement[] = TMRM_PGSQL_VALUES_BY_KEY;
     char *query;
     PGresult* res;
     ExecStatusType status;
@@ -991,12 +1174,12 @@ tmrm_storage_pgsql_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_prox
     tmrm_storage_pgsql_context* c = (tmrm_storage_pgsql_context*)s->context;
     if (!c) return NULL;
 
-    len = strlen(statement) + 1 * INT_DIGITS;
+    len = strlen(statement) + 2 * INT_DIGITS;
     if (!(query = (char*)TMRM_MALLOC(cstring, len + 1))) {
         return NULL;
     }
 
-    (void)snprintf(query, len, statement, (int)p->label);
+    (void)snprintf(query, len, statement, (int)p->label, (int)key->label);
 
     if(!(res = PQexec(c->conn, query))) {
         fprintf(stdout, "postgresql select proxy keys failed: %s\n",
@@ -1044,7 +1227,7 @@ tmrm_storage_pgsql_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_prox
 static tmrm_iterator*
 tmrm_storage_pgsql_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
 {
-    char statement[] = "SELECT proxy FROM property WHERE key=%d AND value=%d";
+    char statement[] = TMRM_PGSQL_IS_VALUE_BY_KEY;
     char* query;
     size_t len;
     tmrm_iterator* iterator;
@@ -1062,7 +1245,7 @@ tmrm_storage_pgsql_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_pr
 static tmrm_iterator*
 tmrm_storage_pgsql_proxy_keys_by_value(tmrm_storage* s, tmrm_proxy* p)
 {
-    char statement[] = "SELECT key FROM property WHERE value=%d";
+    char statement[] = TMRM_PGSQL_KEYS_BY_VALUE;
     char* query;
     size_t len;
     tmrm_iterator* iterator;
@@ -1152,6 +1335,205 @@ tmrm_storage_pgsql_proxy_by_literal(tmrm_storage* s, tmrm_literal* lit, tmrm_pro
 }
 
 
+/*
+ * Builds a PostgreSQL array literal from the labels of the proxies in
+ * values, or from the values (or datatypes) of the literals.
+ * Returns NULL on failure.
+ */
+static char*
+_sql_array(tmrm_object* const* values, int count, tmrm_object_type type,
+        int datatype)
+{
+    const char *str, *c;
+    char *array, *out;
+    size_t len = 3;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (tmrm_object_get_type(values[i]) != type) continue;
+        if (type == TMRM_TYPE_PROXY) {
+            len += INT_DIGITS + 1;
+        } else {
+            str = (const char*)(datatype ?
+                tmrm_literal_datatype((tmrm_literal*)values[i]) :
+                tmrm_literal_value((tmrm_literal*)values[i]));
+            len += (str ? 2 * strlen(str) + 3 : 5);
+        }
+    }
+    if (!(array = (char*)TMRM_MALLOC(cstring, len))) return NULL;
+
+    out = array;
+    *out++ = '{';
+    for (i = 0; i < count; i++) {
+        if (tmrm_object_get_type(values[i]) != type) continue;
+        if (out > array + 1) *out++ = ',';
+        if (type == TMRM_TYPE_PROXY) {
+            out += sprintf(out, "%d", (int)((tmrm_proxy*)values[i])->label);
+            continue;
+        }
+        str = (const char*)(datatype ?
+            tmrm_literal_datatype((tmrm_literal*)values[i]) :
+            tmrm_literal_value((tmrm_literal*)values[i]));
+        if (!str) {
+            out += sprintf(out, "NULL");
+            continue;
+        }
+        *out++ = '"';
+        for (c = str; *c; c++) {
+            if (*c == '"' || *c == '\\') *out++ = '\\';
+            *out++ = *c;
+        }
+        *out++ = '"';
+    }
+    *out++ = '}';
+    *out = '\0';
+    return array;
+}
+
+
+/*
+ * Answers proxy_is_value_by_key and literal_is_value_by_key for all values
+ * with one query. The inputs are joined rather than matched with ANY, so
+ * that duplicates in values yield their matches more than once, just as
+ * separate queries would.
+ */
+static tmrm_iterator*
+tmrm_storage_pgsql_is_value_by_key_many(tmrm_storage* s,
+        tmrm_object* const* values, int count, tmrm_proxy* key)
+{
+    char statement[] = "SELECT r.proxy FROM property r "
+        "JOIN unnest($1::integer[]) AS v(id) ON r.value=v.id "
+        "WHERE r.key=%d "
+        "UNION ALL "
+        "SELECT r.proxy FROM property r "
+        "JOIN (SELECT unnest($2::text[]) AS value, "
+        "unnest($3::text[]) AS datatype) l "
+        "ON r.value_literal=l.value AND r.datatype=l.datatype "
+        "WHERE r.key=%d";
+    char *query;
+    char *arrays[3];
+    size_t len;
+    tmrm_iterator* iterator = NULL;
+    int i;
+
+    arrays[0] = _sql_array(values, count, TMRM_TYPE_PROXY, 0);
+    arrays[1] = _sql_array(values, count, TMRM_TYPE_LITERAL, 0);
+    arrays[2] = _sql_array(values, count, TMRM_TYPE_LITERAL, 1);
+
+    len = strlen(statement) + 2 * INT_DIGITS;
+    query = (char*)TMRM_MALLOC(cstring, len + 1);
+    if (query && arrays[0] && arrays[1] && arrays[2]) {
+        (void)snprintf(query, len, statement, (int)key->label,
+                (int)key->label);
+        iterator = _iterator_by_sql_query_params(s, key->subject_map, query,
+                (const char* const*)arrays, 3);
+    }
+    if (query) TMRM_FREE(cstring, query);
+    for (i = 0; i < 3; i++) {
+        if (arrays[i]) TMRM_FREE(cstring, arrays[i]);
+    }
+    return iterator;
+}
+
+
+/*
+ * Evaluates the path steps with a single query: each step joins the
+ * property table once more. The Kleene star becomes a recursive query,
+ * whose UNION drops the duplicates like the evaluation in tmrm_path.c
+ * does. Rows are (proxy, literal value, datatype), as for
+ * tmrm_storage_pgsql_value_list_get_element().
+ */
+static tmrm_iterator*
+tmrm_storage_pgsql_path(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_object* const* values, int count,
+        const tmrm_path_step* steps, int step_count, int closure)
+{
+    const char source[] = "(SELECT unnest($1::integer[]) AS id, "
+        "NULL::text AS lit, NULL::text AS dt UNION ALL "
+        "SELECT NULL, unnest($2::text[]), unnest($3::text[])) s";
+    char id[32], lit[32], dt[32];
+    char *query, *joins, *out;
+    char *arrays[3];
+    size_t len;
+    tmrm_iterator* iterator = NULL;
+    int i, k, may_be_literal = 1;
+
+    /* Upper bound of the length of the joins */
+    len = 1;
+    for (i = 0; i < step_count; i++) {
+        len += 256 + steps[i].key_count * (INT_DIGITS + 1);
+    }
+    if (!(joins = (char*)TMRM_MALLOC(cstring, len))) return NULL;
+    out = joins;
+    *out = '\0';
+    strcpy(id, "s.id");
+    strcpy(lit, "s.lit");
+    strcpy(dt, "s.dt");
+    for (i = 0; i < step_count; i++) {
+        out += sprintf(out, "JOIN property r%d ON ", i);
+        if (steps[i].key_count == 1) {
+            out += sprintf(out, "r%d.key=%d AND ", i, (int)steps[i].keys[0]);
+        } else if (steps[i].key_count > 1) {
+            out += sprintf(out, "r%d.key IN (", i);
+            for (k = 0; k < steps[i].key_count; k++) {
+                out += sprintf(out, k ? ",%d" : "%d", (int)steps[i].keys[k]);
+            }
+            out += sprintf(out, ") AND ");
+        }
+        if (steps[i].axis == TMRM_PATH_AXIS_VALUES_BY_KEY) {
+            out += sprintf(out, "r%d.proxy=%s ", i, id);
+            sprintf(id, "r%d.value", i);
+            sprintf(lit, "r%d.value_literal", i);
+            sprintf(dt, "r%d.datatype", i);
+            may_be_literal = 1;
+            continue;
+        }
+        out += sprintf(out, "(r%d.value=%s", i, id);
+        if (may_be_literal) {
+            out += sprintf(out, " OR (r%d.value_literal=%s AND "
+                    "r%d.datatype=%s)", i, lit, i, dt);
+        }
+        out += sprintf(out, ") ");
+        sprintf(id, steps[i].axis == TMRM_PATH_AXIS_KEYS_BY_VALUE ?
+                "r%d.key" : "r%d.proxy", i);
+        strcpy(lit, "NULL::text");
+        strcpy(dt, "NULL::text");
+        may_be_literal = 0;
+    }
+
+    len = strlen(source) + strlen(joins) + 3 * 32 + 256;
+    if (!(query = (char*)TMRM_MALLOC(cstring, len))) {
+        TMRM_FREE(cstring, joins);
+        return NULL;
+    }
+    if (closure) {
+        (void)snprintf(query, len, "WITH RECURSIVE c(id, lit, dt) AS ("
+                "SELECT id, lit, dt FROM %s UNION "
+                "SELECT %s, %s, %s FROM c s %s) "
+                "SELECT id, lit, dt FROM c", source, id, lit, dt, joins);
+    } else {
+        (void)snprintf(query, len, "SELECT %s, %s, %s FROM %s %s",
+                id, lit, dt, source, joins);
+    }
+    TMRM_FREE(cstring, joins);
+
+    arrays[0] = _sql_array(values, count, TMRM_TYPE_PROXY, 0);
+    arrays[1] = _sql_array(values, count, TMRM_TYPE_LITERAL, 0);
+    arrays[2] = _sql_array(values, count, TMRM_TYPE_LITERAL, 1);
+    if (arrays[0] && arrays[1] && arrays[2]) {
+        TMRM_DEBUG2("Path query: %s\n", query);
+        iterator = _iterator_by_sql(s, map, query,
+                (const char* const*)arrays, 3,
+                tmrm_storage_pgsql_value_list_get_element);
+    }
+    TMRM_FREE(cstring, query);
+    for (i = 0; i < 3; i++) {
+        if (arrays[i]) TMRM_FREE(cstring, arrays[i]);
+    }
+    return iterator;
+}
+
+
 /**
  * Helper function to iterate over a list of proxies.
  */
@@ -1204,7 +1586,7 @@ tmrm_storage_pgsql_proxy_list_get_element(void* context, tmrm_iterator_flag flag
 
     /* TMRM_DEBUG2("get_element(): Found proxy with id %d\n", proxy_id); */
 
-    new_proxy = (tmrm_proxy*)TMRM_CALLOC(tmrm_proxy, 1, sizeof(tmrm_proxy));
+    new_proxy = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
     if (!new_proxy) {
         return NULL;
     }
@@ -1247,7 +1629,8 @@ tmrm_storage_pgsql_value_list_get_element(void* context, tmrm_iterator_flag flag
         /* FIXME: Encode UTF-8? */
         value_literal_str = (tmrm_char_t*)PQgetvalue(c->res, c->current_row, 1);
         value_datatype_str = (tmrm_char_t*)PQgetvalue(c->res, c->current_row, 2);
-        new_literal = tmrm_literal_new(value_literal_str, value_datatype_str);
+        new_literal = tmrm_literal_new_borrowed(value_literal_str,
+                value_datatype_str, &c->owner);
         obj = tmrm_literal_to_object(new_literal);
         return obj;
     } else {
@@ -1255,7 +1638,7 @@ tmrm_storage_pgsql_value_list_get_element(void* context, tmrm_iterator_flag flag
         proxy_id_str = PQgetvalue(c->res, c->current_row, 0);
         proxy_id = atoi(proxy_id_str);
         /*TMRM_DEBUG2("get_element(): Found proxy with id %d\n", proxy_id);*/
-        new_proxy = (tmrm_proxy*)TMRM_CALLOC(tmrm_proxy, 1, sizeof(tmrm_proxy));
+        new_proxy = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
         if (!new_proxy) {
             return NULL;
         }
@@ -1304,9 +1687,9 @@ tmrm_storage_pgsql_property_get_element(void* context, tmrm_iterator_flag flag)
                     /* FIXME: Encode UTF-8? */
                     value_literal_str = (tmrm_char_t*)PQgetvalue(c->res, c->current_row, 2);
                     value_datatype_str = (tmrm_char_t*)PQgetvalue(c->res, c->current_row, 3);
-                    lit = tmrm_literal_new(
+                    lit = tmrm_literal_new_borrowed(
                             value_literal_str,
-                            value_datatype_str);
+                            value_datatype_str, &c->owner);
                     obj = tmrm_literal_to_object(lit);
                     return obj;
                 } else {
@@ -1327,8 +1710,19 @@ tmrm_storage_pgsql_property_get_element(void* context, tmrm_iterator_flag flag)
 }
 
 
+static void
+tmrm_storage_pgsql_result_release(tmrm_literal_owner* owner)
+{
+    tmrm_storage_pgsql_iterator_context *c;
+    c = (tmrm_storage_pgsql_iterator_context*)owner;
+
+    PQclear(c->res);
+    TMRM_FREE(tmrm_storage_pgsql_iterator_context, c);
+}
+
 /**
- * Helper function to iterate over a list of proxies.
+ * Helper function to iterate over a list of proxies. The result is
+ * cleared once the literals that were read from it have been freed.
  */
 static void
 tmrm_storage_pgsql_list_free(void* context)
@@ -1336,8 +1730,8 @@ tmrm_storage_pgsql_list_free(void* context)
     tmrm_storage_pgsql_iterator_context *c;
     c = (tmrm_storage_pgsql_iterator_context*)context;
 
-    PQclear(c->res);
-    /* TMRM_FREE(xxx_context, c); */
+    c->owner.release = tmrm_storage_pgsql_result_release;
+    tmrm_literal_owner_close(&c->owner);
 }
 
 static int
@@ -1510,7 +1904,7 @@ _create_proxy_struct(tmrm_subject_map* m, tmrm_label label)
 {
     tmrm_proxy *p;
 
-    p = (tmrm_proxy*)TMRM_CALLOC(tmrm_proxy, 1, sizeof(tmrm_proxy));
+    p = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
     if (!p) {
         return NULL;
     }
@@ -1520,6 +1914,123 @@ _create_proxy_struct(tmrm_subject_map* m, tmrm_label label)
     return p;
 }
 
+/**
+ * Installs the trigger that announces property changes on
+ * TMRM_PGSQL_NOTIFY_CHANNEL, unless the database has it already, and
+ * listens on the channel. The trigger sees every write, including the
+ * writes of clients that do not enable notify.
+ *
+ * @returns 0 on success
+ */
+static int
+_notify_setup(tmrm_storage* s)
+{
+    PGresult* res;
+    int exists;
+    tmrm_storage_pgsql_context* c = (tmrm_storage_pgsql_context*)s->context;
+
+    res = PQexec(c->conn,
+            "SELECT 1 FROM pg_trigger WHERE tgname = 'tmrm_property_notify'");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Looking up the notify trigger failed: %s",
+                PQresultErrorMessage(res));
+        PQclear(res);
+        return 1;
+    }
+    exists = PQntuples(res) > 0;
+    PQclear(res);
+
+    if (!exists && _exec_sql(s, "BEGIN;" TMRM_PGSQL_NOTIFY_TRIGGER "COMMIT;")) {
+        return 1;
+    }
+    return _exec_sql(s, "LISTEN " TMRM_PGSQL_NOTIFY_CHANNEL);
+}
+
+
+/**
+ * Reads the notifications that arrived since the last call without
+ * blocking, and passes the changes of other connections to changed.
+ *
+ * @returns 0 on success
+ */
+static int
+tmrm_storage_pgsql_poll_changes(tmrm_storage* s,
+        void (*changed)(void* data, tmrm_label proxy, tmrm_label key,
+            const tmrm_label* value),
+        void* data)
+{
+    PGnotify* n;
+    int pid, proxy, key, value;
+    tmrm_storage_pgsql_context* c = (tmrm_storage_pgsql_context*)s->context;
+
+    if (!c || !c->notify) return 0;
+    if (!PQconsumeInput(c->conn)) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Reading notifications failed: %s",
+                PQerrorMessage(c->conn));
+        return 1;
+    }
+    pid = PQbackendPID(c->conn);
+    while ((n = PQnotifies(c->conn)) != NULL) {
+        /* Our own writes have been handled by the caller already */
+        if (n->be_pid != pid) {
+            switch (sscanf(n->extra, "%d %d %d", &proxy, &key, &value)) {
+                case 3:
+                    changed(data, (tmrm_label)proxy, (tmrm_label)key,
+                            (const tmrm_label*)&value);
+                    break;
+                case 2:
+                    changed(data, (tmrm_label)proxy, (tmrm_label)key, NULL);
+                    break;
+                default:
+                    TMRM_DEBUG2("Invalid notification '%s'\n", n->extra);
+                    break;
+            }
+        }
+        PQfreemem(n);
+    }
+    return 0;
+}
+
+
+/* Runs a statement in a tracing span (see tmrm_trace_begin()). Statements
+   with params go through PQexecParams(). */
+static PGresult*
+_exec_traced(tmrm_storage* s, PGconn* conn, const char* query, int params,
+        const char* const* param_values, int param_count)
+{
+    PGresult* res;
+    ExecStatusType status;
+    tmrm_span span;
+    int traced, failed = 1;
+    long rows = -1;
+
+    traced = tmrm_trace_begin(s, &span, "sql", 0, 0, query);
+    if (params) {
+        res = PQexecParams(conn, query, param_count,
+                NULL /* Let the backend deduce the param type */,
+                param_values,
+                NULL, /* don’t need param lengths since text */
+                NULL, /* default to all text params */
+                0 /* ask for text results */);
+    } else {
+        res = PQexec(conn, query);
+    }
+    if (!traced) return res;
+    if (res) {
+        status = PQresultStatus(res);
+        if (status == PGRES_TUPLES_OK) {
+            rows = PQntuples(res);
+            failed = 0;
+        } else if (status == PGRES_COMMAND_OK) {
+            rows = atol(PQcmdTuples(res));
+            failed = 0;
+        }
+    }
+    tmrm_trace_end(s, &span, failed, rows);
+    return res;
+}
+
+
 /**
 * Executes a query without parameters. Returns 0 on success, or a non-zero
 * value on failure.
@@ -1535,7 +2046,7 @@ _exec_sql(tmrm_storage* s, const char* query)
         return 1;
     }
 
-    if(!(res = PQexec(c->conn, query))) {
+    if(!(res = _exec_traced(s, c->conn, query, 0, NULL, 0))) {
         fprintf(stdout, "postgresql query failed: '%s': %s\n",
             query,
             PQresultErrorMessage(res));
@@ -1568,7 +2079,7 @@ _iterator_by_sql_query(tmrm_storage* s, tmrm_subject_map* subject_map, const cha
         return NULL;
     }
 
-    if(!(res = PQexec(c->conn, query))) {
+    if(!(res = _exec_traced(s, c->conn, query, 0, NULL, 0))) {
         fprintf(stdout, "postgresql select proxy keys failed: %s\n",
             PQresultErrorMessage(res));
         PQclear(res);
@@ -1613,23 +2124,29 @@ _iterator_by_sql_query(tmrm_storage* s, tmrm_subject_map* subject_map, const cha
 static tmrm_iterator*
 _iterator_by_sql_query_params(tmrm_storage* s, tmrm_subject_map *subject_map,
         const char* query, const char* const *param_values, int param_count)
+{
+    return _iterator_by_sql(s, subject_map, query, param_values, param_count,
+            tmrm_storage_pgsql_proxy_list_get_element);
+}
+
+
+/* Runs the query and returns an iterator that reads its rows with
+   get_element */
+static tmrm_iterator*
+_iterator_by_sql(tmrm_storage* s, tmrm_subject_map *subject_map,
+        const char* query, const char* const *param_values, int param_count,
+        tmrm_object* (*get_element)(void*, tmrm_iterator_flag))
 {
     PGresult* res;
     ExecStatusType status;
-    tmrm_iterator *iterator;
-    tmrm_storage_pgsql_iterator_context *context;
 
     tmrm_storage_pgsql_context* c = (tmrm_storage_pgsql_context*)s->context;
     if (!c) {
         return NULL;
     }
 
-    if(!(res = PQexecParams(c->conn, query, param_count,
-            NULL /* Let the backend deduce the param type */,
-            param_values,
-            NULL, /* don’t need param lengths since text */ 
-            NULL, /* default to all text params */ 
-            0 /* ask for text results */))) {
+    if(!(res = _exec_traced(s, c->conn, query, 1, param_values,
+                    param_count))) {
         fprintf(stdout, "postgresql select proxy keys failed: %s\n",
             PQresultErrorMessage(res));
         PQclear(res);
@@ -1644,6 +2161,20 @@ _iterator_by_sql_query_params(tmrm_storage* s, tmrm_subject_map *subject_map,
         return NULL;
     }
 
+    return _iterator_by_result(s, subject_map, res, get_element);
+}
+
+
+/* Returns an iterator that reads the rows of res with get_element and
+   clears res when it is done. Clears res on failure. */
+static tmrm_iterator*
+_iterator_by_result(tmrm_storage* s, tmrm_subject_map *subject_map,
+        PGresult* res,
+        tmrm_object* (*get_element)(void*, tmrm_iterator_flag))
+{
+    tmrm_iterator *iterator;
+    tmrm_storage_pgsql_iterator_context *context;
+
     context = (tmrm_storage_pgsql_iterator_context*)
         TMRM_CALLOC(tmrm_storage_pgsql_iterator_context, 1,
             sizeof(tmrm_storage_pgsql_iterator_context));
@@ -1663,7 +2194,7 @@ _iterator_by_sql_query_params(tmrm_storage* s, tmrm_subject_map *subject_map,
     iterator = tmrm_iterator_new(s->subject_map_sphere, (void*)context, 
         tmrm_storage_pgsql_list_next,
         tmrm_storage_pgsql_list_end,
-        tmrm_storage_pgsql_proxy_list_get_element,
+        get_element,
         tmrm_storage_pgsql_list_free);
 
     /* Note that we don't have to call PQclear(res) here. */
@@ -1671,11 +2202,225 @@ _iterator_by_sql_query_params(tmrm_storage* s, tmrm_subject_map *subject_map,
 }
 
 
+/* Hands the statement of q to libpq once the connection is up */
+static int
+_query_dispatch(tmrm_storage_query* q)
+{
+    tmrm_storage_pgsql_query* pq = (tmrm_storage_pgsql_query*)q->context;
+    const char* params[1];
+
+    params[0] = pq->param;
+    if (!PQsendQueryParams(pq->conn, pq->sql, pq->param ? 1 : 0, NULL,
+                params, NULL, NULL, 0)) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Sending query '%s' failed: %s", pq->sql,
+                PQerrorMessage(pq->conn));
+        return 1;
+    }
+    pq->sent = 1;
+    return 0;
+}
+
+
+/**
+ * Starts a read on a connection of its own, so that it neither blocks the
+ * caller nor waits for the connection of the storage. The connection is
+ * taken from the idle ones, or established with PQconnectStart().
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int
+tmrm_storage_pgsql_query_send(tmrm_storage* s, tmrm_storage_query* q,
+        tmrm_proxy* p, tmrm_proxy* key, const char* label)
+{
+    tmrm_storage_pgsql_query* pq;
+    const char* statement;
+    size_t len;
+    tmrm_storage_pgsql_context* c = (tmrm_storage_pgsql_context*)s->context;
+    if (!c) return 1;
+
+    pq = (tmrm_storage_pgsql_query*)TMRM_CALLOC(tmrm_storage_pgsql_query, 1,
+            sizeof(tmrm_storage_pgsql_query));
+    if (!pq) return 1;
+    q->context = pq;
+    pq->get_element = tmrm_storage_pgsql_proxy_list_get_element;
+    switch (q->op) {
+        case TMRM_STORAGE_OP_PROXY_BY_LABEL:
+            /* Invalid labels are left to the blocking read */
+            if (atoi(label) == 0 && (strlen(label) == 0 || label[0] != '0')) {
+                return 1;
+            }
+            statement = TMRM_PGSQL_PROXY_BY_LABEL;
+            len = strlen(label);
+            if (!(pq->param = (char*)TMRM_MALLOC(cstring, len + 1))) {
+                return 1;
+            }
+            memcpy(pq->param, label, len + 1);
+            break;
+        case TMRM_STORAGE_OP_PROXY_VALUES_BY_KEY:
+            statement = TMRM_PGSQL_VALUES_BY_KEY;
+            pq->get_element = tmrm_storage_pgsql_value_list_get_element;
+            break;
+        case TMRM_STORAGE_OP_PROXY_IS_VALUE_BY_KEY:
+            statement = TMRM_PGSQL_IS_VALUE_BY_KEY;
+            break;
+        case TMRM_STORAGE_OP_PROXY_KEYS_BY_VALUE:
+            statement = TMRM_PGSQL_KEYS_BY_VALUE;
+            break;
+        default:
+            return 1;
+    }
+    len = strlen(statement) + 2 * INT_DIGITS;
+    if (!(pq->sql = (char*)TMRM_MALLOC(cstring, len + 1))) {
+        return 1;
+    }
+    /* is_value_by_key names the key first */
+    if (q->op == TMRM_STORAGE_OP_PROXY_IS_VALUE_BY_KEY) {
+        (void)snprintf(pq->sql, len, statement, (int)key->label,
+                (int)p->label);
+    } else if (p) {
+        (void)snprintf(pq->sql, len, statement, (int)p->label,
+                key ? (int)key->label : 0);
+    } else {
+        (void)snprintf(pq->sql, len, "%s", statement);
+    }
+
+    if (c->idle_count > 0) {
+        pq->conn = c->idle[--c->idle_count];
+        q->fd = PQsocket(pq->conn);
+        return _query_dispatch(q);
+    }
+    pq->conn = PQconnectStart(c->conninfo);
+    if (!pq->conn || PQstatus(pq->conn) == CONNECTION_BAD) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Connection to postgresql database failed: %s",
+                pq->conn ? PQerrorMessage(pq->conn) : "out of memory");
+        return 1;
+    }
+    /* PQconnectPoll() has to be called once the socket is writable */
+    pq->connecting = 1;
+    q->fd = PQsocket(pq->conn);
+    q->want_write = 1;
+    return 0;
+}
+
+
+/**
+ * Advances the connection of q, sends its statement and reads the result
+ * as far as data has arrived, without blocking. The connection is ready
+ * for the next query once libpq has returned all results.
+ *
+ * @returns 1 while the query runs, 0 once q->result is set
+ */
+static int
+tmrm_storage_pgsql_query_poll(tmrm_storage* s, tmrm_storage_query* q)
+{
+    tmrm_storage_pgsql_query* pq = (tmrm_storage_pgsql_query*)q->context;
+    PGresult* res;
+    int flush;
+
+    if (pq->connecting) {
+        switch (PQconnectPoll(pq->conn)) {
+            case PGRES_POLLING_READING:
+                q->fd = PQsocket(pq->conn);
+                q->want_write = 0;
+                return 1;
+            case PGRES_POLLING_WRITING:
+                q->fd = PQsocket(pq->conn);
+                q->want_write = 1;
+                return 1;
+            case PGRES_POLLING_OK:
+                pq->connecting = 0;
+                q->fd = PQsocket(pq->conn);
+                if (PQsetnonblocking(pq->conn, 1) || _query_dispatch(q)) {
+                    return 0;
+                }
+                break;
+            default:
+                TMRM_LOG(TMRM_LOG_ERROR,
+                        "Connection to postgresql database failed: %s",
+                        PQerrorMessage(pq->conn));
+                return 0;
+        }
+    }
+    if (!pq->sent) return 0;
+
+    /* Statements that did not fit into the socket buffer at once */
+    if ((flush = PQflush(pq->conn)) != 0) {
+        q->want_write = 1;
+        return flush > 0 ? 1 : 0;
+    }
+    q->want_write = 0;
+    if (!PQconsumeInput(pq->conn)) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Reading query '%s' failed: %s", pq->sql,
+                PQerrorMessage(pq->conn));
+        return 0;
+    }
+    while (!PQisBusy(pq->conn)) {
+        if (!(res = PQgetResult(pq->conn))) {
+            pq->sent = 0;
+            if (pq->res && PQresultStatus(pq->res) == PGRES_TUPLES_OK) {
+                q->result = _iterator_by_result(s, q->map, pq->res,
+                        pq->get_element);
+                pq->res = NULL;
+            } else if (pq->res) {
+                TMRM_LOG(TMRM_LOG_ERROR, "Query '%s' failed: %s / %s",
+                        pq->sql, PQresStatus(PQresultStatus(pq->res)),
+                        PQresultErrorMessage(pq->res));
+            }
+            return 0;
+        }
+        if (pq->res) {
+            PQclear(res);
+        } else {
+            pq->res = res;
+        }
+    }
+    return 1;
+}
+
+
+/* Frees q. Its connection is kept for the next query if the query has
+   finished, and closed otherwise, which cancels the query. */
+static void
+tmrm_storage_pgsql_query_free(tmrm_storage* s, tmrm_storage_query* q)
+{
+    tmrm_storage_pgsql_query* pq = (tmrm_storage_pgsql_query*)q->context;
+    PGconn** idle;
+    int max;
+    tmrm_storage_pgsql_context* c = (tmrm_storage_pgsql_context*)s->context;
+
+    if (!pq) return;
+    if (pq->conn && c && !pq->connecting && !pq->sent &&
+            PQstatus(pq->conn) == CONNECTION_OK &&
+            PQtransactionStatus(pq->conn) == PQTRANS_IDLE) {
+        if (c->idle_count == c->idle_max) {
+            max = c->idle_max ? 2 * c->idle_max : 4;
+            if ((idle = (PGconn**)TMRM_REALLOC(PGconn*, c->idle,
+                            max * sizeof(PGconn*)))) {
+                c->idle = idle;
+                c->idle_max = max;
+            }
+        }
+        if (c->idle_count < c->idle_max) {
+            c->idle[c->idle_count++] = pq->conn;
+            pq->conn = NULL;
+        }
+    }
+    if (pq->conn) PQfinish(pq->conn);
+    if (pq->res) PQclear(pq->res);
+    if (pq->sql) TMRM_FREE(cstring, pq->sql);
+    if (pq->param) TMRM_FREE(cstring, pq->param);
+    TMRM_FREE(tmrm_storage_pgsql_query, pq);
+    q->context = NULL;
+}
+
+
 static void
 tmrm_storage_pgsql_register_factory(tmrm_storage_factory *factory)
 {
     factory->init = tmrm_storage_pgsql_init;
     factory->free = tmrm_storage_pgsql_free;
+    /* A connection must not be used by two threads at once */
+    factory->concurrency = TMRM_STORAGE_SERIALIZED;
 
     factory->bootstrap = tmrm_storage_pgsql_bootstrap;
     factory->remove = tmrm_storage_pgsql_remove;
@@ -1688,6 +2433,8 @@ tmrm_storage_pgsql_register_factory(tmrm_storage_factory *factory)
     factory->proxy_remove_properties_by_key = tmrm_storage_pgsql_proxy_remove_properties_by_key;
     factory->proxy_properties = tmrm_storage_pgsql_proxy_properties;
     factory->proxy_remove = tmrm_storage_pgsql_proxy_remove;
+    factory->scan_properties = tmrm_storage_pgsql_scan_properties;
+    factory->poll_changes = tmrm_storage_pgsql_poll_changes;
     factory->proxy_by_label = tmrm_storage_pgsql_proxy_by_label;
     factory->proxies = tmrm_storage_pgsql_proxies;
     factory->proxy_label = tmrm_storage_pgsql_proxy_label;
@@ -1697,12 +2444,17 @@ tmrm_storage_pgsql_register_factory(tmrm_storage_factory *factory)
     factory->proxy_keys_by_value = tmrm_storage_pgsql_proxy_keys_by_value;
     factory->literal_keys_by_value = tmrm_storage_pgsql_literal_keys_by_value;
     factory->literal_is_value_by_key = tmrm_storage_pgsql_literal_is_value_by_key;
+    factory->is_value_by_key_many = tmrm_storage_pgsql_is_value_by_key_many;
+    factory->path = tmrm_storage_pgsql_path;
     factory->proxy_add_type = tmrm_storage_pgsql_proxy_add_type;
     factory->proxy_add_superclass = tmrm_storage_pgsql_proxy_add_superclass;
     factory->proxy_direct_subclasses = tmrm_storage_pgsql_proxy_direct_subclasses;
     factory->proxy_direct_superclasses = tmrm_storage_pgsql_proxy_direct_superclasses;
     factory->proxy_direct_types = tmrm_storage_pgsql_proxy_direct_types;
     factory->proxy_direct_instances = tmrm_storage_pgsql_proxy_direct_instances;
+    factory->query_send = tmrm_storage_pgsql_query_send;
+    factory->query_poll = tmrm_storage_pgsql_query_poll;
+    factory->query_free = tmrm_storage_pgsql_query_free;
 }
 
 
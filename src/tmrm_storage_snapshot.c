@@ -0,0 +1,1678 @@
+/*
+ * tmrm_storage_snapshot.c - read-only memory-mapped snapshot storage
+ * http://libtmrm.ravn.no
+ *
+ * This file is licensed under the 
+ * GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Copyright (C) 2008-2009 Jan Schreiber, http://purl.org/net/jans
+ * Copyright (C) 2008-2009 Ravn Webveveriet AS, NO http://www.ravn.no
+ */ 
+#ifdef HAVE_CONFIG_H
+#include <libtmrm_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libtmrm.h>
+#include <tmrm_internal.h>
+#include <tmrm_storage_internal.h>
+#include <tmrm_storage.h>
+#include <tmrm_hash.h>
+
+/*
+ * Layout of a snapshot file. All integers are 32 bit in host byte order, so
+ * that the file can be used without decoding once it is mapped. The
+ * sections follow the header in this order:
+ *
+ *   labels[num_proxies]             sorted labels of all proxies
+ *   offsets[num_proxies + 1]        CSR offsets: the properties of proxy
+ *                                   labels[i] are forward[offsets[i]] up to
+ *                                   forward[offsets[i + 1]]
+ *   forward[num_properties]         properties sorted by proxy, key, value
+ *   reverse[num_properties]         properties sorted by value, key, proxy
+ *   literals[num_literals]          pool offsets of value and datatype,
+ *                                   sorted by value and datatype
+ *   pool[pool_size]                 zero terminated literal strings
+ *
+ * The value of a property is either the label of a proxy or the index of a
+ * literal, depending on its kind.
+ */
+#define TMRM_SNAPSHOT_MAGIC "TMRMSNP1"
+#define TMRM_SNAPSHOT_VERSION 1
+#define TMRM_SNAPSHOT_BYTE_ORDER 0x01020304
+
+#define TMRM_SNAPSHOT_VALUE_PROXY 0
+#define TMRM_SNAPSHOT_VALUE_LITERAL 1
+
+struct tmrm_snapshot_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t num_proxies;
+    uint32_t num_properties;
+    uint32_t num_literals;
+    uint32_t pool_size;
+};
+
+typedef struct tmrm_snapshot_header_s tmrm_snapshot_header;
+
+struct tmrm_snapshot_property_s {
+    uint32_t proxy;
+    uint32_t key;
+    uint32_t kind;
+    uint32_t value;
+};
+
+typedef struct tmrm_snapshot_property_s tmrm_snapshot_property;
+
+struct tmrm_snapshot_literal_s {
+    uint32_t value;
+    uint32_t datatype;
+};
+
+typedef struct tmrm_snapshot_literal_s tmrm_snapshot_literal;
+
+struct tmrm_storage_snapshot_context_s {
+    void* map;
+    size_t map_size;
+    const tmrm_snapshot_header* header;
+    const uint32_t* labels;
+    const uint32_t* offsets;
+    const tmrm_snapshot_property* forward;
+    const tmrm_snapshot_property* reverse;
+    const tmrm_snapshot_literal* literals;
+    const char* pool;
+};
+
+typedef struct tmrm_storage_snapshot_context_s tmrm_storage_snapshot_context;
+
+/* Part of a position that an iterator returns */
+enum tmrm_storage_snapshot_element_e {
+    TMRM_SNAPSHOT_ELEMENT_LABEL,     /* labels[i] */
+    TMRM_SNAPSHOT_ELEMENT_KEY,       /* key of a property */
+    TMRM_SNAPSHOT_ELEMENT_PROPERTY,  /* key and value of a property */
+    TMRM_SNAPSHOT_ELEMENT_VALUE,     /* value of a property */
+    TMRM_SNAPSHOT_ELEMENT_PROXY      /* proxy of a property */
+};
+
+typedef enum tmrm_storage_snapshot_element_e tmrm_storage_snapshot_element;
+
+/* An iterator is a range [current, end) of one of the mapped arrays. */
+struct tmrm_storage_snapshot_iterator_context_s {
+    tmrm_subject_map* subject_map;
+    const tmrm_storage_snapshot_context* snapshot;
+    tmrm_storage_snapshot_element element;
+    const tmrm_snapshot_property* properties;
+    uint32_t current;
+    uint32_t end;
+    /* Joins only: for each proxy in the range, iterate over the values of
+       the proxy's property join_key in forward[inner_current, inner_end). */
+    int join;
+    uint32_t join_key;
+    uint32_t inner_current;
+    uint32_t inner_end;
+};
+
+typedef struct tmrm_storage_snapshot_iterator_context_s tmrm_storage_snapshot_iterator_context;
+
+struct tmrm_snapshot_builder_s {
+    tmrm_snapshot_property* properties;
+    uint32_t num_properties;
+    uint32_t max_properties;
+    uint32_t* labels;
+    uint32_t num_labels;
+    uint32_t max_labels;
+    /* Literals in insertion order; properties refer to them by index */
+    char** strings;
+    uint32_t num_literals;
+    uint32_t max_literals;
+};
+
+/* ---------------------------------------------------------------------------
+Prototypes for the snapshot storage factory
+*/
+static void
+tmrm_storage_snapshot_register_factory(tmrm_storage_factory *factory);
+
+void
+tmrm_init_storage_snapshot(tmrm_subject_map_sphere *sms);
+
+static int
+tmrm_storage_snapshot_init(tmrm_storage* s, tmrm_hash* options);
+
+static void
+tmrm_storage_snapshot_free(tmrm_storage* storage);
+
+static int 
+tmrm_storage_snapshot_bootstrap(tmrm_storage* s, tmrm_subject_map* map);
+
+static tmrm_proxy*
+tmrm_storage_snapshot_bottom(tmrm_storage* storage, tmrm_subject_map* map);
+
+static int
+tmrm_storage_snapshot_merge(tmrm_storage* storage, tmrm_subject_map* map);
+
+static unsigned long
+tmrm_storage_snapshot_snapshot_acquire(tmrm_storage* s, tmrm_subject_map* map);
+
+static void
+tmrm_storage_snapshot_snapshot_release(tmrm_storage* s, unsigned long version);
+
+static tmrm_proxy*
+tmrm_storage_snapshot_proxy_create(tmrm_storage* storage, tmrm_subject_map* map);
+
+static int
+tmrm_storage_snapshot_add_property(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value);
+
+static int
+tmrm_storage_snapshot_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value);
+
+static int
+tmrm_storage_snapshot_proxy_remove_properties_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
+
+static int
+tmrm_storage_snapshot_proxy_remove(tmrm_storage* s, const tmrm_proxy* p);
+
+static int
+tmrm_storage_snapshot_proxy_add_type(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* type);
+
+static int
+tmrm_storage_snapshot_proxy_add_superclass(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* superclass);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_properties(tmrm_storage* s, tmrm_proxy* p);
+
+static int
+tmrm_storage_snapshot_scan_properties(tmrm_storage* s, tmrm_subject_map* map,
+        const tmrm_property_visitor* visitor, void* data);
+
+static tmrm_proxy*
+tmrm_storage_snapshot_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
+        const char* label);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxies(tmrm_storage* s, tmrm_subject_map* map);
+
+static char*
+tmrm_storage_snapshot_proxy_label(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_keys(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_keys_by_value(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_class(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* a, tmrm_proxy* b);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_subclasses(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_superclasses(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_types(tmrm_storage* s, tmrm_proxy* p);
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_instances(tmrm_storage* s, tmrm_proxy* p);
+
+static int
+tmrm_storage_snapshot_list_next(void* context);
+
+static int
+tmrm_storage_snapshot_list_end(void* context);
+
+static tmrm_object*
+tmrm_storage_snapshot_list_get_element(void* context, tmrm_iterator_flag flag);
+
+static void
+tmrm_storage_snapshot_list_free(void* context);
+
+/* Internal helper functions */
+static int
+_snapshot_open(tmrm_storage_snapshot_context* c, const char* file);
+
+static void
+_snapshot_close(tmrm_storage_snapshot_context* c);
+
+static int
+_snapshot_visit(const tmrm_storage_snapshot_context* c,
+        const tmrm_property_visitor* visitor, void* data);
+
+static tmrm_proxy*
+_create_proxy_struct(tmrm_subject_map* m, tmrm_label label);
+
+static int
+_proxy_index(const tmrm_storage_snapshot_context* c, tmrm_label label,
+        uint32_t* idx);
+
+static int
+_literal_index(const tmrm_storage_snapshot_context* c, const tmrm_literal* lit,
+        uint32_t* idx);
+
+static void
+_forward_key_range(const tmrm_storage_snapshot_context* c, uint32_t proxy_idx,
+        uint32_t key, uint32_t* begin, uint32_t* end);
+
+static void
+_reverse_range(const tmrm_storage_snapshot_context* c, uint32_t kind,
+        uint32_t value, const uint32_t* key, uint32_t* begin, uint32_t* end);
+
+static tmrm_iterator*
+_iterator_new(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_storage_snapshot_element element,
+        const tmrm_snapshot_property* properties, uint32_t begin, uint32_t end);
+
+static void
+_iterator_join_advance(tmrm_storage_snapshot_iterator_context* c);
+
+/* ======================================================================= */
+static int 
+tmrm_storage_snapshot_init(tmrm_storage* s, tmrm_hash* options)
+{
+    tmrm_storage_snapshot_context* c;
+    char *file;
+    int ret;
+
+    c = (tmrm_storage_snapshot_context*)TMRM_CALLOC(tmrm_storage_snapshot_context,
+            1, sizeof(tmrm_storage_snapshot_context));
+    if (!c) return 1;
+    s->context = c;
+
+    if (!options || !(file = tmrm_hash_get(options, "file"))) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Missing file - check the options string");
+        return 1;
+    }
+    ret = _snapshot_open(c, file);
+    TMRM_FREE(cstring, file);
+    return ret;
+}
+
+
+/**
+ * Looks up the bootstrap proxies. The snapshot must have been exported from
+ * a subject map that contains the bootstrap ontology.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+static int 
+tmrm_storage_snapshot_bootstrap(tmrm_storage* s, tmrm_subject_map* map)
+{
+    const char* names[4] = {"libtmrm:superclass", "libtmrm:subclass",
+        "libtmrm:type", "libtmrm:instance"};
+    tmrm_proxy** proxies[4];
+    tmrm_literal* lit;
+    uint32_t idx, begin, end, key = 0;
+    int i;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return 1;
+
+    proxies[0] = &map->superclass;
+    proxies[1] = &map->subclass;
+    proxies[2] = &map->type;
+    proxies[3] = &map->instance;
+
+    map->bottom = tmrm_storage_snapshot_bottom(s, map);
+    for (i = 0; i < 4; i++) {
+        lit = tmrm_literal_new((tmrm_char_t*)names[i], (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+        if (!lit) return 1;
+        if (_literal_index(c, lit, &idx) == 0) {
+            _reverse_range(c, TMRM_SNAPSHOT_VALUE_LITERAL, idx, &key, &begin,
+                    &end);
+            if (begin < end) {
+                *proxies[i] = _create_proxy_struct(map,
+                        (tmrm_label)c->reverse[begin].proxy);
+            }
+        }
+        tmrm_literal_free(lit);
+        if (*proxies[i] == NULL) {
+            TMRM_DEBUG2("Bootstrap proxy %s not found\n", names[i]);
+        }
+    }
+    return 0;
+}
+
+
+static void
+tmrm_storage_snapshot_free(tmrm_storage* s)
+{
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return;
+
+    _snapshot_close(c);
+    TMRM_FREE(tmrm_storage_snapshot_context, s->context);
+}
+
+
+static tmrm_proxy*
+tmrm_storage_snapshot_bottom(tmrm_storage* s, tmrm_subject_map* map)
+{
+    uint32_t idx;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    /* The bottom proxy has the label 0, it cannot be created here */
+    if (_proxy_index(c, 0, &idx)) return NULL;
+    return _create_proxy_struct(map, 0);
+}
+
+
+static int
+tmrm_storage_snapshot_merge(tmrm_storage* storage, tmrm_subject_map* map)
+{
+    /* Snapshots are exported from fully merged subject maps */
+    return 0;
+}
+
+
+/* The mapped file never changes, so every subject map snapshot sees the
+   same version */
+static unsigned long
+tmrm_storage_snapshot_snapshot_acquire(tmrm_storage* s, tmrm_subject_map* map)
+{
+    return 1;
+}
+
+
+static void
+tmrm_storage_snapshot_snapshot_release(tmrm_storage* s, unsigned long version)
+{
+}
+
+
+/* Snapshots are immutable: all modifying callbacks fail. */
+static tmrm_proxy*
+tmrm_storage_snapshot_proxy_create(tmrm_storage* storage, tmrm_subject_map* map)
+{
+    TMRM_LOG(TMRM_LOG_ERROR, "snapshot storage is read-only");
+    return NULL;
+}
+
+
+static int
+tmrm_storage_snapshot_add_property(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_proxy* value)
+{
+    TMRM_LOG(TMRM_LOG_ERROR, "snapshot storage is read-only");
+    return 1;
+}
+
+
+static int
+tmrm_storage_snapshot_add_property_literal(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key, tmrm_literal* value)
+{
+    TMRM_LOG(TMRM_LOG_ERROR, "snapshot storage is read-only");
+    return 1;
+}
+
+
+static int
+tmrm_storage_snapshot_proxy_remove_properties_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    TMRM_LOG(TMRM_LOG_ERROR, "snapshot storage is read-only");
+    return 1;
+}
+
+
+static int
+tmrm_storage_snapshot_proxy_remove(tmrm_storage* s, const tmrm_proxy* p)
+{
+    TMRM_LOG(TMRM_LOG_ERROR, "snapshot storage is read-only");
+    return 1;
+}
+
+
+static int
+tmrm_storage_snapshot_proxy_add_type(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* type)
+{
+    TMRM_LOG(TMRM_LOG_ERROR, "snapshot storage is read-only");
+    return -1;
+}
+
+
+static int
+tmrm_storage_snapshot_proxy_add_superclass(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* superclass)
+{
+    TMRM_LOG(TMRM_LOG_ERROR, "snapshot storage is read-only");
+    return -1;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_properties(tmrm_storage* s, tmrm_proxy* p)
+{
+    uint32_t idx;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    if (_proxy_index(c, p->label, &idx)) {
+        return _iterator_new(s, p->subject_map, TMRM_SNAPSHOT_ELEMENT_PROPERTY,
+                c->forward, 0, 0);
+    }
+    return _iterator_new(s, p->subject_map, TMRM_SNAPSHOT_ELEMENT_PROPERTY,
+            c->forward, c->offsets[idx], c->offsets[idx + 1]);
+}
+
+
+static int
+tmrm_storage_snapshot_scan_properties(tmrm_storage* s, tmrm_subject_map* map,
+        const tmrm_property_visitor* visitor, void* data)
+{
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return 1;
+
+    return _snapshot_visit(c, visitor, data);
+}
+
+
+static tmrm_proxy*
+tmrm_storage_snapshot_proxy_by_label(tmrm_storage* s, tmrm_subject_map* map,
+        const char* label)
+{
+    char* end;
+    long proxy_id;
+    uint32_t idx;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    /* Check that label is valid */
+    proxy_id = strtol(label, &end, 10);
+    if (strlen(label) == 0 || *end != '\0' || proxy_id < 0) {
+        return NULL;
+    }
+    if (_proxy_index(c, (tmrm_label)proxy_id, &idx)) return NULL;
+    return _create_proxy_struct(map, (tmrm_label)proxy_id);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxies(tmrm_storage* s, tmrm_subject_map* map)
+{
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    return _iterator_new(s, map, TMRM_SNAPSHOT_ELEMENT_LABEL, NULL, 0,
+            c->header->num_proxies);
+}
+
+
+static char*
+tmrm_storage_snapshot_proxy_label(tmrm_storage* s, tmrm_proxy* p)
+{
+    size_t len;
+    char *label;
+
+    len = 1 * INT_DIGITS;
+    if (!(label = (char*)TMRM_MALLOC(cstring, len + 1))) {
+        return NULL;
+    }
+
+    (void)snprintf(label, len, "%d", (int)p->label);
+    return label;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_keys(tmrm_storage* s, tmrm_proxy* p)
+{
+    uint32_t idx;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    if (_proxy_index(c, p->label, &idx)) {
+        return _iterator_new(s, p->subject_map, TMRM_SNAPSHOT_ELEMENT_KEY,
+                c->forward, 0, 0);
+    }
+    return _iterator_new(s, p->subject_map, TMRM_SNAPSHOT_ELEMENT_KEY,
+            c->forward, c->offsets[idx], c->offsets[idx + 1]);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_values_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    uint32_t idx, begin = 0, end = 0;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    if (_proxy_index(c, p->label, &idx) == 0) {
+        _forward_key_range(c, idx, (uint32_t)key->label, &begin, &end);
+    }
+    return _iterator_new(s, p->subject_map, TMRM_SNAPSHOT_ELEMENT_VALUE,
+            c->forward, begin, end);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_is_value_by_key(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* key)
+{
+    uint32_t k, begin, end;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    k = (uint32_t)key->label;
+    _reverse_range(c, TMRM_SNAPSHOT_VALUE_PROXY, (uint32_t)p->label, &k,
+            &begin, &end);
+    return _iterator_new(s, p->subject_map, TMRM_SNAPSHOT_ELEMENT_PROXY,
+            c->reverse, begin, end);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_keys_by_value(tmrm_storage* s, tmrm_proxy* p)
+{
+    uint32_t begin, end;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    _reverse_range(c, TMRM_SNAPSHOT_VALUE_PROXY, (uint32_t)p->label, NULL,
+            &begin, &end);
+    return _iterator_new(s, p->subject_map, TMRM_SNAPSHOT_ELEMENT_KEY,
+            c->reverse, begin, end);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_literal_keys_by_value(tmrm_storage* s, tmrm_literal* lit, tmrm_subject_map* map)
+{
+    uint32_t idx, begin = 0, end = 0;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    if (_literal_index(c, lit, &idx) == 0) {
+        _reverse_range(c, TMRM_SNAPSHOT_VALUE_LITERAL, idx, NULL, &begin, &end);
+    }
+    return _iterator_new(s, map, TMRM_SNAPSHOT_ELEMENT_KEY, c->reverse, begin,
+            end);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_literal_is_value_by_key(tmrm_storage* s, tmrm_literal* lit, tmrm_proxy* key)
+{
+    uint32_t idx, k, begin = 0, end = 0;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    k = (uint32_t)key->label;
+    if (_literal_index(c, lit, &idx) == 0) {
+        _reverse_range(c, TMRM_SNAPSHOT_VALUE_LITERAL, idx, &k, &begin, &end);
+    }
+    return _iterator_new(s, key->subject_map, TMRM_SNAPSHOT_ELEMENT_PROXY,
+            c->reverse, begin, end);
+}
+
+
+/* Helper function for superclass-subclass or type-instance relations:
+   Returns the values for key a of all proxies that have p as value for
+   key b. */
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_class(tmrm_storage* s, tmrm_proxy* p, tmrm_proxy* a, tmrm_proxy* b)
+{
+    uint32_t k, begin, end;
+    tmrm_iterator* iterator;
+    tmrm_storage_snapshot_iterator_context* context;
+    tmrm_storage_snapshot_context* c = (tmrm_storage_snapshot_context*)s->context;
+    if (!c) return NULL;
+
+    k = (uint32_t)b->label;
+    _reverse_range(c, TMRM_SNAPSHOT_VALUE_PROXY, (uint32_t)p->label, &k,
+            &begin, &end);
+    iterator = _iterator_new(s, p->subject_map, TMRM_SNAPSHOT_ELEMENT_VALUE,
+            c->reverse, begin, end);
+    if (!iterator) return NULL;
+
+    context = (tmrm_storage_snapshot_iterator_context*)iterator->context;
+    context->join = 1;
+    context->join_key = (uint32_t)a->label;
+    _iterator_join_advance(context);
+    return iterator;
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_subclasses(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_snapshot_proxy_direct_class(s, p,
+        p->subject_map->subclass, p->subject_map->superclass);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_superclasses(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_snapshot_proxy_direct_class(s, p,
+        p->subject_map->superclass, p->subject_map->subclass);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_types(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_snapshot_proxy_direct_class(s, p,
+        p->subject_map->type, p->subject_map->instance);
+}
+
+
+static tmrm_iterator*
+tmrm_storage_snapshot_proxy_direct_instances(tmrm_storage* s, tmrm_proxy* p)
+{
+    return tmrm_storage_snapshot_proxy_direct_class(s, p,
+        p->subject_map->instance, p->subject_map->type);
+}
+
+
+/**
+ * Helper function to iterate over a range of a mapped array.
+ */
+static int
+tmrm_storage_snapshot_list_next(void* context)
+{
+    tmrm_storage_snapshot_iterator_context *c;
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(context, void, -1);
+    c = (tmrm_storage_snapshot_iterator_context*)context;
+
+    if (c->current >= c->end) return 1;
+    if (c->join) {
+        c->inner_current++;
+        if (c->inner_current >= c->inner_end) {
+            c->current++;
+            _iterator_join_advance(c);
+        }
+        return 0;
+    }
+    c->current++;
+    return 0;
+}
+
+
+/**
+ * Helper function to iterate over a range of a mapped array.
+ */
+static int
+tmrm_storage_snapshot_list_end(void* context)
+{
+    tmrm_storage_snapshot_iterator_context *c;
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(context, void, -1);
+    c = (tmrm_storage_snapshot_iterator_context*)context;
+
+    return c->current >= c->end;
+}
+
+
+/**
+ * Helper function that creates a proxy or literal object for the current
+ * position. The strings of literals are copied from the pool.
+ */
+static tmrm_object*
+tmrm_storage_snapshot_list_get_element(void* context, tmrm_iterator_flag flag)
+{
+    tmrm_storage_snapshot_iterator_context *c;
+    const tmrm_snapshot_property* prop;
+    const tmrm_snapshot_literal* lit;
+    tmrm_literal* new_literal;
+    tmrm_proxy* p = NULL;
+
+    c = (tmrm_storage_snapshot_iterator_context*)context;
+    if (c->current >= c->end) return NULL;
+
+    if (c->element == TMRM_SNAPSHOT_ELEMENT_LABEL) {
+        p = _create_proxy_struct(c->subject_map,
+                (tmrm_label)c->snapshot->labels[c->current]);
+        return p ? tmrm_proxy_to_object(p) : NULL;
+    }
+
+    prop = c->join ? &c->snapshot->forward[c->inner_current] :
+        &c->properties[c->current];
+    switch (c->element) {
+        case TMRM_SNAPSHOT_ELEMENT_KEY:
+            p = _create_proxy_struct(c->subject_map, (tmrm_label)prop->key);
+            break;
+        case TMRM_SNAPSHOT_ELEMENT_PROXY:
+            p = _create_proxy_struct(c->subject_map, (tmrm_label)prop->proxy);
+            break;
+        case TMRM_SNAPSHOT_ELEMENT_PROPERTY:
+            if (flag == TMRM_ITERATOR_GET_METHOD_GET_KEY) {
+                p = _create_proxy_struct(c->subject_map, (tmrm_label)prop->key);
+                break;
+            }
+            /* fall through */
+        case TMRM_SNAPSHOT_ELEMENT_VALUE:
+            if (prop->kind == TMRM_SNAPSHOT_VALUE_LITERAL) {
+                lit = &c->snapshot->literals[prop->value];
+                new_literal = tmrm_literal_new(
+                        (const tmrm_char_t*)c->snapshot->pool + lit->value,
+                        (const tmrm_char_t*)c->snapshot->pool + lit->datatype);
+                return new_literal ? tmrm_literal_to_object(new_literal) : NULL;
+            }
+            p = _create_proxy_struct(c->subject_map, (tmrm_label)prop->value);
+            break;
+        default:
+            break;
+    }
+    return p ? tmrm_proxy_to_object(p) : NULL;
+}
+
+
+static void
+tmrm_storage_snapshot_list_free(void* context)
+{
+    TMRM_FREE(tmrm_storage_snapshot_iterator_context, context);
+}
+
+
+/* Checks the kinds and literal indexes of a property table */
+static int
+_snapshot_check_properties(const tmrm_storage_snapshot_context* c,
+        const tmrm_snapshot_property* properties)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->header->num_properties; i++) {
+        switch (properties[i].kind) {
+            case TMRM_SNAPSHOT_VALUE_PROXY:
+                break;
+            case TMRM_SNAPSHOT_VALUE_LITERAL:
+                if (properties[i].value >= c->header->num_literals) return 1;
+                break;
+            default:
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/* Checks that every offset and index of the mapped file c lies within the
+   table it refers to, so that reads never leave the mapping. */
+static int
+_snapshot_check(const tmrm_storage_snapshot_context* c)
+{
+    const tmrm_snapshot_header* h = c->header;
+    uint32_t i;
+
+    if (c->offsets[0] != 0 || c->offsets[h->num_proxies] != h->num_properties) {
+        return 1;
+    }
+    for (i = 0; i < h->num_proxies; i++) {
+        if (c->offsets[i] > c->offsets[i + 1]) return 1;
+    }
+    if (_snapshot_check_properties(c, c->forward) != 0 ||
+            _snapshot_check_properties(c, c->reverse) != 0) {
+        return 1;
+    }
+    /* The last string of the pool must be terminated */
+    if (h->num_literals > 0 &&
+            (h->pool_size == 0 || c->pool[h->pool_size - 1] != '\0')) {
+        return 1;
+    }
+    for (i = 0; i < h->num_literals; i++) {
+        if (c->literals[i].value >= h->pool_size ||
+                c->literals[i].datatype >= h->pool_size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Maps the snapshot file and sets up the section pointers of c. */
+static int
+_snapshot_open(tmrm_storage_snapshot_context* c, const char* file)
+{
+    const tmrm_snapshot_header* h;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Opening snapshot %s failed", file);
+        if (fd >= 0) (void)close(fd);
+        return 1;
+    }
+    c->map_size = (size_t)st.st_size;
+    if (c->map_size < sizeof(tmrm_snapshot_header)) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Snapshot %s is truncated", file);
+        (void)close(fd);
+        return 1;
+    }
+    /* Pages of the mapping are shared between all processes that serve
+       the same snapshot. */
+    c->map = mmap(NULL, c->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        TMRM_LOG(TMRM_LOG_ERROR, "Mapping snapshot %s failed", file);
+        return 1;
+    }
+
+    h = c->header = (const tmrm_snapshot_header*)c->map;
+    if (memcmp(h->magic, TMRM_SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version != TMRM_SNAPSHOT_VERSION ||
+            h->byte_order != TMRM_SNAPSHOT_BYTE_ORDER) {
+        TMRM_LOG(TMRM_LOG_ERROR, "%s is not a snapshot of this platform", file);
+        return 1;
+    }
+    /* Each count is bounded by the file size, so the sum cannot overflow */
+    if (h->num_proxies >= c->map_size / sizeof(uint32_t) ||
+            h->num_properties > c->map_size / sizeof(tmrm_snapshot_property) ||
+            h->num_literals > c->map_size / sizeof(tmrm_snapshot_literal) ||
+            h->pool_size > c->map_size) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Snapshot %s is truncated", file);
+        return 1;
+    }
+    size = sizeof(tmrm_snapshot_header) +
+        ((size_t)h->num_proxies * 2 + 1) * sizeof(uint32_t) +
+        (size_t)h->num_properties * 2 * sizeof(tmrm_snapshot_property) +
+        (size_t)h->num_literals * sizeof(tmrm_snapshot_literal) +
+        (size_t)h->pool_size;
+    if (size > c->map_size) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Snapshot %s is truncated", file);
+        return 1;
+    }
+
+    c->labels = (const uint32_t*)(h + 1);
+    c->offsets = c->labels + h->num_proxies;
+    c->forward = (const tmrm_snapshot_property*)(c->offsets + h->num_proxies + 1);
+    c->reverse = c->forward + h->num_properties;
+    c->literals = (const tmrm_snapshot_literal*)(c->reverse + h->num_properties);
+    c->pool = (const char*)(c->literals + h->num_literals);
+
+    if (_snapshot_check(c) != 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Snapshot index of %s is corrupt", file);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Passes the proxies of c in label order to visitor, each followed by its
+   properties. */
+static int
+_snapshot_visit(const tmrm_storage_snapshot_context* c,
+        const tmrm_property_visitor* visitor, void* data)
+{
+    const tmrm_snapshot_property* prop;
+    const tmrm_snapshot_literal* lit;
+    uint32_t i, j;
+    int ret = 0;
+
+    for (i = 0; i < c->header->num_proxies && ret == 0; i++) {
+        ret = visitor->proxy(data, (tmrm_label)c->labels[i]);
+        for (j = c->offsets[i]; j < c->offsets[i + 1] && ret == 0; j++) {
+            prop = &c->forward[j];
+            if (prop->kind == TMRM_SNAPSHOT_VALUE_LITERAL) {
+                lit = &c->literals[prop->value];
+                ret = visitor->property_literal(data, (tmrm_label)prop->proxy,
+                        (tmrm_label)prop->key,
+                        (const tmrm_char_t*)c->pool + lit->value,
+                        (const tmrm_char_t*)c->pool + lit->datatype);
+            } else {
+                ret = visitor->property(data, (tmrm_label)prop->proxy,
+                        (tmrm_label)prop->key, (tmrm_label)prop->value);
+            }
+        }
+    }
+    return ret;
+}
+
+
+static void
+_snapshot_close(tmrm_storage_snapshot_context* c)
+{
+    if (c->map != NULL) {
+        (void)munmap(c->map, c->map_size);
+        c->map = NULL;
+    }
+}
+
+
+/**
+* Allocates memory for a new tmrm_proxy structure.
+*/
+static tmrm_proxy*
+_create_proxy_struct(tmrm_subject_map* m, tmrm_label label)
+{
+    tmrm_proxy *p;
+
+    p = TMRM_POOL_CALLOC(tmrm_proxy, TMRM_POOL_PROXY);
+    if (!p) {
+        return NULL;
+    }
+    p->type = TMRM_TYPE_PROXY;
+    p->label = label;
+    p->subject_map = m;
+    return p;
+}
+
+
+/* Finds the position of label in the label array. Returns 0 on success. */
+static int
+_proxy_index(const tmrm_storage_snapshot_context* c, tmrm_label label,
+        uint32_t* idx)
+{
+    uint32_t lo = 0, hi = c->header->num_proxies, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (c->labels[mid] < (uint32_t)label) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < c->header->num_proxies && c->labels[lo] == (uint32_t)label) {
+        *idx = lo;
+        return 0;
+    }
+    return 1;
+}
+
+
+/* Finds the index of a literal in the literal table. Returns 0 on success. */
+static int
+_literal_index(const tmrm_storage_snapshot_context* c, const tmrm_literal* lit,
+        uint32_t* idx)
+{
+    const char *value, *datatype;
+    uint32_t lo = 0, hi = c->header->num_literals, mid;
+    int cmp;
+
+    value = (const char*)tmrm_literal_value(lit);
+    datatype = (const char*)tmrm_literal_datatype(lit);
+    if (!value || !datatype) return 1;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(c->pool + c->literals[mid].value, value);
+        if (cmp == 0) {
+            cmp = strcmp(c->pool + c->literals[mid].datatype, datatype);
+        }
+        if (cmp == 0) {
+            *idx = mid;
+            return 0;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return 1;
+}
+
+
+/* Narrows the adjacency range of a proxy to the properties with key. */
+static void
+_forward_key_range(const tmrm_storage_snapshot_context* c, uint32_t proxy_idx,
+        uint32_t key, uint32_t* begin, uint32_t* end)
+{
+    uint32_t lo, hi, mid, first;
+
+    lo = c->offsets[proxy_idx];
+    hi = c->offsets[proxy_idx + 1];
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (c->forward[mid].key < key) lo = mid + 1; else hi = mid;
+    }
+    first = lo;
+    hi = c->offsets[proxy_idx + 1];
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (c->forward[mid].key <= key) lo = mid + 1; else hi = mid;
+    }
+    *begin = first;
+    *end = lo;
+}
+
+
+/* Compares a reverse entry with (kind, value[, key]). */
+static int
+_reverse_compare(const tmrm_snapshot_property* p, uint32_t kind,
+        uint32_t value, const uint32_t* key)
+{
+    if (p->kind != kind) return p->kind < kind ? -1 : 1;
+    if (p->value != value) return p->value < value ? -1 : 1;
+    if (key && p->key != *key) return p->key < *key ? -1 : 1;
+    return 0;
+}
+
+
+/* Finds the range of reverse entries with the given value (and key, if key
+   is not NULL). */
+static void
+_reverse_range(const tmrm_storage_snapshot_context* c, uint32_t kind,
+        uint32_t value, const uint32_t* key, uint32_t* begin, uint32_t* end)
+{
+    uint32_t lo = 0, hi = c->header->num_properties, mid, first;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (_reverse_compare(&c->reverse[mid], kind, value, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    first = lo;
+    hi = c->header->num_properties;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (_reverse_compare(&c->reverse[mid], kind, value, key) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *begin = first;
+    *end = lo;
+}
+
+
+static tmrm_iterator*
+_iterator_new(tmrm_storage* s, tmrm_subject_map* map,
+        tmrm_storage_snapshot_element element,
+        const tmrm_snapshot_property* properties, uint32_t begin, uint32_t end)
+{
+    tmrm_storage_snapshot_iterator_context* context;
+    tmrm_iterator* iterator;
+
+    context = (tmrm_storage_snapshot_iterator_context*)
+        TMRM_CALLOC(tmrm_storage_snapshot_iterator_context, 1,
+                sizeof(tmrm_storage_snapshot_iterator_context));
+    if (!context) return NULL;
+
+    context->subject_map = map;
+    context->snapshot = (tmrm_storage_snapshot_context*)s->context;
+    context->element = element;
+    context->properties = properties;
+    context->current = begin;
+    context->end = end;
+
+    iterator = tmrm_iterator_new(s->subject_map_sphere, (void*)context,
+            tmrm_storage_snapshot_list_next,
+            tmrm_storage_snapshot_list_end,
+            tmrm_storage_snapshot_list_get_element,
+            tmrm_storage_snapshot_list_free);
+    if (!iterator) TMRM_FREE(tmrm_storage_snapshot_iterator_context, context);
+    return iterator;
+}
+
+
+/* Moves a join iterator to the first outer proxy (at or after current)
+   that has a value for join_key. */
+static void
+_iterator_join_advance(tmrm_storage_snapshot_iterator_context* c)
+{
+    uint32_t idx;
+
+    for (; c->current < c->end; c->current++) {
+        if (_proxy_index(c->snapshot,
+                    (tmrm_label)c->properties[c->current].proxy, &idx)) {
+            continue;
+        }
+        _forward_key_range(c->snapshot, idx, c->join_key, &c->inner_current,
+                &c->inner_end);
+        if (c->inner_current < c->inner_end) return;
+    }
+}
+
+
+/* ---------------------------------------------------------------------------
+Snapshot builder
+*/
+
+static int
+_compare_label(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+/* Order of literals by value and datatype. The elements point to the
+   value of a literal in the strings of the builder, which is followed by
+   its datatype. */
+static int
+_compare_literal(const void* a, const void* b)
+{
+    char* const* x = *(char* const* const*)a;
+    char* const* y = *(char* const* const*)b;
+    int cmp;
+
+    cmp = strcmp(x[0], y[0]);
+    if (cmp == 0) cmp = strcmp(x[1], y[1]);
+    return cmp;
+}
+
+
+static int
+_compare_forward(const void* a, const void* b)
+{
+    const tmrm_snapshot_property *x = a, *y = b;
+
+    if (x->proxy != y->proxy) return x->proxy < y->proxy ? -1 : 1;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    if (x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    if (x->value != y->value) return x->value < y->value ? -1 : 1;
+    return 0;
+}
+
+
+static int
+_compare_reverse(const void* a, const void* b)
+{
+    const tmrm_snapshot_property *x = a, *y = b;
+
+    if (x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    if (x->value != y->value) return x->value < y->value ? -1 : 1;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    if (x->proxy != y->proxy) return x->proxy < y->proxy ? -1 : 1;
+    return 0;
+}
+
+
+/**
+ * Creates a new snapshot builder. Proxies and properties are added in any
+ * order and written with tmrm_snapshot_builder_write().
+ *
+ * @returns NULL on failure (out of memory).
+ */
+tmrm_snapshot_builder*
+tmrm_snapshot_builder_new(void)
+{
+    return (tmrm_snapshot_builder*)TMRM_CALLOC(tmrm_snapshot_builder, 1,
+            sizeof(tmrm_snapshot_builder));
+}
+
+
+int
+tmrm_snapshot_builder_add_proxy(tmrm_snapshot_builder* b, tmrm_label label)
+{
+    uint32_t* labels;
+    uint32_t max;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(b, tmrm_snapshot_builder, 1);
+    if (b->num_labels == b->max_labels) {
+        max = b->max_labels ? 2 * b->max_labels : 64;
+        if (!(labels = (uint32_t*)TMRM_REALLOC(uint32_t, b->labels,
+                        max * sizeof(uint32_t)))) {
+            return 1;
+        }
+        b->labels = labels;
+        b->max_labels = max;
+    }
+    b->labels[b->num_labels++] = (uint32_t)label;
+    return 0;
+}
+
+
+static int
+_builder_add(tmrm_snapshot_builder* b, tmrm_label proxy, tmrm_label key,
+        uint32_t kind, uint32_t value)
+{
+    tmrm_snapshot_property* properties;
+    uint32_t max;
+
+    if (b->num_properties == b->max_properties) {
+        max = b->max_properties ? 2 * b->max_properties : 256;
+        if (!(properties = (tmrm_snapshot_property*)TMRM_REALLOC(
+                        tmrm_snapshot_property, b->properties,
+                        max * sizeof(tmrm_snapshot_property)))) {
+            return 1;
+        }
+        b->properties = properties;
+        b->max_properties = max;
+    }
+    properties = &b->properties[b->num_properties++];
+    properties->proxy = (uint32_t)proxy;
+    properties->key = (uint32_t)key;
+    properties->kind = kind;
+    properties->value = value;
+    return 0;
+}
+
+
+int
+tmrm_snapshot_builder_add_property(tmrm_snapshot_builder* b,
+        tmrm_label proxy, tmrm_label key, tmrm_label value)
+{
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(b, tmrm_snapshot_builder, 1);
+    return _builder_add(b, proxy, key, TMRM_SNAPSHOT_VALUE_PROXY,
+            (uint32_t)value);
+}
+
+
+int
+tmrm_snapshot_builder_add_property_literal(tmrm_snapshot_builder* b,
+        tmrm_label proxy, tmrm_label key, const tmrm_char_t* value,
+        const tmrm_char_t* datatype)
+{
+    char **strings, *v, *d;
+    uint32_t max;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(b, tmrm_snapshot_builder, 1);
+    if (b->num_literals == b->max_literals) {
+        max = b->max_literals ? 2 * b->max_literals : 64;
+        if (!(strings = (char**)TMRM_REALLOC(cstring, b->strings,
+                        2 * max * sizeof(char*)))) {
+            return 1;
+        }
+        b->strings = strings;
+        b->max_literals = max;
+    }
+    v = (char*)TMRM_MALLOC(cstring, strlen((const char*)value) + 1);
+    d = (char*)TMRM_MALLOC(cstring, strlen((const char*)datatype) + 1);
+    if (!v || !d) {
+        if (v) TMRM_FREE(cstring, v);
+        if (d) TMRM_FREE(cstring, d);
+        return 1;
+    }
+    (void)strcpy(v, (const char*)value);
+    (void)strcpy(d, (const char*)datatype);
+    if (_builder_add(b, proxy, key, TMRM_SNAPSHOT_VALUE_LITERAL,
+                b->num_literals)) {
+        TMRM_FREE(cstring, v);
+        TMRM_FREE(cstring, d);
+        return 1;
+    }
+    b->strings[2 * b->num_literals] = v;
+    b->strings[2 * b->num_literals + 1] = d;
+    b->num_literals++;
+    return 0;
+}
+
+
+/**
+ * Syncs the directory dir, so that files that were created, renamed or
+ * removed in it survive a crash.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+int
+tmrm_sync_directory(const char* dir)
+{
+    int fd, ret;
+
+    if ((fd = open(dir, O_RDONLY)) < 0) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Opening directory %s failed", dir);
+        return 1;
+    }
+    ret = fsync(fd) != 0;
+    if (ret) TMRM_LOG(TMRM_LOG_ERROR, "Syncing directory %s failed", dir);
+    (void)close(fd);
+    return ret;
+}
+
+
+/* Syncs the directory that contains filename */
+static int
+_sync_parent(const char* filename)
+{
+    const char* slash = strrchr(filename, '/');
+    char* dir;
+    int ret;
+
+    if (!slash) return tmrm_sync_directory(".");
+    if (slash == filename) return tmrm_sync_directory("/");
+    if (!(dir = (char*)TMRM_MALLOC(cstring, slash - filename + 1))) return 1;
+    memcpy(dir, filename, slash - filename);
+    dir[slash - filename] = '\0';
+    ret = tmrm_sync_directory(dir);
+    TMRM_FREE(cstring, dir);
+    return ret;
+}
+
+
+/**
+ * Sorts and indexes everything added to the builder and writes the snapshot
+ * to filename. The file is written under a temporary name and renamed, so
+ * processes that have mapped an older snapshot are not affected.
+ *
+ * @returns 0 on success or a non-zero value on failure.
+ */
+int
+tmrm_snapshot_builder_write(tmrm_snapshot_builder* b, const char* filename)
+{
+    tmrm_snapshot_header header;
+    tmrm_snapshot_property* reverse = NULL;
+    tmrm_snapshot_literal* literals = NULL;
+    char*** order = NULL;
+    uint32_t *remap = NULL, *offsets = NULL;
+    uint32_t i, j, n, num_labels, num_literals, pool_size;
+    char* tmp_name = NULL;
+    FILE* fh = NULL;
+    int ret = 1;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(b, tmrm_snapshot_builder, 1);
+
+    /* Labels: sorted and unique */
+    if (b->num_labels > 0) {
+        qsort(b->labels, b->num_labels, sizeof(uint32_t), _compare_label);
+    }
+    for (i = 0, num_labels = 0; i < b->num_labels; i++) {
+        if (num_labels == 0 || b->labels[num_labels - 1] != b->labels[i]) {
+            b->labels[num_labels++] = b->labels[i];
+        }
+    }
+    b->num_labels = num_labels;
+
+    /* Literals: sorted and unique, properties are renumbered */
+    order = (char***)TMRM_MALLOC(cstring, (b->num_literals + 1) * sizeof(char**));
+    remap = (uint32_t*)TMRM_MALLOC(uint32_t, (b->num_literals + 1) * sizeof(uint32_t));
+    literals = (tmrm_snapshot_literal*)TMRM_MALLOC(tmrm_snapshot_literal,
+            (b->num_literals + 1) * sizeof(tmrm_snapshot_literal));
+    if (!order || !remap || !literals) goto error;
+    for (i = 0; i < b->num_literals; i++) order[i] = &b->strings[2 * i];
+    if (b->num_literals > 0) {
+        qsort(order, b->num_literals, sizeof(char**), _compare_literal);
+    }
+    pool_size = 0;
+    num_literals = 0;
+    for (i = 0; i < b->num_literals; i++) {
+        if (num_literals == 0 || _compare_literal(&order[i - 1], &order[i]) != 0) {
+            literals[num_literals].value = pool_size;
+            pool_size += (uint32_t)strlen(order[i][0]) + 1;
+            literals[num_literals].datatype = pool_size;
+            pool_size += (uint32_t)strlen(order[i][1]) + 1;
+            num_literals++;
+        }
+        remap[(order[i] - b->strings) / 2] = num_literals - 1;
+    }
+    for (i = 0; i < b->num_properties; i++) {
+        if (b->properties[i].kind == TMRM_SNAPSHOT_VALUE_LITERAL) {
+            b->properties[i].value = remap[b->properties[i].value];
+        }
+    }
+
+    /* Forward adjacency with CSR offsets and the reverse index */
+    if (b->num_properties > 0) {
+        qsort(b->properties, b->num_properties, sizeof(tmrm_snapshot_property),
+                _compare_forward);
+    }
+    for (i = 0, n = 0; i < b->num_properties; i++) {
+        if (n == 0 || _compare_forward(&b->properties[n - 1],
+                    &b->properties[i]) != 0) {
+            b->properties[n++] = b->properties[i];
+        }
+    }
+    b->num_properties = n;
+    offsets = (uint32_t*)TMRM_MALLOC(uint32_t, (num_labels + 1) * sizeof(uint32_t));
+    reverse = (tmrm_snapshot_property*)TMRM_MALLOC(tmrm_snapshot_property,
+            (n + 1) * sizeof(tmrm_snapshot_property));
+    if (!offsets || !reverse) goto error;
+    for (i = 0, j = 0; i < num_labels; i++) {
+        offsets[i] = j;
+        while (j < n && b->properties[j].proxy <= b->labels[i]) {
+            if (b->properties[j].proxy < b->labels[i]) {
+                TMRM_LOG(TMRM_LOG_ERROR, "Property of unknown proxy %u",
+                        (unsigned)b->properties[j].proxy);
+                goto error;
+            }
+            j++;
+        }
+    }
+    if (j != n) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Property of unknown proxy %u",
+                (unsigned)b->properties[j].proxy);
+        goto error;
+    }
+    offsets[num_labels] = n;
+    if (n > 0) {
+        memcpy(reverse, b->properties, n * sizeof(tmrm_snapshot_property));
+        qsort(reverse, n, sizeof(tmrm_snapshot_property), _compare_reverse);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TMRM_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = TMRM_SNAPSHOT_VERSION;
+    header.byte_order = TMRM_SNAPSHOT_BYTE_ORDER;
+    header.num_proxies = num_labels;
+    header.num_properties = n;
+    header.num_literals = num_literals;
+    header.pool_size = pool_size;
+
+    if (!(tmp_name = (char*)TMRM_MALLOC(cstring, strlen(filename) + 5))) {
+        goto error;
+    }
+    (void)sprintf(tmp_name, "%s.tmp", filename);
+    if (!(fh = fopen(tmp_name, "wb"))) {
+        TMRM_LOG(TMRM_LOG_ERROR, "Could not open %s for writing", tmp_name);
+        goto error;
+    }
+    if (fwrite(&header, sizeof(header), 1, fh) != 1 ||
+            fwrite(b->labels, sizeof(uint32_t), num_labels, fh) != num_labels ||
+            fwrite(offsets, sizeof(uint32_t), num_labels + 1, fh) != num_labels + 1 ||
+            fwrite(b->properties, sizeof(tmrm_snapshot_property), n, fh) != n ||
+            fwrite(reverse, sizeof(tmrm_snapshot_property), n, fh) != n ||
+            fwrite(literals, sizeof(tmrm_snapshot_literal), num_literals, fh) != num_literals) {
+        goto write_error;
+    }
+    for (i = 0; i < b->num_literals; i++) {
+        if (i == 0 || _compare_literal(&order[i - 1], &order[i]) != 0) {
+            if (fputs(order[i][0], fh) == EOF ||
+                    fputc('\0', fh) == EOF ||
+                    fputs(order[i][1], fh) == EOF ||
+                    fputc('\0', fh) == EOF) {
+                goto write_error;
+            }
+        }
+    }
+    if (fflush(fh) != 0 || fsync(fileno(fh)) != 0) goto write_error;
+    ret = fclose(fh);
+    fh = NULL;
+    if (ret != 0 || rename(tmp_name, filename) != 0) {
+        ret = 1;
+        goto write_error;
+    }
+    ret = _sync_parent(filename);
+    goto error;
+
+write_error:
+    TMRM_LOG(TMRM_LOG_ERROR, "Writing snapshot %s failed", filename);
+    if (fh) (void)fclose(fh);
+    fh = NULL;
+    (void)remove(tmp_name);
+
+error:
+    if (fh) (void)fclose(fh);
+    if (tmp_name) TMRM_FREE(cstring, tmp_name);
+    if (order) TMRM_FREE(cstring, order);
+    if (remap) TMRM_FREE(uint32_t, remap);
+    if (literals) TMRM_FREE(tmrm_snapshot_literal, literals);
+    if (offsets) TMRM_FREE(uint32_t, offsets);
+    if (reverse) TMRM_FREE(tmrm_snapshot_property, reverse);
+    return ret;
+}
+
+
+void
+tmrm_snapshot_builder_free(tmrm_snapshot_builder* b)
+{
+    uint32_t i;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN(b, tmrm_snapshot_builder);
+    for (i = 0; i < 2 * b->num_literals; i++) {
+        TMRM_FREE(cstring, b->strings[i]);
+    }
+    if (b->strings) TMRM_FREE(cstring, b->strings);
+    if (b->labels) TMRM_FREE(uint32_t, b->labels);
+    if (b->properties) TMRM_FREE(tmrm_snapshot_property, b->properties);
+    TMRM_FREE(tmrm_snapshot_builder, b);
+}
+
+
+/**
+ * Reads a snapshot file and passes every proxy and property to the
+ * callbacks of visitor. Proxies are visited in ascending order of their
+ * labels, each followed by its properties.
+ *
+ * @returns 0 on success or a non-zero value on failure or if a callback
+ *          returned a non-zero value.
+ */
+int
+tmrm_snapshot_load(const char* filename, const tmrm_property_visitor* visitor,
+        void* data)
+{
+    tmrm_storage_snapshot_context c;
+    int ret;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(visitor, tmrm_property_visitor, 1);
+
+    memset(&c, 0, sizeof(c));
+    if (_snapshot_open(&c, filename)) {
+        _snapshot_close(&c);
+        return 1;
+    }
+    ret = _snapshot_visit(&c, visitor, data);
+    _snapshot_close(&c);
+    return ret;
+}
+
+
+static int
+_export_proxy(void* data, tmrm_label label)
+{
+    return tmrm_snapshot_builder_add_proxy((tmrm_snapshot_builder*)data, label);
+}
+
+
+static int
+_export_property(void* data, tmrm_label proxy, tmrm_label key,
+        tmrm_label value)
+{
+    return tmrm_snapshot_builder_add_property((tmrm_snapshot_builder*)data,
+            proxy, key, value);
+}
+
+
+static int
+_export_property_literal(void* data, tmrm_label proxy, tmrm_label key,
+        const tmrm_char_t* value, const tmrm_char_t* datatype)
+{
+    return tmrm_snapshot_builder_add_property_literal(
+            (tmrm_snapshot_builder*)data, proxy, key, value, datatype);
+}
+
+
+/* Adds everything it visits to the builder passed as data */
+const tmrm_property_visitor tmrm_snapshot_builder_visitor = {
+    _export_proxy,
+    _export_property,
+    _export_property_literal
+};
+
+
+/**
+ * Writes all proxies and properties of a subject map into a snapshot file
+ * that can be opened with the "snapshot" storage (option file='...'). Works
+ * with any storage that implements the proxies and proxy_properties
+ * callbacks.
+ *
+ * @param map The subject map
+ * @param filename Name of the snapshot file, an existing file is replaced
+ * @returns 0 on success or a non-zero value on failure.
+ */
+int
+tmrm_subject_map_export_snapshot(tmrm_subject_map *map, const char *filename)
+{
+    tmrm_snapshot_builder* b;
+    int ret;
+
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(map, tmrm_subject_map, 1);
+    TMRM_ASSERT_OBJECT_POINTER_RETURN_VALUE(filename, cstring, 1);
+
+    if (!(b = tmrm_snapshot_builder_new())) return 1;
+    ret = tmrm_storage_scan_properties(map->storage, map,
+            &tmrm_snapshot_builder_visitor, b);
+    if (ret == 0) ret = tmrm_snapshot_builder_write(b, filename);
+    tmrm_snapshot_builder_free(b);
+    return ret;
+}
+
+
+static void
+tmrm_storage_snapshot_register_factory(tmrm_storage_factory *factory)
+{
+    factory->init = tmrm_storage_snapshot_init;
+    factory->free = tmrm_storage_snapshot_free;
+    /* The mapped file never changes */
+    factory->concurrency = TMRM_STORAGE_CONCURRENT;
+
+    factory->bootstrap = tmrm_storage_snapshot_bootstrap;
+    factory->remove = NULL;
+    factory->bottom = tmrm_storage_snapshot_bottom;
+    factory->merge = tmrm_storage_snapshot_merge;
+    factory->proxy_create = tmrm_storage_snapshot_proxy_create;
+    factory->proxy_update = NULL;
+    factory->add_property = tmrm_storage_snapshot_add_property;
+    factory->add_property_literal = tmrm_storage_snapshot_add_property_literal;
+    factory->proxy_remove_properties_by_key = tmrm_storage_snapshot_proxy_remove_properties_by_key;
+    factory->proxy_properties = tmrm_storage_snapshot_proxy_properties;
+    factory->proxy_remove = tmrm_storage_snapshot_proxy_remove;
+    factory->scan_properties = tmrm_storage_snapshot_scan_properties;
+    factory->proxy_by_label = tmrm_storage_snapshot_proxy_by_label;
+    factory->proxies = tmrm_storage_snapshot_proxies;
+    factory->proxy_label = tmrm_storage_snapshot_proxy_label;
+    factory->proxy_keys = tmrm_storage_snapshot_proxy_keys;
+    factory->proxy_values_by_key = tmrm_storage_snapshot_proxy_values_by_key;
+    factory->proxy_is_value_by_key = tmrm_storage_snapshot_proxy_is_value_by_key;
+    factory->proxy_keys_by_value = tmrm_storage_snapshot_proxy_keys_by_value;
+    factory->literal_keys_by_value = tmrm_storage_snapshot_literal_keys_by_value;
+    factory->literal_is_value_by_key = tmrm_storage_snapshot_literal_is_value_by_key;
+    factory->proxy_add_type = tmrm_storage_snapshot_proxy_add_type;
+    factory->proxy_add_superclass = tmrm_storage_snapshot_proxy_add_superclass;
+    factory->proxy_direct_subclasses = tmrm_storage_snapshot_proxy_direct_subclasses;
+    factory->proxy_direct_superclasses = tmrm_storage_snapshot_proxy_direct_superclasses;
+    factory->proxy_direct_types = tmrm_storage_snapshot_proxy_direct_types;
+    factory->proxy_direct_instances = tmrm_storage_snapshot_proxy_direct_instances;
+    factory->snapshot_acquire = tmrm_storage_snapshot_snapshot_acquire;
+    factory->snapshot_release = tmrm_storage_snapshot_snapshot_release;
+}
+
+
+void
+tmrm_init_storage_snapshot(tmrm_subject_map_sphere *sms)
+{
+    tmrm_storage_register_factory(sms, "snapshot",
+            "Read-only memory-mapped snapshot storage module",
+            &tmrm_storage_snapshot_register_factory);
+}
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
 #include <check.h>
 #include <libtmrm.h>
 #include <libtmrm_config.h>
@@ -38,6 +39,10 @@
 #include <tmrm_hash.h>
 #include <tmrm_hash_internal.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #if STORAGE_POSTGRESQL
 #include <libpq-fe.h>
 
@@ -52,8 +57,27 @@
 #define POSTGRESQL_DBNAME "tmrm_test2"
 #endif
 
+#if STORAGE_BDB
+#define BDB_OPTIONS "dir='.',file='tmrm_test.db',new='yes'"
+#endif
+
+#if STORAGE_LOG
+/* Small segments, so that the test runs through compaction */
+#define LOG_OPTIONS "dir='.',name='tmrm_test',segment_size='4096'," \
+    "compact_segments='2'"
+#endif
+
+#define SNAPSHOT_FILE "tmrm_test.snp"
+/* The snapshot is exported from whichever writable backend is built */
+#if STORAGE_LOG
+#define SNAPSHOT_SOURCE "log", LOG_OPTIONS ",new='yes'"
+#elif STORAGE_BDB
+#define SNAPSHOT_SOURCE "dbd", BDB_OPTIONS
+#endif
+
 void setup(void);
 void teardown(void);
+void snapshot_teardown(void);
 
 #if STORAGE_POSTGRESQL
 PGconn* pg_conn;
@@ -91,6 +115,13 @@ teardown (void)
 #endif
 }
 
+void
+snapshot_teardown (void)
+{
+    teardown();
+    remove(SNAPSHOT_FILE);
+}
+
 #if STORAGE_POSTGRESQL
 void pgsql_new_storage_setup(void) {
     PGresult* res;
@@ -642,7 +673,7 @@ START_TEST (test_proxy_subclasses)
         fail_if(lit == NULL, "Could not create literal");
         res = tmrm_proxy_add_property_literal(proxy[i], bottom, lit);
         tmrm_literal_free(lit);
-        free(label);
+        tmrm_free(label);
     }
 
     /* Create the superclass/subclass hierarchy as specified above */
@@ -826,7 +857,7 @@ START_TEST (test_is_value_by_key)
         fail_if(lit == NULL, "Could not create literal");
         res = tmrm_proxy_add_property_literal(proxy[i], bottom, lit);
         tmrm_literal_free(lit);
-        free(label);
+        tmrm_free(label);
     }
 
     tmrm_proxy_add_property(proxy[0], proxy[1], proxy[2]);
@@ -990,7 +1021,7 @@ START_TEST(test_new_hash)
     res_str = tmrm_hash_get(h, "key");
     fail_if(res_str == NULL, "Could not retrieve value for 'key'");
     fail_unless(strncmp(res_str, "value", 5) == 0, "Invalid value for 'key': %s", res_str);
-    free(res_str);
+    tmrm_free(res_str);
 
     tmrm_hash_free(h);
 
@@ -1106,13 +1137,13 @@ START_TEST(test_hash_get_del)
     fail_if(strcmp(value, "foo"), "Expected value 'foo'");
     fail_if(tmrm_hash_size(h) != 2, "Size should still be 2 (now %d)",
         tmrm_hash_size(h));
-    free(value);
+    tmrm_free(value);
     value = tmrm_hash_get_del(h, "field2");
     fail_unless(strcmp(value, "bar") || strcmp(value, "baz"),
         "value should be 'bar' or 'baz'");
     fail_if(tmrm_hash_size(h) != 0, "Size should still be 0 (now %d)",
         tmrm_hash_size(h));
-    free(value);
+    tmrm_free(value);
 
     h2 = tmrm_hash_new_from_hash(h);
     fail_if(h2 == NULL, "Could not clone hash");
@@ -1226,61 +1257,2485 @@ START_TEST(test_pgsql_create_storage)
 END_TEST
 #endif
 
-Suite*
-libtmrm_suite (void)
+#if STORAGE_BDB
+START_TEST(test_bdb_storage)
 {
-    Suite *s = suite_create("libtmrm");
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[3], *q[2], *r, *bottom;
+    tmrm_literal *lit;
+    tmrm_multiset *set;
+    char *label;
+    int i, res;
 
-    TCase *tc_sm = tcase_create("Subject Map");
-    /* tcase_add_checked_fixture(tc_sm, setup, teardown); */
-    tcase_add_test(tc_sm, test_pgsql_storage);
-    tcase_add_test(tc_sm, test_subject_map_yaml_import);
-    tcase_add_checked_fixture(tc_sm, setup, teardown);
-    suite_add_tcase(s, tc_sm);
+    printf("=> test_bdb_storage\n");
 
-    TCase *tc_list = tcase_create("List");
-    tcase_add_test(tc_list, test_new_list);
-    tcase_add_checked_fixture(tc_list, setup, teardown);
-    suite_add_tcase(s, tc_list);
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, "dbd", BDB_OPTIONS);
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
 
-    TCase *tc_ms = tcase_create("Multi Set");
-    tcase_add_test(tc_ms, test_new_multiset);
-    tcase_add_test(tc_ms, test_add_multiset);
-    tcase_add_checked_fixture(tc_ms, setup, teardown);
-    suite_add_tcase(s, tc_ms);
+    bottom = tmrm_subject_map_bottom(m);
+    fail_if(bottom == NULL, "Did not find proxy _bottom_");
 
-    TCase *tc_tuple = tcase_create("Tuple");
-    tcase_add_test(tc_tuple, test_new_tuple);
-    tcase_add_test(tc_tuple, test_tuple_get_at);
-    tcase_add_checked_fixture(tc_tuple, setup, teardown);
-    suite_add_tcase(s, tc_tuple);
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    lit = tmrm_literal_new("p0", "http://www.w3.org/2001/XMLSchema#string");
+    res = tmrm_proxy_add_property_literal(p[0], bottom, lit);
+    fail_unless(res == 0, "Could not add literal property");
+    res = tmrm_proxy_add_property(p[0], p[1], p[2]);
+    fail_unless(res == 0, "Could not add property");
 
-    TCase *tc_hash = tcase_create("Hash");
-    tcase_add_test(tc_hash, test_new_hash);
-    tcase_add_test(tc_hash, test_hash_new_from_string);
-    tcase_add_test(tc_hash, test_hash_get);
-    tcase_add_test(tc_hash, test_hash_get_del);
-    tcase_add_checked_fixture(tc_hash, setup, teardown);
-    suite_add_tcase(s, tc_hash);
+    set = tmrm_proxy_is_value_by_key(p[2], p[1]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "is_value_by_key(p2, p1) returned %d proxies", i);
+    tmrm_multiset_free(set);
 
-    TCase *tc_proxy = tcase_create("Proxy");
-    tcase_add_test(tc_proxy, test_create_proxy);
-    tcase_add_test(tc_proxy, test_clone_proxy);
-    tcase_add_test(tc_proxy, test_create_property_literal);
-    tcase_add_test(tc_proxy, test_values_by_key);
-    tcase_add_test(tc_proxy, test_literal_keys_by_value);
-    tcase_add_test(tc_proxy, test_proxy_subclasses);
-    tcase_add_test(tc_proxy, test_is_value_by_key);
-    tcase_add_checked_fixture(tc_proxy, setup, teardown);
-    suite_add_tcase(s, tc_proxy);
+    set = tmrm_literal_is_value_by_key(lit, bottom);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "literal_is_value_by_key(lit, bottom) returned %d "
+        "proxies", i);
+    tmrm_multiset_free(set);
 
-#if STORAGE_POSTGRESQL
-    TCase *tc_pgsql = tcase_create("PostgresSQL");
-    tcase_add_test(tc_pgsql, test_pgsql_create_storage);
-    tcase_add_checked_fixture(tc_pgsql,
-        pgsql_new_storage_setup, pgsql_new_storage_teardown);
-    /* not needed: tcase_set_timeout(tc_pgsql, 0);*/
-    suite_add_tcase(s, tc_pgsql);
+    /* Removing the value also removes the property from all indexes */
+    res = tmrm_proxy_remove(p[2]);
+    fail_unless(res == 0, "Could not remove proxy");
+    set = tmrm_proxy_values_by_key(p[0], p[1]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 0, "values_by_key(p0, p1) returned %d values after "
+        "removal", i);
+    tmrm_multiset_free(set);
+
+    /* Two proxies with equal properties are merged into one, and the
+       properties that have the removed proxy as value are moved over */
+    for (i = 0; i < 2; i++) {
+        q[i] = tmrm_proxy_new(m);
+        fail_if(q[i] == NULL, "Could not create proxy");
+        res = tmrm_proxy_add_property(q[i], p[1], p[0]);
+        fail_unless(res == 0, "Could not add property");
+        res = tmrm_proxy_add_property(q[i], p[1], bottom);
+        fail_unless(res == 0, "Could not add property");
+    }
+    r = tmrm_proxy_new(m);
+    fail_if(r == NULL, "Could not create proxy");
+    res = tmrm_proxy_add_property(r, p[1], q[1]);
+    fail_unless(res == 0, "Could not add property");
+
+    set = tmrm_proxy_keys(q[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "keys(q0) returned %d keys", i);
+    tmrm_multiset_free(set);
+
+    label = (char*)tmrm_proxy_label(q[1]);
+    res = tmrm_subject_map_merge(m);
+    fail_unless(res == 0, "Could not merge subject map");
+    set = tmrm_proxy_is_value_by_key(p[0], p[1]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "is_value_by_key(p0, p1) returned %d proxies after "
+        "merge", i);
+    tmrm_multiset_free(set);
+    set = tmrm_proxy_is_value_by_key(q[0], p[1]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "is_value_by_key(q0, p1) returned %d proxies after "
+        "merge", i);
+    tmrm_multiset_free(set);
+    fail_unless(tmrm_proxy_by_label(m, label) == NULL,
+        "Proxy %s survived the merge", label);
+    tmrm_free(label);
+
+    tmrm_proxy_free(q[0]);
+    tmrm_proxy_free(q[1]);
+    tmrm_proxy_free(r);
+    tmrm_literal_free(lit);
+    tmrm_proxy_free(p[0]);
+    tmrm_proxy_free(p[1]);
+    tmrm_proxy_free(bottom);
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+#endif
+
+#ifdef SNAPSHOT_SOURCE
+START_TEST(test_snapshot_storage)
+{
+    tmrm_storage *storage, *snapshot;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map *m, *snapshot_map;
+    tmrm_proxy *p[3], *q[3], *bottom;
+    tmrm_literal *lit;
+    tmrm_multiset *set;
+    char *label;
+    int i, res;
+
+    printf("=> test_snapshot_storage\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, SNAPSHOT_SOURCE);
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    lit = tmrm_literal_new("p0", "http://www.w3.org/2001/XMLSchema#string");
+    bottom = tmrm_subject_map_bottom(m);
+    fail_if(bottom == NULL, "Did not find proxy _bottom_");
+    res = tmrm_proxy_add_property_literal(p[0], bottom, lit);
+    fail_unless(res == 0, "Could not add literal property");
+    res = tmrm_proxy_add_property(p[0], p[1], p[2]);
+    fail_unless(res == 0, "Could not add property");
+    tmrm_proxy_free(bottom);
+
+    res = tmrm_subject_map_export_snapshot(m, SNAPSHOT_FILE);
+    fail_unless(res == 0, "Could not export snapshot");
+
+    snapshot = tmrm_storage_new(sms, "snapshot", "file='" SNAPSHOT_FILE "'");
+    fail_if(snapshot == NULL, "Could not open snapshot");
+    snapshot_map = tmrm_subject_map_new(sms, snapshot, "snapshot");
+    fail_if(snapshot_map == NULL, "Could not create subject map");
+
+    /* Labels are preserved by the export */
+    for (i = 0; i < 3; i++) {
+        label = (char*)tmrm_proxy_label(p[i]);
+        q[i] = tmrm_proxy_by_label(snapshot_map, label);
+        fail_if(q[i] == NULL, "Proxy %s not found in snapshot", label);
+        tmrm_free(label);
+    }
+
+    set = tmrm_proxy_values_by_key(q[0], q[1]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "values_by_key(q0, q1) returned %d values", i);
+    tmrm_multiset_free(set);
+
+    set = tmrm_proxy_is_value_by_key(q[2], q[1]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "is_value_by_key(q2, q1) returned %d proxies", i);
+    tmrm_multiset_free(set);
+
+    bottom = tmrm_subject_map_bottom(snapshot_map);
+    fail_if(bottom == NULL, "Did not find proxy _bottom_ in snapshot");
+    set = tmrm_literal_is_value_by_key(lit, bottom);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "literal_is_value_by_key(lit, bottom) returned %d "
+        "proxies", i);
+    tmrm_multiset_free(set);
+
+    fail_unless(tmrm_proxy_new(snapshot_map) == NULL,
+        "Created a proxy in a read-only snapshot");
+
+    tmrm_literal_free(lit);
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+        tmrm_proxy_free(q[i]);
+    }
+    tmrm_proxy_free(bottom);
+    tmrm_subject_map_free(snapshot_map);
+    tmrm_storage_free(snapshot);
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Writes data to SNAPSHOT_FILE with the 32 bit word at offset replaced by
+   word and checks that the snapshot storage rejects it */
+static void
+check_corrupt_snapshot(tmrm_subject_map_sphere* sms, const unsigned char* data,
+        size_t size, size_t offset, unsigned int word, const char* what)
+{
+    tmrm_storage* snapshot;
+    FILE* fh;
+
+    fail_unless(offset + sizeof(word) <= size, "%s is beyond the file", what);
+    fh = fopen(SNAPSHOT_FILE, "wb");
+    fail_if(fh == NULL, "Could not write snapshot");
+    fail_unless(fwrite(data, 1, offset, fh) == offset &&
+        fwrite(&word, sizeof(word), 1, fh) == 1 &&
+        fwrite(data + offset + sizeof(word), 1,
+            size - offset - sizeof(word), fh) == size - offset - sizeof(word),
+        "Could not write snapshot");
+    fclose(fh);
+    snapshot = tmrm_storage_new(sms, "snapshot", "file='" SNAPSHOT_FILE "'");
+    fail_unless(snapshot == NULL, "Opened a snapshot with a corrupt %s", what);
+}
+
+START_TEST(test_snapshot_corrupt)
+{
+    tmrm_storage *storage, *snapshot;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map *m;
+    tmrm_proxy *p[3], *bottom;
+    tmrm_literal *lit;
+    unsigned char *data;
+    unsigned int header[6], word;
+    size_t size, offsets, forward, literals, i;
+    FILE *fh;
+    int res;
+
+    printf("=> test_snapshot_corrupt\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, SNAPSHOT_SOURCE);
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    lit = tmrm_literal_new("p0", "http://www.w3.org/2001/XMLSchema#string");
+    bottom = tmrm_subject_map_bottom(m);
+    res = tmrm_proxy_add_property_literal(p[0], bottom, lit);
+    res |= tmrm_proxy_add_property(p[0], p[1], p[2]);
+    fail_unless(res == 0, "Could not add properties");
+    res = tmrm_subject_map_export_snapshot(m, SNAPSHOT_FILE);
+    fail_unless(res == 0, "Could not export snapshot");
+    tmrm_literal_free(lit);
+    tmrm_proxy_free(bottom);
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+
+    /* The magic is followed by 32 bit version, byte order and the sizes of
+       the proxy, property, literal and pool tables */
+    fh = fopen(SNAPSHOT_FILE, "rb");
+    fail_if(fh == NULL, "Could not read snapshot");
+    fseek(fh, 0, SEEK_END);
+    size = (size_t)ftell(fh);
+    rewind(fh);
+    data = (unsigned char*)malloc(size);
+    fail_if(data == NULL, "Could not read snapshot");
+    fail_unless(fread(data, 1, size, fh) == size, "Could not read snapshot");
+    fclose(fh);
+    memcpy(header, data + 8, sizeof(header));
+    offsets = 8 + sizeof(header) + header[2] * sizeof(word);
+    forward = offsets + (header[2] + 1) * sizeof(word);
+    literals = forward + header[3] * 2 * 4 * sizeof(word);
+
+    /* A proxy whose properties run past the property table */
+    check_corrupt_snapshot(sms, data, size, offsets + sizeof(word),
+        header[3] + 1, "offset");
+    /* A property that refers to a missing literal */
+    for (i = 0; i < header[3]; i++) {
+        memcpy(&word, data + forward + (4 * i + 2) * sizeof(word),
+            sizeof(word));
+        if (word == 1) break;
+    }
+    fail_unless(i < header[3], "The snapshot has no literal property");
+    check_corrupt_snapshot(sms, data, size,
+        forward + (4 * i + 3) * sizeof(word), header[4], "literal index");
+    /* A literal whose value lies beyond the pool */
+    check_corrupt_snapshot(sms, data, size, literals, header[5],
+        "pool offset");
+    check_corrupt_snapshot(sms, data, size, 0, 0, "magic");
+
+    /* The intact file opens */
+    fh = fopen(SNAPSHOT_FILE, "wb");
+    fail_if(fh == NULL, "Could not write snapshot");
+    fail_unless(fwrite(data, 1, size, fh) == size, "Could not write snapshot");
+    fclose(fh);
+    snapshot = tmrm_storage_new(sms, "snapshot", "file='" SNAPSHOT_FILE "'");
+    fail_if(snapshot == NULL, "Could not open snapshot");
+    tmrm_storage_free(snapshot);
+
+    free(data);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+#endif
+
+#if STORAGE_LOG
+START_TEST(test_log_storage)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[100], *bottom;
+    tmrm_literal *lit;
+    tmrm_multiset *set, *inputs;
+    FILE *fh;
+    char *label[3];
+    int i, k, res;
+
+    printf("=> test_log_storage\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+
+    bottom = tmrm_subject_map_bottom(m);
+    fail_if(bottom == NULL, "Did not find proxy _bottom_");
+    lit = tmrm_literal_new("p0", "http://www.w3.org/2001/XMLSchema#string");
+    for (i = 0; i < 100; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    for (i = 0; i < 99; i++) {
+        res = tmrm_proxy_add_property(p[i], p[0], p[i + 1]);
+        fail_unless(res == 0, "Could not add property");
+    }
+    /* Fills enough segments for a compaction */
+    for (i = 0; i < 99; i++) {
+        for (k = 1; k < 4; k++) {
+            res = tmrm_proxy_add_property(p[i], p[k], p[i + 1]);
+            fail_unless(res == 0, "Could not add property");
+        }
+    }
+    res = tmrm_proxy_add_property_literal(p[0], bottom, lit);
+    fail_unless(res == 0, "Could not add literal property");
+    res = tmrm_proxy_remove(p[99]);
+    fail_unless(res == 0, "Could not remove proxy");
+    for (i = 0; i < 3; i++) {
+        label[i] = (char*)tmrm_proxy_label(p[i]);
+    }
+    for (i = 0; i < 99; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_proxy_free(bottom);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+
+    /* Compaction finishes before the storage is freed */
+    fh = fopen("./tmrm_test.log.000001", "rb");
+    if (fh) fclose(fh);
+    fail_unless(fh == NULL, "The first segment was not compacted");
+
+    /* Reopen: the state is rebuilt from the snapshot and the log */
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS);
+    fail_if(storage == NULL, "Could not reopen storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_by_label(m, label[i]);
+        fail_if(p[i] == NULL, "Proxy %s was lost", label[i]);
+        tmrm_free(label[i]);
+    }
+
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "values_by_key(p1, p0) returned %d values", i);
+    tmrm_multiset_free(set);
+
+    set = tmrm_proxy_is_value_by_key(p[2], p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "is_value_by_key(p2, p0) returned %d proxies", i);
+    tmrm_multiset_free(set);
+
+    bottom = tmrm_subject_map_bottom(m);
+    set = tmrm_literal_is_value_by_key(lit, bottom);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "literal_is_value_by_key(lit, bottom) returned %d "
+        "proxies", i);
+    tmrm_multiset_free(set);
+
+    /* All inputs in one call; duplicates count once per occurrence */
+    inputs = tmrm_multiset_new(m);
+    tmrm_multiset_insert(inputs, (tmrm_object*)p[1]);
+    tmrm_multiset_insert(inputs, (tmrm_object*)p[2]);
+    tmrm_multiset_insert(inputs, (tmrm_object*)p[2]);
+    tmrm_multiset_insert(inputs, (tmrm_object*)lit);
+    set = tmrm_subject_map_is_value_by_key(inputs, p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 3, "is_value_by_key({p1, p2, p2, lit}, p0) returned %d "
+        "proxies", i);
+    tmrm_multiset_free(set);
+    tmrm_multiset_free(inputs);
+
+    tmrm_literal_free(lit);
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_proxy_free(bottom);
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Checks the state after test_log_merge merged b into a and y into x.
+   label holds the labels of k0, k1, a, b, x and y. */
+static void
+check_log_merge(tmrm_subject_map* m, char** label)
+{
+    tmrm_proxy* p[6];
+    tmrm_literal* lit;
+    tmrm_multiset* set;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        p[i] = tmrm_proxy_by_label(m, label[i]);
+    }
+    fail_if(p[0] == NULL || p[1] == NULL, "A key was lost");
+    fail_if(p[2] == NULL || p[4] == NULL, "A merged proxy was lost");
+    fail_unless(p[3] == NULL, "Proxy b was not merged");
+    fail_unless(p[5] == NULL, "Proxy y was not merged");
+
+    lit = tmrm_literal_new("same", "http://www.w3.org/2001/XMLSchema#string");
+    set = tmrm_literal_is_value_by_key(lit, p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "literal_is_value_by_key(lit, k0) returned %d "
+        "proxies", i);
+    tmrm_multiset_free(set);
+    tmrm_literal_free(lit);
+
+    set = tmrm_proxy_is_value_by_key(p[2], p[1]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "is_value_by_key(a, k1) returned %d proxies", i);
+    tmrm_multiset_free(set);
+
+    set = tmrm_proxy_values_by_key(p[4], p[1]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "values_by_key(x, k1) returned %d values", i);
+    tmrm_multiset_free(set);
+
+    set = tmrm_proxy_keys(p[2]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "a has %d keys", i);
+    tmrm_multiset_free(set);
+
+    for (i = 0; i < 6; i++) {
+        if (p[i]) tmrm_proxy_free(p[i]);
+    }
+}
+
+START_TEST(test_log_merge)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[6];
+    tmrm_literal *lit;
+    char *label[6];
+    int i;
+
+    printf("=> test_log_merge\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+
+    /* p: k0, k1, a, b, x, y. a and b are equal; once b is merged into a,
+       so are x and y. */
+    for (i = 0; i < 6; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    lit = tmrm_literal_new("same", "http://www.w3.org/2001/XMLSchema#string");
+    fail_unless(tmrm_proxy_add_property_literal(p[2], p[0], lit) == 0,
+        "Could not add literal property");
+    fail_unless(tmrm_proxy_add_property_literal(p[3], p[0], lit) == 0,
+        "Could not add literal property");
+    fail_unless(tmrm_proxy_add_property(p[4], p[1], p[3]) == 0,
+        "Could not add property");
+    fail_unless(tmrm_proxy_add_property(p[5], p[1], p[2]) == 0,
+        "Could not add property");
+    tmrm_literal_free(lit);
+    for (i = 0; i < 6; i++) {
+        label[i] = (char*)tmrm_proxy_label(p[i]);
+        tmrm_proxy_free(p[i]);
+    }
+
+    fail_unless(tmrm_subject_map_merge(m) == 0, "Could not merge");
+    check_log_merge(m, label);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+
+    /* The merge is in the log */
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS);
+    fail_if(storage == NULL, "Could not reopen storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    check_log_merge(m, label);
+
+    for (i = 0; i < 6; i++) {
+        tmrm_free(label[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Writes a proxy with one property and returns their labels */
+static void
+write_log_storage(tmrm_subject_map_sphere* sms, char** label)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map* m;
+    tmrm_proxy* p[2];
+    int i;
+
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 2; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[1]) == 0,
+        "Could not add property");
+    for (i = 0; i < 2; i++) {
+        label[i] = (char*)tmrm_proxy_label(p[i]);
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+}
+
+START_TEST(test_log_corrupt_segment)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[2];
+    tmrm_multiset *set;
+    unsigned int header[2] = {0xfffffff0u, 0};
+    unsigned int byte_order = 0x01020304;
+    char *label[2];
+    FILE *fh;
+    int i;
+
+    printf("=> test_log_corrupt_segment\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+
+    /* A torn record with a huge length at the end of the last segment is
+       cut off */
+    write_log_storage(sms, label);
+    fh = fopen("./tmrm_test.log.000001", "ab");
+    fail_if(fh == NULL, "Could not open the segment");
+    fwrite(header, sizeof(header), 1, fh);
+    fclose(fh);
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS);
+    fail_if(storage == NULL, "Could not open storage with a torn tail");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 2; i++) {
+        p[i] = tmrm_proxy_by_label(m, label[i]);
+        fail_if(p[i] == NULL, "Proxy %s was lost", label[i]);
+        tmrm_free(label[i]);
+    }
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "values_by_key(p1, p0) returned %d values", i);
+    tmrm_multiset_free(set);
+    for (i = 0; i < 2; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+
+    /* Damage in a segment that another one follows fails the open */
+    write_log_storage(sms, label);
+    for (i = 0; i < 2; i++) {
+        tmrm_free(label[i]);
+    }
+    fh = fopen("./tmrm_test.log.000001", "r+b");
+    fail_if(fh == NULL, "Could not open the segment");
+    fseek(fh, 12 + 8, SEEK_SET);
+    fputc(0x7f, fh);
+    fclose(fh);
+    fh = fopen("./tmrm_test.log.000002", "wb");
+    fail_if(fh == NULL, "Could not create a segment");
+    fwrite("TMRMLOG1", 8, 1, fh);
+    fwrite(&byte_order, sizeof(byte_order), 1, fh);
+    fclose(fh);
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS);
+    fail_unless(storage == NULL, "Opened a storage with a damaged segment");
+
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    tmrm_storage_remove(storage, NULL);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+#ifdef HAVE_PTHREAD
+/* Reads p[1] -> p[0] while test_log_concurrent_compaction writes, returns
+   the number of wrong results */
+static void*
+compaction_reader(void* data)
+{
+    tmrm_proxy** p = (tmrm_proxy**)data;
+    tmrm_multiset* set;
+    long wrong = 0;
+    int i;
+
+    for (i = 0; i < 2000; i++) {
+        set = tmrm_proxy_values_by_key(p[1], p[0]);
+        if (!set || tmrm_multiset_size(set) != 1) wrong++;
+        if (set) tmrm_multiset_free(set);
+        set = tmrm_proxy_is_value_by_key(p[2], p[0]);
+        if (!set || tmrm_multiset_size(set) != 1) wrong++;
+        if (set) tmrm_multiset_free(set);
+    }
+    return (void*)wrong;
+}
+#endif
+
+START_TEST(test_log_concurrent_compaction)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[3], *q[50];
+    FILE *fh;
+    int i, k;
+#ifdef HAVE_PTHREAD
+    pthread_t threads[2];
+    void* wrong;
+#endif
+
+    printf("=> test_log_concurrent_compaction\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[2]) == 0,
+        "Could not add property");
+
+#ifdef HAVE_PTHREAD
+    for (i = 0; i < 2; i++) {
+        fail_unless(pthread_create(&threads[i], NULL, compaction_reader,
+            p) == 0, "Could not start thread %d", i);
+    }
+#endif
+    /* Fills segments, so that several compactions run meanwhile */
+    for (i = 0; i < 50; i++) {
+        q[i] = tmrm_proxy_new(m);
+        fail_if(q[i] == NULL, "Could not create proxy");
+    }
+    for (k = 1; k < 50; k++) {
+        for (i = 0; i < 50; i++) {
+            fail_unless(tmrm_proxy_add_property(q[i], q[k], p[i % 3]) == 0,
+                "Could not add property");
+        }
+        if (k % 10 == 0) {
+            fail_unless(tmrm_proxy_remove_properties_by_key(q[k - 1],
+                q[k]) == 0, "Could not remove properties");
+        }
+    }
+#ifdef HAVE_PTHREAD
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], &wrong);
+        fail_unless(wrong == NULL, "Thread %d read %ld wrong results", i,
+            (long)wrong);
+    }
+#endif
+
+    for (i = 0; i < 50; i++) {
+        tmrm_proxy_free(q[i]);
+    }
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+
+    fh = fopen("./tmrm_test.log.000001", "rb");
+    if (fh) fclose(fh);
+    fail_unless(fh == NULL, "The first segment was not compacted");
+
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    tmrm_storage_remove(storage, NULL);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Returns a copy of the only proxy in set and frees set */
+static tmrm_proxy*
+single_proxy(tmrm_multiset* set)
+{
+    tmrm_list *list;
+    tmrm_proxy *p = NULL;
+
+    if (set == NULL) return NULL;
+    if (tmrm_multiset_size(set) == 1) {
+        list = tmrm_multiset_as_list(set);
+        p = tmrm_proxy_clone(tmrm_object_to_proxy(
+            tmrm_list_data(tmrm_list_head(list))));
+        tmrm_list_free(list);
+    }
+    tmrm_multiset_free(set);
+    return p;
+}
+
+START_TEST(test_binary_interchange)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map *m, *m2;
+    tmrm_proxy *p[10], *q, *bottom;
+    tmrm_literal *lit;
+    tmrm_multiset *set;
+    tmrm_list *list;
+    tmrm_list_elmt *elem;
+    FILE *fh;
+    int i, res;
+
+    printf("=> test_binary_interchange\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+
+    bottom = tmrm_subject_map_bottom(m);
+    lit = tmrm_literal_new("42", "http://www.w3.org/2001/XMLSchema#integer");
+    for (i = 0; i < 10; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    for (i = 1; i < 10; i++) {
+        res = tmrm_proxy_add_property(p[i], p[0], p[i - 1]);
+        fail_unless(res == 0, "Could not add property");
+    }
+    res = tmrm_proxy_add_property_literal(p[5], bottom, lit);
+    fail_unless(res == 0, "Could not add literal property");
+
+    fh = tmpfile();
+    fail_if(fh == NULL, "Could not create temporary file");
+    res = tmrm_subject_map_export_to_binary(m, fh);
+    fail_unless(res == 0, "Could not export subject map");
+    for (i = 0; i < 10; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_proxy_free(bottom);
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m2 = tmrm_subject_map_new(sms, storage, "mymap2");
+    fail_if(m2 == NULL, "Could not create subject map");
+    rewind(fh);
+    res = tmrm_subject_map_import_from_binary(m2, fh);
+    fail_unless(res == 0, "Could not import subject map");
+    fclose(fh);
+
+    /* The literal keeps its datatype and its key stays the bottom proxy */
+    bottom = tmrm_subject_map_bottom(m2);
+    set = tmrm_literal_is_value_by_key(lit, bottom);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "literal_is_value_by_key(lit, bottom) returned %d "
+        "proxies", i);
+    p[5] = single_proxy(set);
+    fail_if(p[5] == NULL, "Could not find p5");
+
+    /* p5 keeps both keys, and the chain of properties with key p0 */
+    set = tmrm_proxy_keys(p[5]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 2, "p5 has %d keys", i);
+    list = tmrm_multiset_as_list(set);
+    for (elem = tmrm_list_head(list); elem; elem = tmrm_list_next(elem)) {
+        p[0] = tmrm_object_to_proxy(tmrm_list_data(elem));
+        if (!tmrm_proxy_equals(p[0], bottom)) break;
+    }
+    fail_if(elem == NULL, "p5 lost key p0");
+    p[0] = tmrm_proxy_clone(p[0]);
+    tmrm_list_free(list);
+    tmrm_multiset_free(set);
+    for (i = 5; i > 1; i--) {
+        p[i - 1] = single_proxy(tmrm_proxy_values_by_key(p[i], p[0]));
+        fail_if(p[i - 1] == NULL, "p%d lost its value", i);
+    }
+    for (i = 5; i < 9; i++) {
+        p[i + 1] = single_proxy(tmrm_proxy_is_value_by_key(p[i], p[0]));
+        fail_if(p[i + 1] == NULL, "p%d is not the value of p%d", i, i + 1);
+    }
+    q = single_proxy(tmrm_proxy_values_by_key(p[1], p[0]));
+    fail_unless(q != NULL && tmrm_proxy_equals(q, p[0]) == 1,
+        "The value of p1 is not p0");
+    tmrm_proxy_free(q);
+    set = tmrm_proxy_is_value_by_key(p[9], p[0]);
+    fail_unless(tmrm_multiset_size(set) == 0, "p9 is a value");
+    tmrm_multiset_free(set);
+    for (i = 1; i < 10; i++) {
+        set = tmrm_proxy_keys(p[i]);
+        fail_unless(tmrm_multiset_size(set) == (i == 5 ? 2 : 1),
+            "p%d has %d keys", i, tmrm_multiset_size(set));
+        tmrm_multiset_free(set);
+    }
+    for (i = 0; i < 10; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+
+    /* A record longer than the rest of the file is rejected before it is
+       read */
+    fh = tmpfile();
+    fail_if(fh == NULL, "Could not create temporary file");
+    fputs("TMRMBIN1S\xff\xff\xff\xff\x7f", fh);
+    rewind(fh);
+    res = tmrm_subject_map_import_from_binary(m2, fh);
+    fail_unless(res == -1, "Imported a record beyond the end of the file");
+    fclose(fh);
+
+    tmrm_literal_free(lit);
+    tmrm_proxy_free(bottom);
+    tmrm_storage_remove(storage, m2);
+    tmrm_subject_map_free(m2);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+
+/* Writes a YAML document with the proxies p0 ... p<count - 1>. Each has a
+   name and points to the next one. The result must be freed. */
+static char*
+yaml_import_document(int count, size_t* len)
+{
+    char *doc;
+    size_t size;
+    int i, n;
+
+    size = 128 + (size_t)count * 128;
+    doc = (char*)malloc(size);
+    if (doc == NULL) return NULL;
+    n = sprintf(doc, "%%YAML 1.1\n---\nsubject_map: 'mymap'\nproxies:\n"
+        "  name:\n    libtmrm_bottom: name\n"
+        "  next:\n    libtmrm_bottom: next\n");
+    for (i = 0; i < count; i++) {
+        n += sprintf(doc + n, "  p%d:\n    libtmrm_bottom: p%d\n"
+            "    name: Name %d\n    next: !proxy p%d\n",
+            i, i, i, (i + 1) % count);
+    }
+    *len = (size_t)n;
+    return doc;
+}
+
+/* Returns the proxy the import created for label. The document names each
+   proxy by its libtmrm_bottom property. */
+static tmrm_proxy*
+yaml_import_proxy(tmrm_subject_map* m, const char* label)
+{
+    tmrm_proxy *bottom, *p;
+    tmrm_literal *lit;
+
+    bottom = tmrm_subject_map_bottom(m);
+    lit = tmrm_literal_new(label, "http://www.w3.org/2001/XMLSchema#string");
+    p = single_proxy(tmrm_literal_is_value_by_key(lit, bottom));
+    tmrm_literal_free(lit);
+    tmrm_proxy_free(bottom);
+    return p;
+}
+
+/* Checks the proxies of a document from yaml_import_document */
+static void
+check_yaml_import(tmrm_subject_map* m, int count)
+{
+    tmrm_proxy *name, *next, *p, *q, *r;
+    tmrm_literal *lit;
+    tmrm_multiset *set;
+    char label[32];
+    int i, j, size;
+
+    name = yaml_import_proxy(m, "name");
+    next = yaml_import_proxy(m, "next");
+    fail_if(name == NULL || next == NULL, "A key was not imported");
+    for (j = 0; j < 3; j++) {
+        i = j * (count - 1) / 2;
+        sprintf(label, "p%d", i);
+        p = yaml_import_proxy(m, label);
+        fail_if(p == NULL, "Proxy %s was not imported", label);
+
+        set = tmrm_proxy_keys(p);
+        fail_if(set == NULL, "Could not retrieve multiset");
+        size = tmrm_multiset_size(set);
+        fail_unless(size == 3, "%s has %d keys", label, size);
+        tmrm_multiset_free(set);
+
+        sprintf(label, "Name %d", i);
+        lit = tmrm_literal_new(label,
+            "http://www.w3.org/2001/XMLSchema#string");
+        q = single_proxy(tmrm_literal_is_value_by_key(lit, name));
+        fail_unless(q != NULL && tmrm_proxy_equals(p, q) == 1,
+            "'%s' is not the name of p%d", label, i);
+        tmrm_proxy_free(q);
+        tmrm_literal_free(lit);
+
+        sprintf(label, "p%d", (i + 1) % count);
+        q = yaml_import_proxy(m, label);
+        fail_if(q == NULL, "Proxy %s was not imported", label);
+        r = single_proxy(tmrm_proxy_is_value_by_key(q, next));
+        fail_unless(r != NULL && tmrm_proxy_equals(p, r) == 1,
+            "p%d does not point to %s", i, label);
+        tmrm_proxy_free(r);
+        tmrm_proxy_free(q);
+        tmrm_proxy_free(p);
+    }
+    tmrm_proxy_free(name);
+    tmrm_proxy_free(next);
+}
+
+START_TEST(test_yaml_import)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    char *doc;
+    size_t len;
+    int res;
+
+    printf("=> test_yaml_import\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+
+    doc = yaml_import_document(10, &len);
+    fail_if(doc == NULL, "Could not create document");
+    res = tmrm_subject_map_import_from_yaml_string(m,
+        (const unsigned char*)doc, len);
+    fail_unless(res == 0, "Could not import document");
+    check_yaml_import(m, 10);
+
+    /* A syntax error after the last proxy fails the import */
+    strcpy(doc + len, "  broken\n");
+    res = tmrm_subject_map_import_from_yaml_string(m,
+        (const unsigned char*)doc, strlen(doc));
+    fail_unless(res == -1, "Imported an invalid document");
+    free(doc);
+
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+
+START_TEST(test_yaml_import_file)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    FILE *fh;
+    char *doc;
+    size_t len;
+    int res;
+
+    printf("=> test_yaml_import_file\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_if(sms == NULL, "Could not create subject map sphere");
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+
+    /* Enough tuples to fill the queue between the parser thread and the
+       writer several times */
+    doc = yaml_import_document(2000, &len);
+    fail_if(doc == NULL, "Could not create document");
+    fh = tmpfile();
+    fail_if(fh == NULL, "Could not create temporary file");
+    fail_unless(fwrite(doc, 1, len, fh) == len, "Could not write document");
+    rewind(fh);
+    res = tmrm_subject_map_import_from_yaml(m, fh);
+    fail_unless(res == 0, "Could not import document");
+    fclose(fh);
+    check_yaml_import(m, 2000);
+
+    /* The parser thread reports a syntax error after the last proxy */
+    fh = tmpfile();
+    fail_if(fh == NULL, "Could not create temporary file");
+    fail_unless(fwrite(doc, 1, len, fh) == len, "Could not write document");
+    fputs("  broken\n", fh);
+    rewind(fh);
+    res = tmrm_subject_map_import_from_yaml(m, fh);
+    fail_unless(res == -1, "Imported an invalid document");
+    fclose(fh);
+    free(doc);
+
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+
+/* Evaluates expr for the proxies in start and returns the result size */
+static int
+path_count(tmrm_subject_map* m, const char* expr, tmrm_proxy** start,
+        int count)
+{
+    tmrm_path *path;
+    tmrm_multiset *in, *out;
+    int i, size;
+
+    path = tmrm_path_new(m, expr);
+    if (path == NULL) return -1;
+    in = tmrm_multiset_new(m);
+    for (i = 0; i < count; i++) {
+        tmrm_multiset_insert(in, (tmrm_object*)start[i]);
+    }
+    out = tmrm_path_evaluate(path, in);
+    size = out ? tmrm_multiset_size(out) : -1;
+    if (out) tmrm_multiset_free(out);
+    tmrm_multiset_free(in);
+    tmrm_path_free(path);
+    return size;
+}
+
+START_TEST(test_path_expressions)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[6];
+    tmrm_literal *lit;
+    tmrm_multiset *in, *set;
+    char *k, *l, expr[128];
+    int i, res;
+
+    printf("=> test_path_expressions\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+
+    /* p1 -> p2 -> p3 -> p1 by key p0, and p4 has the literal "x" for p5 */
+    for (i = 0; i < 6; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    res = tmrm_proxy_add_property(p[1], p[0], p[2]);
+    res |= tmrm_proxy_add_property(p[2], p[0], p[3]);
+    res |= tmrm_proxy_add_property(p[3], p[0], p[1]);
+    lit = tmrm_literal_new("x", "http://www.w3.org/2001/XMLSchema#string");
+    res |= tmrm_proxy_add_property_literal(p[4], p[5], lit);
+    fail_unless(res == 0, "Could not add properties");
+    k = (char*)tmrm_proxy_label(p[0]);
+    l = (char*)tmrm_proxy_label(p[5]);
+
+    sprintf(expr, "-> %s", k);
+    i = path_count(m, expr, &p[1], 1);
+    fail_unless(i == 1, "'%s' returned %d objects", expr, i);
+    sprintf(expr, "-> %s -> %s", k, k);
+    i = path_count(m, expr, &p[1], 2);
+    fail_unless(i == 2, "'%s' returned %d objects", expr, i);
+    sprintf(expr, "(-> %s)*", k);
+    i = path_count(m, expr, &p[1], 1);
+    fail_unless(i == 3, "'%s' returned %d objects", expr, i);
+    sprintf(expr, "-> %s ++ <- %s", k, k);
+    i = path_count(m, expr, &p[2], 1);
+    fail_unless(i == 2, "'%s' returned %d objects", expr, i);
+    sprintf(expr, "(-> %s)* -- -> %s", k, k);
+    i = path_count(m, expr, &p[1], 1);
+    fail_unless(i == 2, "'%s' returned %d objects", expr, i);
+    sprintf(expr, "(-> %s)* == <- %s", k, k);
+    i = path_count(m, expr, &p[2], 1);
+    fail_unless(i == 1, "'%s' returned %d objects", expr, i);
+    sprintf(expr, "[%s = \"x\"]", l);
+    i = path_count(m, expr, &p[1], 4);
+    fail_unless(i == 1, "'%s' returned %d objects", expr, i);
+    sprintf(expr, "[%s] -> %s / ", l, l);
+    i = path_count(m, expr, &p[3], 2);
+    fail_unless(i == 1, "'%s' returned %d objects", expr, i);
+
+    fail_unless(tmrm_subject_map_sphere_last_error(sms) == TMRM_NO_ERROR,
+        "Valid expressions set an error");
+    fail_unless(path_count(m, "-> ", p, 1) == -1, "Accepted a missing key");
+    fail_unless(tmrm_subject_map_sphere_last_error(sms) == TMRM_SYNTAX_ERROR,
+        "Missing key reported error %d",
+        tmrm_subject_map_sphere_last_error(sms));
+    fail_if(tmrm_subject_map_sphere_last_error_string(sms) == NULL,
+        "No error message");
+    tmrm_subject_map_sphere_clear_error(sms);
+    fail_unless(tmrm_subject_map_sphere_last_error(sms) == TMRM_NO_ERROR,
+        "Error not cleared");
+    fail_unless(tmrm_subject_map_sphere_last_error_string(sms) == NULL,
+        "Error message not cleared");
+    fail_unless(path_count(m, "(-> 1", p, 1) == -1, "Accepted a missing ')'");
+    fail_unless(path_count(m, "-> 999999", p, 1) == -1,
+        "Accepted an unknown key");
+
+    in = tmrm_multiset_new(m);
+    tmrm_multiset_insert(in, (tmrm_object*)p[2]);
+    set = tmrm_subject_map_is_value_by_key_star(in, p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 1, "is_value_by_key_star(p2, p0) returned %d proxies", i);
+    tmrm_multiset_free(set);
+    tmrm_multiset_free(in);
+
+    tmrm_free(k);
+    tmrm_free(l);
+    tmrm_literal_free(lit);
+    for (i = 0; i < 6; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Adds the property <key, value> to the list properties */
+static void
+add_property_tuple(tmrm_list* properties, tmrm_proxy* key,
+        tmrm_object* value)
+{
+    tmrm_object* values[2];
+
+    values[0] = (tmrm_object*)key;
+    values[1] = value;
+    tmrm_list_ins_next(properties, tmrm_list_tail(properties),
+            (tmrm_object*)tmrm_tuple_new(2, values, NULL));
+}
+
+/* Returns the number of proxies that have all properties */
+static int
+properties_count(tmrm_subject_map* m, tmrm_list* properties)
+{
+    tmrm_iterator *it;
+    tmrm_object *object;
+    int size = 0;
+
+    it = tmrm_proxies_by_properties(m, properties);
+    if (it == NULL) return -1;
+    while (!tmrm_iterator_end(it)) {
+        object = tmrm_iterator_get_object(it);
+        if (object == NULL) break;
+        tmrm_object_free(object);
+        size++;
+        tmrm_iterator_next(it);
+    }
+    tmrm_iterator_free(it);
+    return size;
+}
+
+START_TEST(test_proxies_by_properties)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[6];
+    tmrm_literal *x, *y;
+    tmrm_list *properties;
+    int i, res;
+
+    printf("=> test_proxies_by_properties\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+
+    /* p2 and p3 have "x" for p0 and p1 for p1, p3 has "x" twice, p4 only
+       has "x" and p5 only has p1 */
+    for (i = 0; i < 6; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    x = tmrm_literal_new("x", "http://www.w3.org/2001/XMLSchema#string");
+    y = tmrm_literal_new("y", "http://www.w3.org/2001/XMLSchema#string");
+    res = tmrm_proxy_add_property_literal(p[2], p[0], x);
+    res |= tmrm_proxy_add_property(p[2], p[1], p[1]);
+    res |= tmrm_proxy_add_property_literal(p[3], p[0], x);
+    res |= tmrm_proxy_add_property_literal(p[3], p[0], x);
+    res |= tmrm_proxy_add_property(p[3], p[1], p[1]);
+    res |= tmrm_proxy_add_property_literal(p[4], p[0], x);
+    res |= tmrm_proxy_add_property(p[5], p[1], p[1]);
+    fail_unless(res == 0, "Could not add properties");
+
+    properties = tmrm_list_new((tmrm_list_free_handler*)tmrm_tuple_free);
+    i = properties_count(m, properties);
+    fail_unless(i == 0, "No properties matched %d proxies", i);
+    add_property_tuple(properties, p[0], (tmrm_object*)x);
+    i = properties_count(m, properties);
+    fail_unless(i == 3, "{p0: x} matched %d proxies", i);
+    add_property_tuple(properties, p[1], (tmrm_object*)p[1]);
+    i = properties_count(m, properties);
+    fail_unless(i == 2, "{p0: x, p1: p1} matched %d proxies", i);
+    add_property_tuple(properties, p[0], (tmrm_object*)y);
+    i = properties_count(m, properties);
+    fail_unless(i == 0, "{p0: x, p1: p1, p0: y} matched %d proxies", i);
+    tmrm_list_free(properties);
+
+    tmrm_literal_free(x);
+    tmrm_literal_free(y);
+    for (i = 0; i < 6; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Returns the number of objects of it and frees it */
+static int
+iterator_count(tmrm_iterator* it)
+{
+    tmrm_object *object;
+    int size = 0;
+
+    if (it == NULL) return -1;
+    while (!tmrm_iterator_end(it)) {
+        object = tmrm_iterator_get_object(it);
+        if (object == NULL) break;
+        tmrm_object_free(object);
+        size++;
+        tmrm_iterator_next(it);
+    }
+    tmrm_iterator_free(it);
+    return size;
+}
+
+START_TEST(test_read_cache)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[5];
+    tmrm_literal *lit;
+    tmrm_multiset *set;
+    unsigned long hits, misses;
+    int i, res;
+
+    printf("=> test_read_cache\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    fail_unless(tmrm_subject_map_set_cache_size(m, 2) == 0,
+        "Could not enable the cache");
+
+    for (i = 0; i < 5; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    res = tmrm_proxy_add_property(p[1], p[0], p[2]);
+    fail_unless(res == 0, "Could not add property");
+
+    for (i = 0; i < 2; i++) {
+        set = tmrm_proxy_values_by_key(p[1], p[0]);
+        fail_unless(tmrm_multiset_size(set) == 1,
+            "values_by_key returned %d objects", tmrm_multiset_size(set));
+        tmrm_multiset_free(set);
+    }
+    tmrm_subject_map_cache_stats(m, &hits, &misses);
+    fail_unless(hits == 1 && misses == 1, "%lu hits, %lu misses",
+        hits, misses);
+
+    /* Writes drop exactly the results they change */
+    i = iterator_count(tmrm_proxy_direct_types(p[1]));
+    fail_unless(i == 0, "p1 has %d types", i);
+    res = tmrm_proxy_add_property(p[1], p[0], p[3]);
+    res |= tmrm_proxy_add_type(p[1], p[4]);
+    fail_unless(res == 0, "Could not add properties");
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_unless(tmrm_multiset_size(set) == 2,
+        "values_by_key returned %d objects", tmrm_multiset_size(set));
+    tmrm_multiset_free(set);
+    i = iterator_count(tmrm_proxy_direct_types(p[1]));
+    fail_unless(i == 1, "p1 has %d types", i);
+    i = iterator_count(tmrm_proxy_direct_types(p[1]));
+    fail_unless(i == 1, "p1 has %d types", i);
+
+    /* tmrm_proxy_remove() frees the proxies */
+    fail_unless(tmrm_proxy_remove(p[4]) == 0, "Could not remove proxy");
+    i = iterator_count(tmrm_proxy_direct_types(p[1]));
+    fail_unless(i == 0, "p1 has %d types after removing p4", i);
+    fail_unless(tmrm_proxy_remove(p[3]) == 0, "Could not remove proxy");
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_unless(tmrm_multiset_size(set) == 1,
+        "values_by_key returned %d objects", tmrm_multiset_size(set));
+    tmrm_multiset_free(set);
+    tmrm_subject_map_cache_stats(m, &hits, &misses);
+    fail_unless(hits == 2 && misses == 6, "%lu hits, %lu misses",
+        hits, misses);
+
+    lit = tmrm_literal_new("x", "http://www.w3.org/2001/XMLSchema#string");
+    res = tmrm_proxy_add_property_literal(p[1], p[0], lit);
+    fail_unless(res == 0, "Could not add literal property");
+    tmrm_literal_free(lit);
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_unless(tmrm_multiset_size(set) == 2,
+        "values_by_key returned %d objects", tmrm_multiset_size(set));
+    tmrm_multiset_free(set);
+    res = tmrm_proxy_remove_properties_by_key(p[1], p[0]);
+    fail_unless(res == 0, "Could not remove properties");
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_unless(tmrm_multiset_size(set) == 0,
+        "values_by_key returned %d objects", tmrm_multiset_size(set));
+    tmrm_multiset_free(set);
+
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+START_TEST(test_arena)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[3], *q;
+    tmrm_multiset *set;
+    tmrm_arena* arena;
+    int i, res;
+
+    printf("=> test_arena\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    fail_unless(tmrm_subject_map_set_cache_size(m, 4) == 0,
+        "Could not enable the cache");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+
+    /* Query results are left to the arena, writes reach the storage */
+    arena = tmrm_arena_begin();
+    fail_if(arena == NULL, "Could not open arena");
+    q = tmrm_proxy_new(m);
+    fail_if(q == NULL, "Could not create proxy in arena");
+    res = tmrm_proxy_add_property(p[1], p[0], p[2]);
+    res |= tmrm_proxy_add_property(p[1], p[0], q);
+    fail_unless(res == 0, "Could not add property");
+    for (i = 0; i < 3; i++) {
+        set = tmrm_proxy_values_by_key(p[1], p[0]);
+        fail_unless(tmrm_multiset_size(set) == 2,
+            "values_by_key returned %d objects", tmrm_multiset_size(set));
+    }
+    fail_unless(tmrm_arena_allocated(arena) > 0, "Arena is empty");
+    tmrm_arena_end(arena);
+
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_unless(tmrm_multiset_size(set) == 2,
+        "values_by_key returned %d objects", tmrm_multiset_size(set));
+    tmrm_multiset_free(set);
+
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+#endif
+
+START_TEST(test_pools)
+{
+    tmrm_list* list;
+    size_t before, in_use, capacity;
+    int i;
+
+    printf("=> test_pools\n");
+
+    tmrm_pool_stats(TMRM_POOL_LIST_ELEMENT, &before, NULL);
+    list = tmrm_list_new(NULL);
+    fail_if(list == NULL, "Could not create list");
+    for (i = 0; i < 100; i++) {
+        fail_unless(tmrm_list_ins_next(list, NULL, NULL) == 0,
+            "Could not insert element %d", i);
+    }
+    tmrm_pool_stats(TMRM_POOL_LIST_ELEMENT, &in_use, &capacity);
+    fail_unless(in_use == before + 100, "%lu list elements in use",
+        (unsigned long)in_use);
+    fail_unless(capacity >= in_use, "Pool holds %lu list elements",
+        (unsigned long)capacity);
+    tmrm_list_free(list);
+    tmrm_pool_stats(TMRM_POOL_LIST_ELEMENT, &in_use, NULL);
+    fail_unless(in_use == before, "%lu list elements in use after free",
+        (unsigned long)in_use);
+}
+END_TEST
+
+/* Returns the number of live tmrm_list blocks */
+static size_t
+live_lists(void)
+{
+    tmrm_memory_type_stats* stats;
+    size_t live = 0;
+    int count, i;
+
+    stats = tmrm_memory_stats(&count);
+    for (i = 0; i < count; i++) {
+        if (!strcmp(stats[i].type, "tmrm_list")) live = stats[i].count;
+    }
+    if (stats) tmrm_free(stats);
+    return live;
+}
+
+START_TEST(test_memory_report)
+{
+    tmrm_list* list;
+    tmrm_memory_type_stats* stats;
+    char* report;
+    size_t before;
+    int count;
+
+    printf("=> test_memory_report\n");
+
+    report = tmrm_memory_report(TMRM_STATS_TEXT);
+    fail_if(report == NULL, "Could not create report");
+    fail_if(strstr(report, "pool list_element") == NULL,
+        "No list element pool in report:\n%s", report);
+    tmrm_free(report);
+    report = tmrm_memory_report(TMRM_STATS_JSON);
+    fail_if(report == NULL, "Could not create JSON report");
+    fail_unless(strncmp(report, "{\"types\": {", 11) == 0,
+        "Unexpected JSON report %s", report);
+    fail_if(strstr(report, "\"pools\": {\"list_element\"") == NULL,
+        "No pools in JSON report %s", report);
+    tmrm_free(report);
+
+    if (!tmrm_memory_accounting()) {
+        stats = tmrm_memory_stats(&count);
+        fail_unless(stats == NULL && count == 0,
+            "Memory stats without accounting");
+        return;
+    }
+    before = live_lists();
+    list = tmrm_list_new(NULL);
+    fail_if(list == NULL, "Could not create list");
+    fail_unless(live_lists() == before + 1, "%lu lists live, expected %lu",
+        (unsigned long)live_lists(), (unsigned long)before + 1);
+    tmrm_list_free(list);
+    fail_unless(live_lists() == before, "%lu lists live after free",
+        (unsigned long)live_lists());
+    tmrm_memory_stats_reset();
+    stats = tmrm_memory_stats(&count);
+    fail_if(stats == NULL || count == 0, "No memory stats");
+    fail_unless(stats[0].max_bytes == stats[0].bytes,
+        "High-water mark not reset");
+    tmrm_free(stats);
+}
+END_TEST
+
+START_TEST(test_literal_interning)
+{
+    tmrm_literal *a, *b, *c, *d;
+    tmrm_arena* arena;
+    const char* text = "a value that is too long to be stored inline";
+    int id;
+
+    printf("=> test_literal_interning\n");
+
+    id = tmrm_datatype_id((tmrm_char_t*)"http://www.w3.org/2001/XMLSchema#int");
+    fail_unless(id > TMRM_DATATYPE_STRING, "Datatype has ID %d", id);
+    fail_unless(tmrm_datatype_id(
+        (tmrm_char_t*)"http://www.w3.org/2001/XMLSchema#int") == id,
+        "Datatype changed its ID");
+    fail_unless(tmrm_datatype_id((tmrm_char_t*)TMRM_XMLSCHEMA_STRING) ==
+        TMRM_DATATYPE_STRING, "Wrong ID of xsd:string");
+
+    a = tmrm_literal_new((tmrm_char_t*)"42",
+        (tmrm_char_t*)"http://www.w3.org/2001/XMLSchema#int");
+    fail_if(a == NULL, "Could not create literal");
+    fail_unless(tmrm_literal_datatype_id(a) == id, "Wrong datatype ID");
+    fail_unless(strcmp((char*)tmrm_literal_datatype(a),
+        "http://www.w3.org/2001/XMLSchema#int") == 0, "Wrong datatype");
+    b = tmrm_literal_clone(a);
+    fail_unless(strcmp((char*)tmrm_literal_value(b), "42") == 0,
+        "Wrong value of clone");
+    tmrm_literal_free(a);
+    tmrm_literal_free(b);
+
+    tmrm_literal_set_interning(1);
+    a = tmrm_literal_new((tmrm_char_t*)text, (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    b = tmrm_literal_new((tmrm_char_t*)text, (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    fail_if(a == NULL || b == NULL, "Could not create literals");
+    fail_unless(tmrm_literal_value(a) == tmrm_literal_value(b),
+        "Equal values are not shared");
+    c = tmrm_literal_clone(a);
+    fail_unless(tmrm_literal_value(c) == tmrm_literal_value(a),
+        "Clone does not share the value");
+    tmrm_literal_free(a);
+    tmrm_literal_free(b);
+    d = tmrm_literal_new((tmrm_char_t*)text, (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    fail_unless(tmrm_literal_value(d) == tmrm_literal_value(c),
+        "Value was dropped while in use");
+    /* Literals in an arena are not freed one by one, so they copy */
+    arena = tmrm_arena_begin();
+    fail_if(arena == NULL, "Could not open arena");
+    a = tmrm_literal_new((tmrm_char_t*)text, (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    b = tmrm_literal_clone(c);
+    fail_if(a == NULL || b == NULL, "Could not create literals in arena");
+    fail_if(tmrm_literal_value(a) == tmrm_literal_value(c),
+        "Literal in arena shares an interned value");
+    fail_if(tmrm_literal_value(b) == tmrm_literal_value(c),
+        "Clone in arena shares an interned value");
+    fail_unless(strcmp((char*)tmrm_literal_value(b), text) == 0,
+        "Wrong value of clone in arena");
+    tmrm_arena_end(arena);
+    tmrm_literal_free(c);
+    tmrm_literal_free(d);
+    tmrm_literal_set_interning(0);
+
+    a = tmrm_literal_new((tmrm_char_t*)text, (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    b = tmrm_literal_new((tmrm_char_t*)text, (tmrm_char_t*)TMRM_XMLSCHEMA_STRING);
+    fail_if(tmrm_literal_value(a) == tmrm_literal_value(b),
+        "Values are shared without interning");
+    tmrm_literal_free(a);
+    tmrm_literal_free(b);
+}
+END_TEST
+
+#if STORAGE_LOG
+/* Reads p[1] -> p[0] many times, returns the number of wrong results */
+static void*
+concurrent_reader(void* data)
+{
+    tmrm_proxy** p = (tmrm_proxy**)data;
+    tmrm_multiset* set;
+    long wrong = 0;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        set = tmrm_proxy_values_by_key(p[1], p[0]);
+        if (!set || tmrm_multiset_size(set) != 1) wrong++;
+        if (set) tmrm_multiset_free(set);
+    }
+    return (void*)wrong;
+}
+
+START_TEST(test_concurrent_reads)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[3];
+    void* wrong;
+    int i;
+#ifdef HAVE_PTHREAD
+    pthread_t threads[4];
+#endif
+
+    printf("=> test_concurrent_reads\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    fail_unless(tmrm_subject_map_sphere_last_error(sms) == TMRM_NO_ERROR,
+        "New sphere reports an error");
+    fail_unless(tmrm_subject_map_sphere_last_error_string(sms) == NULL,
+        "New sphere has an error message");
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    fail_unless(tmrm_subject_map_set_cache_size(m, 16) == 0,
+        "Could not enable the cache");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[2]) == 0,
+        "Could not add property");
+
+#ifdef HAVE_PTHREAD
+    for (i = 0; i < 4; i++) {
+        fail_unless(pthread_create(&threads[i], NULL, concurrent_reader,
+            p) == 0, "Could not start thread %d", i);
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], &wrong);
+        fail_unless(wrong == NULL, "Thread %d read %ld wrong results", i,
+            (long)wrong);
+    }
+#else
+    wrong = concurrent_reader(p);
+    fail_unless(wrong == NULL, "Read %ld wrong results", (long)wrong);
+#endif
+
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+START_TEST(test_parallel_is_value_by_key)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *key, *holders[600], *values[600];
+    tmrm_multiset *inputs, *set;
+    int i;
+
+    printf("=> test_parallel_is_value_by_key\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    key = tmrm_proxy_new(m);
+    fail_if(key == NULL, "Could not create proxy");
+    inputs = tmrm_multiset_new(m);
+    for (i = 0; i < 600; i++) {
+        holders[i] = tmrm_proxy_new(m);
+        values[i] = tmrm_proxy_new(m);
+        fail_if(holders[i] == NULL || values[i] == NULL,
+            "Could not create proxy");
+        fail_unless(tmrm_proxy_add_property(holders[i], key, values[i]) == 0,
+            "Could not add property");
+        tmrm_multiset_insert(inputs, (tmrm_object*)values[i]);
+    }
+    /* A second holder for the last chunk */
+    fail_unless(tmrm_proxy_add_property(holders[0], key, values[599]) == 0,
+        "Could not add property");
+
+    set = tmrm_subject_map_is_value_by_key(inputs, key);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 601, "Sequential is_value_by_key returned %d proxies", i);
+    tmrm_multiset_free(set);
+
+#ifdef HAVE_PTHREAD
+    fail_unless(tmrm_subject_map_sphere_set_threads(sms, 4) == 0,
+        "Could not start worker threads");
+    set = tmrm_subject_map_is_value_by_key(inputs, key);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    i = tmrm_multiset_size(set);
+    fail_unless(i == 601, "Parallel is_value_by_key returned %d proxies", i);
+    tmrm_multiset_free(set);
+    fail_unless(tmrm_subject_map_sphere_set_threads(sms, 0) == 0,
+        "Could not stop worker threads");
+#else
+    fail_unless(tmrm_subject_map_sphere_set_threads(sms, 4) != 0,
+        "Worker threads started without POSIX threads");
+#endif
+
+    tmrm_multiset_free(inputs);
+    for (i = 0; i < 600; i++) {
+        tmrm_proxy_free(holders[i]);
+        tmrm_proxy_free(values[i]);
+    }
+    tmrm_proxy_free(key);
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Completion callback of test_async: counts the finished requests in
+   done[0] and keeps the size of the last multiset in done[1] */
+static void
+async_done(tmrm_request* r, void* data)
+{
+    int* done = (int*)data;
+    tmrm_multiset* set;
+
+    done[0]++;
+    if (tmrm_request_status(r) != 0) return;
+    if ((set = tmrm_request_take_multiset(r))) {
+        done[1] = tmrm_multiset_size(set);
+        tmrm_multiset_free(set);
+    }
+}
+
+START_TEST(test_async)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_async* a;
+    tmrm_proxy *p[3];
+    struct pollfd pfd;
+    int i, done[2] = {0, -1};
+
+    printf("=> test_async\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    a = tmrm_async_new(sms, 2);
+    fail_if(a == NULL, "Could not create request queue");
+    fail_unless(tmrm_async_dispatch(a) == 0, "Dispatched without requests");
+
+    fail_unless(tmrm_proxy_add_property_async(a, p[1], p[0], p[2],
+        async_done, done) == 0, "Could not submit add_property");
+    while (done[0] < 1) tmrm_async_wait(a);
+    fail_unless(done[1] == -1, "add_property returned a multiset");
+
+    fail_unless(tmrm_proxy_values_by_key_async(a, p[1], p[0], async_done,
+        done) == 0, "Could not submit values_by_key");
+    pfd.fd = tmrm_async_fd(a);
+    pfd.events = POLLIN;
+    fail_unless(poll(&pfd, 1, 10000) == 1, "Completion was not signalled");
+    fail_unless(tmrm_async_dispatch(a) == 1, "Request was not dispatched");
+    fail_unless(done[0] == 2, "Callback ran %d times", done[0]);
+    fail_unless(done[1] == 1, "values_by_key(p1, p0) returned %d values",
+        done[1]);
+    fail_unless(poll(&pfd, 1, 0) == 0, "Descriptor still readable");
+
+    tmrm_async_free(a);
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+START_TEST(test_storage_stats)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[3];
+    tmrm_multiset* set;
+    tmrm_op_stats* stats;
+    tmrm_op_stats* values = NULL;
+    unsigned long total = 0;
+    char* dump;
+    int i, count;
+
+    printf("=> test_storage_stats\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[2]) == 0,
+        "Could not add property");
+    tmrm_subject_map_stats_reset(m);
+
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    tmrm_multiset_free(set);
+
+    stats = tmrm_subject_map_stats(m, &count);
+    fail_if(stats == NULL, "Could not read the statistics");
+    for (i = 0; i < count; i++) {
+        if (strcmp(stats[i].name, "proxy_values_by_key") == 0) {
+            values = &stats[i];
+        } else {
+            fail_unless(stats[i].calls == 0, "%s was called", stats[i].name);
+        }
+    }
+    fail_if(values == NULL, "No statistics for proxy_values_by_key");
+    fail_unless(values->calls == 1, "proxy_values_by_key counted %lu calls",
+        values->calls);
+    fail_unless(values->rows == 1, "proxy_values_by_key counted %lu rows",
+        values->rows);
+    for (i = 0; i < TMRM_STATS_BUCKETS; i++) total += values->histogram[i];
+    fail_unless(total == 1, "Histogram holds %lu calls", total);
+    fail_unless(tmrm_op_stats_percentile(values, 50) >= values->max_ns,
+        "Median below the only latency");
+    fail_unless(tmrm_stats_bucket_limit(4) == 5 &&
+        tmrm_stats_bucket_limit(8) == 10 && tmrm_stats_bucket_limit(12) == 20,
+        "Wrong bucket limits");
+    tmrm_free(stats);
+
+    dump = tmrm_subject_map_stats_dump(m, TMRM_STATS_TEXT);
+    fail_if(dump == NULL, "Could not dump the statistics");
+    fail_unless(strncmp(dump, "proxy_values_by_key ", 20) == 0,
+        "Unexpected text dump: %s", dump);
+    tmrm_free(dump);
+    dump = tmrm_subject_map_stats_dump(m, TMRM_STATS_JSON);
+    fail_if(dump == NULL, "Could not dump the statistics");
+    fail_unless(strncmp(dump, "{\"storage\": \"log\", \"operations\": "
+        "{\"proxy_values_by_key\": {\"calls\": 1,", 69) == 0,
+        "Unexpected JSON dump: %s", dump);
+    tmrm_free(dump);
+
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Tracer of test_tracing: counts the open spans and keeps the last
+   closed one */
+typedef struct {
+    int open;
+    int closed;
+    tmrm_span last;
+} trace_log;
+
+static void
+trace_begin(void* data, tmrm_span* span)
+{
+    ((trace_log*)data)->open++;
+}
+
+static void
+trace_end(void* data, tmrm_span* span)
+{
+    trace_log* log = (trace_log*)data;
+
+    log->open--;
+    log->closed++;
+    log->last = *span;
+}
+
+START_TEST(test_tracing)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[3];
+    tmrm_multiset* set;
+    tmrm_tracer tracer;
+    trace_log log;
+    char *label[2];
+    int i;
+
+    printf("=> test_tracing\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[2]) == 0,
+        "Could not add property");
+
+    memset(&log, 0, sizeof(log));
+    tracer.begin = trace_begin;
+    tracer.end = trace_end;
+    tracer.data = &log;
+    tmrm_subject_map_sphere_set_tracer(sms, &tracer);
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    tmrm_multiset_free(set);
+    tmrm_subject_map_sphere_set_tracer(sms, NULL);
+
+    fail_unless(log.open == 0, "%d spans were not closed", log.open);
+    fail_unless(log.closed == 1, "Traced %d spans", log.closed);
+    fail_unless(strcmp(log.last.operation, "proxy_values_by_key") == 0,
+        "Traced %s", log.last.operation);
+    fail_unless(strcmp(log.last.storage, "log") == 0,
+        "Span of storage %s", log.last.storage);
+    label[0] = tmrm_proxy_label(p[0]);
+    label[1] = tmrm_proxy_label(p[1]);
+    fail_unless(log.last.proxy == atoi(label[1]) &&
+        log.last.key == atoi(label[0]),
+        "Span has proxy %d and key %d", log.last.proxy, log.last.key);
+    tmrm_free(label[0]);
+    tmrm_free(label[1]);
+    fail_unless(log.last.parent == NULL && log.last.sql == NULL &&
+        !log.last.failed, "Unexpected span");
+
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    tmrm_multiset_free(set);
+    fail_unless(log.closed == 1, "Traced without a tracer");
+
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* Log handler of test_logger: counts the messages and keeps the last
+   one */
+typedef struct {
+    int count;
+    tmrm_log_level level;
+    char message[256];
+} log_capture;
+
+static void
+log_handler(void* data, tmrm_log_level level, const char* file, int line,
+        const char* function, const char* message)
+{
+    log_capture* capture = (log_capture*)data;
+
+    capture->count++;
+    capture->level = level;
+    snprintf(capture->message, sizeof(capture->message), "%s", message);
+}
+
+START_TEST(test_logger)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_proxy *p[3];
+    tmrm_multiset* set;
+    log_capture capture;
+    int i;
+
+    printf("=> test_logger\n");
+
+    fail_unless(tmrm_get_log_level() == TMRM_LOG_WARNING,
+        "Default log level is %d", tmrm_get_log_level());
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[2]) == 0,
+        "Could not add property");
+
+    memset(&capture, 0, sizeof(capture));
+    tmrm_set_logger(TMRM_LOG_DEBUG, log_handler, &capture);
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    tmrm_multiset_free(set);
+    fail_unless(capture.count > 0, "No debug messages");
+    fail_unless(capture.level == TMRM_LOG_DEBUG, "Logged level %d",
+        capture.level);
+    fail_if(capture.message[0] == '\0' ||
+        capture.message[strlen(capture.message) - 1] == '\n',
+        "Unexpected message '%s'", capture.message);
+
+    capture.count = 0;
+    tmrm_set_logger(TMRM_LOG_WARNING, log_handler, &capture);
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_if(set == NULL, "Could not retrieve multiset");
+    tmrm_multiset_free(set);
+    fail_unless(capture.count == 0, "Logged %d debug messages",
+        capture.count);
+    tmrm_set_logger(TMRM_LOG_WARNING, NULL, NULL);
+
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+START_TEST(test_subject_map_snapshot)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map *m, *snap;
+    tmrm_proxy *p[4], *sp[2];
+    tmrm_multiset* set;
+    char* label;
+    int i, before;
+
+    printf("=> test_subject_map_snapshot\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "log", LOG_OPTIONS ",new='yes'");
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[2]) == 0,
+        "Could not add property");
+    set = tmrm_subject_map_proxies(m);
+    before = tmrm_multiset_size(set);
+    tmrm_multiset_free(set);
+
+    snap = tmrm_subject_map_snapshot(m);
+    fail_if(snap == NULL, "Could not take snapshot");
+    fail_unless(tmrm_proxy_new(snap) == NULL, "Snapshot is writable");
+
+    /* Change the subject map behind the snapshot */
+    p[3] = tmrm_proxy_new(m);
+    fail_if(p[3] == NULL, "Could not create proxy");
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[3]) == 0,
+        "Could not add property");
+    fail_unless(tmrm_proxy_remove(p[2]) == 0, "Could not remove proxy");
+
+    set = tmrm_subject_map_proxies(snap);
+    fail_unless(tmrm_multiset_size(set) == before,
+        "Snapshot has %d proxies instead of %d", tmrm_multiset_size(set),
+        before);
+    tmrm_multiset_free(set);
+    for (i = 0; i < 2; i++) {
+        label = (char*)tmrm_proxy_label(p[i]);
+        sp[i] = tmrm_proxy_by_label(snap, label);
+        tmrm_free(label);
+        fail_if(sp[i] == NULL, "Proxy %d is not in the snapshot", i);
+    }
+    set = tmrm_proxy_values_by_key(sp[1], sp[0]);
+    fail_unless(tmrm_multiset_size(set) == 1,
+        "Snapshot has %d values", tmrm_multiset_size(set));
+    tmrm_multiset_free(set);
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_unless(tmrm_multiset_size(set) == 1,
+        "Subject map has %d values", tmrm_multiset_size(set));
+    tmrm_multiset_free(set);
+
+    /* Releasing the snapshot reclaims the removed properties */
+    for (i = 0; i < 2; i++) {
+        tmrm_proxy_free(sp[i]);
+    }
+    tmrm_subject_map_free(snap);
+    set = tmrm_proxy_values_by_key(p[1], p[0]);
+    fail_unless(tmrm_multiset_size(set) == 1,
+        "Subject map has %d values after the snapshot",
+        tmrm_multiset_size(set));
+    tmrm_multiset_free(set);
+
+    tmrm_proxy_free(p[0]);
+    tmrm_proxy_free(p[1]);
+    tmrm_proxy_free(p[3]);
+    tmrm_storage_remove(storage, m);
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+#endif
+
+#if STORAGE_POSTGRESQL
+/* Completion callback of test_pgsql_async: counts the finished requests
+   in done[0] and those that found one proxy in done[1] */
+static void
+pgsql_async_done(tmrm_request* r, void* data)
+{
+    int* done = (int*)data;
+    tmrm_multiset* set;
+    tmrm_proxy* p;
+
+    done[0]++;
+    if (tmrm_request_status(r) != 0) return;
+    if ((set = tmrm_request_take_multiset(r))) {
+        if (tmrm_multiset_size(set) == 1) done[1]++;
+        tmrm_multiset_free(set);
+    } else if ((p = tmrm_request_take_proxy(r))) {
+        done[1]++;
+        tmrm_proxy_free(p);
+    }
+}
+
+/* Reads that the PostgreSQL storage sends without blocking */
+START_TEST(test_pgsql_async)
+{
+    tmrm_storage* storage;
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map* m;
+    tmrm_async* a;
+    tmrm_proxy *p[3];
+    struct pollfd pfd;
+    const char* label;
+    int i, done[2] = {0, 0};
+
+    printf("=> test_pgsql_async\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    storage = tmrm_storage_new(sms, "pgsql", POSTGRESQL_OPTIONS);
+    fail_if(storage == NULL, "Could not create storage");
+    m = tmrm_subject_map_new(sms, storage, "mymap");
+    fail_if(m == NULL, "Could not create subject map");
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[2]) == 0,
+        "Could not add property");
+    a = tmrm_async_new(sms, 2);
+    fail_if(a == NULL, "Could not create request queue");
+
+    fail_unless(tmrm_proxy_values_by_key_async(a, p[1], p[0],
+        pgsql_async_done, done) == 0, "Could not submit values_by_key");
+    fail_unless(tmrm_proxy_is_value_by_key_async(a, p[2], p[0],
+        pgsql_async_done, done) == 0, "Could not submit is_value_by_key");
+    fail_unless(tmrm_proxy_keys_by_value_async(a, p[2],
+        pgsql_async_done, done) == 0, "Could not submit keys_by_value");
+    label = tmrm_proxy_label(p[1]);
+    fail_if(label == NULL, "Could not get proxy label");
+    fail_unless(tmrm_proxy_by_label_async(a, m, label,
+        pgsql_async_done, done) == 0, "Could not submit by_label");
+    tmrm_free((char*)label);
+
+    pfd.fd = tmrm_async_fd(a);
+    pfd.events = POLLIN;
+    while (done[0] < 4) {
+        fail_unless(poll(&pfd, 1, 10000) == 1, "Progress was not signalled");
+        tmrm_async_dispatch(a);
+    }
+    fail_unless(done[1] == 4, "%d of 4 requests found their proxy", done[1]);
+    fail_unless(poll(&pfd, 1, 0) == 0, "Descriptor still readable");
+
+    tmrm_async_free(a);
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    tmrm_subject_map_free(m);
+    tmrm_storage_free(storage);
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+
+/* A write on one connection drops the cached results of another connection
+   that listens for changes (option notify) */
+START_TEST(test_pgsql_notify_cache)
+{
+    tmrm_storage *storage[2];
+    tmrm_subject_map_sphere* sms;
+    tmrm_subject_map *m[2];
+    tmrm_proxy *p[3], *q[2];
+    tmrm_multiset* set;
+    unsigned long hits, misses;
+    const char* label;
+    int i, size;
+
+    printf("=> test_pgsql_notify_cache\n");
+
+    sms = tmrm_subject_map_sphere_new();
+    for (i = 0; i < 2; i++) {
+        storage[i] = tmrm_storage_new(sms, "pgsql",
+            POSTGRESQL_OPTIONS ",notify='yes'");
+        fail_if(storage[i] == NULL, "Could not create storage");
+        m[i] = tmrm_subject_map_new(sms, storage[i], "mymap");
+        fail_if(m[i] == NULL, "Could not create subject map");
+    }
+    fail_unless(tmrm_subject_map_set_cache_size(m[1], 16) == 0,
+        "Could not enable the cache");
+
+    for (i = 0; i < 3; i++) {
+        p[i] = tmrm_proxy_new(m[0]);
+        fail_if(p[i] == NULL, "Could not create proxy");
+    }
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[2]) == 0,
+        "Could not add property");
+    for (i = 0; i < 2; i++) {
+        label = tmrm_proxy_label(p[i]);
+        fail_if(label == NULL, "Could not get proxy label");
+        q[i] = tmrm_proxy_by_label(m[1], label);
+        fail_if(q[i] == NULL, "Could not find proxy %s", label);
+        tmrm_free((char*)label);
+    }
+
+    for (i = 0; i < 2; i++) {
+        set = tmrm_proxy_values_by_key(q[1], q[0]);
+        fail_unless(tmrm_multiset_size(set) == 1,
+            "values_by_key returned %d objects", tmrm_multiset_size(set));
+        tmrm_multiset_free(set);
+    }
+    tmrm_subject_map_cache_stats(m[1], &hits, &misses);
+    fail_unless(hits == 1 && misses == 1, "%lu hits, %lu misses",
+        hits, misses);
+
+    /* The notification arrives asynchronously after the commit */
+    fail_unless(tmrm_proxy_add_property(p[1], p[0], p[0]) == 0,
+        "Could not add property");
+    for (i = 0, size = 1; size == 1 && i < 500; i++) {
+        if (i > 0) poll(NULL, 0, 10);
+        set = tmrm_proxy_values_by_key(q[1], q[0]);
+        size = tmrm_multiset_size(set);
+        tmrm_multiset_free(set);
+    }
+    fail_unless(size == 2, "values_by_key returned %d objects", size);
+
+    for (i = 0; i < 3; i++) {
+        tmrm_proxy_free(p[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        tmrm_proxy_free(q[i]);
+        tmrm_subject_map_free(m[i]);
+        tmrm_storage_free(storage[i]);
+    }
+    tmrm_subject_map_sphere_free(sms);
+}
+END_TEST
+#endif
+
+Suite*
+libtmrm_suite (void)
+{
+    Suite *s = suite_create("libtmrm");
+
+    TCase *tc_sm = tcase_create("Subject Map");
+    /* tcase_add_checked_fixture(tc_sm, setup, teardown); */
+    tcase_add_test(tc_sm, test_pgsql_storage);
+    tcase_add_test(tc_sm, test_subject_map_yaml_import);
+    tcase_add_checked_fixture(tc_sm, setup, teardown);
+    suite_add_tcase(s, tc_sm);
+
+    TCase *tc_list = tcase_create("List");
+    tcase_add_test(tc_list, test_new_list);
+    tcase_add_checked_fixture(tc_list, setup, teardown);
+    suite_add_tcase(s, tc_list);
+
+    TCase *tc_ms = tcase_create("Multi Set");
+    tcase_add_test(tc_ms, test_new_multiset);
+    tcase_add_test(tc_ms, test_add_multiset);
+    tcase_add_checked_fixture(tc_ms, setup, teardown);
+    suite_add_tcase(s, tc_ms);
+
+    TCase *tc_tuple = tcase_create("Tuple");
+    tcase_add_test(tc_tuple, test_new_tuple);
+    tcase_add_test(tc_tuple, test_tuple_get_at);
+    tcase_add_checked_fixture(tc_tuple, setup, teardown);
+    suite_add_tcase(s, tc_tuple);
+
+    TCase *tc_hash = tcase_create("Hash");
+    tcase_add_test(tc_hash, test_new_hash);
+    tcase_add_test(tc_hash, test_hash_new_from_string);
+    tcase_add_test(tc_hash, test_hash_get);
+    tcase_add_test(tc_hash, test_hash_get_del);
+    tcase_add_checked_fixture(tc_hash, setup, teardown);
+    suite_add_tcase(s, tc_hash);
+
+    TCase *tc_proxy = tcase_create("Proxy");
+    tcase_add_test(tc_proxy, test_create_proxy);
+    tcase_add_test(tc_proxy, test_clone_proxy);
+    tcase_add_test(tc_proxy, test_create_property_literal);
+    tcase_add_test(tc_proxy, test_values_by_key);
+    tcase_add_test(tc_proxy, test_literal_keys_by_value);
+    tcase_add_test(tc_proxy, test_proxy_subclasses);
+    tcase_add_test(tc_proxy, test_is_value_by_key);
+    tcase_add_checked_fixture(tc_proxy, setup, teardown);
+    suite_add_tcase(s, tc_proxy);
+
+#if STORAGE_POSTGRESQL
+    TCase *tc_pgsql = tcase_create("PostgresSQL");
+    tcase_add_test(tc_pgsql, test_pgsql_create_storage);
+    tcase_add_checked_fixture(tc_pgsql,
+        pgsql_new_storage_setup, pgsql_new_storage_teardown);
+    /* not needed: tcase_set_timeout(tc_pgsql, 0);*/
+    suite_add_tcase(s, tc_pgsql);
+#endif
+
+#if STORAGE_BDB
+    TCase *tc_bdb = tcase_create("Berkeley DB");
+    tcase_add_test(tc_bdb, test_bdb_storage);
+    suite_add_tcase(s, tc_bdb);
+#endif
+
+#ifdef SNAPSHOT_SOURCE
+    TCase *tc_snapshot = tcase_create("Snapshot");
+    tcase_add_test(tc_snapshot, test_snapshot_storage);
+    tcase_add_test(tc_snapshot, test_snapshot_corrupt);
+    tcase_add_checked_fixture(tc_snapshot, setup, snapshot_teardown);
+    suite_add_tcase(s, tc_snapshot);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_log = tcase_create("Log");
+    tcase_add_test(tc_log, test_log_storage);
+    tcase_add_test(tc_log, test_log_merge);
+    tcase_add_test(tc_log, test_log_corrupt_segment);
+    tcase_add_test(tc_log, test_log_concurrent_compaction);
+    tcase_add_checked_fixture(tc_log, setup, teardown);
+    suite_add_tcase(s, tc_log);
+
+    TCase *tc_import = tcase_create("Import");
+    tcase_add_test(tc_import, test_yaml_import);
+    tcase_add_test(tc_import, test_yaml_import_file);
+    tcase_add_checked_fixture(tc_import, setup, teardown);
+    suite_add_tcase(s, tc_import);
+
+    TCase *tc_binary = tcase_create("Binary");
+    tcase_add_test(tc_binary, test_binary_interchange);
+    tcase_add_checked_fixture(tc_binary, setup, teardown);
+    suite_add_tcase(s, tc_binary);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_path = tcase_create("Path");
+    tcase_add_test(tc_path, test_path_expressions);
+    tcase_add_checked_fixture(tc_path, setup, teardown);
+    suite_add_tcase(s, tc_path);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_properties = tcase_create("Properties");
+    tcase_add_test(tc_properties, test_proxies_by_properties);
+    tcase_add_checked_fixture(tc_properties, setup, teardown);
+    suite_add_tcase(s, tc_properties);
+#endif
+
+#if STORAGE_LOG || STORAGE_POSTGRESQL
+    TCase *tc_cache = tcase_create("Read Cache");
+#if STORAGE_LOG
+    tcase_add_test(tc_cache, test_read_cache);
+#endif
+#if STORAGE_POSTGRESQL
+    tcase_add_test(tc_cache, test_pgsql_notify_cache);
+#endif
+    tcase_add_checked_fixture(tc_cache, setup, teardown);
+    suite_add_tcase(s, tc_cache);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_arena = tcase_create("Arena");
+    tcase_add_test(tc_arena, test_arena);
+    tcase_add_checked_fixture(tc_arena, setup, teardown);
+    suite_add_tcase(s, tc_arena);
+#endif
+
+    TCase *tc_pools = tcase_create("Pools");
+    tcase_add_test(tc_pools, test_pools);
+    tcase_add_checked_fixture(tc_pools, setup, teardown);
+    suite_add_tcase(s, tc_pools);
+
+    TCase *tc_interning = tcase_create("Interning");
+    tcase_add_test(tc_interning, test_literal_interning);
+    tcase_add_checked_fixture(tc_interning, setup, teardown);
+    suite_add_tcase(s, tc_interning);
+
+    TCase *tc_memory = tcase_create("Memory");
+    tcase_add_test(tc_memory, test_memory_report);
+    tcase_add_checked_fixture(tc_memory, setup, teardown);
+    suite_add_tcase(s, tc_memory);
+
+#if STORAGE_LOG
+    TCase *tc_threads = tcase_create("Threads");
+    tcase_add_test(tc_threads, test_concurrent_reads);
+    tcase_add_checked_fixture(tc_threads, setup, teardown);
+    suite_add_tcase(s, tc_threads);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_map_snapshot = tcase_create("Subject Map Snapshot");
+    tcase_add_test(tc_map_snapshot, test_subject_map_snapshot);
+    tcase_add_checked_fixture(tc_map_snapshot, setup, teardown);
+    suite_add_tcase(s, tc_map_snapshot);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_executor = tcase_create("Executor");
+    tcase_add_test(tc_executor, test_parallel_is_value_by_key);
+    tcase_add_checked_fixture(tc_executor, setup, teardown);
+    suite_add_tcase(s, tc_executor);
+#endif
+
+#if STORAGE_LOG || STORAGE_POSTGRESQL
+    TCase *tc_async = tcase_create("Async");
+#if STORAGE_LOG
+    tcase_add_test(tc_async, test_async);
+#endif
+#if STORAGE_POSTGRESQL
+    tcase_add_test(tc_async, test_pgsql_async);
+#endif
+    tcase_add_checked_fixture(tc_async, setup, teardown);
+    suite_add_tcase(s, tc_async);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_stats = tcase_create("Stats");
+    tcase_add_test(tc_stats, test_storage_stats);
+    tcase_add_checked_fixture(tc_stats, setup, teardown);
+    suite_add_tcase(s, tc_stats);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_tracing = tcase_create("Tracing");
+    tcase_add_test(tc_tracing, test_tracing);
+    tcase_add_checked_fixture(tc_tracing, setup, teardown);
+    suite_add_tcase(s, tc_tracing);
+#endif
+
+#if STORAGE_LOG
+    TCase *tc_logger = tcase_create("Logger");
+    tcase_add_test(tc_logger, test_logger);
+    tcase_add_checked_fixture(tc_logger, setup, teardown);
+    suite_add_tcase(s, tc_logger);
 #endif
 
     return s;